@@ -86,6 +86,13 @@ proc getFilterIfcRuleAsString { node_id iface_id id } {
 	set action_data [dictGet $rule_dict "action_data"]
 
 	if { $offset != "" } {
+		# written the way ghc prints it back, for rule set digests to
+		# match: bytes in lower case separated by dots, and the two
+		# ends of an offset range by two dots
+		set pattern [string tolower [string map { " " "." ":" "." } $pattern]]
+		set mask [string tolower [string map { " " "." ":" "." } $mask]]
+		regsub {\.+} $offset ".." offset
+
 		return "${id}:${action}:${pattern}/${mask}@${offset}:${action_data}"
 	}
 
@@ -106,6 +113,10 @@ proc checkPatternMask { str } {
 }
 
 proc checkOffset { str } {
+	# Offsets may be relative to the network or transport header
+	if { [regexp {^l[34]\+(.*)$} $str -> str] && $str == "" } {
+		return 0
+	}
 	set syn [regexp {^((0|(([1-9])([0-9])*))((\.)+(([1-9])([0-9])*)+)?)?$} $str]
 	if { $syn == 1 } {
 		set l [split $str .]
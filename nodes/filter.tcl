@@ -67,6 +67,30 @@ namespace eval $MODULE {
 		return [list $private_elem $public_elem $hook_name]
 	}
 
+	# Rules of a hook as shc takes them and ghc prints them, leaving out
+	# those that send frames to interfaces which are not running.
+	proc getHookRules { node_id iface_id } {
+		set rules {}
+		foreach rule_num [lsort -dictionary [ifcFilterRuleList $node_id $iface_id]] {
+			set rule [getFilterIfcRuleAsString $node_id $iface_id $rule_num]
+
+			set action [getFilterIfcAction $node_id $iface_id $rule_num]
+			if { $action == "match_drop" } {
+				lappend rules $rule
+
+				continue
+			}
+
+			set action_data [getFilterIfcActionData $node_id $iface_id $rule_num]
+			set other_iface_id [ifaceIdFromName $node_id $action_data]
+			if { [isRunningNodeIface $node_id $other_iface_id] } {
+				lappend rules $rule
+			}
+		}
+
+		return [join $rules " "]
+	}
+
 	################################################################################
 	############################ INSTANTIATE PROCEDURES ############################
 	################################################################################
@@ -143,23 +167,12 @@ namespace eval $MODULE {
 		addStateNode $node_id "node_configuring"
 
 		foreach iface_id $ifaces {
-			set ng_cfg_req "shc [getIfcName $node_id $iface_id]"
-			foreach rule_num [lsort -dictionary [ifcFilterRuleList $node_id $iface_id]] {
-				set rule [getFilterIfcRuleAsString $node_id $iface_id $rule_num]
-
-				set action [getFilterIfcAction $node_id $iface_id $rule_num]
-				if { $action == "match_drop" } {
-					set ng_cfg_req "${ng_cfg_req} ${rule}"
+			# kept for nodeConfigure_check, as the interfaces running
+			# may change before it runs
+			set rules [getHookRules $node_id $iface_id]
+			setToRunning "${node_id}|${iface_id}_filter_rules" $rules
 
-					continue
-				}
-
-				set action_data [getFilterIfcActionData $node_id $iface_id $rule_num]
-				set other_iface_id [ifaceIdFromName $node_id $action_data]
-				if { [isRunningNodeIface $node_id $other_iface_id] } {
-					set ng_cfg_req "${ng_cfg_req} ${rule}"
-				}
-			}
+			set ng_cfg_req "shc [getIfcName $node_id $iface_id] $rules"
 
 			pipesExec "jexec $eid ngctl msg $node_id: $ng_cfg_req" "hold"
 		}
@@ -179,39 +192,27 @@ namespace eval $MODULE {
 
 		set private_ns [invokeNodeProc $node_id "getPrivateNs" $eid $node_id]
 
-		set cmds ""
-		foreach iface_id $ifaces {
-			lassign [invokeNodeProc $node_id "getHookData" $node_id $iface_id] iface_name - -
-
-			set ng_cfg_req "Args.*$iface_name.*"
-			foreach rule_num [lsort -dictionary [ifcFilterRuleList $node_id $iface_id]] {
-				set rule [getFilterIfcRuleAsString $node_id $iface_id $rule_num]
+		# one getdigests round trip answers for all hooks, each listed
+		# as name:crc32 of its rule set the way ghc prints it
+		set cmds "jexec $private_ns ngctl msg $node_id: getdigests"
 
-				set action [getFilterIfcAction $node_id $iface_id $rule_num]
-				if { $action == "match_drop" } {
-					set ng_cfg_req "${ng_cfg_req}.*${rule}"
+		set cmds [getTimeoutCmd "ifacesconf_timeout" $cmds]
 
-					continue
-				}
+		try {
+			rexec $cmds
+		} on ok digests {
+			set ifaces_all {}
+			foreach iface_id $ifaces {
+				lassign [invokeNodeProc $node_id "getHookData" $node_id $iface_id] iface_name - -
 
-				set action_data [getFilterIfcActionData $node_id $iface_id $rule_num]
-				set other_iface_id [ifaceIdFromName $node_id $action_data]
-				if { [getIfcLink $node_id $other_iface_id] != "" } {
-					set ng_cfg_req "${ng_cfg_req}.*${rule}"
+				set rules [getFromRunning "${node_id}|${iface_id}_filter_rules"]
+				set digest [format "%08x" [zlib crc32 $rules]]
+				if { "$iface_name:$digest" in [split $digests " \t\n"] } {
+					lappend ifaces_all $iface_name
 				}
 			}
 
-			append cmds "ngctl msg $node_id: ghc $iface_name | grep -q '$ng_cfg_req' && echo $iface_name; "
-		}
-
-		set cmds "jexec $private_ns sh -c '$cmds'"
-
-		set cmds [getTimeoutCmd "ifacesconf_timeout" $cmds]
-
-		try {
-			rexec $cmds
-		} on ok ifaces_all {
-			if { [string trim $ifaces_all "\n "] == "" } {
+			if { $ifaces_all == {} } {
 				return false
 			}
 
@@ -267,6 +268,8 @@ namespace eval $MODULE {
 		addStateNode $node_id "node_unconfiguring"
 
 		foreach iface_id $ifaces {
+			unsetRunning "${node_id}|${iface_id}_filter_rules"
+
 			set ngcfgreq "shc [getIfcName $node_id $iface_id]"
 			pipesExec "jexec $eid ngctl msg $node_id: $ngcfgreq" "hold"
 		}
@@ -0,0 +1,2391 @@
+/*-
+ * Copyright (c) 2026 University of Zagreb
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * pm_bench -- drives an unmodified ng_patmat.c, linked against the ngshim
+ * userspace netgraph stand-in.
+ *
+ * Without arguments, runs the benchmark suite: frames, synthetic or read
+ * from a pcap file with -r, are pushed through rule sets of a number of
+ * shapes (rule count, width of the offset range each rule searches, VLAN
+ * tagged or not), or through those read from a file with -R, and the
+ * wall-clock cost per packet is reported.  With -b, frames are handed to
+ * the node in m_nextpkt chains of that many.
+ *
+ * With -c, runs the correctness suite instead: the verdicts and rule
+ * counters of the node for the same frames and rule sets, and for randomly
+ * generated ones, are compared with those of a straightforward reference
+ * matcher, with and without the flow cache, with frames split across mbuf
+ * chains, and with all of them in a single packet chain, for sinks some of
+ * which take the packets passed on as chains and some one by one.  Random
+ * rule sets use every action, with lookup tables, hook groups, patterns
+ * anchored at the IPv4 or IPv6 headers and content searched for over
+ * windows, and meters run on the virtual clock of the shim.
+ *
+ * With -f, fuzzes the shc parser with mutated rule sets, checking that
+ * whatever it accepts reads back through ghc as a rule set which parses
+ * to the same, and that packets going through it get the verdicts and
+ * counts of the reference matcher.  Build with SAN set to the sanitizer
+ * flags of the compiler to catch memory errors as well.
+ *
+ * All modes exit non-zero on failure.
+ */
+
+#include <unistd.h>
+
+#include "ngshim.h"
+
+#define	FRAME_MAX	2048
+#define	POOL_SYNTH	4096
+#define	NSINKS		4	/* out0 .. out3 */
+#define	MAXRULES	4096
+#define	PATLEN		32	/* NG_PM_MAXPATLEN */
+#define	CMD_MAX		(MAXRULES * 128)
+
+/*
+ * Frames
+ */
+struct frame {
+	int	len;
+	u_char	*data;
+};
+
+static struct frame *pool;
+static int npool;
+
+static uint64_t rng = 0x9e3779b97f4a7c15ULL;
+
+static void
+rng_seed(uint64_t seed)
+{
+
+	rng = seed * 0x9e3779b97f4a7c15ULL + 1;
+}
+
+/*
+ * xorshift64*, so that the node's own random() is left alone.  Runs only
+ * repeat across compilers if no expression calls it twice unsequenced.
+ */
+static uint32_t
+rnd(void)
+{
+
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return ((rng * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+static int
+rnd_range(int lo, int hi)
+{
+
+	return (lo + rnd() % (hi - lo + 1));
+}
+
+static void
+pool_add(const u_char *data, int len)
+{
+	static int size;
+
+	if (npool == size) {
+		size = size ? size * 2 : 1024;
+		pool = realloc(pool, size * sizeof(*pool));
+		if (pool == NULL) {
+			perror("realloc");
+			exit(2);
+		}
+	}
+	pool[npool].len = len;
+	pool[npool].data = malloc(len ? len : 1);
+	if (pool[npool].data == NULL) {
+		perror("malloc");
+		exit(2);
+	}
+	bcopy(data, pool[npool].data, len);
+	npool++;
+}
+
+static void
+pool_free(void)
+{
+	int i;
+
+	for (i = 0; i < npool; i++)
+		free(pool[i].data);
+	npool = 0;
+}
+
+/* One's complement sum of 'len' bytes taken as 16-bit words, onto 'sum' */
+static uint32_t
+cksum_add(const u_char *p, int len, uint32_t sum)
+{
+	int i;
+
+	for (i = 0; i + 1 < len; i += 2)
+		sum += p[i] << 8 | p[i + 1];
+	if (i < len)
+		sum += p[i] << 8;
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return (sum);
+}
+
+/*
+ * Ethernet / [802.1Q] / IPv4 or IPv6 / UDP to 'dport', of 'len' bytes,
+ * with checksums, and the offset of the UDP header returned.  Sources vary
+ * with 'flow', and odd flows over IPv6 have a hop-by-hop options header.
+ */
+static int
+frame_build(u_char *f, int len, int vlan, int ip6, int flow, int dport)
+{
+	uint32_t c;
+	int l3, l4, i;
+
+	bzero(f, len);
+	f[0] = 0x02; f[5] = 0x01;
+	f[6] = 0x02; f[9] = flow >> 16; f[10] = flow >> 8; f[11] = flow;
+	l3 = 14;
+	if (vlan) {
+		f[12] = 0x81; f[13] = 0x00;
+		f[14] = 0x00; f[15] = 100 + flow % 8;
+		l3 = 18;
+	}
+	if (ip6) {
+		f[l3 - 2] = 0x86; f[l3 - 1] = 0xdd;
+		f[l3] = 0x60;
+		f[l3 + 4] = (len - l3 - 40) >> 8; f[l3 + 5] = len - l3 - 40;
+		f[l3 + 6] = flow & 1 ? 0 : 17;
+		f[l3 + 7] = 64;
+		f[l3 + 8] = 0xfe; f[l3 + 9] = 0x80;
+		f[l3 + 22] = flow >> 8; f[l3 + 23] = flow;
+		f[l3 + 24] = 0xfe; f[l3 + 25] = 0x80; f[l3 + 39] = 1;
+		l4 = l3 + 40;
+		if (flow & 1) {
+			/* Next header, length, then a PadN option */
+			f[l4] = 17; f[l4 + 2] = 1; f[l4 + 3] = 4;
+			l4 += 8;
+		}
+	} else {
+		f[l3 - 2] = 0x08; f[l3 - 1] = 0x00;
+		f[l3] = 0x45;
+		f[l3 + 2] = (len - l3) >> 8; f[l3 + 3] = len - l3;
+		f[l3 + 8] = 64;
+		f[l3 + 9] = 17;
+		f[l3 + 12] = 10; f[l3 + 13] = 0;
+		f[l3 + 14] = flow >> 8; f[l3 + 15] = flow;
+		f[l3 + 16] = 10; f[l3 + 17] = 1; f[l3 + 19] = 1;
+		l4 = l3 + 20;
+	}
+	f[l4] = 0xc0 | (flow >> 8 & 0x3f); f[l4 + 1] = flow;
+	f[l4 + 2] = dport >> 8; f[l4 + 3] = dport;
+	f[l4 + 4] = (len - l4) >> 8; f[l4 + 5] = len - l4;
+	for (i = l4 + 8; i < len; i++)
+		f[i] = i;
+	if (ip6)
+		c = cksum_add(f + l3 + 8, 32, 17 + len - l4);
+	else {
+		c = ~cksum_add(f + l3, 20, 0);
+		f[l3 + 10] = c >> 8; f[l3 + 11] = c;
+		c = cksum_add(f + l3 + 12, 8, 17 + len - l4);
+	}
+	c = ~cksum_add(f + l4, len - l4, c) & 0xffff;
+	if (c == 0)
+		c = 0xffff;
+	f[l4 + 6] = c >> 8; f[l4 + 7] = c;
+	return (l4);
+}
+
+/*
+ * Synthetic traffic for 'nrules' port rules: half of the frames go to
+ * ports the rules match, spread evenly over the rule set, the others to
+ * ports none of them does.
+ */
+static void
+pool_synth(int nrules, int vlan)
+{
+	u_char f[FRAME_MAX];
+	int i;
+
+	pool_free();
+	for (i = 0; i < POOL_SYNTH; i++) {
+		frame_build(f, 64, vlan, 0, i,
+		    1000 + (int)((uint64_t)i * 7919 % (2 * nrules)));
+		pool_add(f, 64);
+	}
+}
+
+/*
+ * Classic pcap files of Ethernet frames, in either byte order, with
+ * microsecond or nanosecond timestamps.  Frames longer than FRAME_MAX are
+ * truncated.
+ */
+static void
+pool_pcap(const char *path)
+{
+	u_char hdr[24], rec[16], f[FRAME_MAX];
+	uint32_t magic, linktype, caplen;
+	FILE *fp;
+	int swap, n;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		perror(path);
+		exit(2);
+	}
+	if (fread(hdr, sizeof(hdr), 1, fp) != 1) {
+		fprintf(stderr, "%s: short file\n", path);
+		exit(2);
+	}
+	bcopy(hdr, &magic, sizeof(magic));
+	if (magic == 0xa1b2c3d4 || magic == 0xa1b23c4d)
+		swap = 0;
+	else if (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1)
+		swap = 1;
+	else {
+		fprintf(stderr, "%s: not a pcap file\n", path);
+		exit(2);
+	}
+	bcopy(hdr + 20, &linktype, sizeof(linktype));
+	if (swap)
+		linktype = __builtin_bswap32(linktype);
+	if (linktype != 1) {
+		fprintf(stderr, "%s: link type %u, not Ethernet\n", path,
+		    linktype);
+		exit(2);
+	}
+	pool_free();
+	while (fread(rec, sizeof(rec), 1, fp) == 1) {
+		bcopy(rec + 8, &caplen, sizeof(caplen));
+		if (swap)
+			caplen = __builtin_bswap32(caplen);
+		if (caplen > 262144) {
+			fprintf(stderr, "%s: corrupt record\n", path);
+			exit(2);
+		}
+		n = imin(caplen, FRAME_MAX);
+		if (fread(f, 1, n, fp) != (size_t)n ||
+		    fseek(fp, caplen - n, SEEK_CUR) != 0)
+			break;
+		pool_add(f, n);
+	}
+	fclose(fp);
+	if (npool == 0) {
+		fprintf(stderr, "%s: no frames\n", path);
+		exit(2);
+	}
+}
+
+/*
+ * Rule sets, kept in a form the reference matcher can evaluate.
+ * Comparisons keep their value, or the low end of their range, in pat and
+ * the high end in mask, and lookup rules their mask in mask.  Rules name
+ * the sinks, out4, which is gone once they are set, and in, whose peer
+ * drops what it gets, by number.
+ */
+enum { A_HOOK, A_NHOOK, A_DUP, A_NDUP, A_SKIP, A_NSKIP, A_DROP, A_NDROP,
+    A_SET, A_LOOKUP, A_HASH, A_SAMPLE, A_POLICE, A_ACTIONS };
+
+static const char *anames[] = {
+	"match_hook", "nomatch_hook", "match_dupto", "nomatch_dupto",
+	"match_skipto", "nomatch_skipto", "match_drop", "nomatch_drop",
+	"match_set_field", "lookup", "match_hash", "match_sample",
+	"match_police"
+};
+
+enum { C_MASK, C_RANGE, C_LT, C_LE, C_GT, C_GE, C_CMPS };
+
+static const char *cnames[] = { "", "", "<", "<=", ">", ">=" };
+
+enum { AN_FRAME, AN_L3, AN_L4, AN_ANCHORS };
+
+static const char *ancnames[] = { "", "l3+", "l4+" };
+
+#define	HK_GONE		NSINKS		/* out4 */
+#define	HK_IN		(NSINKS + 1)
+#define	HK_NONE		(-1)		/* match_police without a hook */
+
+struct rule {
+	int	number;
+	int	action;
+	int	cmp;
+	int	len;		/* 0 matches any packet */
+	int	anchor;
+	int	lo, hi;
+	int	target;		/* hook, rule index to skip to, table, group */
+	u_char	pat[PATLEN];
+	u_char	mask[PATLEN];
+	int	soff, slen;	/* field set */
+	int	sanchor;
+	u_char	sval[PATLEN];
+	u_char	smask[PATLEN];
+	uint64_t rate;		/* sampling period, or bits/s */
+	uint32_t burst;
+	int	random;		/* sample at random */
+};
+
+static struct rule rules[MAXRULES];
+static int nrules;
+
+/*
+ * Exact match and longest prefix match tables, and hook groups, set along
+ * with the rules.  Entry actions are A_HOOK, A_DUP and A_DROP.
+ */
+#define	NTABLES		8
+#define	TABLE_MAX	16
+#define	NHGROUPS	4
+
+struct table {
+	int	keylen;		/* 0 if not set */
+	int	lpm;
+	int	n;
+	struct {
+		u_char	key[PATLEN];
+		int	plen;
+		int	action;
+		int	target;
+	}	ent[TABLE_MAX];
+};
+
+struct hgroup {
+	int	fields;		/* l2, l3, l4 */
+	int	n;		/* 0 if not set */
+	int	member[NSINKS + 1];
+};
+
+static struct table tables[NTABLES];
+static struct hgroup hgroups[NHGROUPS];
+
+static const char *
+hook_name(int t)
+{
+	static char name[4][NG_HOOKSIZ];
+	static int k;
+
+	if (t == HK_NONE)
+		return ("");
+	k = (k + 1) % 4;
+	if (t == HK_IN)
+		snprintf(name[k], sizeof(name[k]), "in");
+	else
+		snprintf(name[k], sizeof(name[k]), "out%d", t);
+	return (name[k]);
+}
+
+static int
+hook_number(const char *name, int len)
+{
+	int t;
+
+	for (t = 0; t <= HK_IN; t++)
+		if ((int)strlen(hook_name(t)) == len &&
+		    strncmp(hook_name(t), name, len) == 0)
+			return (t);
+	return (len == 0 ? HK_NONE : HK_GONE);
+}
+
+static int
+hex_format(char *cp, int size, const u_char *b, int len, const char *first)
+{
+	int j, n = 0;
+
+	for (j = 0; j < len; j++)
+		n += snprintf(cp + n, size > n ? size - n : 0, "%s%02x",
+		    j ? "." : first, b[j]);
+	return (n);
+}
+
+static int
+rules_format(char *cmd, int size)
+{
+	const struct rule *r;
+	int i, n;
+
+	n = snprintf(cmd, size, "shc in");
+	for (i = 0; i < nrules && n < size; i++) {
+		r = &rules[i];
+		n += snprintf(cmd + n, size - n, " %d:%s:%s", r->number,
+		    anames[r->action], r->len > 0 && r->action != A_LOOKUP ?
+		    cnames[r->cmp] : "");
+		if (r->action != A_LOOKUP)
+			n += hex_format(cmd + n, size - n, r->pat, r->len, "");
+		if (r->cmp <= C_RANGE)
+			n += hex_format(cmd + n, size - n, r->mask, r->len,
+			    r->action == A_LOOKUP ? "" :
+			    r->cmp == C_RANGE ? "-" : "/");
+		if (r->len > 0)
+			n += snprintf(cmd + n, size - n, "@%s%d",
+			    ancnames[r->anchor], r->lo);
+		if (r->len > 0 && r->hi != r->lo)
+			n += snprintf(cmd + n, size - n, "..%d", r->hi);
+		switch (r->action) {
+		case A_SKIP:
+		case A_NSKIP:
+			n += snprintf(cmd + n, size - n, ":%d",
+			    rules[r->target].number);
+			break;
+		case A_DROP:
+		case A_NDROP:
+			n += snprintf(cmd + n, size - n, ":");
+			break;
+		case A_SET:
+			n += hex_format(cmd + n, size - n, r->sval, r->slen,
+			    ":");
+			n += hex_format(cmd + n, size - n, r->smask, r->slen,
+			    "/");
+			n += snprintf(cmd + n, size - n, "@%s%d",
+			    ancnames[r->sanchor], r->soff);
+			break;
+		case A_LOOKUP:
+		case A_HASH:
+			n += snprintf(cmd + n, size - n, ":%d", r->target);
+			break;
+		case A_SAMPLE:
+			n += snprintf(cmd + n, size - n, ":%s%ju/%s",
+			    r->random ? "~" : "", (uintmax_t)r->rate,
+			    hook_name(r->target));
+			break;
+		case A_POLICE:
+			n += snprintf(cmd + n, size - n, ":%ju/%u%s%s",
+			    (uintmax_t)r->rate, r->burst,
+			    r->target != HK_NONE ? "/" : "",
+			    hook_name(r->target));
+			break;
+		default:
+			n += snprintf(cmd + n, size - n, ":%s",
+			    hook_name(r->target));
+		}
+	}
+	if (n >= size) {
+		fprintf(stderr, "rule set too long\n");
+		exit(2);
+	}
+	return (n);
+}
+
+/*
+ * Network and transport header offsets, -1 if missing, as the node finds
+ * them in the first 'max' bytes of a frame, or 104 if fewer.
+ */
+struct hdrs {
+	int	l3, l4;
+	int	ipver, proto;
+};
+
+static void
+ref_hdrs(const struct frame *f, int max, struct hdrs *h)
+{
+	const u_char *d = f->data;
+	int off, type, n, nh, frag, len;
+
+	max = imin(max, 104);
+	h->l3 = h->l4 = -1;
+	h->ipver = 0;
+	h->proto = -1;
+	for (off = 12, n = 0;; off += 4, n++) {
+		if (off + 2 > max)
+			return;
+		type = d[off] << 8 | d[off + 1];
+		if (type != 0x8100 && type != 0x88a8)
+			break;
+		if (n == 2)
+			return;
+	}
+	h->l3 = off += 2;
+	if (type == 0x0800) {
+		if (off + 20 > max || d[off] >> 4 != 4 || (d[off] & 0x0f) < 5)
+			return;
+		h->ipver = 4;
+		frag = (d[off + 6] << 8 | d[off + 7]) & 0x3fff;
+		if (frag & 0x1fff)
+			return;
+		nh = frag ? -1 : d[off + 9];
+		off += (d[off] & 0x0f) * 4;
+	} else if (type == 0x86dd) {
+		if (off + 40 > max || d[off] >> 4 != 6)
+			return;
+		h->ipver = 6;
+		frag = 0;
+		nh = d[off + 6];
+		off += 40;
+		for (n = 0; nh == 0 || nh == 43 || nh == 44 || nh == 51 ||
+		    nh == 60; n++) {
+			if (n == 8 || off > 96 || off + 8 > max)
+				return;
+			if (nh == 44) {
+				if ((d[off + 2] << 8 | d[off + 3]) & 0xfff8)
+					return;
+				frag = 1;
+			}
+			len = nh == 44 ? 8 : nh == 51 ? (d[off + 1] + 2) * 4 :
+			    (d[off + 1] + 1) * 8;
+			nh = d[off];
+			off += len;
+		}
+		if (frag)
+			nh = -1;
+	} else
+		return;
+	if (off <= 96) {
+		h->l4 = off;
+		h->proto = nh;
+	}
+}
+
+/* Offset of the header 'anchor' within 'max' bytes, -1 if missing */
+static int
+ref_base(const struct frame *f, int max, int anchor)
+{
+	struct hdrs h;
+
+	if (anchor == AN_FRAME)
+		return (0);
+	ref_hdrs(f, max, &h);
+	return (anchor == AN_L3 ? h.l3 : h.l4);
+}
+
+/*
+ * 'n' rules forwarding UDP destination ports 1000 and up to out0..out3,
+ * each searching for its port over 'width' more offsets than the one it
+ * is at, or with 'ranges', each for a range of eight ports overlapping
+ * the next, followed by a rule dropping the rest.  With 'set', a first
+ * rule sets the DSCP of all IPv4 packets to EF.
+ */
+static void
+rules_ports(int n, int width, int vlan, int ranges, int set)
+{
+	struct rule *r;
+	int i, off;
+
+	bzero(tables, sizeof(tables));
+	bzero(hgroups, sizeof(hgroups));
+	off = vlan ? 40 : 36;
+	if (set) {
+		r = &rules[0];
+		bzero(r, sizeof(*r));
+		r->number = 1;
+		r->action = A_SET;
+		r->len = 2;
+		r->pat[0] = 0x08;
+		r->mask[0] = r->mask[1] = 0xff;
+		r->lo = r->hi = off - 24;
+		r->soff = off - 21;
+		r->slen = 1;
+		r->sval[0] = 0xb8;
+		r->smask[0] = 0xfc;
+	}
+	for (i = 0; i < n; i++) {
+		r = &rules[set + i];
+		bzero(r, sizeof(*r));
+		r->number = set + i + 1;
+		r->action = A_HOOK;
+		r->len = 2;
+		r->pat[0] = (1000 + i) >> 8;
+		r->pat[1] = 1000 + i;
+		r->mask[0] = r->mask[1] = 0xff;
+		r->lo = off - width / 2;
+		r->hi = r->lo + width;
+		r->target = i % NSINKS;
+		if (ranges) {
+			r->cmp = C_RANGE;
+			r->mask[0] = (1000 + i + 7) >> 8;
+			r->mask[1] = 1000 + i + 7;
+			r->lo = r->hi = off;
+		}
+	}
+	r = &rules[set + n];
+	bzero(r, sizeof(*r));
+	r->number = set + n + 1;
+	r->action = A_DROP;
+	nrules = set + n + 1;
+}
+
+static u_char
+rnd_mask(void)
+{
+	static const u_char m[] = { 0xff, 0xff, 0xff, 0x00, 0x0f, 0xf0 };
+
+	return (rnd() % 8 < 6 ? m[rnd() % 6] : rnd());
+}
+
+/*
+ * Bounds around the value in pat for a comparison: a value close to it,
+ * or a range of a few values or of many around it.
+ */
+static void
+rule_bounds(struct rule *r)
+{
+	uint64_t v, lo, hi, max;
+	int j;
+
+	max = (1ULL << 8 * r->len) - 1;
+	for (v = 0, j = 0; j < r->len; j++)
+		v = v << 8 | r->pat[j];
+	if (r->cmp == C_RANGE) {
+		lo = rnd() % 4 ? rnd() % 4 : rnd() & max;
+		hi = rnd() % 4 ? rnd() % 4 : rnd() & max;
+		lo = lo > v ? 0 : v - lo;
+		hi = hi > max - v ? max : v + hi;
+	} else
+		lo = hi = (v + rnd_range(0, 2) + max) % (max + 1);
+	for (j = r->len - 1; j >= 0; j--, lo >>= 8, hi >>= 8) {
+		r->pat[j] = lo;
+		r->mask[j] = hi;
+	}
+}
+
+/* A hook for a rule to name, now and then one about to go */
+static int
+rnd_hook(void)
+{
+
+	return (rnd() % 8 ? (int)(rnd() % NSINKS) : HK_GONE);
+}
+
+/*
+ * Where a rule looks: mostly at the start of the frame, else past the
+ * network or transport header, at offsets those headers and the first
+ * bytes after them are at.
+ */
+static void
+rnd_where(struct rule *r, int window)
+{
+
+	r->anchor = rnd() % 3 ? AN_FRAME : rnd_range(AN_L3, AN_L4);
+	switch (r->anchor) {
+	case AN_FRAME:
+		r->lo = rnd() % 2 ? rnd_range(0, 40) : 12;
+		break;
+	case AN_L3:
+		r->lo = rnd_range(0, 24);
+		break;
+	default:
+		r->lo = rnd_range(0, 8);
+	}
+	r->hi = r->lo + (window && rnd() % 2 == 0 ?
+	    rnd_range(1, r->anchor == AN_FRAME ? 40 : 8) : 0);
+}
+
+/* Shapes of the tables, filled once the rules looking them up are made */
+static void
+tables_random(void)
+{
+	struct table *t;
+	int i;
+
+	bzero(tables, sizeof(tables));
+	for (i = 0; i < NTABLES; i++) {
+		t = &tables[i];
+		if (rnd() % 4 == 0)
+			continue;
+		t->lpm = rnd() % 2;
+		t->keylen = !t->lpm ? rnd_range(1, 8) :
+		    rnd() % 2 ? 4 : rnd_range(1, 16);
+	}
+}
+
+/*
+ * Entries with keys mostly lifted from pool frames from under the lookup
+ * rules naming the table, of all prefix lengths in LPM tables.
+ */
+static void
+tables_fill(void)
+{
+	static const int eact[] = { A_HOOK, A_DUP, A_DROP };
+	const struct frame *f;
+	const struct rule *r;
+	struct table *t;
+	int i, j, k, base;
+
+	for (i = 0; i < NTABLES; i++) {
+		t = &tables[i];
+		for (t->n = 0; t->keylen > 0 && t->n < TABLE_MAX &&
+		    rnd() % 16 != 0; t->n++) {
+			for (r = NULL, k = rnd() % nrules, j = 0; j < nrules;
+			    j++, k = (k + 1) % nrules)
+				if (rules[k].action == A_LOOKUP &&
+				    rules[k].target == i &&
+				    rules[k].len == t->keylen) {
+					r = &rules[k];
+					break;
+				}
+			f = &pool[rnd() % npool];
+			base = r != NULL ? ref_base(f, f->len, r->anchor) : -1;
+			for (j = 0; j < t->keylen; j++)
+				t->ent[t->n].key[j] = base >= 0 &&
+				    rnd() % 8 != 0 &&
+				    base + r->lo + t->keylen <= f->len ?
+				    f->data[base + r->lo + j] & r->mask[j] :
+				    rnd();
+			t->ent[t->n].plen = rnd() % 2 ? t->keylen * 8 :
+			    rnd_range(0, t->keylen * 8);
+			t->ent[t->n].action = eact[rnd() % 3];
+			t->ent[t->n].target = rnd_hook();
+		}
+	}
+}
+
+/* Hook groups of some of the hooks, in any order */
+static void
+hgroups_random(void)
+{
+	struct hgroup *g;
+	int i, j, k, t;
+
+	bzero(hgroups, sizeof(hgroups));
+	for (i = 0; i < NHGROUPS; i++) {
+		g = &hgroups[i];
+		if (rnd() % 4 == 0)
+			continue;
+		g->fields = rnd() % 3;
+		for (j = 0; j <= NSINKS; j++)
+			g->member[j] = j;
+		for (j = NSINKS; j > 0; j--) {
+			k = rnd() % (j + 1);
+			t = g->member[j];
+			g->member[j] = g->member[k];
+			g->member[k] = t;
+		}
+		g->n = rnd_range(1, NSINKS + 1);
+	}
+}
+
+/*
+ * Random rule sets.  Patterns are mostly lifted from pool frames, so that
+ * rules do match some of them, and often share offsets and masks with
+ * their predecessor, as rules compiled into groups do.  In some sets most
+ * patterns are fully masked and searched for over a window, as the content
+ * automaton takes them.
+ */
+static void
+rules_random(void)
+{
+	static const uint64_t rates[] = { 100000, 1000000, 4000000 };
+	const struct frame *f;
+	struct rule *r, *p = NULL;
+	int i, j, off, base, content;
+
+	tables_random();
+	hgroups_random();
+	content = rnd() % 4 == 0;
+	nrules = rnd_range(1, 40);
+	for (i = 0; i < nrules; i++) {
+		r = &rules[i];
+		bzero(r, sizeof(*r));
+		r->number = (i + 1) * 10 - rnd() % 5;
+		r->action = rnd() % A_ACTIONS;
+		if ((r->action == A_SKIP || r->action == A_NSKIP) &&
+		    i == nrules - 1)
+			r->action = A_DROP;
+		switch (r->action) {
+		case A_SKIP:
+		case A_NSKIP:
+			r->target = rnd_range(i + 1, nrules - 1);
+			break;
+		case A_SET:
+			/* Headers, checksums and lengths of UDP over IP */
+			r->sanchor = rnd() % 4 ? AN_FRAME :
+			    rnd_range(AN_L3, AN_L4);
+			if (r->sanchor != AN_FRAME)
+				r->soff = rnd_range(0, r->sanchor == AN_L3 ?
+				    40 : 8);
+			else
+				r->soff = rnd() % 2 ? rnd_range(12, 42) :
+				    rnd_range(0, 100);
+			r->slen = rnd() % 4 ? rnd_range(1, 4) :
+			    rnd_range(1, PATLEN);
+			for (j = 0; j < r->slen; j++) {
+				r->sval[j] = rnd();
+				r->smask[j] = rnd_mask();
+			}
+			break;
+		case A_LOOKUP:
+			/* Under a mask, mostly of the table's key length */
+			r->target = rnd() % NTABLES;
+			r->len = tables[r->target].keylen > 0 && rnd() % 8 ?
+			    tables[r->target].keylen : rnd_range(1, 8);
+			rnd_where(r, 0);
+			for (j = 0; j < r->len; j++)
+				r->mask[j] = rnd() % 4 ? 0xff : rnd_mask();
+			continue;
+		case A_HASH:
+			r->target = rnd() % (NHGROUPS + 1);
+			break;
+		case A_SAMPLE:
+			r->rate = rnd() % 4 ? rnd_range(1, 4) :
+			    rnd_range(5, 100);
+			r->random = rnd() % 3 == 0;
+			r->target = rnd_hook();
+			break;
+		case A_POLICE:
+			r->rate = rates[rnd() % 3];
+			r->burst = rnd_range(64, 1500);
+			r->target = rnd() % 4 ? rnd_hook() : HK_NONE;
+			break;
+		default:
+			r->target = rnd_hook();
+		}
+		if (rnd() % 10 == 0)
+			continue;
+		if (p != NULL && p->len > 0 && rnd() % 2) {
+			r->cmp = p->cmp == C_MASK ? C_MASK :
+			    rnd_range(C_RANGE, C_GE);
+			r->len = p->len;
+			r->anchor = p->anchor;
+			r->lo = p->lo;
+			r->hi = p->hi;
+			bcopy(p->mask, r->mask, sizeof(r->mask));
+		} else if ((content && rnd() % 4) || rnd() % 16 == 0) {
+			r->len = rnd_range(2, 6);
+			r->anchor = rnd_range(AN_FRAME, AN_L4);
+			r->lo = rnd_range(0, r->anchor == AN_L4 ? 4 : 20);
+			r->hi = r->lo + rnd_range(8, r->anchor == AN_L4 ? 20 :
+			    r->anchor == AN_L3 ? 40 : 60);
+			memset(r->mask, 0xff, r->len);
+		} else if (rnd() % 4 == 0) {
+			r->cmp = rnd_range(C_RANGE, C_GE);
+			r->len = 1 << rnd() % 3;
+			rnd_where(r, 0);
+		} else {
+			r->len = rnd() % 10 ? rnd_range(1, 8) :
+			    rnd_range(1, PATLEN);
+			rnd_where(r, 1);
+			for (j = 0; j < r->len; j++)
+				r->mask[j] = rnd_mask();
+		}
+		f = &pool[rnd() % npool];
+		base = ref_base(f, f->len, r->anchor);
+		off = base + rnd_range(r->lo, r->hi);
+		for (j = 0; j < r->len; j++)
+			r->pat[j] = rnd() % 8 != 0 && base >= 0 &&
+			    off + j < f->len ? f->data[off + j] : rnd();
+		if (r->cmp != C_MASK)
+			rule_bounds(r);
+		p = r;
+	}
+	tables_fill();
+}
+
+/*
+ * Frames for the random rule sets, of all lengths, tagged or not, over
+ * IPv4, some of them fragments, or IPv6
+ */
+static void
+pool_random(void)
+{
+	u_char f[FRAME_MAX];
+	int i, j, len, l4, ip6, vlan, flow, dport;
+
+	pool_free();
+	for (i = 0; i < 512; i++) {
+		len = rnd() % 4 ? rnd_range(60, 128) : rnd_range(1, 60);
+		ip6 = rnd() % 4 == 0;
+		vlan = rnd() % 4 == 0;
+		flow = rnd() % 64;
+		dport = rnd() % 16;
+		l4 = frame_build(f, imax(len, ip6 ? 80 : 64), vlan, ip6, flow,
+		    dport);
+		/* The first fragment of several, or a later one */
+		if (!ip6 && rnd() % 8 == 0) {
+			j = l4 - 14 + rnd() % 2;
+			f[j] = rnd() % 2 ? 0x20 : 0xb9;
+		}
+		for (j = rnd() % 4; j > 0; j--) {
+			l4 = rnd() % len;
+			f[l4] = rnd();
+		}
+		pool_add(f, len);
+	}
+}
+
+/*
+ * The reference matcher.  Meters keep the node's fixed point token buckets
+ * and sample at random with a copy of the shim's random(), seeded alike,
+ * so that their verdicts are the node's to the packet.
+ */
+#define	TB_SHIFT	24	/* NG_PM_TB_SHIFT */
+#define	HG_BUCKETS	4096	/* NG_PM_HG_BUCKETS */
+
+static struct {
+	uint64_t	packets, bytes;
+} ref_counts[MAXRULES + 2];	/* then the default drop, and nocopy */
+
+static struct {
+	uint64_t	tokens, last;
+	u_int		count;
+} ref_meter[MAXRULES];
+
+static int ref_maxcontig;
+static uint64_t ref_rnd;
+
+/* Leading bytes of a packet a rule may look at */
+static int
+ref_extent(const struct rule *r)
+{
+	static const int base[] = { 0, 22, 96 };
+	int n;
+
+	n = base[r->anchor] + r->hi + r->len;
+	if (r->action == A_HASH || r->action == A_SET)
+		n = imax(n, 104);
+	return (n);
+}
+
+static int
+ref_maxlen(const struct frame *f)
+{
+
+	return (imin(f->len, ref_maxcontig));
+}
+
+/*
+ * Start over as the node does on taking the rules: counters cleared,
+ * buckets full, and random() seeded anew, here and in the shim.
+ */
+static void
+ref_install(void)
+{
+	int i;
+
+	bzero(ref_counts, sizeof(ref_counts));
+	bzero(ref_meter, sizeof(ref_meter));
+	for (ref_maxcontig = i = 0; i < nrules; i++) {
+		ref_maxcontig = imax(ref_maxcontig, ref_extent(&rules[i]));
+		ref_meter[i].tokens = (uint64_t)rules[i].burst << TB_SHIFT;
+		ref_meter[i].last = ngshim_now;
+	}
+	ref_rnd = (uint64_t)rnd() << 32;
+	ref_rnd |= rnd() | 1;
+	ngshim_srandom(ref_rnd);
+}
+
+/* The shim's random() */
+static u_long
+ref_random(void)
+{
+	uint64_t x = ref_rnd;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	ref_rnd = x;
+	return ((x * 0x2545f4914f6cdd1dULL) >> 33);
+}
+
+static int
+ref_match(const struct rule *r, const struct frame *f)
+{
+	uint32_t v, lo, hi;
+	int base, max, off, j;
+
+	max = ref_maxlen(f);
+	if ((base = ref_base(f, max, r->anchor)) < 0 ||
+	    base + r->lo + r->len > max)
+		return (0);
+	if (r->cmp != C_MASK) {
+		for (v = lo = hi = 0, j = 0; j < r->len; j++) {
+			v = v << 8 | f->data[base + r->lo + j];
+			lo = lo << 8 | r->pat[j];
+			hi = hi << 8 | r->mask[j];
+		}
+		switch (r->cmp) {
+		case C_RANGE:
+			return (v >= lo && v <= hi);
+		case C_LT:
+			return (v < lo);
+		case C_LE:
+			return (v <= lo);
+		case C_GT:
+			return (v > lo);
+		default:
+			return (v >= lo);
+		}
+	}
+	for (off = base + r->lo; off <= base + r->hi && off + r->len <= max;
+	    off++) {
+		for (j = 0; j < r->len; j++)
+			if ((f->data[off + j] ^ r->pat[j]) & r->mask[j])
+				break;
+		if (j == r->len)
+			return (1);
+	}
+	return (0);
+}
+
+/*
+ * Table entry for the key under a lookup rule, or -1: the last one added
+ * of those with the key, or with the longest prefix of it
+ */
+static int
+ref_lookup(const struct rule *r, const struct frame *f)
+{
+	const struct table *t;
+	u_char key[PATLEN];
+	int base, max, e, best, j;
+
+	max = ref_maxlen(f);
+	if (r->target >= NTABLES || (t = &tables[r->target])->keylen !=
+	    r->len || (base = ref_base(f, max, r->anchor)) < 0 ||
+	    base + r->lo + r->len > max)
+		return (-1);
+	for (j = 0; j < r->len; j++)
+		key[j] = f->data[base + r->lo + j] & r->mask[j];
+	for (best = -1, e = t->n - 1; e >= 0; e--) {
+		if (!t->lpm) {
+			if (bcmp(key, t->ent[e].key, r->len) == 0)
+				return (e);
+			continue;
+		}
+		for (j = 0; j < t->ent[e].plen; j++)
+			if ((key[j / 8] ^ t->ent[e].key[j / 8]) &
+			    0x80 >> j % 8)
+				break;
+		if (j == t->ent[e].plen &&
+		    (best < 0 || t->ent[e].plen > t->ent[best].plen))
+			best = e;
+	}
+	return (best);
+}
+
+/* Keys hashed as the node's tables hash them, a native word at a time */
+static uint32_t
+ref_hash64(const u_char *k, int len)
+{
+	uint64_t h = 0x9e3779b97f4a7c15ULL, w;
+	int i;
+
+	for (i = 0; i < len; i += 8) {
+		bcopy(k + i, &w, sizeof(w));
+		h ^= w;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+	}
+	return ((uint32_t)h);
+}
+
+/*
+ * Hash of a flow, the same both ways: its addresses, and ports and
+ * protocol for l4, in order, else the Ethernet addresses
+ */
+static uint32_t
+ref_flow_hash(const struct frame *f, int fields)
+{
+	u_char key[40], a[32], pt[4];
+	struct hdrs h;
+	int alen, max, c, n, ports = 0;
+
+	max = ref_maxlen(f);
+	ref_hdrs(f, max, &h);
+	if (fields != 0 && h.l3 >= 0 && h.ipver != 0) {
+		alen = h.ipver == 4 ? 4 : 16;
+		bcopy(f->data + h.l3 + (h.ipver == 4 ? 12 : 8), a, 2 * alen);
+		if (fields == 2 && h.l4 >= 0 && h.l4 + 4 <= max &&
+		    (h.proto == 6 || h.proto == 17 || h.proto == 132)) {
+			bcopy(f->data + h.l4, pt, 4);
+			ports = 1;
+		}
+	} else {
+		if (max < 12)
+			return (0);
+		alen = 6;
+		bcopy(f->data, a, 12);
+	}
+	bzero(key, sizeof(key));
+	c = memcmp(a, a + alen, alen);
+	if (c == 0 && ports)
+		c = memcmp(pt, pt + 2, 2);
+	n = c > 0 ? alen : 0;
+	bcopy(a + n, key, alen);
+	bcopy(a + alen - n, key + alen, alen);
+	n = 2 * alen;
+	if (ports) {
+		bcopy(pt + (c > 0 ? 2 : 0), key + n, 2);
+		bcopy(pt + (c > 0 ? 0 : 2), key + n + 2, 2);
+		key[n + 4] = h.proto;
+		n += 5;
+	}
+	return (ref_hash64(key, n));
+}
+
+static uint64_t
+ref_mix64(uint64_t h)
+{
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return (h);
+}
+
+/*
+ * Member of a hook group a flow goes to, rendezvous hashed over the
+ * connected ones, or -1
+ */
+static int
+ref_hash(const struct rule *r, const struct frame *f)
+{
+	const struct hgroup *g;
+	const char *name;
+	uint64_t w, best = 0;
+	uint32_t id;
+	int b, i, t = -1;
+
+	if (r->target >= NHGROUPS || (g = &hgroups[r->target])->n == 0)
+		return (-1);
+	b = ref_flow_hash(f, g->fields) % HG_BUCKETS;
+	for (i = 0; i < g->n; i++) {
+		if (g->member[i] == HK_GONE)
+			continue;
+		/* FNV-1a of the name */
+		for (id = 2166136261U, name = hook_name(g->member[i]);
+		    *name != '\0'; name++)
+			id = (id ^ (u_char)*name) * 16777619U;
+		w = ref_mix64((uint64_t)id << 32 | b);
+		if (t < 0 || w > best) {
+			best = w;
+			t = g->member[i];
+		}
+	}
+	return (t);
+}
+
+/* Does the sampler of rule 'i' take this one? */
+static int
+ref_sample(int i)
+{
+	const struct rule *r = &rules[i];
+
+	if (r->random)
+		return (ref_random() % r->rate == 0);
+	return (ref_meter[i].count++ % r->rate == r->rate - 1);
+}
+
+/* Does a packet of 'len' bytes conform to the bucket of rule 'i'? */
+static int
+ref_police(int i, int len)
+{
+	const struct rule *r = &rules[i];
+	uint64_t rate, depth, dt, need;
+
+	rate = (r->rate << (TB_SHIFT - 3)) / 1000000;
+	depth = (uint64_t)r->burst << TB_SHIFT;
+	need = (uint64_t)len << TB_SHIFT;
+	if (ngshim_now > ref_meter[i].last) {
+		dt = ngshim_now - ref_meter[i].last;
+		if (dt > depth / rate + 1)
+			dt = depth / rate + 1;
+		ref_meter[i].last = ngshim_now;
+		ref_meter[i].tokens += dt * rate;
+		if (ref_meter[i].tokens > depth)
+			ref_meter[i].tokens = depth;
+	}
+	if (ref_meter[i].tokens < need)
+		return (0);
+	ref_meter[i].tokens -= need;
+	return (1);
+}
+
+/* 16-bit word at 'w', with bytes from 'end' on taken as zero */
+static uint32_t
+ref_word(const u_char *p, int w, int end)
+{
+
+	return ((w < end ? p[w] << 8 : 0) | (w + 1 < end ? p[w + 1] : 0));
+}
+
+/*
+ * Set the field of a match_set_field rule.  Checksums which were right are
+ * computed anew, others are updated as RFC 1624 has it, unless the field
+ * covers them.
+ */
+static void
+ref_set(const struct rule *r, struct frame *f)
+{
+	u_char old[FRAME_MAX];
+	struct hdrs h;
+	uint32_t c, sum;
+	int ck, end, ihl, pseudo, lenw, full, j, w, soff;
+
+	if ((soff = ref_base(f, ref_maxlen(f), r->sanchor)) < 0 ||
+	    (soff += r->soff) + r->slen > f->len)
+		return;
+	ref_hdrs(f, ref_maxlen(f), &h);
+	bcopy(f->data, old, f->len);
+	for (j = 0; j < r->slen; j++)
+		f->data[soff + j] = (old[soff + j] & ~r->smask[j]) |
+		    (r->sval[j] & r->smask[j]);
+	if (bcmp(old, f->data, f->len) == 0)
+		return;
+
+	/* IPv4 header */
+#define	COVERS(o, n)	((o) < soff + r->slen && (o) + (n) > soff)
+	ihl = h.ipver == 4 ? (old[h.l3] & 0x0f) * 4 : 0;
+	ck = h.l3 + 10;
+	if (h.ipver == 4 && ck + 2 <= f->len && !COVERS(ck, 2)) {
+		if (h.l3 + ihl <= f->len && !COVERS(h.l3, 1) &&
+		    cksum_add(old + h.l3, ihl, 0) == 0xffff) {
+			f->data[ck] = f->data[ck + 1] = 0;
+			c = ~cksum_add(f->data + h.l3, ihl, 0);
+		} else {
+			c = ~ref_word(old, ck, f->len) & 0xffff;
+			for (w = soff & ~1; w < soff + r->slen; w += 2)
+				if (w >= h.l3 && w < h.l3 + ihl)
+					c = cksum_add(NULL, 0, c +
+					    (~ref_word(old, w, f->len) &
+					    0xffff) + ref_word(f->data, w,
+					    f->len));
+			c = ~c;
+		}
+		f->data[ck] = c >> 8;
+		f->data[ck + 1] = c;
+	}
+
+	/* TCP or UDP, over the addresses and length in the pseudo header */
+	if (h.l4 < 0 || (h.proto != 6 && h.proto != 17))
+		return;
+	ck = h.l4 + (h.proto == 6 ? 16 : 6);
+	if (ck + 2 > f->len || COVERS(ck, 2) ||
+	    (h.proto == 17 && h.ipver == 4 && ref_word(old, ck, f->len) == 0))
+		return;
+	pseudo = h.ipver == 4 ? h.l3 + 12 : h.l3 + 8;
+	lenw = h.proto == 17 ? h.l4 + 4 : h.l3 + (h.ipver == 4 ? 2 : 4);
+	end = h.l3 + (h.ipver == 4 ? 0 : 40) + ref_word(old, h.l3 +
+	    (h.ipver == 4 ? 2 : 4), f->len);
+	if (h.ipver == 6 && end == h.l3 + 40)
+		end = f->len;
+	full = end <= f->len && end >= ck + 2 && !COVERS(h.l3, 1) &&
+	    !COVERS(h.l3 + (h.ipver == 4 ? 9 : 6), 1) &&
+	    !COVERS(h.l3 + (h.ipver == 4 ? 2 : 4), 2) && !COVERS(lenw, 2) &&
+	    (h.proto == 6 || ref_word(old, lenw, f->len) == end - h.l4);
+	if (full) {
+		sum = cksum_add(old + pseudo, h.ipver == 4 ? 8 : 32,
+		    h.proto + end - h.l4);
+		full = cksum_add(old + h.l4, end - h.l4, sum) == 0xffff;
+	}
+	if (full) {
+		f->data[ck] = f->data[ck + 1] = 0;
+		sum = cksum_add(f->data + pseudo, h.ipver == 4 ? 8 : 32,
+		    h.proto + end - h.l4);
+		c = ~cksum_add(f->data + h.l4, end - h.l4, sum) & 0xffff;
+	} else {
+		c = ~ref_word(old, ck, f->len) & 0xffff;
+		for (w = soff & ~1; w < soff + r->slen; w += 2) {
+			if ((w >= pseudo && w < pseudo +
+			    (h.ipver == 4 ? 8 : 32)) || w == lenw)
+				c = cksum_add(NULL, 0, c +
+				    (~ref_word(old, w, f->len) & 0xffff) +
+				    ref_word(f->data, w, f->len));
+			if (w >= h.l4 && w < end)
+				c = cksum_add(NULL, 0, c +
+				    (~ref_word(old, w, imin(end, f->len)) &
+				    0xffff) + ref_word(f->data, w,
+				    imin(end, f->len)));
+		}
+		c = ~c & 0xffff;
+	}
+	if (c == 0 && h.proto == 17)
+		c = 0xffff;
+	f->data[ck] = c >> 8;
+	f->data[ck + 1] = c;
+#undef COVERS
+}
+
+/* Hooks which are there to be sent to: sinks, and in */
+#define	CONNECTED(t)	((t) >= 0 && (t) != HK_GONE)
+
+/* Count a packet on rule 'i', and note a copy of it going to sink 't' */
+static int
+ref_copy(int i, int t, const struct frame *f, int *out, int n)
+{
+
+	ref_counts[i].packets++;
+	ref_counts[i].bytes += f->len;
+	if (t >= 0 && t < NSINKS)
+		out[n++] = t;
+	return (n);
+}
+
+/*
+ * Sinks the frame is sent to, copies first, -1 if dropped, and the CRC
+ * of what each of them gets.  Rules are counted on as the node counts
+ * them.
+ */
+static int
+ref_verdict(const struct frame *f0, int *out, uint32_t *crc)
+{
+	u_char buf[FRAME_MAX];
+	struct frame fr = { f0->len, buf }, *f = &fr;
+	const struct rule *r;
+	const struct table *t;
+	int i, e, to, n = 0;
+
+	bcopy(f0->data, buf, f0->len);
+	for (i = 0; i < nrules;) {
+		r = &rules[i];
+		crc[n] = crc32(f->data, f->len);
+		switch (r->action) {
+		case A_HOOK:
+		case A_NHOOK:
+			if (ref_match(r, f) == (r->action == A_HOOK) &&
+			    CONNECTED(r->target)) {
+				to = r->target;
+				goto done;
+			}
+			break;
+		case A_DUP:
+		case A_NDUP:
+			if (ref_match(r, f) == (r->action == A_DUP) &&
+			    CONNECTED(r->target))
+				n = ref_copy(i, r->target, f, out, n);
+			break;
+		case A_SKIP:
+		case A_NSKIP:
+			/* As it always has, past the rule skipped to */
+			if (ref_match(r, f) == (r->action == A_SKIP)) {
+				n = ref_copy(i, -1, f, out, n);
+				i = r->target + 1;
+				continue;
+			}
+			break;
+		case A_DROP:
+		case A_NDROP:
+			if (ref_match(r, f) == (r->action == A_DROP)) {
+				to = -1;
+				goto done;
+			}
+			break;
+		case A_SET:
+			if (ref_match(r, f)) {
+				ref_set(r, f);
+				n = ref_copy(i, -1, f, out, n);
+			}
+			break;
+		case A_LOOKUP:
+			if ((e = ref_lookup(r, f)) < 0)
+				break;
+			t = &tables[r->target];
+			if (t->ent[e].action == A_DROP) {
+				to = -1;
+				goto done;
+			}
+			if (!CONNECTED(t->ent[e].target))
+				break;
+			if (t->ent[e].action == A_HOOK) {
+				to = t->ent[e].target;
+				goto done;
+			}
+			n = ref_copy(i, t->ent[e].target, f, out, n);
+			break;
+		case A_HASH:
+			if (ref_match(r, f) && (to = ref_hash(r, f)) >= 0)
+				goto done;
+			break;
+		case A_SAMPLE:
+			if (ref_match(r, f) && ref_sample(i) &&
+			    CONNECTED(r->target))
+				n = ref_copy(i, r->target, f, out, n);
+			break;
+		case A_POLICE:
+			if (ref_match(r, f) && !ref_police(i, f->len)) {
+				to = CONNECTED(r->target) ? r->target : -1;
+				goto done;
+			}
+			break;
+		}
+		i++;
+	}
+	to = -1;
+done:
+	ref_copy(i, -1, f, out, n);
+	out[n++] = to < NSINKS ? to : -1;
+	return (n);
+}
+
+/*
+ * The node
+ */
+/* CRCs of the packets a sink is to get or got, in order */
+struct crcs {
+	uint32_t	*crc;
+	int		n;
+	int		size;
+};
+
+static int got[MAXRULES + 1];
+static struct mbuf *held[MAXRULES + 1];
+static int ngot, hold, batching;
+static int chains[NSINKS], unchained;
+static hook_p gone;		/* out4 */
+static struct crcs bgot[NSINKS];
+static uint64_t rcvd[NSINKS];
+
+static void
+crcs_add(struct crcs *c, uint32_t crc)
+{
+
+	if (c->n == c->size) {
+		c->size = c->size ? c->size * 2 : 1024;
+		if ((c->crc = realloc(c->crc, c->size * sizeof(*c->crc))) ==
+		    NULL) {
+			perror("realloc");
+			exit(2);
+		}
+	}
+	c->crc[c->n++] = crc;
+}
+
+static uint32_t
+mbuf_crc(struct mbuf *m)
+{
+	u_char buf[FRAME_MAX];
+
+	m_copydata(m, 0, m->m_pkthdr.len, (caddr_t)buf);
+	return (crc32(buf, m->m_pkthdr.len));
+}
+
+/*
+ * With 'hold', packets are kept, for copies to share their storage.  With
+ * 'batching', their CRCs are kept instead.  A chain sent to a sink not set
+ * to take chains is counted in 'unchained'.
+ */
+static void
+sink_rcv(hook_p hook, struct mbuf *m, void *arg)
+{
+	struct mbuf *next;
+	int i = (intptr_t)arg;
+
+	if (i >= 0 && !chains[i] && m->m_nextpkt != NULL)
+		unchained++;
+	for (; m != NULL; m = next) {
+		next = m->m_nextpkt;
+		m->m_nextpkt = NULL;
+		if (i >= 0) {
+			rcvd[i]++;
+			if (batching)
+				crcs_add(&bgot[i], mbuf_crc(m));
+			else if (ngot < MAXRULES) {
+				if (hold) {
+					held[ngot] = m;
+					m = NULL;
+				}
+				got[ngot++] = i;
+			}
+		}
+		if (m != NULL)
+			m_freem(m);
+	}
+}
+
+static node_p
+node_create(hook_p *in)
+{
+	char name[NG_HOOKSIZ];
+	node_p node;
+	int i;
+
+	node = ngshim_node_create(ngshim_type, "patmat");
+	if (node == NULL) {
+		fprintf(stderr, "can't create node\n");
+		exit(2);
+	}
+	*in = ngshim_hook_create(node, "in", sink_rcv, (void *)(intptr_t)-1);
+	for (i = 0; i < NSINKS; i++) {
+		snprintf(name, sizeof(name), "out%d", i);
+		ngshim_hook_create(node, name, sink_rcv, (void *)(intptr_t)i);
+	}
+	gone = ngshim_hook_create(node, "out4", sink_rcv,
+	    (void *)(intptr_t)-1);
+	bzero(rcvd, sizeof(rcvd));
+	bzero(chains, sizeof(chains));
+	return (node);
+}
+
+static void
+node_msg(node_p node, const char *cmd)
+{
+	int error;
+
+	if ((error = ngshim_ascii_msg(node, cmd, NULL, 0)) != 0) {
+		fprintf(stderr, "%.200s: %s\n", cmd, strerror(error));
+		exit(2);
+	}
+}
+
+/* Whether sink i takes packet chains */
+static void
+node_chains(node_p node, int i, int on)
+{
+	char msg[32];
+
+	snprintf(msg, sizeof(msg), "chains out%d %d", i, on);
+	node_msg(node, msg);
+	chains[i] = on;
+}
+
+/* Set the tables and hook groups of a node as they are here */
+static void
+tables_set(node_p node)
+{
+	char msg[TABLE_MAX * 128];
+	const struct table *t;
+	const struct hgroup *g;
+	int i, j, n;
+
+	for (i = 0; i < NTABLES; i++) {
+		t = &tables[i];
+		if (t->n == 0)
+			continue;
+		n = snprintf(msg, sizeof(msg), "tadd %d", i);
+		for (j = 0; j < t->n; j++) {
+			n += hex_format(msg + n, sizeof(msg) - n,
+			    t->ent[j].key, t->keylen, " ");
+			if (t->lpm)
+				n += snprintf(msg + n, sizeof(msg) - n, "/%d",
+				    t->ent[j].plen);
+			n += snprintf(msg + n, sizeof(msg) - n, ":%s:%s",
+			    anames[t->ent[j].action],
+			    t->ent[j].action == A_DROP ? "" :
+			    hook_name(t->ent[j].target));
+		}
+		node_msg(node, msg);
+	}
+	for (i = 0; i < NHGROUPS; i++) {
+		g = &hgroups[i];
+		if (g->n == 0)
+			continue;
+		n = snprintf(msg, sizeof(msg), "hgroup %d %s", i,
+		    g->fields == 0 ? "l2" : g->fields == 1 ? "l3" : "l4");
+		for (j = 0; j < g->n; j++)
+			n += snprintf(msg + n, sizeof(msg) - n, " %s",
+			    hook_name(g->member[j]));
+		node_msg(node, msg);
+	}
+}
+
+/*
+ * Benchmarks
+ */
+struct bench {
+	const char	*name;
+	int		rules;
+	int		width;		/* offsets searched beyond the first */
+	int		vlan;		/* tagged frames, rules for them */
+	int		fcache;		/* flow cache entries, or 0 */
+	int		ranges;		/* port ranges rather than ports */
+	int		set;		/* set the DSCP first */
+};
+
+static const struct bench benches[] = {
+	{ "ports-1",		1,	0,	0,	0,	0 },
+	{ "ports-16",		16,	0,	0,	0,	0 },
+	{ "ports-64",		64,	0,	0,	0,	0 },
+	{ "ports-256",		256,	0,	0,	0,	0 },
+	{ "ports-1024",		1024,	0,	0,	0,	0 },
+	{ "ports-64-w8",	64,	8,	0,	0,	0 },
+	{ "ports-64-w32",	64,	32,	0,	0,	0 },
+	{ "ports-256-w32",	256,	32,	0,	0,	0 },
+	{ "ports-64-vlan",	64,	0,	1,	0,	0 },
+	{ "ports-256-w8-vlan",	256,	8,	1,	0,	0 },
+	{ "ports-1024-fc",	1024,	0,	0,	4096,	0 },
+	{ "ranges-16",		16,	0,	0,	0,	1 },
+	{ "ranges-256",		256,	0,	0,	0,	1 },
+	{ "ranges-1024",	1024,	0,	0,	0,	1 },
+	{ "set-16",		16,	0,	0,	0,	0,	1 },
+	{ "set-256",		256,	0,	0,	0,	0,	1 },
+	{ NULL }
+};
+
+static const char *pcap_path;
+static char *cmd;
+static int batch;		/* frames per packet chain, if any */
+
+/* Wall clock cost of making and freeing the mbufs alone */
+static double
+bench_base(uint64_t frames)
+{
+	uint64_t t0, i;
+
+	t0 = ngshim_wallclock_ns();
+	for (i = 0; i < frames; i++)
+		m_freem(ngshim_m_frombuf(pool[i % npool].data,
+		    pool[i % npool].len, 0));
+	return ((double)(ngshim_wallclock_ns() - t0) / frames);
+}
+
+static void
+run_bench(const char *name, const char *shape, int fcache, uint64_t frames)
+{
+	char fc[32];
+	node_p node;
+	hook_p in;
+	struct mbuf *head, **tail;
+	uint64_t t0, t1, i, fwd;
+	double ns;
+	int j;
+
+	node = node_create(&in);
+	node_msg(node, cmd);
+	if (fcache) {
+		snprintf(fc, sizeof(fc), "fcache %d", fcache);
+		node_msg(node, fc);
+	}
+	for (j = 0; j < NSINKS && batch > 1; j++)
+		node_chains(node, j, 1);
+	for (i = 0; i < (uint64_t)npool; i++)
+		ngshim_rcvdata(in, ngshim_m_frombuf(pool[i].data,
+		    pool[i].len, 0));
+	bzero(rcvd, sizeof(rcvd));
+
+	t0 = ngshim_wallclock_ns();
+	for (i = 0; i < frames && batch > 1;) {
+		head = NULL;
+		for (tail = &head, j = 0; j < batch && i < frames; j++, i++) {
+			*tail = ngshim_m_frombuf(pool[i % npool].data,
+			    pool[i % npool].len, 0);
+			tail = &(*tail)->m_nextpkt;
+		}
+		ngshim_rcvdata(in, head);
+		ngot = 0;
+	}
+	for (; i < frames; i++) {
+		ngshim_rcvdata(in, ngshim_m_frombuf(pool[i % npool].data,
+		    pool[i % npool].len, 0));
+		ngot = 0;
+	}
+	t1 = ngshim_wallclock_ns();
+	ngshim_node_shutdown(node);
+
+	for (fwd = 0, j = 0; j < NSINKS; j++)
+		fwd += rcvd[j];
+	ns = (double)(t1 - t0) / frames;
+	printf("%-18s %-22s %10.0f pkt/s %8.1f ns/pkt  (%.1f%% forwarded)\n",
+	    name, shape, 1e9 / ns, ns, fwd * 100.0 / frames);
+}
+
+static int
+selected(const char *name, int argc, char **argv)
+{
+	int i;
+
+	if (argc == 0)
+		return (1);
+	for (i = 0; i < argc; i++)
+		if (strcmp(argv[i], name) == 0)
+			return (1);
+	return (0);
+}
+
+static void
+bench_all(uint64_t frames, int argc, char **argv)
+{
+	const struct bench *b;
+	char shape[32];
+
+	if (pcap_path != NULL)
+		pool_pcap(pcap_path);
+	else
+		pool_synth(1, 0);
+	printf("%-18s %48.1f ns/pkt\n", "mbuf alloc/free",
+	    bench_base(frames));
+	for (b = benches; b->name != NULL; b++) {
+		if (!selected(b->name, argc, argv))
+			continue;
+		if (pcap_path == NULL)
+			pool_synth(b->rules, b->vlan);
+		rules_ports(b->rules, b->width, b->vlan, b->ranges, b->set);
+		rules_format(cmd, CMD_MAX);
+		snprintf(shape, sizeof(shape), "%5d rules w%-3d %s", b->rules,
+		    b->width, b->vlan ? "vlan" : b->ranges ? "ranges" :
+		    b->set ? "set" : "");
+		run_bench(b->name, shape, b->fcache, frames);
+	}
+}
+
+/*
+ * Rule sets from a file, one per line, as given to shc after the hook
+ * name.  Blank lines and those starting with # are skipped.
+ */
+static void
+bench_file(const char *path, uint64_t frames)
+{
+	char name[32], shape[32], *line, *cp;
+	FILE *fp;
+	int n = 0, rules;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		perror(path);
+		exit(2);
+	}
+	if (pcap_path != NULL)
+		pool_pcap(pcap_path);
+	else
+		pool_synth(1024, 0);
+	printf("%-18s %48.1f ns/pkt\n", "mbuf alloc/free",
+	    bench_base(frames));
+	line = malloc(CMD_MAX);
+	while (fgets(line, CMD_MAX, fp) != NULL) {
+		line[strcspn(line, "\r\n")] = '\0';
+		cp = line + strspn(line, " \t");
+		if (*cp == '\0' || *cp == '#')
+			continue;
+		snprintf(cmd, CMD_MAX, "shc in %s", cp);
+		snprintf(name, sizeof(name), "%s:%d",
+		    strrchr(path, '/') ? strrchr(path, '/') + 1 : path, ++n);
+		for (rules = 0; *cp != '\0'; rules++) {
+			cp += strcspn(cp, " \t");
+			cp += strspn(cp, " \t");
+		}
+		snprintf(shape, sizeof(shape), "%5d rules", rules);
+		run_bench(name, shape, 0, frames);
+	}
+	free(line);
+	fclose(fp);
+}
+
+/*
+ * Correctness
+ */
+static int failures;
+
+/*
+ * One frame, a little or a while after the one before, for the meters to
+ * have something to meter
+ */
+static int
+check_frame(hook_p in, const char *what, int seglen, int i)
+{
+	const struct frame *f = &pool[i];
+	u_char buf[FRAME_MAX];
+	uint32_t wcrc[MAXRULES + 1], gcrc[MAXRULES + 1];
+	int want[MAXRULES + 1], nwant, j;
+
+	ngshim_clock_advance(rnd() % 4 ? rnd_range(0, 400) : 4000);
+	nwant = ref_verdict(f, want, wcrc);
+	if (want[nwant - 1] < 0)
+		nwant--;
+	ngot = 0;
+	hold = 1;
+	ngshim_rcvdata(in, ngshim_m_frombuf(f->data, f->len, seglen));
+	hold = 0;
+	for (j = 0; j < ngot; j++) {
+		m_copydata(held[j], 0, held[j]->m_pkthdr.len, (caddr_t)buf);
+		gcrc[j] = crc32(buf, held[j]->m_pkthdr.len);
+		m_freem(held[j]);
+	}
+	for (j = 0; j < nwant && j < ngot; j++)
+		if (want[j] != got[j] || wcrc[j] != gcrc[j])
+			break;
+	if (j == nwant && j == ngot)
+		return (0);
+	printf("FAIL %s seg %d frame %d:", what, seglen, i);
+	for (j = 0; j < f->len; j++)
+		printf("%s%02x", j % 16 ? "" : "\n  ", f->data[j]);
+	printf("\n  %s\n  want", cmd);
+	for (j = 0; j < nwant; j++)
+		printf(" out%d/%08x", want[j], wcrc[j]);
+	printf(", got");
+	for (j = 0; j < ngot; j++)
+		printf(" out%d/%08x", got[j], gcrc[j]);
+	printf("\n");
+	return (1);
+}
+
+static int
+check_frames(hook_p in, const char *what, int seglen)
+{
+	int i;
+
+	for (i = 0; i < npool; i++)
+		if (check_frame(in, what, seglen, i))
+			return (1);
+	return (0);
+}
+
+/* Counters of the rules, the default drop and nocopy, as getstats has them */
+static int
+check_stats(node_p node, const char *what, int seglen)
+{
+	static char st[(MAXRULES + 2) * 64];
+	uintmax_t pk, by;
+	const char *cp;
+	int error, i;
+
+	if ((error = ngshim_ascii_msg(node, "getstats in", st,
+	    sizeof(st))) != 0) {
+		printf("FAIL %s getstats: %s\n", what, strerror(error));
+		return (1);
+	}
+	for (cp = st, i = 0; i <= nrules + 1; i++) {
+		cp += strcspn(cp, " ");
+		pk = by = UINTMAX_MAX;
+		if (sscanf(cp, " %*[^:]:%ju:%ju", &pk, &by) != 2 ||
+		    pk != ref_counts[i].packets || by != ref_counts[i].bytes)
+			break;
+		cp++;
+	}
+	if (i > nrules + 1)
+		return (0);
+	printf("FAIL %s seg %d counter %d: %ju packets, %ju bytes, want "
+	    "%ju, %ju\n  %s\n", what, seglen, i, pk, by,
+	    (uintmax_t)ref_counts[i].packets, (uintmax_t)ref_counts[i].bytes,
+	    cmd);
+	return (1);
+}
+
+/*
+ * All frames in one packet chain.  Each sink gets the copies as they are
+ * made, then the packets forwarded to it in the order they came in, as a
+ * chain if it is set to take chains, which a random few are, else one by
+ * one.
+ */
+static int
+check_batch(node_p node, hook_p in, const char *what, int seglen)
+{
+	static struct crcs bwant[NSINKS], bfwd[NSINKS];
+	struct mbuf *head = NULL, **tail = &head;
+	uint32_t wcrc[MAXRULES + 1];
+	int want[MAXRULES + 1], nwant, i, j, s;
+
+	for (s = 0; s < NSINKS; s++) {
+		bwant[s].n = bfwd[s].n = bgot[s].n = 0;
+		node_chains(node, s, rnd() % 2);
+	}
+	for (i = 0; i < npool; i++) {
+		nwant = ref_verdict(&pool[i], want, wcrc);
+		for (j = 0; j < nwant - 1; j++)
+			crcs_add(&bwant[want[j]], wcrc[j]);
+		if (want[j] >= 0)
+			crcs_add(&bfwd[want[j]], wcrc[j]);
+		*tail = ngshim_m_frombuf(pool[i].data, pool[i].len, seglen);
+		tail = &(*tail)->m_nextpkt;
+	}
+	batching = 1;
+	unchained = 0;
+	ngshim_rcvdata(in, head);
+	batching = 0;
+	if (unchained) {
+		printf("FAIL %s seg %d batch, %d chain(s) to sinks not "
+		    "taking them\n  %s\n", what, seglen, unchained, cmd);
+		return (1);
+	}
+	for (s = 0; s < NSINKS; s++) {
+		for (j = 0; j < bfwd[s].n; j++)
+			crcs_add(&bwant[s], bfwd[s].crc[j]);
+		for (j = 0; j < bwant[s].n && j < bgot[s].n; j++)
+			if (bwant[s].crc[j] != bgot[s].crc[j])
+				break;
+		if (j == bwant[s].n && j == bgot[s].n)
+			continue;
+		printf("FAIL %s seg %d batch, out%d packet %d of %d, got %d\n"
+		    "  %s\n", what, seglen, s, j, bwant[s].n, bgot[s].n, cmd);
+		return (1);
+	}
+	return (0);
+}
+
+/*
+ * Each rule set, without and with the flow cache, whole and chained, one
+ * frame at a time and all at once, then its counters
+ */
+static void
+check_rules(const char *what)
+{
+	static const int segs[] = { 0, 7, 1 };
+	node_p node;
+	hook_p in;
+	int c, s;
+
+	rules_format(cmd, CMD_MAX);
+	for (c = 0; c < 2; c++) {
+		for (s = 0; s < 3; s++) {
+			node = node_create(&in);
+			tables_set(node);
+			node_msg(node, cmd);
+			ngshim_hook_disconnect(gone);
+			ref_install();
+			if (c)
+				node_msg(node, "fcache 1024");
+			/* Twice, for cached verdicts to be used */
+			if (check_frames(in, what, segs[s]) ||
+			    (c && check_frames(in, what, segs[s])) ||
+			    check_batch(node, in, what, segs[s]) ||
+			    check_stats(node, what, segs[s])) {
+				failures++;
+				ngshim_node_shutdown(node);
+				return;
+			}
+			ngshim_node_shutdown(node);
+		}
+	}
+}
+
+static void
+check_all(int cases)
+{
+	const struct bench *b;
+	char what[64];
+	int i, n = 0;
+
+	for (b = benches; b->name != NULL; b++) {
+		if (b->rules > 256)
+			continue;
+		n++;
+		if (pcap_path != NULL)
+			pool_pcap(pcap_path);
+		else
+			pool_synth(b->rules, b->vlan);
+		rules_ports(b->rules, b->width, b->vlan, b->ranges, b->set);
+		check_rules(b->name);
+	}
+	for (i = 0; i < cases; i++) {
+		if (pcap_path != NULL) {
+			if (i == 0)
+				pool_pcap(pcap_path);
+		} else if (i % 64 == 0)
+			pool_random();
+		rules_random();
+		snprintf(what, sizeof(what), "random-%d", i);
+		check_rules(what);
+	}
+	printf("%d rule sets, %d failure(s)\n", n + cases, failures);
+}
+
+/*
+ * Parser fuzzing
+ */
+static const char *seeds[] = {
+	"10:match_hook:08.00/ff.ff@12:out0 20:match_drop::",
+	"10:nomatch_hook:45/f0@l3+0:out1 20:match_skipto:00.35/ff.ff@l4+2:40 "
+	    "30:match_dupto::out2 40:match_hook::out3",
+	"10:lookup:ff.ff.ff.ff.ff.ff@0:3 20:lookup:ff.ff.ff.ff@l3+16:4 "
+	    "30:match_hook::out0",
+	"10:match_hash:08.00/ff.ff@12:1 20:nomatch_drop:11/ff@l3+9:",
+	"10:match_sample:08.00/ff.ff@12:100/out1 "
+	    "20:match_police::8000000/3000/out2 30:match_hook::out0",
+	"10:match_sample::~4/out1 20:match_police:06/ff@l3+9:1000/1500 "
+	    "30:nomatch_dupto:de.ad.be.ef/ff.ff.ff.ff@0..60:out2",
+	"10:match_hook:81.00.00.05/ff.ff.0f.ff@12:out0 "
+	    "20:nomatch_skipto:06/ff@l3+9:30 30:match_dupto:47.45.54/ff.ff.ff"
+	    "@l4+8..200:out1 40:match_drop:00/00@0:",
+	"5:match_hook:aa.bb.cc.dd.ee.ff.00.11.22.33.44.55.66.77.88.99.aa.bb."
+	    "cc.dd.ee.ff.00.11.22.33.44.55.66.77.88.99/ff.ff.ff.ff.ff.ff.ff.ff."
+	    "ff.ff.ff.ff.ff.ff.ff.ff.ff.ff.ff.ff.ff.ff.ff.ff.ff.ff.ff.ff.ff.ff."
+	    "ff.ff@1400..1500:out3",
+	"10:match_hook:04.00-ff.ff@l4+2:out0 20:match_drop:<05@l3+8: "
+	    "30:nomatch_skipto:>=05.dc@12:50 40:match_dupto:<=0a.00.00.ff@26:"
+	    "out1 50:match_hook:>7f@0:out2 60:match_sample:00-0f@14:2/out3",
+	"10:match_set_field:08.00/ff.ff@12:b8/fc@l3+1 "
+	    "20:match_set_field::0a.00.00.01@l3+16 30:match_dupto::out1 "
+	    "40:match_set_field:11/ff@l3+9:12.34@l4+2 50:match_hook::out0",
+};
+
+static const char *tokens[] = {
+	":", "/", ".", "@", "..", "~", " ", "l3+", "l4+", "ff", "00", "08.00",
+	"-", "<", ">", "<=", ">=",
+	"match_hook", "nomatch_hook", "match_dupto", "nomatch_dupto",
+	"match_skipto", "nomatch_skipto", "match_drop", "nomatch_drop",
+	"lookup", "match_hash", "match_sample", "match_police",
+	"match_set_field", "out0", "in",
+	"nosuch", "0", "1", "65535", "65536", "4294967296", "-1", "+",
+	"99999999999999999999", "12", "40",
+};
+
+#define	NTOKENS	(sizeof(tokens) / sizeof(tokens[0]))
+#define	NSEEDS	(sizeof(seeds) / sizeof(seeds[0]))
+
+static void
+mutate(char *s, int size)
+{
+	static const char alpha[] = ":/.@~+-<>= 0123456789abcdeflx_";
+	char tmp[4096];
+	int len, i, j, k, n;
+
+	for (n = rnd() % 2 ? 1 : rnd_range(2, 4); n > 0; n--) {
+		len = strlen(s);
+		i = len ? rnd() % (len + 1) : 0;
+		switch (rnd() % 6) {
+		case 0:		/* replace a character */
+			if (i < len)
+				s[i] = rnd() % 4 ? alpha[rnd() %
+				    (sizeof(alpha) - 1)] : rnd_range(1, 255);
+			break;
+		case 1:		/* delete a span */
+			j = imin(len, i + rnd_range(1, 8));
+			memmove(s + i, s + j, len - j + 1);
+			break;
+		case 2:		/* insert a token */
+			snprintf(tmp, sizeof(tmp), "%.*s%s%s", i, s,
+			    tokens[rnd() % NTOKENS], s + i);
+			strlcpy(s, tmp, size);
+			break;
+		case 3:		/* duplicate a span */
+			j = imin(len, i + rnd_range(1, 32));
+			k = snprintf(tmp, sizeof(tmp), "%.*s", j, s);
+			for (n = rnd_range(1, 20); n > 0 && k + j - i < 3000;
+			    n--)
+				k += snprintf(tmp + k, sizeof(tmp) - k, "%.*s",
+				    j - i, s + i);
+			snprintf(tmp + k, sizeof(tmp) - k, "%s", s + j);
+			strlcpy(s, tmp, size);
+			break;
+		case 4:		/* truncate */
+			s[i] = '\0';
+			break;
+		case 5:		/* splice in part of another seed */
+			k = rnd() % NSEEDS;
+			j = rnd() % strlen(seeds[k]);
+			snprintf(tmp, sizeof(tmp), "%.*s%s", i, s,
+			    seeds[rnd() % NSEEDS] + j % 16);
+			strlcpy(s, tmp, size);
+			break;
+		}
+	}
+}
+
+/* Dot separated hex bytes from *sp on, how many */
+static int
+hex_parse(const char **sp, u_char *b)
+{
+	int n, k;
+
+	for (n = 0; n < PATLEN && isxdigit((u_char)**sp) &&
+	    sscanf(*sp, "%2hhx%n", &b[n], &k) == 1;) {
+		*sp += k;
+		n++;
+		if (**sp != '.')
+			break;
+		(*sp)++;
+	}
+	return (n);
+}
+
+/* [l3+|l4+]offset from *sp on */
+static int
+anchor_parse(const char **sp, int *anchor, int *off)
+{
+	int k;
+
+	for (*anchor = AN_ANCHORS - 1; *anchor > AN_FRAME &&
+	    strncmp(*sp, ancnames[*anchor], 3) != 0; (*anchor)--)
+		continue;
+	*sp += strlen(ancnames[*anchor]);
+	if (sscanf(*sp, "%d%n", off, &k) != 1)
+		return (-1);
+	*sp += k;
+	return (0);
+}
+
+/* A hook name from *sp on */
+static int
+hook_parse(const char **sp)
+{
+	int n = strcspn(*sp, " /");
+
+	*sp += n;
+	return (hook_number(*sp - n, n));
+}
+
+/*
+ * Read rules back from what ghc prints, for the reference to run the
+ * rule sets the fuzzer comes up with.  Returns -1 on what it cannot.
+ */
+static int
+rules_parse(const char *s)
+{
+	struct rule *r;
+	char act[32];
+	uintmax_t rate;
+	u_int burst;
+	int i, j, n;
+
+	s += strcspn(s, " ");
+	for (nrules = 0; *(s += strspn(s, " ")) != '\0'; nrules++) {
+		if (nrules == MAXRULES)
+			return (-1);
+		r = &rules[nrules];
+		bzero(r, sizeof(*r));
+		if (sscanf(s, "%d:%31[a-z_]:%n", &r->number, act, &n) != 2)
+			return (-1);
+		s += n;
+		for (r->action = 0; r->action < A_ACTIONS &&
+		    strcmp(act, anames[r->action]) != 0; r->action++)
+			continue;
+		if (r->action == A_ACTIONS)
+			return (-1);
+		if (r->action == A_LOOKUP)
+			r->len = hex_parse(&s, r->mask);
+		else if (*s != ':') {
+			for (r->cmp = C_CMPS - 1; r->cmp > C_RANGE &&
+			    strncmp(s, cnames[r->cmp], strlen(cnames[r->cmp]));
+			    r->cmp--)
+				continue;
+			s += strlen(cnames[r->cmp]);
+			r->len = hex_parse(&s, r->pat);
+			if (r->cmp == C_RANGE) {
+				if (*s != '-' && *s != '/')
+					return (-1);
+				r->cmp = *s++ == '/' ? C_MASK : C_RANGE;
+				if (hex_parse(&s, r->mask) != r->len)
+					return (-1);
+			}
+		}
+		if (r->len > 0) {
+			if (*s++ != '@' ||
+			    anchor_parse(&s, &r->anchor, &r->lo) != 0)
+				return (-1);
+			r->hi = r->lo;
+			if (strncmp(s, "..", 2) == 0 &&
+			    sscanf(s + 2, "%d%n", &r->hi, &n) == 1)
+				s += 2 + n;
+		}
+		if (*s++ != ':')
+			return (-1);
+		n = 0;
+		switch (r->action) {
+		case A_SKIP:
+		case A_NSKIP:
+		case A_LOOKUP:
+		case A_HASH:
+			/* Skips by rule number, until all are read */
+			if (sscanf(s, "%d%n", &r->target, &n) != 1)
+				return (-1);
+			break;
+		case A_DROP:
+		case A_NDROP:
+			break;
+		case A_SET:
+			r->slen = hex_parse(&s, r->sval);
+			if (*s++ != '/' || hex_parse(&s, r->smask) != r->slen ||
+			    *s++ != '@' ||
+			    anchor_parse(&s, &r->sanchor, &r->soff) != 0)
+				return (-1);
+			break;
+		case A_SAMPLE:
+			if ((r->random = *s == '~'))
+				s++;
+			if (sscanf(s, "%ju/%n", &rate, &n) != 1)
+				return (-1);
+			s += n;
+			n = 0;
+			r->rate = rate;
+			r->target = hook_parse(&s);
+			break;
+		case A_POLICE:
+			if (sscanf(s, "%ju/%u%n", &rate, &burst, &n) != 2)
+				return (-1);
+			s += n;
+			n = 0;
+			r->rate = rate;
+			r->burst = burst;
+			r->target = HK_NONE;
+			if (*s == '/') {
+				s++;
+				r->target = hook_parse(&s);
+			}
+			break;
+		default:
+			r->target = hook_parse(&s);
+		}
+		s += n;
+		if (*s != ' ' && *s != '\0')
+			return (-1);
+	}
+	for (i = 0; i < nrules; i++) {
+		r = &rules[i];
+		if (r->action != A_SKIP && r->action != A_NSKIP)
+			continue;
+		for (j = i + 1; j < nrules && rules[j].number != r->target;
+		    j++)
+			continue;
+		if (j == nrules)
+			return (-1);
+		r->target = j;
+	}
+	return (0);
+}
+
+/* 1 if the input was accepted, -1 if it failed the checks */
+static int
+fuzz_one(node_p node, hook_p in, const char *input)
+{
+	static char ghc1[CMD_MAX / 2], ghc2[CMD_MAX / 2];
+	int error, i, seglen = rnd() % 2 ? 0 : rnd_range(1, 16);
+
+	snprintf(cmd, CMD_MAX, "shc in %s", input);
+	if (ngshim_ascii_msg(node, cmd, NULL, 0) != 0)
+		return (0);
+	if ((error = ngshim_ascii_msg(node, "ghc in", ghc1,
+	    sizeof(ghc1))) != 0) {
+		printf("FAIL ghc: %s\n  shc in %s\n", strerror(error), input);
+		return (-1);
+	}
+	snprintf(cmd, CMD_MAX, "shc %s", ghc1);
+	if ((error = ngshim_ascii_msg(node, cmd, NULL, 0)) != 0) {
+		printf("FAIL ghc output rejected: %s\n  shc in %s\n  %s\n",
+		    strerror(error), input, cmd);
+		return (-1);
+	}
+	ngshim_ascii_msg(node, "ghc in", ghc2, sizeof(ghc2));
+	if (strcmp(ghc1, ghc2) != 0) {
+		printf("FAIL ghc differs after reading back:\n  shc in %s\n"
+		    "  %s\n  %s\n", input, ghc1, ghc2);
+		return (-1);
+	}
+	if (rules_parse(ghc1) != 0) {
+		printf("FAIL ghc output not understood:\n  shc in %s\n"
+		    "  %s\n", input, ghc1);
+		return (-1);
+	}
+	ref_install();
+	for (i = 0; i < 8; i++)
+		if (check_frame(in, "fuzz", seglen, rnd() % npool))
+			return (-1);
+	return (check_stats(node, "fuzz", seglen) ? -1 : 1);
+}
+
+static void
+fuzz(int iterations)
+{
+	char input[4096];
+	node_p node;
+	hook_p in;
+	int i, accepted = 0;
+
+	static const struct table t3 = { 6, 0, 2, {
+		{ { 0x02, 0, 0, 0, 0, 0x01 }, 0, A_HOOK, 1 },
+		{ { 0x02, 0, 0, 0, 0, 0x02 }, 0, A_DROP, HK_NONE } } };
+	static const struct table t4 = { 4, 1, 2, {
+		{ { 0x0a }, 8, A_DUP, 2 },
+		{ { 0x0a, 0x01 }, 16, A_HOOK, 3 } } };
+	static const struct hgroup g1 = { 2, 3, { 0, 1, 2 } };
+
+	pool_random();
+	bzero(tables, sizeof(tables));
+	bzero(hgroups, sizeof(hgroups));
+	tables[3] = t3;
+	tables[4] = t4;
+	hgroups[1] = g1;
+	node = node_create(&in);
+	ngshim_hook_disconnect(gone);
+	tables_set(node);
+	for (i = 0; i < (int)NSEEDS; i++)
+		if (fuzz_one(node, in, seeds[i]) != 1) {
+			printf("FAIL seed rejected:\n  shc in %s\n", seeds[i]);
+			failures++;
+		}
+	for (i = 0; i < iterations; i++) {
+		strlcpy(input, seeds[rnd() % NSEEDS], sizeof(input));
+		mutate(input, sizeof(input));
+		switch (fuzz_one(node, in, input)) {
+		case 1:
+			accepted++;
+			break;
+		case -1:
+			failures++;
+			break;
+		}
+		if (i % 1000 == 999)
+			node_msg(node, "clrstats in");
+	}
+	ngshim_node_shutdown(node);
+	printf("%d inputs, %d accepted, %d failure(s)\n", iterations,
+	    accepted, failures);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: pm_bench [-b batch] [-n frames] [-r pcap] "
+	    "[-R rulefile] [bench ...]\n"
+	    "       pm_bench -c [-n cases] [-r pcap] [-s seed]\n"
+	    "       pm_bench -f iterations [-s seed]\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *rulefile = NULL;
+	uint64_t n = 0;
+	int check = 0, fuzzing = 0;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "b:cf:n:r:R:s:")) != -1) {
+		switch (ch) {
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		case 'c':
+			check = 1;
+			break;
+		case 'f':
+			fuzzing = atoi(optarg);
+			break;
+		case 'n':
+			n = strtoull(optarg, NULL, 10);
+			break;
+		case 'r':
+			pcap_path = optarg;
+			break;
+		case 'R':
+			rulefile = optarg;
+			break;
+		case 's':
+			rng_seed(strtoull(optarg, NULL, 10));
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (ngshim_load(ngshim_type) != 0) {
+		fprintf(stderr, "can't load ng_patmat\n");
+		return (2);
+	}
+	if ((cmd = malloc(CMD_MAX)) == NULL) {
+		perror("malloc");
+		return (2);
+	}
+
+	if (check)
+		check_all(n ? n : 500);
+	else if (fuzzing)
+		fuzz(fuzzing);
+	else if (rulefile != NULL)
+		bench_file(rulefile, n ? n : 1000000);
+	else
+		bench_all(n ? n : 1000000, argc, argv);
+
+	pool_free();
+	free(pool);
+	free(cmd);
+	ngshim_unload(ngshim_type);
+	return (failures != 0);
+}
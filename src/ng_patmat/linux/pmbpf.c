@@ -0,0 +1,1151 @@
+/*-
+ * Copyright (c) 2026 University of Zagreb
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * pmbpf -- ng_patmat rule sets as eBPF programs on Linux.
+ *
+ * A rule set, in the syntax shc takes for a hook of ng_patmat, is compiled
+ * into a tc classifier program for the frames received on one network
+ * interface, and attached in direct action mode to the ingress hook of its
+ * clsact qdisc, where it replaces any program attached there before:
+ *
+ *	pmbpf eth0 10:match_hook:08.06/ff.ff@12:eth1 20:match_drop::
+ *
+ * Hook names are interface names.  Frames are forwarded with bpf_redirect()
+ * to the egress of the interface a match_hook rule names, copies are sent
+ * with bpf_clone_redirect() by dupto rules, and frames are dropped by drop
+ * rules and past the last rule, all within the kernel.  A skipto continues
+ * past the rule skipped to, as it does in ng_patmat.  Without rules, the
+ * program is detached and frames pass as they would without pmbpf.
+ *
+ * Frames are matched as they are on the wire: where the interface has
+ * taken a VLAN tag out of the frame, bytes 12 to 15 are those of the tag
+ * and later bytes are read 4 bytes further back.  The program is built
+ * twice, for untagged and tagged frames, and picks the half to run once.
+ *
+ * Offsets relative to l3 or l4 headers, lookup, match_hash, match_sample,
+ * match_police and match_set_field rules are not supported.
+ */
+
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/netlink.h>
+#include <linux/pkt_cls.h>
+#include <linux/pkt_sched.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define	MAXRULES	65535	/* rule numbers are 16 bit */
+#define	MAXPATLEN	32
+#define	MAXPKTOFF	0xffff
+#define	MAXINSNS	(1 << 20)
+#define	FILTER_PRIO	1
+#define	FILTER_HANDLE	1
+
+enum {
+	A_HOOK, A_NHOOK, A_DUP, A_NDUP, A_SKIP, A_NSKIP, A_DROP, A_NDROP
+};
+
+static const char *anames[] = {
+	"match_hook", "nomatch_hook", "match_dupto", "nomatch_dupto",
+	"match_skipto", "nomatch_skipto", "match_drop", "nomatch_drop"
+};
+
+/* Also ng_patmat actions, but not ours */
+static const char *unsupported[] = {
+	"lookup", "match_hash", "match_sample", "match_police",
+	"match_set_field", NULL
+};
+
+struct rule {
+	int		number;
+	int		action;
+	int		len;		/* 0 matches any frame */
+	int		lo, hi;
+	int		range;		/* compares a field with vlo..vhi */
+	uint32_t	vlo, vhi;	/* never in range if vlo > vhi */
+	u_char		pat[MAXPATLEN];
+	u_char		mask[MAXPATLEN];
+	char		ifname[IF_NAMESIZE];	/* hook and dupto target */
+	int		ifindex;
+	int		skipto;		/* rule number, then index */
+};
+
+static struct rule *rules;
+static int nrules;
+
+static const char *progname = "pmbpf";
+
+static void	fail(const char *fmt, ...)
+		    __attribute__((__noreturn__, __format__(printf, 1, 2)));
+
+static void
+fail(const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "%s: ", progname);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+/*
+ * Rule parser, for the same syntax as ng_patmat's shc.
+ */
+static int
+hexbyte(const char *cp)
+{
+
+	return ((isdigit((u_char)cp[0]) ? cp[0] - '0' :
+	    tolower((u_char)cp[0]) - 'a' + 10) << 4 |
+	    (isdigit((u_char)cp[1]) ? cp[1] - '0' :
+	    tolower((u_char)cp[1]) - 'a' + 10));
+}
+
+/* Bytes of 'aa.bb.cc', ending in one of 'end', or -1 */
+static int
+parse_bytes(const char **sp, u_char *b, const char *end)
+{
+	const char *s = *sp;
+	int n = 0;
+
+	for (;;) {
+		if (!isxdigit((u_char)s[0]) || !isxdigit((u_char)s[1]) ||
+		    n == MAXPATLEN)
+			return (-1);
+		b[n++] = hexbyte(s);
+		s += 2;
+		if (*s != '\0' && strchr(end, *s) != NULL)
+			break;
+		if (*s++ != '.')
+			return (-1);
+	}
+	*sp = s + 1;
+	return (n);
+}
+
+static uint32_t
+field_value(const u_char *b, int len)
+{
+	uint32_t v = 0;
+	int i;
+
+	for (i = 0; i < len; i++)
+		v = v << 8 | b[i];
+	return (v);
+}
+
+/*
+ * The range of values a comparison or range of 'r' stands for, as
+ * ng_patmat takes them, from 'op', "<", "<=", ">", ">=" or "-".
+ */
+static int
+parse_range(struct rule *r, const char *op)
+{
+	uint32_t v, max;
+
+	if (r->len != 1 && r->len != 2 && r->len != 4)
+		return (-1);
+	v = field_value(r->pat, r->len);
+	max = 0xffffffffU >> (32 - 8 * r->len);
+	r->range = 1;
+	r->vlo = 0;
+	r->vhi = max;
+	if (strcmp(op, "-") == 0) {
+		r->vlo = v;
+		r->vhi = field_value(r->mask, r->len);
+		if (r->vlo > r->vhi)
+			return (-1);
+	} else if (strcmp(op, "<") == 0)
+		r->vhi = v - 1;
+	else if (strcmp(op, "<=") == 0)
+		r->vhi = v;
+	else if (strcmp(op, ">") == 0)
+		r->vlo = v + 1;
+	else
+		r->vlo = v;
+	if ((strcmp(op, "<") == 0 && v == 0) ||
+	    (strcmp(op, ">") == 0 && v == max)) {
+		r->vlo = 1;
+		r->vhi = 0;
+	}
+	return (0);
+}
+
+static int
+parse_number(const char **sp, long max)
+{
+	const char *s = *sp;
+	long v = 0;
+
+	if (!isdigit((u_char)*s))
+		return (-1);
+	for (; isdigit((u_char)*s); s++)
+		if ((v = v * 10 + *s - '0') > max)
+			return (-1);
+	*sp = s;
+	return (v);
+}
+
+static void
+parse_rule(const char *tok, struct rule *r, int prev)
+{
+	const char *s = tok, *e;
+	char op[3];
+	int i;
+
+	memset(r, 0, sizeof(*r));
+	r->ifindex = -1;
+	if ((r->number = parse_number(&s, MAXRULES)) <= prev || *s++ != ':')
+		fail("%s: bad or out of order rule number", tok);
+
+	e = s + strcspn(s, ":");
+	if (*e != ':')
+		fail("%s: no action", tok);
+	for (i = 0; unsupported[i] != NULL; i++)
+		if (strlen(unsupported[i]) == (size_t)(e - s) &&
+		    strncmp(s, unsupported[i], e - s) == 0)
+			fail("%s: %s rules are not supported", tok,
+			    unsupported[i]);
+	for (r->action = A_HOOK; r->action <= A_NDROP; r->action++)
+		if (strlen(anames[r->action]) == (size_t)(e - s) &&
+		    strncmp(s, anames[r->action], e - s) == 0)
+			break;
+	if (r->action > A_NDROP)
+		fail("%s: unknown action", tok);
+	s = e + 1;
+
+	if (*s == '<' || *s == '>') {
+		e = s + (s[1] == '=' ? 2 : 1);
+		snprintf(op, sizeof(op), "%.*s", (int)(e - s), s);
+		s = e;
+		if ((r->len = parse_bytes(&s, r->pat, "@")) < 0 ||
+		    parse_range(r, op) < 0)
+			fail("%s: bad comparison", tok);
+	} else if (*s != ':') {
+		if ((r->len = parse_bytes(&s, r->pat, "/-")) < 0)
+			fail("%s: bad pattern", tok);
+		if (s[-1] == '-') {
+			if (parse_bytes(&s, r->mask, "@") != r->len ||
+			    parse_range(r, "-") < 0)
+				fail("%s: bad range", tok);
+		} else if (parse_bytes(&s, r->mask, "@") != r->len)
+			fail("%s: bad pattern or mask", tok);
+	}
+	if (r->len > 0) {
+		if (strncmp(s, "l3+", 3) == 0 || strncmp(s, "l4+", 3) == 0)
+			fail("%s: header relative offsets are not supported",
+			    tok);
+		if ((r->lo = parse_number(&s, 65535)) < 0)
+			fail("%s: bad offset", tok);
+		r->hi = r->lo;
+		if (*s == '.') {
+			while (*s == '.')
+				s++;
+			if ((r->hi = parse_number(&s, 65535)) < 0 ||
+			    r->hi < r->lo)
+				fail("%s: bad offset range", tok);
+		}
+		if (*s != ':')
+			fail("%s: bad offset", tok);
+		if (r->range && r->hi != r->lo)
+			fail("%s: comparisons take a single offset", tok);
+		/* As far as the verifier lets programs into packets */
+		if (r->hi + r->len > MAXPKTOFF)
+			fail("%s: pattern beyond %d bytes", tok, MAXPKTOFF);
+		for (i = 0; i < r->len && !r->range; i++)
+			r->pat[i] &= r->mask[i];
+	}
+	s++;
+
+	switch (r->action) {
+	case A_HOOK:
+	case A_NHOOK:
+	case A_DUP:
+	case A_NDUP:
+		if (*s == '\0' || strlen(s) >= IF_NAMESIZE)
+			fail("%s: bad interface name", tok);
+		strcpy(r->ifname, s);
+		break;
+	case A_SKIP:
+	case A_NSKIP:
+		if ((r->skipto = parse_number(&s, MAXRULES)) < 0 || *s != '\0')
+			fail("%s: bad rule number to skip to", tok);
+		break;
+	default:
+		if (*s != '\0')
+			fail("%s: junk after drop", tok);
+		break;
+	}
+}
+
+/*
+ * Rules as given on the command line, one per argument or many to an
+ * argument separated by white space.  Targets are resolved unless 'dump'.
+ */
+static void
+parse_rules(int argc, char **argv, int dump)
+{
+	char *buf, *tok;
+	size_t len = 1;
+	int i, j;
+
+	for (i = 0; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+	if ((buf = malloc(len)) == NULL ||
+	    (rules = calloc(len / 4 + 1, sizeof(*rules))) == NULL)
+		fail("out of memory");
+	buf[0] = '\0';
+	for (i = 0; i < argc; i++) {
+		strcat(buf, argv[i]);
+		strcat(buf, " ");
+	}
+	for (tok = strtok(buf, " \t\n"); tok != NULL;
+	    tok = strtok(NULL, " \t\n")) {
+		parse_rule(tok, &rules[nrules],
+		    nrules ? rules[nrules - 1].number : 0);
+		nrules++;
+	}
+	free(buf);
+
+	for (i = 0; i < nrules; i++) {
+		switch (rules[i].action) {
+		case A_SKIP:
+		case A_NSKIP:
+			for (j = i + 1; j < nrules; j++)
+				if (rules[j].number == rules[i].skipto)
+					break;
+			if (j == nrules)
+				fail("rule %d: no rule %d to skip to",
+				    rules[i].number, rules[i].skipto);
+			rules[i].skipto = j;
+			break;
+		case A_HOOK:
+		case A_NHOOK:
+		case A_DUP:
+		case A_NDUP:
+			rules[i].ifindex = if_nametoindex(rules[i].ifname);
+			if (rules[i].ifindex == 0 && !dump)
+				fail("%s: %s", rules[i].ifname,
+				    strerror(errno));
+			break;
+		}
+	}
+}
+
+/*
+ * Code generator.  Jumps are to labels, fixed up once all are placed.
+ */
+static struct bpf_insn *insns;
+static int ninsns;
+static int *labels;
+static int nlabels, maxlabels;
+
+struct fixup {
+	int	insn;
+	int	label;
+};
+
+static struct fixup *fixups;
+static int nfixups, maxfixups;
+
+#define	R0	BPF_REG_0
+#define	R1	BPF_REG_1
+#define	R2	BPF_REG_2
+#define	R3	BPF_REG_3
+#define	R4	BPF_REG_4
+#define	RCTX	BPF_REG_6	/* the skb */
+#define	RTAG	BPF_REG_7	/* VLAN tag present, then the tag bytes */
+
+/*
+ * The verifier expands some context loads into several instructions, and
+ * jumps over them with it, so far jumps are given 32 bit offsets a little
+ * before 16 bits run out.
+ */
+#define	NEARJMP	(INT16_MAX - 256)
+
+static void
+emit(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm)
+{
+	struct bpf_insn *i;
+
+	if (ninsns == MAXINSNS)
+		fail("rule set too large for a BPF program");
+	i = &insns[ninsns++];
+	i->code = code;
+	i->dst_reg = dst;
+	i->src_reg = src;
+	i->off = off;
+	i->imm = imm;
+}
+
+static int
+label_new(void)
+{
+
+	if (nlabels == maxlabels) {
+		maxlabels = maxlabels ? maxlabels * 2 : 1024;
+		if ((labels = realloc(labels, maxlabels * sizeof(*labels))) ==
+		    NULL)
+			fail("out of memory");
+	}
+	labels[nlabels] = -1;
+	return (nlabels++);
+}
+
+static void
+label_set(int l)
+{
+
+	labels[l] = ninsns;
+}
+
+/* Conditional or, with code BPF_JA, unconditional jump to a label */
+static void
+emit_jmp(uint8_t code, uint8_t dst, uint8_t src, int32_t imm, int l)
+{
+
+	if (nfixups == maxfixups) {
+		maxfixups = maxfixups ? maxfixups * 2 : 1024;
+		if ((fixups = realloc(fixups, maxfixups * sizeof(*fixups))) ==
+		    NULL)
+			fail("out of memory");
+	}
+	fixups[nfixups].insn = ninsns;
+	fixups[nfixups++].label = l;
+	emit(code, dst, src, 0, imm);
+}
+
+/*
+ * Conditional jumps are to the next offset of a rule or to the next rule;
+ * only unconditional ones go far, with a 32 bit offset where needed.
+ */
+static void
+resolve(void)
+{
+	struct bpf_insn *i;
+	int n, d;
+
+	for (n = 0; n < nfixups; n++) {
+		i = &insns[fixups[n].insn];
+		d = labels[fixups[n].label] - fixups[n].insn - 1;
+		if (d >= -NEARJMP && d <= NEARJMP)
+			i->off = d;
+		else if (i->code == (BPF_JMP | BPF_JA)) {
+			i->code = BPF_JMP32 | BPF_JA;
+			i->imm = d;
+		} else
+			fail("rule set too large for a BPF program");
+	}
+}
+
+/* Jump target of a jump instruction */
+static int
+target(const struct bpf_insn *i, int n)
+{
+
+	return (n + 1 + (i->code == (BPF_JMP32 | BPF_JA) ? i->imm : i->off));
+}
+
+/*
+ * The verifier refuses unreachable instructions, as after a rule that
+ * always drops, so leave them out and move the jumps over them.
+ */
+static void
+prune(void)
+{
+	struct bpf_insn *i;
+	char *seen;
+	int *to, *stack, sp = 0, n, m, d;
+
+	if ((seen = calloc(ninsns, 1)) == NULL ||
+	    (to = malloc(ninsns * sizeof(*to))) == NULL ||
+	    (stack = malloc(ninsns * sizeof(*stack))) == NULL)
+		fail("out of memory");
+	stack[sp++] = 0;
+	seen[0] = 1;
+	while (sp > 0) {
+		i = &insns[n = stack[--sp]];
+		if (BPF_CLASS(i->code) == BPF_JMP ||
+		    BPF_CLASS(i->code) == BPF_JMP32) {
+			if (BPF_OP(i->code) == BPF_EXIT)
+				continue;
+			if (BPF_OP(i->code) != BPF_CALL &&
+			    !seen[m = target(i, n)]) {
+				seen[m] = 1;
+				stack[sp++] = m;
+			}
+			if (BPF_OP(i->code) == BPF_JA)
+				continue;
+		}
+		if (!seen[n + 1]) {
+			seen[n + 1] = 1;
+			stack[sp++] = n + 1;
+		}
+	}
+	for (n = m = 0; n < ninsns; n++)
+		to[n] = seen[n] ? m++ : -1;
+	for (n = 0; n < ninsns; n++) {
+		if (!seen[n])
+			continue;
+		i = &insns[n];
+		if ((BPF_CLASS(i->code) == BPF_JMP ||
+		    BPF_CLASS(i->code) == BPF_JMP32) &&
+		    BPF_OP(i->code) != BPF_CALL &&
+		    BPF_OP(i->code) != BPF_EXIT) {
+			d = to[target(i, n)] - to[n] - 1;
+			if (i->code == (BPF_JMP32 | BPF_JA))
+				i->imm = d;
+			else
+				i->off = d;
+		}
+		insns[to[n]] = *i;
+	}
+	ninsns = m;
+	free(stack);
+	free(to);
+	free(seen);
+}
+
+/* Labels of the code common to both halves */
+static int l_drop;
+static int *l_fwd;		/* by rule, for hook rules */
+
+/*
+ * Go to 'l' unless the frame has 'end' bytes, and leave pointers to the
+ * skb data in R2 and its end in R3.  They are loaded anew for every offset,
+ * or the verifier would keep apart what it has seen for every length
+ * checked before.
+ */
+static void
+emit_avail(int tagged, int end, int l)
+{
+
+	/* Tagged frames have at least their addresses in the skb */
+	if (tagged && end > 12)
+		end = end - 4 > 12 ? end - 4 : 12;
+	emit(BPF_LDX | BPF_MEM | BPF_W, R2, RCTX, offsetof(struct __sk_buff,
+	    data), 0);
+	emit(BPF_LDX | BPF_MEM | BPF_W, R3, RCTX, offsetof(struct __sk_buff,
+	    data_end), 0);
+	emit(BPF_ALU64 | BPF_MOV | BPF_X, R1, R2, 0, 0);
+	emit(BPF_ALU64 | BPF_ADD | BPF_K, R1, 0, 0, end);
+	emit_jmp(BPF_JMP | BPF_JGT | BPF_X, R1, R3, 0, l);
+}
+
+/*
+ * Compare 'n' bytes at frame offset 'p' and go to 'l' if they differ.  In
+ * the tagged half, bytes 12 to 15 come from RTAG, big endian, and later
+ * bytes are 4 bytes back in the skb.
+ */
+static void
+emit_cmp(int tagged, int p, int n, const u_char *mask, const u_char *pat,
+    int l)
+{
+	static const uint8_t size[] = { 0, BPF_B, BPF_H, 0, BPF_W };
+	uint32_t m, v, full;
+	uint16_t m16, v16;
+	int j;
+
+	if (tagged && p >= 12 && p < 16) {
+		for (m = v = 0, j = 0; j < n; j++) {
+			m = m << 8 | mask[j];
+			v = v << 8 | pat[j];
+		}
+		emit(BPF_ALU | BPF_MOV | BPF_X, R0, RTAG, 0, 0);
+		if (p + n < 16)
+			emit(BPF_ALU | BPF_RSH | BPF_K, R0, 0, 0,
+			    8 * (16 - p - n));
+		emit(BPF_ALU | BPF_AND | BPF_K, R0, 0, 0, m);
+		emit_jmp(BPF_JMP32 | BPF_JNE | BPF_K, R0, 0, v, l);
+		return;
+	}
+
+	/* As loaded from the frame, in host byte order */
+	switch (n) {
+	case 1:
+		m = mask[0];
+		v = pat[0];
+		full = 0xff;
+		break;
+	case 2:
+		memcpy(&m16, mask, 2);
+		memcpy(&v16, pat, 2);
+		m = m16;
+		v = v16;
+		full = 0xffff;
+		break;
+	default:
+		memcpy(&m, mask, 4);
+		memcpy(&v, pat, 4);
+		full = 0xffffffff;
+		break;
+	}
+	if (tagged && p >= 16)
+		p -= 4;
+	if (p <= INT16_MAX)
+		emit(BPF_LDX | BPF_MEM | size[n], R0, R2, p, 0);
+	else {
+		emit(BPF_ALU64 | BPF_MOV | BPF_X, R1, R2, 0, 0);
+		emit(BPF_ALU64 | BPF_ADD | BPF_K, R1, 0, 0, p);
+		emit(BPF_LDX | BPF_MEM | size[n], R0, R1, 0, 0);
+	}
+	if (m != full)
+		emit(BPF_ALU | BPF_AND | BPF_K, R0, 0, 0, m);
+	emit_jmp(BPF_JMP32 | BPF_JNE | BPF_K, R0, 0, v, l);
+}
+
+/*
+ * Load the big-endian value of the 'n' bytes at frame offset 'p' into R0,
+ * a byte at a time, taking tag bytes from RTAG as emit_cmp() does.
+ */
+static void
+emit_value(int tagged, int p, int n)
+{
+	int q, j;
+
+	for (j = 0; j < n; j++) {
+		q = p + j;
+		if (tagged && q >= 12 && q < 16) {
+			emit(BPF_ALU | BPF_MOV | BPF_X, R4, RTAG, 0, 0);
+			if (q < 15)
+				emit(BPF_ALU | BPF_RSH | BPF_K, R4, 0, 0,
+				    8 * (15 - q));
+			emit(BPF_ALU | BPF_AND | BPF_K, R4, 0, 0, 0xff);
+		} else {
+			if (tagged && q >= 16)
+				q -= 4;
+			if (q <= INT16_MAX)
+				emit(BPF_LDX | BPF_MEM | BPF_B, R4, R2, q, 0);
+			else {
+				emit(BPF_ALU64 | BPF_MOV | BPF_X, R1, R2, 0, 0);
+				emit(BPF_ALU64 | BPF_ADD | BPF_K, R1, 0, 0, q);
+				emit(BPF_LDX | BPF_MEM | BPF_B, R4, R1, 0, 0);
+			}
+		}
+		if (j == 0) {
+			emit(BPF_ALU | BPF_MOV | BPF_X, R0, R4, 0, 0);
+			continue;
+		}
+		emit(BPF_ALU | BPF_LSH | BPF_K, R0, 0, 0, 8);
+		emit(BPF_ALU | BPF_OR | BPF_X, R0, R4, 0, 0);
+	}
+}
+
+/* Go to 'lt' if the pattern of 'r' is found in the frame, else to 'lf' */
+static void
+emit_match(const struct rule *r, int tagged, int lt, int lf)
+{
+	int off, next, i, n;
+
+	if (r->len == 0) {
+		emit_jmp(BPF_JMP | BPF_JA, 0, 0, 0, lt);
+		return;
+	}
+	if (r->range) {
+		emit_avail(tagged, r->lo + r->len, lf);
+		if (r->vlo > r->vhi) {
+			emit_jmp(BPF_JMP | BPF_JA, 0, 0, 0, lf);
+			return;
+		}
+		emit_value(tagged, r->lo, r->len);
+		if (r->vlo > 0)
+			emit_jmp(BPF_JMP32 | BPF_JLT | BPF_K, R0, 0, r->vlo,
+			    lf);
+		if (r->vhi < 0xffffffffU >> (32 - 8 * r->len))
+			emit_jmp(BPF_JMP32 | BPF_JGT | BPF_K, R0, 0, r->vhi,
+			    lf);
+		emit_jmp(BPF_JMP | BPF_JA, 0, 0, 0, lt);
+		return;
+	}
+	for (off = r->lo; off <= r->hi; off++) {
+		next = off < r->hi ? label_new() : lf;
+		/* And then short at the offsets further on, too */
+		emit_avail(tagged, off + r->len, next);
+		for (i = 0; i < r->len; i += n) {
+			if (r->mask[i] == 0) {
+				n = 1;
+				continue;
+			}
+			/* Up to a word, not across the tag in tagged frames */
+			n = r->len - i >= 4 ? 4 : r->len - i >= 2 ? 2 : 1;
+			if (tagged && off + i < 12 && off + i + n > 12)
+				n = 12 - off - i >= 2 ? 2 : 1;
+			if (tagged && off + i < 16 && off + i + n > 16)
+				n = 16 - off - i >= 2 ? 2 : 1;
+			emit_cmp(tagged, off + i, n, &r->mask[i], &r->pat[i],
+			    next);
+		}
+		emit_jmp(BPF_JMP | BPF_JA, 0, 0, 0, lt);
+		if (off < r->hi)
+			label_set(next);
+	}
+}
+
+/* Rules, for tagged or untagged frames */
+static void
+emit_rules(int tagged)
+{
+	const struct rule *r;
+	int *start, fire, miss, i;
+
+	if ((start = malloc((nrules + 1) * sizeof(*start))) == NULL)
+		fail("out of memory");
+	for (i = 0; i <= nrules; i++)
+		start[i] = label_new();
+	for (i = 0; i < nrules; i++) {
+		r = &rules[i];
+		label_set(start[i]);
+		switch (r->action) {
+		case A_HOOK:
+		case A_NHOOK:
+			fire = l_fwd[i];
+			break;
+		case A_SKIP:
+		case A_NSKIP:
+			fire = start[r->skipto + 1];
+			break;
+		case A_DROP:
+		case A_NDROP:
+			fire = l_drop;
+			break;
+		default:
+			fire = label_new();
+			break;
+		}
+		if (r->action % 2 == 0)
+			emit_match(r, tagged, fire, start[i + 1]);
+		else if (r->action == A_NDUP)
+			emit_match(r, tagged, start[i + 1], fire);
+		else {
+			/* Keep conditional jumps near, see resolve() */
+			miss = label_new();
+			emit_match(r, tagged, start[i + 1], miss);
+			label_set(miss);
+			emit_jmp(BPF_JMP | BPF_JA, 0, 0, 0, fire);
+		}
+		if (r->action == A_DUP || r->action == A_NDUP) {
+			label_set(fire);
+			emit(BPF_ALU64 | BPF_MOV | BPF_X, R1, RCTX, 0, 0);
+			emit(BPF_ALU64 | BPF_MOV | BPF_K, R2, 0, 0, r->ifindex);
+			emit(BPF_ALU64 | BPF_MOV | BPF_K, R3, 0, 0, 0);
+			emit(BPF_JMP | BPF_CALL, 0, 0, 0,
+			    BPF_FUNC_clone_redirect);
+		}
+	}
+	label_set(start[nrules]);
+	emit_jmp(BPF_JMP | BPF_JA, 0, 0, 0, l_drop);
+	free(start);
+}
+
+static void
+compile(void)
+{
+	int l_tagged, l_untagged, l_pull, l_pulled, need, i;
+
+	if ((insns = malloc(MAXINSNS * sizeof(*insns))) == NULL ||
+	    (l_fwd = malloc((nrules + 1) * sizeof(*l_fwd))) == NULL)
+		fail("out of memory");
+	l_drop = label_new();
+	l_tagged = label_new();
+	l_untagged = label_new();
+	for (i = 0; i < nrules; i++)
+		l_fwd[i] = label_new();
+
+	emit(BPF_ALU64 | BPF_MOV | BPF_X, RCTX, R1, 0, 0);
+
+	/* All bytes matched against in the skb data, as far as there are */
+	for (need = i = 0; i < nrules; i++)
+		if (rules[i].len > 0 && rules[i].hi + rules[i].len > need)
+			need = rules[i].hi + rules[i].len;
+	if (need > 0) {
+		l_pull = label_new();
+		l_pulled = label_new();
+		emit_avail(0, need, l_pull);
+		emit_jmp(BPF_JMP | BPF_JA, 0, 0, 0, l_pulled);
+		label_set(l_pull);
+		emit(BPF_LDX | BPF_MEM | BPF_W, R2, RCTX,
+		    offsetof(struct __sk_buff, len), 0);
+		emit(BPF_JMP | BPF_JLT | BPF_K, R2, 0, 1, need);
+		emit(BPF_ALU64 | BPF_MOV | BPF_K, R2, 0, 0, need);
+		emit(BPF_ALU64 | BPF_MOV | BPF_X, R1, RCTX, 0, 0);
+		emit(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_skb_pull_data);
+		label_set(l_pulled);
+	}
+	emit(BPF_LDX | BPF_MEM | BPF_W, RTAG, RCTX, offsetof(struct __sk_buff,
+	    vlan_present), 0);
+	emit_jmp(BPF_JMP | BPF_JEQ | BPF_K, RTAG, 0, 0, l_untagged);
+	emit_jmp(BPF_JMP | BPF_JA, 0, 0, 0, l_tagged);
+	label_set(l_untagged);
+	emit_rules(0);
+
+	/* Tag bytes: TPID, as stored in network byte order, and TCI */
+	label_set(l_tagged);
+	emit(BPF_LDX | BPF_MEM | BPF_W, RTAG, RCTX, offsetof(struct __sk_buff,
+	    vlan_proto), 0);
+	emit(BPF_ALU | BPF_END | BPF_TO_BE, RTAG, 0, 0, 16);
+	emit(BPF_ALU | BPF_LSH | BPF_K, RTAG, 0, 0, 16);
+	emit(BPF_LDX | BPF_MEM | BPF_W, R0, RCTX, offsetof(struct __sk_buff,
+	    vlan_tci), 0);
+	emit(BPF_ALU | BPF_AND | BPF_K, R0, 0, 0, 0xffff);
+	emit(BPF_ALU | BPF_OR | BPF_X, RTAG, R0, 0, 0);
+	emit_rules(1);
+
+	for (i = 0; i < nrules; i++) {
+		if (rules[i].action != A_HOOK && rules[i].action != A_NHOOK)
+			continue;
+		label_set(l_fwd[i]);
+		emit(BPF_ALU64 | BPF_MOV | BPF_K, R1, 0, 0, rules[i].ifindex);
+		emit(BPF_ALU64 | BPF_MOV | BPF_K, R2, 0, 0, 0);
+		emit(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect);
+		emit(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+	}
+	label_set(l_drop);
+	emit(BPF_ALU64 | BPF_MOV | BPF_K, R0, 0, 0, TC_ACT_SHOT);
+	emit(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+	resolve();
+	prune();
+}
+
+/* The instructions we emit, in the verifier's notation */
+static void
+dump(void)
+{
+	static const char *sz[] = { "u32", "u16", "u8", "u64" };
+	const struct bpf_insn *i;
+	int n;
+
+	for (n = 0; n < ninsns; n++) {
+		i = &insns[n];
+		printf("%5d: ", n);
+		switch (i->code) {
+		case BPF_ALU64 | BPF_MOV | BPF_X:
+			printf("r%d = r%d\n", i->dst_reg, i->src_reg);
+			break;
+		case BPF_ALU64 | BPF_MOV | BPF_K:
+			printf("r%d = %d\n", i->dst_reg, i->imm);
+			break;
+		case BPF_ALU | BPF_MOV | BPF_X:
+			printf("w%d = w%d\n", i->dst_reg, i->src_reg);
+			break;
+		case BPF_ALU64 | BPF_ADD | BPF_K:
+			printf("r%d += %d\n", i->dst_reg, i->imm);
+			break;
+		case BPF_ALU | BPF_AND | BPF_K:
+			printf("w%d &= %#x\n", i->dst_reg, i->imm);
+			break;
+		case BPF_ALU | BPF_OR | BPF_X:
+			printf("w%d |= w%d\n", i->dst_reg, i->src_reg);
+			break;
+		case BPF_ALU | BPF_LSH | BPF_K:
+			printf("w%d <<= %d\n", i->dst_reg, i->imm);
+			break;
+		case BPF_ALU | BPF_RSH | BPF_K:
+			printf("w%d >>= %d\n", i->dst_reg, i->imm);
+			break;
+		case BPF_ALU | BPF_END | BPF_TO_BE:
+			printf("r%d = be%d r%d\n", i->dst_reg, i->imm,
+			    i->dst_reg);
+			break;
+		case BPF_LDX | BPF_MEM | BPF_W:
+		case BPF_LDX | BPF_MEM | BPF_H:
+		case BPF_LDX | BPF_MEM | BPF_B:
+			printf("r%d = *(%s *)(r%d %+d)\n", i->dst_reg,
+			    sz[BPF_SIZE(i->code) >> 3], i->src_reg, i->off);
+			break;
+		case BPF_JMP | BPF_JA:
+			printf("goto %d\n", target(i, n));
+			break;
+		case BPF_JMP32 | BPF_JA:
+			printf("gotol %d\n", target(i, n));
+			break;
+		case BPF_JMP | BPF_JEQ | BPF_K:
+			printf("if r%d == %#x goto %d\n", i->dst_reg, i->imm,
+			    n + 1 + i->off);
+			break;
+		case BPF_JMP32 | BPF_JNE | BPF_K:
+			printf("if w%d != %#x goto %d\n", i->dst_reg, i->imm,
+			    n + 1 + i->off);
+			break;
+		case BPF_JMP32 | BPF_JLT | BPF_K:
+			printf("if w%d < %#x goto %d\n", i->dst_reg, i->imm,
+			    n + 1 + i->off);
+			break;
+		case BPF_JMP32 | BPF_JGT | BPF_K:
+			printf("if w%d > %#x goto %d\n", i->dst_reg, i->imm,
+			    n + 1 + i->off);
+			break;
+		case BPF_JMP | BPF_JGT | BPF_X:
+			printf("if r%d > r%d goto %d\n", i->dst_reg, i->src_reg,
+			    n + 1 + i->off);
+			break;
+		case BPF_JMP | BPF_JLT | BPF_K:
+			printf("if r%d < %d goto %d\n", i->dst_reg, i->imm,
+			    n + 1 + i->off);
+			break;
+		case BPF_JMP | BPF_CALL:
+			printf("call %s\n", i->imm == BPF_FUNC_redirect ?
+			    "bpf_redirect" : i->imm == BPF_FUNC_clone_redirect ?
+			    "bpf_clone_redirect" : "bpf_skb_pull_data");
+			break;
+		case BPF_JMP | BPF_EXIT:
+			printf("exit\n");
+			break;
+		default:
+			printf("%#04x %d %d %d %d\n", i->code, i->dst_reg,
+			    i->src_reg, i->off, i->imm);
+			break;
+		}
+	}
+}
+
+static int
+prog_load(void)
+{
+	static char log[1 << 20];
+	union bpf_attr attr;
+	char *cp;
+	int fd, error, n;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_SCHED_CLS;
+	attr.insns = (uintptr_t)insns;
+	attr.insn_cnt = ninsns;
+	attr.license = (uintptr_t)"Dual BSD/GPL";
+	strncpy(attr.prog_name, "patmat", sizeof(attr.prog_name) - 1);
+	fd = syscall(__NR_bpf, BPF_PROG_LOAD, &attr, sizeof(attr));
+	if (fd >= 0)
+		return (fd);
+	error = errno;
+
+	/*
+	 * Once more, for the verifier's reasons, which are at the end of
+	 * what may be a long trace of the instructions it went through.
+	 */
+	attr.log_buf = (uintptr_t)log;
+	attr.log_size = sizeof(log);
+	attr.log_level = 1;
+	if ((fd = syscall(__NR_bpf, BPF_PROG_LOAD, &attr, sizeof(attr))) >= 0)
+		return (fd);
+	for (cp = log + strlen(log), n = 0; cp > log && n <= 12; cp--)
+		if (cp[-1] == '\n')
+			n++;
+	fail("BPF_PROG_LOAD: %s\n%s", strerror(error), cp);
+}
+
+/*
+ * rtnetlink, for the clsact qdisc and the filter on its ingress hook
+ */
+struct nlreq {
+	struct nlmsghdr	nh;
+	struct tcmsg	tc;
+	char		attrs[256];
+};
+
+static void
+nl_attr(struct nlreq *req, int type, const void *data, int len)
+{
+	struct rtattr *rta;
+
+	rta = (struct rtattr *)((char *)req + NLMSG_ALIGN(req->nh.nlmsg_len));
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(len);
+	if (len > 0)
+		memcpy(RTA_DATA(rta), data, len);
+	req->nh.nlmsg_len = NLMSG_ALIGN(req->nh.nlmsg_len) +
+	    RTA_ALIGN(rta->rta_len);
+}
+
+static struct rtattr *
+nl_nest(struct nlreq *req, int type)
+{
+	struct rtattr *rta;
+
+	rta = (struct rtattr *)((char *)req + NLMSG_ALIGN(req->nh.nlmsg_len));
+	nl_attr(req, type, NULL, 0);
+	return (rta);
+}
+
+static void
+nl_nest_end(struct nlreq *req, struct rtattr *rta)
+{
+
+	rta->rta_len = (char *)req + req->nh.nlmsg_len - (char *)rta;
+}
+
+/* 0 or an errno */
+static int
+nl_talk(struct nlreq *req)
+{
+	struct sockaddr_nl sa;
+	char buf[4096];
+	struct nlmsghdr *nh;
+	struct nlmsgerr *err;
+	int fd, n, error = EIO;
+
+	if ((fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC,
+	    NETLINK_ROUTE)) < 0)
+		fail("netlink: %s", strerror(errno));
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	req->nh.nlmsg_flags |= NLM_F_REQUEST | NLM_F_ACK;
+	req->nh.nlmsg_seq = 1;
+	if (sendto(fd, req, req->nh.nlmsg_len, 0, (struct sockaddr *)&sa,
+	    sizeof(sa)) < 0)
+		fail("netlink: %s", strerror(errno));
+	if ((n = recv(fd, buf, sizeof(buf), 0)) < 0)
+		fail("netlink: %s", strerror(errno));
+	for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, n);
+	    nh = NLMSG_NEXT(nh, n)) {
+		if (nh->nlmsg_type != NLMSG_ERROR)
+			continue;
+		err = NLMSG_DATA(nh);
+		error = -err->error;
+		break;
+	}
+	close(fd);
+	return (error);
+}
+
+static void
+nl_init(struct nlreq *req, int type, int flags, int ifindex)
+{
+
+	memset(req, 0, sizeof(*req));
+	req->nh.nlmsg_len = NLMSG_LENGTH(sizeof(req->tc));
+	req->nh.nlmsg_type = type;
+	req->nh.nlmsg_flags = flags;
+	req->tc.tcm_family = AF_UNSPEC;
+	req->tc.tcm_ifindex = ifindex;
+}
+
+static void
+attach(int ifindex, const char *ifname, int fd)
+{
+	struct nlreq req;
+	struct rtattr *opts;
+	uint32_t flags = TCA_BPF_FLAG_ACT_DIRECT;
+	int error;
+
+	nl_init(&req, RTM_NEWQDISC, NLM_F_CREATE | NLM_F_EXCL, ifindex);
+	req.tc.tcm_parent = TC_H_CLSACT;
+	req.tc.tcm_handle = TC_H_MAKE(TC_H_CLSACT, 0);
+	nl_attr(&req, TCA_KIND, "clsact", sizeof("clsact"));
+	if ((error = nl_talk(&req)) != 0 && error != EEXIST)
+		fail("%s: clsact qdisc: %s", ifname, strerror(error));
+
+	nl_init(&req, RTM_NEWTFILTER, NLM_F_CREATE, ifindex);
+	req.tc.tcm_parent = TC_H_MAKE(TC_H_CLSACT, TC_H_MIN_INGRESS);
+	req.tc.tcm_handle = FILTER_HANDLE;
+	req.tc.tcm_info = TC_H_MAKE(FILTER_PRIO << 16, htons(ETH_P_ALL));
+	nl_attr(&req, TCA_KIND, "bpf", sizeof("bpf"));
+	opts = nl_nest(&req, TCA_OPTIONS);
+	nl_attr(&req, TCA_BPF_FD, &fd, sizeof(fd));
+	nl_attr(&req, TCA_BPF_NAME, "patmat", sizeof("patmat"));
+	nl_attr(&req, TCA_BPF_FLAGS, &flags, sizeof(flags));
+	nl_nest_end(&req, opts);
+	if ((error = nl_talk(&req)) != 0)
+		fail("%s: bpf filter: %s", ifname, strerror(error));
+}
+
+static void
+detach(int ifindex, const char *ifname)
+{
+	struct nlreq req;
+	int error;
+
+	nl_init(&req, RTM_DELTFILTER, 0, ifindex);
+	req.tc.tcm_parent = TC_H_MAKE(TC_H_CLSACT, TC_H_MIN_INGRESS);
+	req.tc.tcm_info = TC_H_MAKE(FILTER_PRIO << 16, htons(ETH_P_ALL));
+	error = nl_talk(&req);
+	if (error != 0 && error != ENOENT && error != EINVAL)
+		fail("%s: bpf filter: %s", ifname, strerror(error));
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: pmbpf [-d] ifname [rule ...]\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *ifname;
+	int ch, dflag = 0, ifindex, fd;
+
+	while ((ch = getopt(argc, argv, "d")) != -1) {
+		switch (ch) {
+		case 'd':
+			dflag = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc < 1)
+		usage();
+	ifname = argv[0];
+	parse_rules(argc - 1, argv + 1, dflag);
+	if (dflag) {
+		compile();
+		dump();
+		return (0);
+	}
+
+	if ((ifindex = if_nametoindex(ifname)) == 0)
+		fail("%s: %s", ifname, strerror(errno));
+	if (nrules == 0) {
+		detach(ifindex, ifname);
+		return (0);
+	}
+	compile();
+	fd = prog_load();
+	attach(ifindex, ifname, fd);
+	close(fd);
+	return (0);
+}
@@ -10,6 +10,15 @@
 #include <sys/kernel.h>
 #include <sys/malloc.h>
 #include <sys/mbuf.h>
+#include <sys/pcpu.h>
+#include <sys/smp.h>
+#include <sys/lock.h>
+#include <sys/mutex.h>
+#include <sys/syslog.h>
+#include <machine/atomic.h>
+
+#include <net/ethernet.h>
+#include <netinet/in.h>
 
 #include <netgraph/ng_message.h>
 #include <netgraph/netgraph.h>
@@ -18,13 +27,27 @@
 #define NG_PM_NODE_TYPE		"patmat"
 #define	NGM_PM_COOKIE		201111081
 
-#define	NG_PM_MAXRULES		128
+#define	NG_PM_MAXRULES		65535	/* rule numbers are 16 bit */
 #define	NG_PM_MAXPATLEN		32
+#define	NG_PM_MAXWORDS		(NG_PM_MAXPATLEN / sizeof(uint64_t))
+#define	NG_PM_MAXTABLES		64
+#define	NG_PM_LPM_MAXKEY	16
+#define	NG_PM_FC_MAXENT		65536	/* flow cache entries per CPU */
+#define	NG_PM_FC_MAXSPAN	128	/* flow key bytes */
+#define	NG_PM_FC_MAXSTEPS	6	/* rules in a cached verdict */
 
 #ifndef M_DONTWAIT
 #define M_DONTWAIT M_NOWAIT
 #endif
 
+#ifndef ETHERTYPE_QINQ
+#define	ETHERTYPE_QINQ		0x88a8
+#endif
+
+#ifndef CSUM_DELAY_DATA_IPV6
+#define	CSUM_DELAY_DATA_IPV6	0
+#endif
+
 MALLOC_DEFINE(M_NETGRAPH_PM, "ng_patmat", "ng_patmat");
 
 #ifndef MALLOC
@@ -47,11 +70,52 @@ static int ng_pm_hookcfg_parse(const struct ng_parse_type *,
     const char *, int *, const u_char *const, u_char *const, int *);
 static int ng_pm_hookcfg_unparse(const struct ng_parse_type *,
     const u_char *, int *, char *, int);
+static int ng_pm_tabreq_parse(const struct ng_parse_type *,
+    const char *, int *, const u_char *const, u_char *const, int *);
+static int ng_pm_tabreq_unparse(const struct ng_parse_type *,
+    const u_char *, int *, char *, int);
+static int ng_pm_fcreq_parse(const struct ng_parse_type *,
+    const char *, int *, const u_char *const, u_char *const, int *);
+static int ng_pm_fcreq_unparse(const struct ng_parse_type *,
+    const u_char *, int *, char *, int);
+static int ng_pm_stats_parse(const struct ng_parse_type *,
+    const char *, int *, const u_char *const, u_char *const, int *);
+static int ng_pm_stats_unparse(const struct ng_parse_type *,
+    const u_char *, int *, char *, int);
+static int ng_pm_snapreq_parse(const struct ng_parse_type *,
+    const char *, int *, const u_char *const, u_char *const, int *);
+static int ng_pm_snapreq_unparse(const struct ng_parse_type *,
+    const u_char *, int *, char *, int);
+static int ng_pm_chainsreq_parse(const struct ng_parse_type *,
+    const char *, int *, const u_char *const, u_char *const, int *);
+static int ng_pm_chainsreq_unparse(const struct ng_parse_type *,
+    const u_char *, int *, char *, int);
+static int ng_pm_hgreq_parse(const struct ng_parse_type *,
+    const char *, int *, const u_char *const, u_char *const, int *);
+static int ng_pm_hgreq_unparse(const struct ng_parse_type *,
+    const u_char *, int *, char *, int);
+static int ng_pm_digests_unparse(const struct ng_parse_type *,
+    const u_char *, int *, char *, int);
 
 /* Netgraph commands. */
 enum {
 	NGM_PM_SETHOOKCFG = 1,
 	NGM_PM_GETHOOKCFG,
+	NGM_PM_TABLE_ADD,
+	NGM_PM_TABLE_DEL,
+	NGM_PM_TABLE_FLUSH,
+	NGM_PM_TABLE_GET,
+	NGM_PM_SET_FCACHE,
+	NGM_PM_GET_FCACHE,
+	NGM_PM_GETSTATS,
+	NGM_PM_CLRSTATS,
+	NGM_PM_SET_HGROUP,
+	NGM_PM_GET_HGROUP,
+	NGM_PM_SET_SNAPLEN,
+	NGM_PM_GET_SNAPLEN,
+	NGM_PM_GET_DIGESTS,
+	NGM_PM_SET_CHAINS,
+	NGM_PM_GET_CHAINS,
 };
 
 enum {
@@ -64,6 +128,11 @@ enum {
 	NGM_PM_ACTION_NOMATCH_SKIPTO,
 	NGM_PM_ACTION_MATCH_DROP,
 	NGM_PM_ACTION_NOMATCH_DROP,
+	NGM_PM_ACTION_LOOKUP,
+	NGM_PM_ACTION_MATCH_HASH,
+	NGM_PM_ACTION_MATCH_SAMPLE,
+	NGM_PM_ACTION_MATCH_POLICE,
+	NGM_PM_ACTION_MATCH_SET_FIELD,
 };
 
 static struct actions {
@@ -78,6 +147,11 @@ static struct actions {
 	{ NGM_PM_ACTION_NOMATCH_SKIPTO,	"nomatch_skipto" },
 	{ NGM_PM_ACTION_MATCH_DROP, 	"match_drop" },
 	{ NGM_PM_ACTION_NOMATCH_DROP,	"nomatch_drop" },
+	{ NGM_PM_ACTION_LOOKUP,		"lookup" },
+	{ NGM_PM_ACTION_MATCH_HASH,	"match_hash" },
+	{ NGM_PM_ACTION_MATCH_SAMPLE,	"match_sample" },
+	{ NGM_PM_ACTION_MATCH_POLICE,	"match_police" },
+	{ NGM_PM_ACTION_MATCH_SET_FIELD, "match_set_field" },
 	{ NGM_PM_ACTION_NONE, 		NULL }
 };
 
@@ -88,6 +162,67 @@ static struct actions {
  * 20:match_skipto:aa.bb.cc.dd/ff.00.ff.00@10:rule_number
  * 30:match_drop:aa.bb.cc.dd/ff.00.ff.00@10:
  * 40:match_hook::hook_name
+ * 50:lookup:ff.ff.ff.ff.ff.ff@0:table_number
+ * 55:match_hash:08.00/ff.ff@12:group_number
+ * 56:match_sample:08.00/ff.ff@12:100/hook_name
+ * 57:match_police:08.00/ff.ff@12:8000000/12000/hook_name
+ * 58:match_set_field:06/ff@l3+9:b8/fc@l3+1
+ *
+ * A lookup rule takes the bytes under its mask at a single offset as a key
+ * into one of the node's exact match tables, and if found applies the
+ * action of the table entry.  Otherwise, and after a match_dupto entry,
+ * processing continues with the next rule.
+ *
+ * A match_hash rule forwards a matching packet to one of the hooks of a
+ * hook group, chosen by a hash of its flow, or continues with the next
+ * rule while none of them is connected.
+ *
+ * A match_sample rule sends a copy of every Nth matching packet to a hook,
+ * or with ~N instead of N, of each matching packet with a probability of
+ * 1/N.  A match_police rule passes matching packets on to the next rule
+ * while they conform to a token bucket of the given rate in bits per
+ * second and depth in bytes, and forwards the excess to a hook, or drops
+ * it if there is none or it is not connected.  Rules count the packets
+ * they sampled and the excess they policed.  Each hook a rule set is
+ * installed on samples and polices on its own.
+ *
+ * A match_set_field rule sets the bytes of a matching packet under a mask
+ * to a value, at an offset which may be relative to a header as below,
+ * here the DSCP of TCP packets to EF, and processing continues with the
+ * next rule, which sees the new bytes.  Without a mask all of the bytes
+ * are set.  The IPv4 header checksum and the TCP or UDP checksum are
+ * updated incrementally (RFC 1624) unless the field covers them, also in
+ * packets leaving their computation to the interface.  A field in the
+ * 802.1Q tag of a packet whose tag has been stripped into the packet
+ * header sets the tag there.  Packets too short for the field are left
+ * alone, and packets sharing their storage, for instance with copies sent
+ * to dupto hooks, are copied before being written to.
+ *
+ * Offsets may be relative to the network or the transport header instead
+ * of the start of the frame:
+ *
+ * 60:match_hook:06/ff@l3+9:hook_name
+ * 70:match_drop:00.50/ff.ff@l4+2:
+ * 80:lookup:ff.ff.ff.ff@l3+16:table_number
+ *
+ * The network header follows the Ethertype, past up to two 802.1Q / 802.1ad
+ * tags still in the packet data.  The transport header follows the IPv4
+ * header and its options, or the IPv6 header and any hop-by-hop, routing,
+ * destination options, fragment and AH extension headers.  Patterns of
+ * rules whose header is missing, such as l4 in non-initial fragments or in
+ * non-IP packets, never match.
+ *
+ * Instead of a pattern and mask, a rule may compare a big-endian field of
+ * 1, 2 or 4 bytes at a single offset with a range of values, both ends
+ * included, or with a value:
+ *
+ * 90:match_hook:04.00-ff.ff@l4+2:hook_name
+ * 91:match_drop:<05@l3+8:
+ * 92:nomatch_skipto:>=05.dc@12:rule_number
+ *
+ * The comparisons are <, <=, > and >=.  A range goes into pattern and
+ * mask, its low end as the pattern and its high end as the mask, and a
+ * value into the pattern.
  */
 struct ng_pm_rule {
 	uint32_t	prob;
@@ -96,32 +231,646 @@ struct ng_pm_rule {
 	uint16_t	p_off_lo;
 	uint16_t	p_off_hi;
 	uint16_t	p_len;
-	uint16_t	spare;
+	uint16_t	anchor;		/* NG_PM_ANCHOR_* offsets are from */
+	uint16_t	cmp;		/* NG_PM_CMP_*, pattern/mask if 0 */
 	union {
 		char	hname[NG_HOOKSIZ];
-		hook_p	hp;
+		int	slot;
 		int	skipto_index;
 		int	skipto_rule_number;
+		int	table;
+		int	hgroup;
 	}		asdata;
 	char		pattern[NG_PM_MAXPATLEN];
 	char		mask[NG_PM_MAXPATLEN];
+	uint64_t	rate;		/* sampling period, or bits/s */
+	uint32_t	burst;		/* token bucket depth in bytes */
+	uint32_t	rflags;		/* NG_PM_RATE_* */
+	uint16_t	s_off;		/* field set by match_set_field */
+	uint16_t	s_len;
+	uint16_t	s_anchor;
+	char		s_value[NG_PM_MAXPATLEN];
+	char		s_mask[NG_PM_MAXPATLEN];
 };
 typedef struct ng_pm_rule ng_pm_rule_t;
 
-/* Per-hook configuration */
+#define	NG_PM_RATE_RANDOM	0x01	/* sample at random */
+
+enum {
+	NG_PM_ANCHOR_FRAME = 0,
+	NG_PM_ANCHOR_L3,
+	NG_PM_ANCHOR_L4,
+	NG_PM_ANCHORS
+};
+
+static const char *anchors[NG_PM_ANCHORS] = { "", "l3+", "l4+" };
+
+enum {
+	NG_PM_CMP_MASK = 0,
+	NG_PM_CMP_RANGE,
+	NG_PM_CMP_LT,
+	NG_PM_CMP_LE,
+	NG_PM_CMP_GT,
+	NG_PM_CMP_GE,
+	NG_PM_CMPS
+};
+
+static const char *cmps[NG_PM_CMPS] = { "", "", "<", "<=", ">", ">=" };
+
+/*
+ * Headers are looked for within the first bytes of a packet only, and a
+ * rule relative to a header may look that many bytes further.
+ */
+#define	NG_PM_L3_MAX		22	/* two tags */
+#define	NG_PM_L4_MAX		96
+#define	NG_PM_HDR_MAX		(NG_PM_L4_MAX + 8)
+
+/*
+ * Per-hook configuration, as carried by shc and ghc, sized to the number
+ * of rules.
+ */
 struct ng_pm_hookcfg {
+	char		name[NG_HOOKSIZ];
 	int		rules;
 	int		maxcontig;
-	ng_pm_rule_t	rule[NG_PM_MAXRULES];
+	ng_pm_rule_t	rule[];
 };
 typedef struct ng_pm_hookcfg ng_pm_hookcfg_t;
 typedef struct ng_pm_hookcfg *ng_pm_hookcfg_p;
 
-struct ng_pm_hookcfgreq {
+#define	NG_PM_HOOKCFG_SIZE(rules)					\
+	(offsetof(ng_pm_hookcfg_t, rule) + (rules) * sizeof(ng_pm_rule_t))
+
+/*
+ * Longest rule: number, action, pattern, mask, window, then rate, burst
+ * and hook, or the value and mask of a field set
+ */
+#define	NG_PM_RULE_MAXLEN	(80 + 12 * NG_PM_MAXPATLEN + NG_HOOKSIZ)
+
+/*
+ * Exact match table entries, added or deleted in bulk:
+ *
+ * tadd 3 02.00.00.00.00.01:match_hook:hook_name 02.00.00.00.00.02:match_drop:
+ * tdel 3 02.00.00.00.00.01
+ *
+ * All keys of a table are of the same length, and are compared with the
+ * packet bytes under the mask of the lookup rule, so key bits outside of
+ * that mask must be zero.  Entry actions are match_hook, match_dupto and
+ * match_drop.  tflush and tget take a table number only.
+ *
+ * Keys with a prefix length make a longest prefix match table instead,
+ * for keys of up to 16 bytes:
+ *
+ * tadd 4 0a.00.00.00/8:match_hook:hook_name c0.a8.01.00/24:match_drop:
+ * tdel 4 0a.00.00.00/8
+ *
+ * The type of a table is set by the first tadd after it was flushed.
+ */
+struct ng_pm_tabent {
+	u_char		key[NG_PM_MAXPATLEN];
+	uint16_t	action;
+	uint16_t	plen;		/* prefix length in bits, if LPM */
+	char		hname[NG_HOOKSIZ];
+};
+
+struct ng_pm_tabreq {
+	uint16_t	table;
+	uint8_t		keylen;
+	uint8_t		flags;
+	uint32_t	entries;
+	struct ng_pm_tabent ent[];
+};
+#define	NG_PM_TABLE_LPM		0x01
+
+/*
+ * Exact match table: open addressing with linear probing, at most half
+ * full.  Each slot holds the full hash of its key along with the index of
+ * the entry, so that a lookup usually touches one cache line of slots and
+ * one entry.  Entries are kept dense, for tget and for rehashing.
+ */
+struct ng_pm_tslot {
+	uint32_t	hash;
+	uint32_t	idx;		/* entry index + 1, 0 if empty */
+};
+
+struct ng_pm_tentry {
+	uint64_t	key[NG_PM_MAXWORDS];
+	uint16_t	action;
+	hook_p		hp;		/* NULL while the hook is missing */
+	char		hname[NG_HOOKSIZ];
+};
+
+/*
+ * Longest prefix match tables keep their prefixes in the hash table as
+ * well, for updates, with the prefix length in the last key word.  Lookups
+ * go through a multibit trie built from all prefixes at once, with a first
+ * stride of 16 bits and 8 bits after that.  Slots hold either a chunk index
+ * with NG_PM_TRIE_CHILD set, or the entry index + 1 of the longest prefix
+ * covering the slot, so an IPv4 lookup takes at most three memory accesses.
+ */
+#define	NG_PM_TRIE_ROOT		65536
+#define	NG_PM_TRIE_CHILD	0x80000000
+
+struct ng_pm_table {
+	int			keylen;
+	int			nwords;
+	int			lpm;
+	uint32_t		nent;
+	uint32_t		entcap;
+	uint32_t		mask;		/* slots - 1 */
+	struct ng_pm_tslot	*slot;
+	struct ng_pm_tentry	*ent;
+	uint32_t		*trie;		/* root, then 256 slot chunks */
+};
+
+/*
+ * Flow verdict cache, off by default:
+ *
+ * fcache 4096 34
+ *
+ * sets the number of entries of each program's cache, per CPU and rounded
+ * up to a power of two, and the number of leading packet bytes which make
+ * up the flow key.  A span of 0 keys on all the bytes the rule set looks
+ * at, which must then be at most 128.  A shorter span is only correct as
+ * long as all packets agreeing in those bytes get the same verdict.
+ * Rule sets which sample, police or set fields are not cached.
+ * gfcache returns the settings.
+ */
+struct ng_pm_fcreq {
+	uint32_t	entries;
+	uint16_t	span;
+	uint16_t	spare;
+};
+
+/*
+ * What happens to a packet: the rules which acted on it, in order, with
+ * a copy sent to the hook of each but the last, if any, and the packet
+ * forwarded to the hook of the last one, or dropped if that is NULL.
+ */
+struct ng_pm_verdict {
+	int		nsteps;		/* -1 if too long to cache */
+	uint16_t	rule[NG_PM_FC_MAXSTEPS];	/* index */
+	hook_p		hook[NG_PM_FC_MAXSTEPS];
+};
+
+/*
+ * Cached verdicts are found by a hash of the flow key, which is the packet
+ * length as seen by the rules, the VLAN tag and the first span bytes of the
+ * packet, in sets of two entries, the most recently added one first.
+ * Entries are valid for the configuration generation they were made in
+ * only, so any change to rules, tables or hooks of the node invalidates
+ * them all at once.  Each CPU has a cache of its own.
+ */
+struct ng_pm_fkey {
+	uint32_t	hash;
+	int		nwords;
+	uint64_t	w[1 + NG_PM_FC_MAXSPAN / sizeof(uint64_t)];
+};
+
+struct ng_pm_fcent {
+	uint32_t	hash;
+	uint32_t	gen;		/* 0 if never used */
+	struct ng_pm_verdict v;
+	uint64_t	key[];		/* length and tag, then span bytes */
+};
+
+struct ng_pm_fcache {
+	int		span;
+	int		nwords;		/* key words */
+	uint32_t	mask;		/* sets - 1 */
+	size_t		stride;		/* entry size */
+	size_t		size;		/* of each CPU's cache */
+	u_char		*ent;		/* mp_maxid + 1 caches */
+};
+
+/*
+ * Rules name their target hooks through per-node slots, which hold the
+ * hook of that name while it is connected.  Rule sets thus outlive the
+ * hooks they send to: a rule whose hook is gone is skipped, and acts
+ * again once a hook of that name is connected.  Cached verdicts, which
+ * hold hook pointers, go stale with the configuration generation.
+ */
+struct ng_pm_hslot {
+	hook_p		hook;		/* NULL while not connected */
+	int		refs;		/* installed programs naming it */
+	char		name[NG_HOOKSIZ];
+};
+
+/*
+ * Hook groups of match_hash rules, set or deleted as a whole:
+ *
+ * hgroup 2 l4 srv0 srv1 srv2
+ * hgroup 2
+ *
+ * Packets are spread by a hash of their Ethernet addresses (l2), of
+ * their IPv4 or IPv6 addresses (l3), or of those, the protocol and the
+ * TCP, UDP or SCTP ports (l4, the default).  The hash is symmetric, so
+ * both directions of a flow go to the same hook.  Fragments are hashed on
+ * their addresses only, and non-IP packets on their Ethernet addresses.
+ * Members need not be connected yet.  ghgroup takes a group number only.
+ */
+#define	NG_PM_MAXHGROUPS	64
+#define	NG_PM_HG_MAXHOOKS	64
+#define	NG_PM_HG_BUCKETS	4096
+
+enum {
+	NG_PM_HASH_L2 = 0,
+	NG_PM_HASH_L3,
+	NG_PM_HASH_L4,
+	NG_PM_HASH_FIELDS
+};
+
+static const char *hfields[NG_PM_HASH_FIELDS] = { "l2", "l3", "l4" };
+
+struct ng_pm_hgreq {
+	uint16_t	group;
+	uint16_t	fields;		/* NG_PM_HASH_* */
+	uint32_t	hooks;
+	char		hname[][NG_HOOKSIZ];
+};
+
+/*
+ * Flow hashes select one of a fixed number of buckets, each mapped to the
+ * connected member ranking highest for it by a hash of the bucket and the
+ * member's name (rendezvous hashing).  A member coming or going thus only
+ * moves the buckets it wins or loses, and the flows in them, and the
+ * mapping is the same whatever the order members were configured in.
+ */
+struct ng_pm_hgroup {
+	int		fields;
+	int		nhooks;
+	int		nup;		/* members connected */
+	int		slot[NG_PM_HG_MAXHOOKS];
+	uint32_t	id[NG_PM_HG_MAXHOOKS];	/* hash of the name */
+	uint8_t		bucket[NG_PM_HG_BUCKETS];	/* member index */
+};
+
+/* Per-node private data */
+struct ng_pm_priv {
+	struct ng_pm_table	*table[NG_PM_MAXTABLES];
+	struct ng_pm_hgroup	*hgroup[NG_PM_MAXHGROUPS];
+	LIST_HEAD(, ng_pm_prog)	progs;		/* installed on some hook */
+	struct ng_pm_hslot	*hslot;		/* hooks named by rules */
+	int			nhslots;
+	uint32_t		gen;		/* configuration generation */
+	uint32_t		fc_entries;	/* flow cache settings */
+	int			fc_span;
+	time_t			nocopy_logged;	/* uptime of the last report */
+};
+typedef struct ng_pm_priv *ng_pm_priv_p;
+
+/*
+ * Compiled form of a hook configuration.
+ *
+ * Each distinct pattern / mask / offset window of a rule set becomes a
+ * predicate, with leading and trailing bytes whose mask is all zeros
+ * trimmed off, and each rule becomes an instruction testing its predicate.
+ * Both branches of every test are resolved when the rule set is installed:
+ * rules whose outcome is already implied by the branch taken (the same
+ * predicate, a refinement of a prefix which failed, another value of a
+ * field which matched, an empty pattern) are stepped over, and the
+ * actions of rules known to act are branched to directly.  A skipto taken
+ * goes through a SKIP instruction, which only counts the rule.  Runs of
+ * rules comparing the same field with different values collapse into a
+ * single GROUP instruction, which finds the first matching rule by binary
+ * search.
+ *
+ * Significant bytes are also kept as pre-masked 64-bit words, in memory
+ * order, so that a predicate is matched with a few unaligned loads, ANDs
+ * and XORs instead of a branch per byte.
+ *
+ * Comparisons become ranges of values, empty if lo > hi, and are tested
+ * through the range tables below rather than as patterns.
+ */
+struct ng_pm_pred {
+	uint16_t	off_lo;		/* offset window, as configured */
+	uint16_t	off_hi;
+	uint16_t	p_len;		/* pattern length, as configured */
+	uint16_t	skip;		/* leading bytes with all-zero mask */
+	uint16_t	len;		/* significant bytes following those */
+	uint16_t	vlan;		/* may cover the 802.1Q tag position */
+	uint16_t	nwords;		/* len in words, rounded up */
+	uint16_t	anchor;		/* NG_PM_ANCHOR_* offsets are from */
+	uint16_t	acid;		/* automaton pattern + 1, 0 if none */
+	uint16_t	range;		/* compares a field with lo..hi */
+	uint32_t	lo;
+	uint32_t	hi;
+	uint64_t	wpat[NG_PM_MAXWORDS];
+	uint64_t	wmask[NG_PM_MAXWORDS];
+	u_char		pattern[NG_PM_MAXPATLEN];	/* pre-masked */
+	u_char		mask[NG_PM_MAXPATLEN];
+};
+
+enum {
+	NG_PM_OP_TEST = 1,	/* predicate true ? jt : jf */
+	NG_PM_OP_GROUP,		/* first matching member ? its jt : last jf */
+	NG_PM_OP_FWD,		/* forward to hook, done, or jt if gone */
+	NG_PM_OP_DUP,		/* send a copy to hook, continue at jt */
+	NG_PM_OP_DROP,		/* drop, done */
+	NG_PM_OP_LOOKUP,	/* table entry action if found, then jf */
+	NG_PM_OP_SKIP,		/* skipto taken, continue at jt */
+	NG_PM_OP_CONTENT,	/* found by the automaton ? jt : jf */
+	NG_PM_OP_HASH,		/* forward to a group member, done, or jt */
+	NG_PM_OP_SAMPLE,	/* maybe send a copy to hook, continue at jt */
+	NG_PM_OP_POLICE,	/* conforming ? jt : forward or drop, done */
+	NG_PM_OP_RANGE,		/* first member from here in range ? its jt :
+				   last jf */
+	NG_PM_OP_SET,		/* set a field, continue at jt */
+};
+
+struct ng_pm_insn {
+	uint16_t	op;
+	uint16_t	rule;		/* index, for the counters */
+	uint32_t	arg;		/* operand index, by op */
+	uint32_t	jt;
+	uint32_t	jf;
+};
+
+struct ng_pm_group {
+	uint32_t	pred;		/* shape shared by all members */
+	uint32_t	last;		/* last member rule */
+	uint32_t	nkeys;
+	uint64_t	*keys;		/* sorted distinct nwords values */
+	uint32_t	*rule;		/* first member rule for each value */
+};
+
+/* Table key extraction, for a lookup rule */
+struct ng_pm_lookup {
+	uint16_t	off;
+	uint16_t	len;
+	uint16_t	nwords;
+	uint16_t	table;
+	uint16_t	anchor;
+	uint64_t	wmask[NG_PM_MAXWORDS];
+};
+
+/*
+ * Range tables.  The range predicates of a rule set comparing the same
+ * field share a table, in which the ends of all their ranges cut the
+ * values of the field into intervals, and each interval has a bitmap of
+ * the rules whose range covers it, one bit per rule in rule order.  The
+ * interval a packet's value falls into is found by binary search the first
+ * time one of the rules is tested, and its row kept for the rest of the
+ * packet, so that each rule costs a bit test from then on.  Rules of a
+ * table which follow each other and only act on a match form a run, and
+ * the first of them in range is found a word of the row at a time.  A
+ * field compared by more than NG_PM_RT_MAXBITS rules has more tables.
+ */
+#define	NG_PM_RT_MAXBITS	256
+#define	NG_PM_RT_CACHED		32	/* tables whose rows a packet keeps */
+
+struct ng_pm_rtab {
+	uint16_t	off;
+	uint16_t	len;		/* of the field, 1, 2 or 4 */
+	uint16_t	anchor;
+	uint16_t	vlan;		/* may cover the 802.1Q tag position */
+	uint16_t	nbits;
+	uint16_t	nwords;
+	uint32_t	nbounds;
+	uint32_t	*bound;		/* sorted first values of intervals */
+	uint64_t	*bits;		/* a row of nwords for each */
+	uint32_t	*rule;		/* by bit */
+};
+
+struct ng_pm_rrun {
+	uint32_t	rtab;
+	uint32_t	rule;		/* first member */
+	uint16_t	bit;		/* of the first member */
+	uint16_t	n;		/* members */
+};
+
+/*
+ * Content search.  Predicates with an offset window whose significant
+ * bytes are all fully masked are looked for all at once, in a single pass
+ * of an Aho-Corasick automaton over the part of the packet their windows
+ * cover, the first time any of them is tested.  Each occurrence found is
+ * checked against the window of its predicate, and the outcome of each is
+ * kept for the rest of the packet.  The automaton is a table of next
+ * states by byte class, bytes not in any pattern sharing one class.  States
+ * are kept as offsets of their rows, those where patterns end numbered
+ * last, so that a byte costs two loads and a compare.
+ */
+#define	NG_PM_AC_MIN		4	/* fewest predicates worth it */
+#define	NG_PM_AC_MAXPATS	1024
+
+struct ng_pm_ac {
+	int		nstates;
+	int		nclasses;
+	int		npats;
+	uint32_t	outmin;		/* first row where patterns end */
+	int		lo[NG_PM_ANCHORS];	/* bytes scanned, by anchor */
+	int		hi[NG_PM_ANCHORS];	/* 0 if none */
+	u_char		class[256];
+	uint32_t	*delta;		/* nstates * nclasses */
+	uint16_t	*out;		/* first acid ending in a state, or 0 */
+	uint16_t	*next;		/* next acid ending there, by acid-1 */
+	uint32_t	*pred;		/* by acid - 1 */
+	uint32_t	*none;		/* by rule, past misses if none found */
+};
+
+/*
+ * Sampling and policing parameters of a rule.  The state of each hook's
+ * instance is kept with the hook.  Token buckets hold bytes in fixed
+ * point, and refill by 'rate' of those per microsecond, so that a packet
+ * costs a multiplication rather than a division.
+ */
+#define	NG_PM_TB_SHIFT		24	/* fractional bits */
+#define	NG_PM_TB_MAXRATE	(1ULL << 40)	/* bits/s */
+#define	NG_PM_MAXPERIOD		0x7fffffff	/* as random() goes */
+
+struct ng_pm_meter {
+	int		slot;		/* -1 if none */
+	uint32_t	flags;		/* NG_PM_RATE_* */
+	uint64_t	period;		/* one in, if sampling */
+	uint64_t	rate;		/* refill per usec, if policing */
+	uint64_t	depth;
+	uint64_t	dtmax;		/* usecs to fill an empty bucket */
+};
+
+struct ng_pm_mstate {
+	struct mtx	mtx;
+	uint64_t	tokens;
+	uint64_t	last;		/* uptime of the last refill, usecs */
+	u_int		count;		/* matches seen, if sampling */
+};
+
+/*
+ * Field set by a match_set_field rule, with the value pre-masked.
+ */
+struct ng_pm_setf {
+	uint16_t	off;
+	uint16_t	len;
+	uint16_t	anchor;
+	u_char		value[NG_PM_MAXPATLEN];
+	u_char		mask[NG_PM_MAXPATLEN];
+};
+
+/*
+ * Hooks with identical rule sets, down to the target hooks, share one
+ * program.
+ */
+struct ng_pm_prog {
+	LIST_ENTRY(ng_pm_prog)	next;
+	int			refs;
+	ng_pm_hookcfg_p		cfg;		/* as configured, for ghc */
+	uint32_t		digest;		/* of cfg, for getdigests */
+	int			maxcontig;
+	int			npreds;
+	int			ninsns;
+	int			ngroups;
+	int			nlookups;
+	struct ng_pm_pred	*preds;
+	struct ng_pm_insn	*insns;
+	struct ng_pm_group	*groups;
+	struct ng_pm_lookup	*lookups;
+	int			nmeters;
+	struct ng_pm_meter	*meters;
+	int			nsetfs;
+	struct ng_pm_setf	*setfs;
+	struct ng_pm_ac		*ac;		/* NULL if no content search */
+	int			nrtabs;
+	int			nrruns;
+	struct ng_pm_rtab	*rtabs;
+	struct ng_pm_rrun	*rruns;
+	struct ng_pm_fcache	*fc;		/* NULL if not caching */
+};
+
+#define	NG_PM_NORULE		0xffffffff
+#define	NG_PM_GROUP_MIN		4	/* shortest run worth a GROUP */
+#define	NG_PM_RESOLVE_MAX	64	/* rules looked ahead per branch */
+
+/*
+ * Rule counters of a hook, as returned by getstats:
+ *
+ * getstats hook_name
+ * hook_name 10:1205:98104:3605 20:0:0:0 default:17:1020:3600 nocopy:0:0:0
+ *
+ * with the number of packets and bytes each rule acted on, and the uptime
+ * in seconds when it last did so, 0 if never, followed by the same for the
+ * implicit drop past the last rule, and for packets whose copies to mirror
+ * hooks could not be made, or which were lost being copied to set a field.
+ * clrstats hook_name zeroes them.
+ */
+struct ng_pm_rstat {
+	uint64_t	packets;
+	uint64_t	bytes;
+	uint32_t	last;
+	uint16_t	rule_number;
+	uint16_t	spare;
+};
+
+struct ng_pm_stats {
+	char			name[NG_HOOKSIZ];
+	int			rules;
+	struct ng_pm_rstat	stat[];		/* rules + 2 */
+};
+
+#define	NG_PM_STATS_SIZE(rules)						\
+	(offsetof(struct ng_pm_stats, stat) +				\
+	    ((rules) + 2) * sizeof(struct ng_pm_rstat))
+
+/*
+ * Copies sent to a hook by dupto rules and table entries share the
+ * storage of the packet, read-only, and may be cut to a snap length:
+ *
+ * snaplen hook_name 128
+ *
+ * 0, the default, sends whole packets.  gsnaplen hook_name returns it.
+ */
+struct ng_pm_snapreq {
+	char		name[NG_HOOKSIZ];
+	uint32_t	snaplen;
+};
+
+/*
+ * Whether a hook takes packets chained by m_nextpkt, as ng_pm_rcvbatch()
+ * groups them, in one go:
+ *
+ * chains hook_name 1
+ *
+ * 0, the default, has them sent one by one, as stock nodes expect.
+ * gchains hook_name returns it.
+ */
+struct ng_pm_chainsreq {
+	char		hname[NG_HOOKSIZ];
+	uint32_t	chains;		/* 0 or 1 */
+};
+
+/*
+ * Rule set digests of all hooks, as returned by getdigests:
+ *
+ * getdigests
+ * eth0:5b0e2f6c eth1:00000000 eth2:5b0e2f6c
+ *
+ * A digest is the CRC-32 of the rules of a hook as ghc lists them,
+ * separated by single spaces, and 0 for a hook without rules.  It is taken
+ * when shc sets the rules, so whoever set them can check a whole node in
+ * one message.
+ */
+struct ng_pm_digest {
 	char		name[NG_HOOKSIZ];
-	ng_pm_hookcfg_t	cfg;
+	uint32_t	digest;
+};
+
+struct ng_pm_digests {
+	int			hooks;
+	struct ng_pm_digest	hook[];
+};
+
+#define	NG_PM_DIGESTS_SIZE(hooks)					\
+	(offsetof(struct ng_pm_digests, hook) +				\
+	    (hooks) * sizeof(struct ng_pm_digest))
+
+/*
+ * The counters themselves are kept per CPU, each CPU's on cache lines of
+ * their own, and summed up by getstats.
+ */
+struct ng_pm_rcount {
+	uint64_t	packets;
+	uint64_t	bytes;
+	time_t		last;
 };
-typedef struct ng_pm_hookcfgreq ng_pm_hookcfgreq_t;
+
+/* Per-hook private data */
+struct ng_pm_hookinfo {
+	struct ng_pm_prog	*prog;
+	struct ng_pm_rcount	*stats;		/* NULL if not configured */
+	int			nstats;		/* rules + 1, then nocopy */
+	size_t			sstride;	/* bytes per CPU */
+	uint32_t		snaplen;	/* of copies sent here, or 0 */
+	int			chains;		/* takes m_nextpkt chains */
+	struct ng_pm_mstate	*mstate;	/* by meter */
+	int			nmeters;
+};
+typedef struct ng_pm_hookinfo *ng_pm_hookinfo_p;
+
+/* Rule set compiler */
+static int ng_pm_compile(const ng_pm_hookcfg_t *, struct ng_pm_prog **);
+static void ng_pm_prog_free(struct ng_pm_prog *);
+static void ng_pm_prog_release(ng_pm_priv_p, struct ng_pm_prog *);
+
+/* Exact match tables */
+static void ng_pm_table_free(struct ng_pm_table *);
+
+/* Flow verdict cache */
+static int ng_pm_fc_alloc(ng_pm_priv_p, struct ng_pm_prog *);
+static void ng_pm_fc_invalidate(ng_pm_priv_p);
+
+/* Hook slots */
+static int ng_pm_hslot_get(node_p, const char *);
+static void ng_pm_hslot_ref(ng_pm_priv_p, const ng_pm_hookcfg_t *, int);
+static void ng_pm_hslot_put(ng_pm_priv_p, const ng_pm_hookcfg_t *, int);
+static void ng_pm_hslot_rehook(ng_pm_priv_p, const char *, hook_p,
+    hook_p);
+
+/* Hook groups */
+static void ng_pm_hgroup_fill(ng_pm_priv_p, struct ng_pm_hgroup *);
+static void ng_pm_hgroup_rehook(ng_pm_priv_p);
+static void ng_pm_hgroup_free(ng_pm_priv_p, int);
+
+/* Rule counters */
+static struct ng_pm_rcount *ng_pm_stats_alloc(int, size_t *);
+static void ng_pm_stats_free(ng_pm_hookinfo_p);
 
 /* Parse type for hook configuration. */
 static const struct ng_parse_type ng_pm_hookcfg_type = {
@@ -129,6 +878,47 @@ static const struct ng_parse_type ng_pm_hookcfg_type = {
 	.unparse =	&ng_pm_hookcfg_unparse,
 };
 
+/* Parse type for table entries. */
+static const struct ng_parse_type ng_pm_tabreq_type = {
+	.parse =	&ng_pm_tabreq_parse,
+	.unparse =	&ng_pm_tabreq_unparse,
+};
+
+/* Parse type for flow cache settings. */
+static const struct ng_parse_type ng_pm_fcreq_type = {
+	.parse =	&ng_pm_fcreq_parse,
+	.unparse =	&ng_pm_fcreq_unparse,
+};
+
+/* Parse type for rule counters. */
+static const struct ng_parse_type ng_pm_stats_type = {
+	.parse =	&ng_pm_stats_parse,
+	.unparse =	&ng_pm_stats_unparse,
+};
+
+/* Parse type for snap lengths. */
+static const struct ng_parse_type ng_pm_snapreq_type = {
+	.parse =	&ng_pm_snapreq_parse,
+	.unparse =	&ng_pm_snapreq_unparse,
+};
+
+/* Parse type for chain settings. */
+static const struct ng_parse_type ng_pm_chainsreq_type = {
+	.parse =	&ng_pm_chainsreq_parse,
+	.unparse =	&ng_pm_chainsreq_unparse,
+};
+
+/* Parse type for hook groups. */
+static const struct ng_parse_type ng_pm_hgreq_type = {
+	.parse =	&ng_pm_hgreq_parse,
+	.unparse =	&ng_pm_hgreq_unparse,
+};
+
+/* Parse type for rule set digests. */
+static const struct ng_parse_type ng_pm_digests_type = {
+	.unparse =	&ng_pm_digests_unparse,
+};
+
 /* List of commands and how to convert arguments to/from ASCII. */
 static const struct ng_cmdlist ng_pm_cmds[] = {
         {
@@ -145,6 +935,111 @@ static const struct ng_cmdlist ng_pm_cmds[] = {
 		.mesgType =     &ng_pm_hookcfg_type,
 		.respType =     &ng_pm_hookcfg_type,
 	},
+	{
+		.cookie =	NGM_PM_COOKIE,
+		.cmd =		NGM_PM_TABLE_ADD,
+		.name =		"tadd",
+		.mesgType =	&ng_pm_tabreq_type,
+		.respType =	NULL
+	},
+	{
+		.cookie =	NGM_PM_COOKIE,
+		.cmd =		NGM_PM_TABLE_DEL,
+		.name =		"tdel",
+		.mesgType =	&ng_pm_tabreq_type,
+		.respType =	NULL
+	},
+	{
+		.cookie =	NGM_PM_COOKIE,
+		.cmd =		NGM_PM_TABLE_FLUSH,
+		.name =		"tflush",
+		.mesgType =	&ng_pm_tabreq_type,
+		.respType =	NULL
+	},
+	{
+		.cookie =	NGM_PM_COOKIE,
+		.cmd =		NGM_PM_TABLE_GET,
+		.name =		"tget",
+		.mesgType =	&ng_pm_tabreq_type,
+		.respType =	&ng_pm_tabreq_type,
+	},
+	{
+		.cookie =	NGM_PM_COOKIE,
+		.cmd =		NGM_PM_SET_FCACHE,
+		.name =		"fcache",
+		.mesgType =	&ng_pm_fcreq_type,
+		.respType =	NULL
+	},
+	{
+		.cookie =	NGM_PM_COOKIE,
+		.cmd =		NGM_PM_GET_FCACHE,
+		.name =		"gfcache",
+		.mesgType =	NULL,
+		.respType =	&ng_pm_fcreq_type,
+	},
+	{
+		.cookie =	NGM_PM_COOKIE,
+		.cmd =		NGM_PM_GETSTATS,
+		.name =		"getstats",
+		.mesgType =	&ng_pm_stats_type,
+		.respType =	&ng_pm_stats_type,
+	},
+	{
+		.cookie =	NGM_PM_COOKIE,
+		.cmd =		NGM_PM_CLRSTATS,
+		.name =		"clrstats",
+		.mesgType =	&ng_pm_stats_type,
+		.respType =	NULL
+	},
+	{
+		.cookie =	NGM_PM_COOKIE,
+		.cmd =		NGM_PM_SET_HGROUP,
+		.name =		"hgroup",
+		.mesgType =	&ng_pm_hgreq_type,
+		.respType =	NULL
+	},
+	{
+		.cookie =	NGM_PM_COOKIE,
+		.cmd =		NGM_PM_GET_HGROUP,
+		.name =		"ghgroup",
+		.mesgType =	&ng_pm_hgreq_type,
+		.respType =	&ng_pm_hgreq_type,
+	},
+	{
+		.cookie =	NGM_PM_COOKIE,
+		.cmd =		NGM_PM_SET_SNAPLEN,
+		.name =		"snaplen",
+		.mesgType =	&ng_pm_snapreq_type,
+		.respType =	NULL
+	},
+	{
+		.cookie =	NGM_PM_COOKIE,
+		.cmd =		NGM_PM_GET_SNAPLEN,
+		.name =		"gsnaplen",
+		.mesgType =	&ng_pm_snapreq_type,
+		.respType =	&ng_pm_snapreq_type,
+	},
+	{
+		.cookie =	NGM_PM_COOKIE,
+		.cmd =		NGM_PM_SET_CHAINS,
+		.name =		"chains",
+		.mesgType =	&ng_pm_chainsreq_type,
+		.respType =	NULL
+	},
+	{
+		.cookie =	NGM_PM_COOKIE,
+		.cmd =		NGM_PM_GET_CHAINS,
+		.name =		"gchains",
+		.mesgType =	&ng_pm_chainsreq_type,
+		.respType =	&ng_pm_chainsreq_type,
+	},
+	{
+		.cookie =	NGM_PM_COOKIE,
+		.cmd =		NGM_PM_GET_DIGESTS,
+		.name =		"getdigests",
+		.mesgType =	NULL,
+		.respType =	&ng_pm_digests_type,
+	},
 	{ 0 }
 };
 
@@ -163,45 +1058,122 @@ static struct ng_type typestruct = {
 NETGRAPH_INIT(pm, &typestruct);
 
 
-static void
-ng_pm_clear_config(node_p node)
+/*
+ * Cfg parsing routines.
+ */
+/*
+ * Rule sets and table requests may be large, too large to go through
+ * sscanf(), which may scan the whole remaining string on every call.
+ */
+static __inline int
+ng_pm_hexbyte(const char *cp)
+{
+	int i, v = 0;
+
+	for (i = 0; i < 2; i++)
+		v = v << 4 | (isdigit(cp[i]) ? cp[i] - '0' :
+		    tolower(cp[i]) - 'a' + 10);
+	return (v);
+}
+
+/* Leading packet bytes a rule may look at */
+static __inline int
+ng_pm_rule_extent(const ng_pm_rule_t *r)
 {
-	hook_p hi;
-	ng_pm_hookcfg_p hcp;
+	int base;
 
-	LIST_FOREACH(hi, &node->nd_hooks, hk_hooks) {
-		hcp = NG_HOOK_PRIVATE(hi);
-		hcp->rules = 0;
+	switch (r->anchor) {
+	case NG_PM_ANCHOR_L3:
+		base = NG_PM_L3_MAX;
+		break;
+	case NG_PM_ANCHOR_L4:
+		base = NG_PM_L4_MAX;
+		break;
+	default:
+		base = 0;
+		break;
 	}
+	/* Flow hashes and checksum updates may look at any header byte */
+	if (r->action == NGM_PM_ACTION_MATCH_HASH ||
+	    r->action == NGM_PM_ACTION_MATCH_SET_FIELD)
+		return (max(base + r->p_off_hi + r->p_len, NG_PM_HDR_MAX));
+	return (base + r->p_off_hi + r->p_len);
 }
 
-/*
- * Cfg parsing routines.
- */
+/* Field of a match_set_field rule, value[/mask]@offset, from s[*off] on */
 static int
-ng_pm_hookcfg_parse(const struct ng_parse_type *type, const char *s, int *off,
-    const u_char *const start, u_char *const buf, int *buflen)
+ng_pm_setfield_parse(ng_pm_rule_t *r, const char *s, int *off, int last)
 {
-	ng_pm_hookcfgreq_t *hcreq = (ng_pm_hookcfgreq_t *) buf;
-	ng_pm_hookcfg_t *hc = &hcreq->cfg;
 	int i = *off;
-	int last = strlen(s);
-	int blen = sizeof(ng_pm_hookcfgreq_t);
-	int rules = 0;
-	int last_rule_number = 0;
-	int p_len;
-	int j;
-
-	if (blen > *buflen)
-		return(ENOMEM);
-
-	bzero(buf, blen);
+	int len, j;
+
+	for (len = 0;;) {
+		if (i + 3 > last || !isxdigit(s[i]) || !isxdigit(s[i + 1]) ||
+		    len == NG_PM_MAXPATLEN)
+			return(EINVAL);
+		r->s_value[len++] = ng_pm_hexbyte(&s[i]);
+		i += 3;
+		if (s[i - 1] != '.')
+			break;
+	}
+	if (s[i - 1] == '/') {
+		for (j = 0;;) {
+			if (i + 3 > last || !isxdigit(s[i]) ||
+			    !isxdigit(s[i + 1]) || j == len)
+				return(EINVAL);
+			r->s_mask[j++] = ng_pm_hexbyte(&s[i]);
+			i += 3;
+			if (s[i - 1] != '.')
+				break;
+		}
+		if (j != len)
+			return(EINVAL);
+	} else
+		memset(r->s_mask, 0xff, len);
+	if (s[i - 1] != '@')
+		return(EINVAL);
+	for (j = NG_PM_ANCHORS - 1; j > NG_PM_ANCHOR_FRAME; j--)
+		if (strncmp(&s[i], anchors[j], strlen(anchors[j])) == 0)
+			break;
+	i += strlen(anchors[j]);
+	r->s_anchor = j;
+	*off = i;
+	while (isdigit(s[i]) && i < last)
+		i++;
+	if (*off == i || i - *off > 5 ||
+	    strtol(&s[*off], NULL, 10) > 0xffff - len)
+		return(EINVAL);
+	r->s_off = strtol(&s[*off], NULL, 10);
+	r->s_len = len;
+	if (i < last && !isspace(s[i]))
+		return(EINVAL);
+	*off = i;
+	return (0);
+}
+
+static int
+ng_pm_hookcfg_parse(const struct ng_parse_type *type, const char *s, int *off,
+    const u_char *const start, u_char *const buf, int *buflen)
+{
+	ng_pm_hookcfg_t *hc = (ng_pm_hookcfg_t *) buf;
+	int i = *off;
+	int last = strlen(s);
+	int rules = 0;
+	int last_rule_number = 0;
+	int p_len;
+	int j;
+
+	if (NG_PM_HOOKCFG_SIZE(0) > *buflen)
+		return(ENOMEM);
+
+	bzero(buf, NG_PM_HOOKCFG_SIZE(0));
 
-	*buflen = blen;
 	/* First token should be a valid hook name */
 	while (!isspace(s[i]) && i < last)
 		i++;
-	bcopy(&s[*off], &hcreq->name, i - *off);
+	if (i - *off >= NG_HOOKSIZ)
+		return(EINVAL);
+	bcopy(&s[*off], &hc->name, i - *off);
 
 	/* Skip whitespace */
 	while (isspace(s[i]) && i < last)
@@ -210,6 +1182,10 @@ ng_pm_hookcfg_parse(const struct ng_parse_type *type, const char *s, int *off,
 
 	/* Remaining token(s) should be filtering rules */
 	for (; i < last;) {
+		if (NG_PM_HOOKCFG_SIZE(rules + 1) > *buflen)
+			return(ENOMEM);
+		bzero(&hc->rule[rules], sizeof(hc->rule[rules]));
+
 		/* Parse rule number */
 		while (isdigit(s[i]) && i < last)
 			i++;
@@ -218,13 +1194,12 @@ ng_pm_hookcfg_parse(const struct ng_parse_type *type, const char *s, int *off,
 		if (*off == i || s[i++] != ':')
 			return(EINVAL);
 
-		hc->rule[rules].rule_number =
-		    strtol(&s[*off], NULL, 10);
-
 		/* Bail out if rule numbers are not monotonically increasing */
-		if (hc->rule[rules].rule_number <= last_rule_number)
+		j = strtol(&s[*off], NULL, 10);
+		if (j <= last_rule_number || j > NG_PM_MAXRULES)
 			return(EINVAL);
-		last_rule_number = hc->rule[rules].rule_number;
+		hc->rule[rules].rule_number = j;
+		last_rule_number = j;
 
 		/* Parse action keyword */
 		*off = i;
@@ -248,31 +1223,70 @@ ng_pm_hookcfg_parse(const struct ng_parse_type *type, const char *s, int *off,
 		if (s[i] == ':') {
 			/* Pattern and offsets are already bzero()ed here */
 		} else {
-			/* Pattern */
+			/* Comparison, if any, except for lookup rules */
+			if (hc->rule[rules].action != NGM_PM_ACTION_LOOKUP &&
+			    (s[i] == '<' || s[i] == '>')) {
+				hc->rule[rules].cmp = s[i++] == '<' ?
+				    NG_PM_CMP_LT : NG_PM_CMP_GT;
+				if (s[i] == '=') {
+					hc->rule[rules].cmp++;	/* LE, GE */
+					i++;
+				}
+			}
+			/* Pattern, value or low end of a range */
 			p_len = 0;
-			do {
+			while (hc->rule[rules].action != NGM_PM_ACTION_LOOKUP) {
 				if (i + 3 > last || !isxdigit(s[i]) ||
-				    !isxdigit(s[i + 1]))
+				    !isxdigit(s[i + 1]) ||
+				    p_len == NG_PM_MAXPATLEN)
 					return(EINVAL);
-				sscanf(&s[i], "%02x*[./]", &j);
-				hc->rule[rules].pattern[p_len++] = j;
+				hc->rule[rules].pattern[p_len++] =
+				    ng_pm_hexbyte(&s[i]);
 				i += 3;
-			} while (s[i - 1] == '.');
+				if (s[i - 1] != '.')
+					break;
+			}
 			hc->rule[rules].p_len = p_len;
-			if (s[i - 1] != '/')
+			if (hc->rule[rules].cmp == NG_PM_CMP_MASK &&
+			    hc->rule[rules].action != NGM_PM_ACTION_LOOKUP &&
+			    s[i - 1] == '-')
+				hc->rule[rules].cmp = NG_PM_CMP_RANGE;
+			if (hc->rule[rules].cmp != NG_PM_CMP_MASK &&
+			    p_len != 1 && p_len != 2 && p_len != 4)
 				return(EINVAL);
-			/* Mask */
-			p_len = 0;
-			do {
-				if (i + 3 > last || !isxdigit(s[i]) ||
-				    !isxdigit(s[i + 1]))
+			/* Mask or high end of a range, nothing for a value */
+			if (hc->rule[rules].cmp > NG_PM_CMP_RANGE) {
+				if (s[i - 1] != '@')
 					return(EINVAL);
-				sscanf(&s[i], "%02x*[.@]", &j);
-				hc->rule[rules].mask[p_len++] = j;
-				i += 3;
-			} while (s[i - 1] == '.');
-			if (s[i - 1] != '@' || !isdigit(s[i]) ||
-			    hc->rule[rules].p_len != p_len)
+			} else if (hc->rule[rules].action !=
+			    NGM_PM_ACTION_LOOKUP && s[i - 1] !=
+			    (hc->rule[rules].cmp == NG_PM_CMP_RANGE ?
+			    '-' : '/'))
+				return(EINVAL);
+			else {
+				p_len = 0;
+				do {
+					if (i + 3 > last || !isxdigit(s[i]) ||
+					    !isxdigit(s[i + 1]) ||
+					    p_len == NG_PM_MAXPATLEN)
+						return(EINVAL);
+					hc->rule[rules].mask[p_len++] =
+					    ng_pm_hexbyte(&s[i]);
+					i += 3;
+				} while (s[i - 1] == '.');
+			}
+			if (hc->rule[rules].action == NGM_PM_ACTION_LOOKUP)
+				hc->rule[rules].p_len = p_len;
+			if (s[i - 1] != '@' || hc->rule[rules].p_len != p_len)
+				return(EINVAL);
+			/* Header the offsets are relative to, if any */
+			for (j = NG_PM_ANCHORS - 1; j > NG_PM_ANCHOR_FRAME; j--)
+				if (strncmp(&s[i], anchors[j],
+				    strlen(anchors[j])) == 0)
+					break;
+			i += strlen(anchors[j]);
+			hc->rule[rules].anchor = j;
+			if (!isdigit(s[i]))
 				return(EINVAL);
 			/* Offset(s) */
 			*off = i;
@@ -306,7 +1320,7 @@ ng_pm_hookcfg_parse(const struct ng_parse_type *type, const char *s, int *off,
 		*off = i;
 
 		/* Update maxcontig */
-		j = hc->rule[rules].p_off_hi + hc->rule[rules].p_len;
+		j = ng_pm_rule_extent(&hc->rule[rules]);
 		if (j > hc->maxcontig)
 			hc->maxcontig = j;
 
@@ -318,7 +1332,7 @@ ng_pm_hookcfg_parse(const struct ng_parse_type *type, const char *s, int *off,
 		case NGM_PM_ACTION_NOMATCH_DUPTO:
 			while (!isspace(s[i]) && i < last)
 				i++;
-			if (*off == i || (i - *off) > NG_HOOKSIZ)
+			if (*off == i || (i - *off) >= NG_HOOKSIZ)
 				return(EINVAL);
 			bcopy(&s[*off], &hc->rule[rules].asdata.hname,
 			    i - *off);
@@ -333,6 +1347,66 @@ ng_pm_hookcfg_parse(const struct ng_parse_type *type, const char *s, int *off,
 			hc->rule[rules].asdata.skipto_rule_number =
 			    strtol(&s[*off], NULL, 10);
 			break;
+		case NGM_PM_ACTION_LOOKUP:
+			while (isdigit(s[i]) && i < last)
+				i++;
+			if (*off == i || hc->rule[rules].p_len == 0)
+				return(EINVAL);
+			hc->rule[rules].asdata.table =
+			    strtol(&s[*off], NULL, 10);
+			break;
+		case NGM_PM_ACTION_MATCH_HASH:
+			while (isdigit(s[i]) && i < last)
+				i++;
+			if (*off == i)
+				return(EINVAL);
+			hc->rule[rules].asdata.hgroup =
+			    strtol(&s[*off], NULL, 10);
+			break;
+		case NGM_PM_ACTION_MATCH_SAMPLE:
+		case NGM_PM_ACTION_MATCH_POLICE:
+			/* [~]period/hook_name, or rate/burst[/hook_name] */
+			if (hc->rule[rules].action ==
+			    NGM_PM_ACTION_MATCH_SAMPLE && s[i] == '~') {
+				hc->rule[rules].rflags |= NG_PM_RATE_RANDOM;
+				*off = ++i;
+			}
+			while (isdigit(s[i]) && i < last)
+				i++;
+			if (*off == i || s[i] != '/')
+				return(EINVAL);
+			hc->rule[rules].rate = strtouq(&s[*off], NULL, 10);
+			*off = ++i;
+			if (hc->rule[rules].action ==
+			    NGM_PM_ACTION_MATCH_POLICE) {
+				while (isdigit(s[i]) && i < last)
+					i++;
+				if (*off == i)
+					return(EINVAL);
+				hc->rule[rules].burst =
+				    strtoul(&s[*off], NULL, 10);
+				if (s[i] == '/')
+					i++;
+				else if (i < last && !isspace(s[i]))
+					return(EINVAL);
+				*off = i;
+			}
+			while (!isspace(s[i]) && i < last)
+				i++;
+			if ((i - *off) >= NG_HOOKSIZ || (*off == i &&
+			    hc->rule[rules].action ==
+			    NGM_PM_ACTION_MATCH_SAMPLE))
+				return(EINVAL);
+			bcopy(&s[*off], &hc->rule[rules].asdata.hname,
+			    i - *off);
+			hc->rule[rules].asdata.hname[i - *off] = 0;
+			break;
+		case NGM_PM_ACTION_MATCH_SET_FIELD:
+			if (ng_pm_setfield_parse(&hc->rule[rules], s, off,
+			    last) != 0)
+				return(EINVAL);
+			i = *off;
+			break;
 		case NGM_PM_ACTION_MATCH_DROP:
 		case NGM_PM_ACTION_NOMATCH_DROP:
 			/* Nothing to parse here */
@@ -349,386 +1423,4256 @@ ng_pm_hookcfg_parse(const struct ng_parse_type *type, const char *s, int *off,
 		rules++;
 	};
 	hc->rules = rules;
+	*buflen = NG_PM_HOOKCFG_SIZE(rules);
 
 	return (0);
 }
 
+/*
+ * One rule, as ghc prints it, with 'hname' for the hook it names if any.
+ * Returns its length, or -1 if the action is unknown.
+ */
+static int
+ng_pm_rule_unparse(const ng_pm_hookcfg_t *hc, int i, const char *hname,
+    char *cbuf)
+{
+	const struct ng_pm_rule *r = &hc->rule[i];
+	char *cp = cbuf;
+	int j;
+
+	/* Rule number */
+	cp += sprintf(cp, "%d:", r->rule_number);
+
+	/* Action */
+	for (j = 0; actions[j].action_name != NULL; j++) {
+		if (actions[j].action_id == r->action) {
+			cp += sprintf(cp, "%s:", actions[j].action_name);
+			break;
+		}
+	}
+
+	/* Pattern, mask, offset(s), or value(s) compared with */
+	if (r->p_len && r->action != NGM_PM_ACTION_LOOKUP)
+		cp += sprintf(cp, "%s", cmps[r->cmp % NG_PM_CMPS]);
+	for (j = 0; j < r->p_len && r->action != NGM_PM_ACTION_LOOKUP; j++) {
+		cp += sprintf(cp, "%02x", r->pattern[j] & 0xff);
+		if (j < r->p_len - 1)
+			*cp++ = '.';
+	}
+	if (r->p_len && r->action != NGM_PM_ACTION_LOOKUP &&
+	    r->cmp <= NG_PM_CMP_RANGE)
+		*cp++ = r->cmp == NG_PM_CMP_RANGE ? '-' : '/';
+	for (j = 0; j < r->p_len && r->cmp <= NG_PM_CMP_RANGE; j++) {
+		cp += sprintf(cp, "%02x", r->mask[j] & 0xff);
+		if (j < r->p_len - 1)
+			*cp++ = '.';
+	}
+	if (r->p_len) {
+		cp += sprintf(cp, "@%s%d", anchors[r->anchor % NG_PM_ANCHORS],
+		    r->p_off_lo);
+		if (r->p_off_lo != r->p_off_hi)
+			cp += sprintf(cp, "..%d", r->p_off_hi);
+	}
+	*cp++ = ':';
+	*cp = '\0';
+
+	/* Action-specific target (hook or rule) */
+	switch (r->action) {
+	case NGM_PM_ACTION_MATCH_HOOK:
+	case NGM_PM_ACTION_NOMATCH_HOOK:
+	case NGM_PM_ACTION_MATCH_DUPTO:
+	case NGM_PM_ACTION_NOMATCH_DUPTO:
+		cp += sprintf(cp, "%s", hname);
+		break;
+	case NGM_PM_ACTION_MATCH_SKIPTO:
+	case NGM_PM_ACTION_NOMATCH_SKIPTO:
+		j = r->asdata.skipto_index;
+		cp += sprintf(cp, "%d", hc->rule[j].rule_number);
+		break;
+	case NGM_PM_ACTION_LOOKUP:
+		cp += sprintf(cp, "%d", r->asdata.table);
+		break;
+	case NGM_PM_ACTION_MATCH_HASH:
+		cp += sprintf(cp, "%d", r->asdata.hgroup);
+		break;
+	case NGM_PM_ACTION_MATCH_SAMPLE:
+		cp += sprintf(cp, "%s%ju/%s",
+		    r->rflags & NG_PM_RATE_RANDOM ? "~" : "",
+		    (uintmax_t)r->rate, hname);
+		break;
+	case NGM_PM_ACTION_MATCH_POLICE:
+		cp += sprintf(cp, "%ju/%u", (uintmax_t)r->rate, r->burst);
+		if (hname[0] != '\0')
+			cp += sprintf(cp, "/%s", hname);
+		break;
+	case NGM_PM_ACTION_MATCH_SET_FIELD:
+		for (j = 0; j < r->s_len && j < NG_PM_MAXPATLEN; j++)
+			cp += sprintf(cp, "%s%02x", j ? "." : "",
+			    r->s_value[j] & 0xff);
+		for (j = 0; j < r->s_len && j < NG_PM_MAXPATLEN; j++)
+			cp += sprintf(cp, "%s%02x", j ? "." : "/",
+			    r->s_mask[j] & 0xff);
+		cp += sprintf(cp, "@%s%d",
+		    anchors[r->s_anchor % NG_PM_ANCHORS], r->s_off);
+		break;
+	case NGM_PM_ACTION_MATCH_DROP:
+	case NGM_PM_ACTION_NOMATCH_DROP:
+		/* Nothing to unparse here */
+		break;
+	default:
+		/* Bail out if action keyword is unknown */
+		return (-1);
+	}
+
+	return (cp - cbuf);
+}
+
 static int
 ng_pm_hookcfg_unparse(const struct ng_parse_type *type, const u_char *data,
     int *off, char *cbuf, int cbuflen)
 {
-	const ng_pm_hookcfgreq_t *hcreq =
-	    (const ng_pm_hookcfgreq_t *) (data + *off);
-	const ng_pm_hookcfg_t *hc = &hcreq->cfg;
-	int i, j;
+	const ng_pm_hookcfg_t *hc = (const ng_pm_hookcfg_t *) (data + *off);
+	char *end = cbuf + cbuflen;
+	int i, n;
 
-        cbuf += sprintf(cbuf, "%s", hcreq->name);
+	if (cbuflen < NG_HOOKSIZ)
+		return(ERANGE);
+        cbuf += sprintf(cbuf, "%.*s", NG_HOOKSIZ - 1, hc->name);
 
 	for (i = 0; i < hc->rules; i++) {
-		/* Rule number */
-		cbuf += sprintf(cbuf, " %d:", hc->rule[i].rule_number);
+		if (end - cbuf < 1 + NG_PM_RULE_MAXLEN)
+			return(ERANGE);
+		*cbuf++ = ' ';
+		n = ng_pm_rule_unparse(hc, i, hc->rule[i].asdata.hname, cbuf);
+		if (n < 0)
+			return(EINVAL);
+		cbuf += n;
+	}
 
-		/* Action */
-		for (j = 0; actions[j].action_name != NULL; j++) {
-			if (actions[j].action_id ==
-			    hc->rule[i].action) {
-				cbuf += sprintf(cbuf, "%s:",
-				    actions[j].action_name);
-				break;
-			}
-		}
+	*off += NG_PM_HOOKCFG_SIZE(hc->rules);
 
-		/* Pattern, mask, offset(s) */
-		for (j = 0; j < hc->rule[i].p_len; j++) {
-			cbuf += sprintf(cbuf, "%02x",
-			    hc->rule[i].pattern[j] & 0xff);
-			if (j < hc->rule[i].p_len - 1)
-				*cbuf++ = '.';
-		}
-		if (hc->rule[i].p_len)
-			*cbuf++ = '/';
-		for (j = 0; j < hc->rule[i].p_len; j++) {
-			cbuf += sprintf(cbuf, "%02x",
-			    hc->rule[i].mask[j] & 0xff);
-			if (j < hc->rule[i].p_len - 1)
-				*cbuf++ = '.';
-		}
-		if (hc->rule[i].p_len) {
-			cbuf += sprintf(cbuf, "@%d", hc->rule[i].p_off_lo);
-			if (hc->rule[i].p_off_lo != hc->rule[i].p_off_hi)
-				cbuf += sprintf(cbuf, "..%d",
-				    hc->rule[i].p_off_hi);
-		}
-		*cbuf++ = ':';
+	return (0);
+}
 
-		/* Action-specific target (hook or rule) */
-		switch (hc->rule[i].action) {
-		case NGM_PM_ACTION_MATCH_HOOK:
-		case NGM_PM_ACTION_NOMATCH_HOOK:
-		case NGM_PM_ACTION_MATCH_DUPTO:
-		case NGM_PM_ACTION_NOMATCH_DUPTO:
-			cbuf += sprintf(cbuf, "%s",
-			    hc->rule[i].asdata.hname);
-			break;
-		case NGM_PM_ACTION_MATCH_SKIPTO:
-		case NGM_PM_ACTION_NOMATCH_SKIPTO:
-			j = hc->rule[i].asdata.skipto_index;
-			cbuf += sprintf(cbuf, "%d", hc->rule[j].rule_number);
-			break;
-		case NGM_PM_ACTION_MATCH_DROP:
-		case NGM_PM_ACTION_NOMATCH_DROP:
-			/* Nothing to unparse here */
+static int
+ng_pm_tabreq_parse(const struct ng_parse_type *type, const char *s, int *off,
+    const u_char *const start, u_char *const buf, int *buflen)
+{
+	struct ng_pm_tabreq *tr = (struct ng_pm_tabreq *) buf;
+	struct ng_pm_tabent *te;
+	const char *cp = s + *off;
+	char *ep;
+	u_long table;
+	int n, j, klen;
+	uint32_t i;
+
+	if (sizeof(*tr) > *buflen)
+		return(ENOMEM);
+	bzero(tr, sizeof(*tr));
+
+	/* First token is the table number */
+	table = strtoul(cp, &ep, 10);
+	if (ep == cp || table >= NG_PM_MAXTABLES)
+		return(EINVAL);
+	tr->table = table;
+	cp = ep;
+
+	/* Remaining token(s) are key:action:hook_name, or just keys */
+	for (n = 0;; n++) {
+		while (isspace(*cp))
+			cp++;
+		if (*cp == '\0')
 			break;
-		default:
-			/* Bail out if action keyword is unknown */
+		if (sizeof(*tr) + (n + 1) * sizeof(*te) > *buflen)
+			return(ENOMEM);
+		te = &tr->ent[n];
+		bzero(te, sizeof(*te));
+		for (klen = 0;; cp++) {
+			if (!isxdigit(cp[0]) || !isxdigit(cp[1]) ||
+			    klen == NG_PM_MAXPATLEN)
+				return(EINVAL);
+			te->key[klen++] = ng_pm_hexbyte(cp);
+			cp += 2;
+			if (*cp != '.')
+				break;
+		}
+		if (tr->keylen == 0)
+			tr->keylen = klen;
+		else if (tr->keylen != klen)
 			return(EINVAL);
+		te->plen = 0xffff;
+		if (*cp == '/') {
+			cp++;
+			if (!isdigit(*cp))
+				return(EINVAL);
+			te->plen = strtoul(cp, &ep, 10);
+			cp = ep;
+			tr->flags |= NG_PM_TABLE_LPM;
+		}
+		if (*cp == ':') {
+			cp++;
+			for (j = 0; actions[j].action_name != NULL; j++) {
+				klen = strlen(actions[j].action_name);
+				if (strncmp(cp, actions[j].action_name,
+				    klen) == 0 && cp[klen] == ':')
+					break;
+			}
+			if (actions[j].action_name == NULL)
+				return(EINVAL);
+			te->action = actions[j].action_id;
+			cp += klen + 1;
+			for (j = 0; cp[j] != '\0' && !isspace(cp[j]); j++)
+				continue;
+			if (j >= NG_HOOKSIZ)
+				return(EINVAL);
+			bcopy(cp, te->hname, j);
+			cp += j;
 		}
+		if (*cp != '\0' && !isspace(*cp))
+			return(EINVAL);
+	}
+	tr->entries = n;
+	/* Keys without a prefix length are host routes in an LPM table */
+	for (i = 0; i < tr->entries; i++)
+		if (tr->ent[i].plen == 0xffff)
+			tr->ent[i].plen = tr->flags & NG_PM_TABLE_LPM ?
+			    tr->keylen * 8 : 0;
+	*off = cp - s;
+	*buflen = sizeof(*tr) + n * sizeof(*te);
+	return (0);
+}
+
+static int
+ng_pm_tabreq_unparse(const struct ng_parse_type *type, const u_char *data,
+    int *off, char *cbuf, int cbuflen)
+{
+	const struct ng_pm_tabreq *tr =
+	    (const struct ng_pm_tabreq *) (data + *off);
+	const struct ng_pm_tabent *te;
+	const char *name;
+	uint32_t i;
+	int j, len;
 
+	len = snprintf(cbuf, cbuflen, "%d", tr->table);
+	for (i = 0; i < tr->entries && len < cbuflen; i++) {
+		te = &tr->ent[i];
+		name = "";
+		for (j = 0; actions[j].action_name != NULL; j++)
+			if (actions[j].action_id == te->action)
+				name = actions[j].action_name;
+		for (j = 0; j < tr->keylen && len < cbuflen; j++)
+			len += snprintf(cbuf + len, cbuflen - len, "%c%02x",
+			    j ? '.' : ' ', te->key[j]);
+		if (tr->flags & NG_PM_TABLE_LPM && len < cbuflen)
+			len += snprintf(cbuf + len, cbuflen - len, "/%d",
+			    te->plen);
+		if (len < cbuflen)
+			len += snprintf(cbuf + len, cbuflen - len, ":%s:%s",
+			    name, te->hname);
 	}
+	if (len >= cbuflen)
+		return(ERANGE);
 
-	*off += sizeof(*hcreq);
+	*off += sizeof(*tr) + tr->entries * sizeof(*te);
 
 	return (0);
 }
 
 static int
-ng_pm_constructor(node_p node)
+ng_pm_fcreq_parse(const struct ng_parse_type *type, const char *s, int *off,
+    const u_char *const start, u_char *const buf, int *buflen)
 {
+	struct ng_pm_fcreq *fr = (struct ng_pm_fcreq *) buf;
+	const char *cp = s + *off;
+	char *ep;
+	u_long v;
 
-	NG_NODE_SET_PRIVATE(node, NULL);
+	if (sizeof(*fr) > *buflen)
+		return(ENOMEM);
+	bzero(fr, sizeof(*fr));
+
+	v = strtoul(cp, &ep, 10);
+	if (ep == cp || v > NG_PM_FC_MAXENT)
+		return(EINVAL);
+	fr->entries = v;
+	cp = ep;
+	while (isspace(*cp))
+		cp++;
+	if (*cp != '\0') {
+		v = strtoul(cp, &ep, 10);
+		if (ep == cp || v > NG_PM_FC_MAXSPAN)
+			return(EINVAL);
+		fr->span = v;
+		cp = ep;
+	}
+	*off = cp - s;
+	*buflen = sizeof(*fr);
 	return (0);
 }
 
 static int
-ng_pm_newhook(node_p node, hook_p hook, const char *name)
+ng_pm_fcreq_unparse(const struct ng_parse_type *type, const u_char *data,
+    int *off, char *cbuf, int cbuflen)
 {
-	ng_pm_hookcfg_p hcp;
+	const struct ng_pm_fcreq *fr =
+	    (const struct ng_pm_fcreq *) (data + *off);
 
-	MALLOC(hcp, ng_pm_hookcfg_p, sizeof(*hcp), M_NETGRAPH_PM,
-            M_NOWAIT | M_ZERO);
-	if (hcp == NULL)
-		return (ENOMEM);
+	if (snprintf(cbuf, cbuflen, "%u %u", fr->entries, fr->span) >= cbuflen)
+		return(ERANGE);
+	*off += sizeof(*fr);
+	return (0);
+}
+
+static int
+ng_pm_stats_parse(const struct ng_parse_type *type, const char *s, int *off,
+    const u_char *const start, u_char *const buf, int *buflen)
+{
+	struct ng_pm_stats *st = (struct ng_pm_stats *) buf;
+	const char *cp = s + *off;
+	int j;
+
+	if (offsetof(struct ng_pm_stats, stat) > *buflen)
+		return(ENOMEM);
+	bzero(st, offsetof(struct ng_pm_stats, stat));
 
-	NG_HOOK_SET_PRIVATE(hook, hcp);
-	ng_pm_clear_config(node);
+	/* Hook name only */
+	while (isspace(*cp))
+		cp++;
+	for (j = 0; cp[j] != '\0' && !isspace(cp[j]); j++)
+		continue;
+	if (j == 0 || j >= NG_HOOKSIZ)
+		return(EINVAL);
+	bcopy(cp, st->name, j);
+	*off = cp + j - s;
+	*buflen = offsetof(struct ng_pm_stats, stat);
 	return (0);
 }
 
 static int
-ng_pm_rcvmsg(node_p node, item_p item, hook_p lasthook)
+ng_pm_stats_unparse(const struct ng_parse_type *type, const u_char *data,
+    int *off, char *cbuf, int cbuflen)
 {
-	ng_pm_hookcfgreq_t *hcreq = NULL;
-	struct ng_mesg *msg;
-	struct ng_mesg *resp = NULL;
-	hook_p hook = NULL;
-	ng_pm_hookcfg_p hcp;
-	int i, j, len, error = 0;
+	const struct ng_pm_stats *st =
+	    (const struct ng_pm_stats *) (data + *off);
+	const struct ng_pm_rstat *rs;
+	int i, len;
 
-	NGI_GET_MSG(item, msg);
-	if (msg->header.typecookie != NGM_PM_COOKIE)
-		error = EINVAL;
-	else {
-		switch (msg->header.cmd) {
-		case NGM_PM_SETHOOKCFG:
-		case NGM_PM_GETHOOKCFG:
-			hcreq = (ng_pm_hookcfgreq_t *) msg->data;
-			hook = ng_findhook(node, hcreq->name);
-			if (hook == NULL)
-				error = ENOENT;
-			break;
-		default:
-			error = EINVAL;
-			break;
-		}
+	len = snprintf(cbuf, cbuflen, "%s", st->name);
+	for (i = 0; i <= st->rules + 1 && len < cbuflen; i++) {
+		rs = &st->stat[i];
+		if (i < st->rules)
+			len += snprintf(cbuf + len, cbuflen - len, " %d:",
+			    rs->rule_number);
+		else
+			len += snprintf(cbuf + len, cbuflen - len, " %s:",
+			    i == st->rules ? "default" : "nocopy");
+		if (len < cbuflen)
+			len += snprintf(cbuf + len, cbuflen - len,
+			    "%ju:%ju:%u", (uintmax_t)rs->packets,
+			    (uintmax_t)rs->bytes, rs->last);
 	}
-	if (error)
-		goto done;
+	if (len >= cbuflen)
+		return(ERANGE);
 
-	/* We have a valid target hook here... */
-	hcp = NG_HOOK_PRIVATE(hook);
-	switch (msg->header.cmd) {
-	case NGM_PM_SETHOOKCFG:
-		len = msg->header.arglen -
-		    offsetof(ng_pm_hookcfgreq_t, cfg);
-		/* XXX exact match for len? */
-		if (len < 0 || len > sizeof(hcreq->cfg)) {
-			error = EINVAL;
-			break;
-		}
-		/* Map hook names to pointers and rule numbers to indices */
-		for (i = 0; i < hcreq->cfg.rules; i++) {
-			switch (hcreq->cfg.rule[i].action) {
-			case NGM_PM_ACTION_MATCH_HOOK:
-			case NGM_PM_ACTION_NOMATCH_HOOK:
-			case NGM_PM_ACTION_MATCH_DUPTO:
-			case NGM_PM_ACTION_NOMATCH_DUPTO:
-				hook = ng_findhook(node,
-				    hcreq->cfg.rule[i].asdata.hname);
-				if (hook == NULL) {
-					error = ENOENT;
-					goto done;
-				}
-				hcreq->cfg.rule[i].asdata.hp = hook;
-				break;
-			case NGM_PM_ACTION_MATCH_SKIPTO:
-			case NGM_PM_ACTION_NOMATCH_SKIPTO:
-				error = ENOENT;
-				for (j = i + 1; j < hcreq->cfg.rules; j++) {
-					if (hcreq->cfg.rule[i].asdata.
-					    skipto_rule_number ==
-					    hcreq->cfg.rule[j].rule_number) {
-						error = 0;
-						break;
-					}
-				}
-				if (error)
-					goto done;
-				hcreq->cfg.rule[i].asdata.skipto_index = j;
-				break;
-			default:
-				break;
-			}
-		}
-		bcopy(&hcreq->cfg, hcp, sizeof(hcreq->cfg));
-		break;
-	case NGM_PM_GETHOOKCFG:
-		NG_MKRESPONSE(resp, msg, sizeof(*hcp), M_NOWAIT);
-		if (resp == NULL)
-			error = ENOMEM;
-		else {
-			hcreq = (ng_pm_hookcfgreq_t *) resp->data;
-			sprintf(hcreq->name, "%s", NG_HOOK_NAME(hook));
-			bcopy(hcp, &hcreq->cfg, sizeof(hcreq->cfg));
-			/* Translate hook pointers to hook names */
-			for (i = 0; i < hcreq->cfg.rules; i++) {
-				switch (hcreq->cfg.rule[i].action) {
-				case NGM_PM_ACTION_MATCH_HOOK:
-				case NGM_PM_ACTION_NOMATCH_HOOK:
-				case NGM_PM_ACTION_MATCH_DUPTO:
-				case NGM_PM_ACTION_NOMATCH_DUPTO:
-					hook = hcreq->cfg.rule[i].asdata.hp;
-					sprintf(hcreq->cfg.rule[i].asdata.hname,
-					    "%s", NG_HOOK_NAME(hook));
-				default:
-					break;
-				}
-			}
-		}
-		break;
-	default:
-		error = EINVAL;
-		break;
-	}
+	*off += NG_PM_STATS_SIZE(st->rules);
 
-done:
-	NG_RESPOND_MSG(error, node, item, resp);
-	NG_FREE_MSG(msg);
-	return (error);
+	return (0);
 }
 
 static int
-ng_pm_rcvdata(hook_p hook, item_p item)
+ng_pm_snapreq_parse(const struct ng_parse_type *type, const char *s, int *off,
+    const u_char *const start, u_char *const buf, int *buflen)
 {
-	ng_pm_hookcfg_p hcp = NG_HOOK_PRIVATE(hook);
-	int rule, i, off0, vlan_tag, vlan_mask, end;
-	int match = 0;
-	int error = 0;
-	int maxlen;
-	struct mbuf *m = NGI_M(item);
-	struct mbuf *m2;
-	char *c;
+	struct ng_pm_snapreq *sr = (struct ng_pm_snapreq *) buf;
+	const char *cp = s + *off;
+	char *ep;
+	int j;
 
-	if (hcp->rules == 0)
-		goto drop;
+	if (sizeof(*sr) > *buflen)
+		return(ENOMEM);
+	bzero(sr, sizeof(*sr));
 
-	if (!(m->m_flags & M_PKTHDR)) {
-		printf("ouch, M_PKTHDR not set!?\n");
-		goto drop;
+	/* Hook name, then the snap length if setting it */
+	while (isspace(*cp))
+		cp++;
+	for (j = 0; cp[j] != '\0' && !isspace(cp[j]); j++)
+		continue;
+	if (j == 0 || j >= NG_HOOKSIZ)
+		return(EINVAL);
+	bcopy(cp, sr->name, j);
+	cp += j;
+	while (isspace(*cp))
+		cp++;
+	if (*cp != '\0') {
+		sr->snaplen = strtoul(cp, &ep, 10);
+		if (ep == cp)
+			return(EINVAL);
+		cp = ep;
 	}
+	*off = cp - s;
+	*buflen = sizeof(*sr);
+	return (0);
+}
 
-	maxlen = hcp->maxcontig;
-	if (m->m_len < maxlen)
-		maxlen = m->m_len;
-
-//printf("%s() %d: rcv'd pkt on hook %s len %d maxcontig %d maxlen %d\n", __FUNCTION__, __LINE__, NG_HOOK_NAME(hook), m->m_len, hcp->maxcontig, maxlen);
-
-	m = m_pullup(m, maxlen);
-	NGI_M(item) = m;
-	if (m == NULL) {
-		printf("m_pullup() failed for %d\n", maxlen);
-		goto drop;
+static int
+ng_pm_snapreq_unparse(const struct ng_parse_type *type, const u_char *data,
+    int *off, char *cbuf, int cbuflen)
+{
+	const struct ng_pm_snapreq *sr =
+	    (const struct ng_pm_snapreq *) (data + *off);
+
+	if (snprintf(cbuf, cbuflen, "%.*s %u", NG_HOOKSIZ - 1, sr->name,
+	    sr->snaplen) >= cbuflen)
+		return(ERANGE);
+	*off += sizeof(*sr);
+	return (0);
+}
+
+static int
+ng_pm_chainsreq_parse(const struct ng_parse_type *type, const char *s,
+    int *off, const u_char *const start, u_char *const buf, int *buflen)
+{
+	struct ng_pm_chainsreq *cr = (struct ng_pm_chainsreq *) buf;
+	const char *cp = s + *off;
+	int j;
+
+	if (sizeof(*cr) > *buflen)
+		return(ENOMEM);
+	bzero(cr, sizeof(*cr));
+
+	/* Hook name, then 0 or 1 if setting it */
+	while (isspace(*cp))
+		cp++;
+	for (j = 0; cp[j] != '\0' && !isspace(cp[j]); j++)
+		continue;
+	if (j == 0 || j >= NG_HOOKSIZ)
+		return(EINVAL);
+	bcopy(cp, cr->hname, j);
+	cp += j;
+	while (isspace(*cp))
+		cp++;
+	if (*cp != '\0') {
+		if ((*cp != '0' && *cp != '1') ||
+		    (cp[1] != '\0' && !isspace(cp[1])))
+			return(EINVAL);
+		cr->chains = *cp++ - '0';
+	}
+	*off = cp - s;
+	*buflen = sizeof(*cr);
+	return (0);
+}
+
+static int
+ng_pm_chainsreq_unparse(const struct ng_parse_type *type, const u_char *data,
+    int *off, char *cbuf, int cbuflen)
+{
+	const struct ng_pm_chainsreq *cr =
+	    (const struct ng_pm_chainsreq *) (data + *off);
+
+	if (snprintf(cbuf, cbuflen, "%.*s %u", NG_HOOKSIZ - 1, cr->hname,
+	    cr->chains) >= cbuflen)
+		return(ERANGE);
+	*off += sizeof(*cr);
+	return (0);
+}
+
+static int
+ng_pm_digests_unparse(const struct ng_parse_type *type, const u_char *data,
+    int *off, char *cbuf, int cbuflen)
+{
+	const struct ng_pm_digests *dg =
+	    (const struct ng_pm_digests *) (data + *off);
+	int i, len;
+
+	cbuf[0] = '\0';
+	for (i = 0, len = 0; i < dg->hooks && len < cbuflen; i++)
+		len += snprintf(cbuf + len, cbuflen - len, "%s%.*s:%08x",
+		    i > 0 ? " " : "", NG_HOOKSIZ - 1, dg->hook[i].name,
+		    dg->hook[i].digest);
+	if (len >= cbuflen)
+		return(ERANGE);
+
+	*off += NG_PM_DIGESTS_SIZE(dg->hooks);
+
+	return (0);
+}
+
+static int
+ng_pm_hgreq_parse(const struct ng_parse_type *type, const char *s, int *off,
+    const u_char *const start, u_char *const buf, int *buflen)
+{
+	struct ng_pm_hgreq *hr = (struct ng_pm_hgreq *) buf;
+	const char *cp = s + *off;
+	char *ep;
+	u_long group;
+	int n, j;
+
+	if (sizeof(*hr) > *buflen)
+		return(ENOMEM);
+	bzero(hr, sizeof(*hr));
+
+	/* Group number, then the fields hashed on, if given */
+	group = strtoul(cp, &ep, 10);
+	if (ep == cp || group >= NG_PM_MAXHGROUPS)
+		return(EINVAL);
+	hr->group = group;
+	cp = ep;
+	while (isspace(*cp))
+		cp++;
+	hr->fields = NG_PM_HASH_L4;
+	for (j = 0; j < NG_PM_HASH_FIELDS; j++)
+		if (strncmp(cp, hfields[j], 2) == 0 &&
+		    (cp[2] == '\0' || isspace(cp[2]))) {
+			hr->fields = j;
+			cp += 2;
+			break;
+		}
+
+	/* Member hook names */
+	for (n = 0;; n++) {
+		while (isspace(*cp))
+			cp++;
+		if (*cp == '\0')
+			break;
+		if (n == NG_PM_HG_MAXHOOKS)
+			return(EINVAL);
+		if (sizeof(*hr) + (n + 1) * NG_HOOKSIZ > *buflen)
+			return(ENOMEM);
+		for (j = 0; cp[j] != '\0' && !isspace(cp[j]); j++)
+			continue;
+		if (j >= NG_HOOKSIZ)
+			return(EINVAL);
+		bzero(hr->hname[n], NG_HOOKSIZ);
+		bcopy(cp, hr->hname[n], j);
+		cp += j;
+	}
+	hr->hooks = n;
+	*off = cp - s;
+	*buflen = sizeof(*hr) + n * NG_HOOKSIZ;
+	return (0);
+}
+
+static int
+ng_pm_hgreq_unparse(const struct ng_parse_type *type, const u_char *data,
+    int *off, char *cbuf, int cbuflen)
+{
+	const struct ng_pm_hgreq *hr =
+	    (const struct ng_pm_hgreq *) (data + *off);
+	uint32_t i;
+	int len;
+
+	len = snprintf(cbuf, cbuflen, "%d %s", hr->group,
+	    hfields[hr->fields % NG_PM_HASH_FIELDS]);
+	for (i = 0; i < hr->hooks && len < cbuflen; i++)
+		len += snprintf(cbuf + len, cbuflen - len, " %.*s",
+		    NG_HOOKSIZ - 1, hr->hname[i]);
+	if (len >= cbuflen)
+		return(ERANGE);
+
+	*off += sizeof(*hr) + hr->hooks * NG_HOOKSIZ;
+
+	return (0);
+}
+
+/*
+ * Rule set compiler.
+ */
+/* Big-endian field value of 'len' bytes */
+static __inline uint32_t
+ng_pm_field_value(const char *c, int len)
+{
+	uint32_t v = 0;
+	int i;
+
+	for (i = 0; i < len; i++)
+		v = v << 8 | (u_char)c[i];
+	return (v);
+}
+
+static int
+ng_pm_pred_range(struct ng_pm_pred *pp, const ng_pm_rule_t *r)
+{
+	uint32_t v, max;
+	int never = 0;
+
+	if ((r->p_len != 1 && r->p_len != 2 && r->p_len != 4) ||
+	    r->p_off_lo != r->p_off_hi)
+		return (EINVAL);
+	v = ng_pm_field_value(r->pattern, r->p_len);
+	max = 0xffffffffU >> (32 - 8 * r->p_len);
+	pp->range = 1;
+	pp->lo = 0;
+	pp->hi = max;
+	switch (r->cmp) {
+	case NG_PM_CMP_RANGE:
+		pp->lo = v;
+		pp->hi = ng_pm_field_value(r->mask, r->p_len);
+		if (pp->lo > pp->hi)
+			return (EINVAL);
+		break;
+	case NG_PM_CMP_LT:
+		never = v == 0;
+		pp->hi = v - 1;
+		break;
+	case NG_PM_CMP_LE:
+		pp->hi = v;
+		break;
+	case NG_PM_CMP_GT:
+		never = v == max;
+		pp->lo = v + 1;
+		break;
+	case NG_PM_CMP_GE:
+		pp->lo = v;
+		break;
+	default:
+		return (EINVAL);
+	}
+	if (never) {
+		/* Said one way for all, lo > hi */
+		pp->lo = 1;
+		pp->hi = 0;
+	}
+	pp->vlan = pp->anchor == NG_PM_ANCHOR_FRAME && pp->off_lo < 16 &&
+	    pp->off_lo + pp->p_len > 12;
+	return (0);
+}
+
+static int
+ng_pm_pred_init(struct ng_pm_pred *pp, const ng_pm_rule_t *r)
+{
+	int i;
+
+	if (r->p_len > NG_PM_MAXPATLEN || r->p_off_lo > r->p_off_hi)
+		return (EINVAL);
+	bzero(pp, sizeof(*pp));
+	pp->off_lo = r->p_off_lo;
+	pp->off_hi = r->p_off_hi;
+	pp->p_len = r->p_len;
+	pp->anchor = r->anchor;
+	if (r->cmp != NG_PM_CMP_MASK)
+		return (ng_pm_pred_range(pp, r));
+	for (i = 0; i < r->p_len; i++) {
+		pp->mask[i] = r->mask[i];
+		pp->pattern[i] = r->pattern[i] & r->mask[i];
+	}
+	for (i = 0; i < pp->p_len && pp->mask[i] == 0; i++)
+		continue;
+	pp->skip = i;
+	for (i = pp->p_len; i > pp->skip && pp->mask[i - 1] == 0; i--)
+		continue;
+	pp->len = i - pp->skip;
+	pp->vlan = pp->len > 0 && pp->anchor == NG_PM_ANCHOR_FRAME &&
+	    pp->off_lo <= 12 &&
+	    pp->off_hi + pp->skip + pp->len > 12;
+	pp->nwords = howmany(pp->len, sizeof(uint64_t));
+	/* pattern[] and mask[] are zero past p_len, pad the last word */
+	bcopy(pp->pattern + pp->skip, pp->wpat, pp->len);
+	bcopy(pp->mask + pp->skip, pp->wmask, pp->len);
+	return (0);
+}
+
+/* For finding duplicates, pred_init() clears any padding */
+static uint32_t
+ng_pm_pred_hash(const struct ng_pm_pred *pp)
+{
+	const u_char *c = (const u_char *)pp;
+	uint32_t h = 2166136261U;
+	int i;
+
+	for (i = 0; i < sizeof(*pp); i++)
+		h = (h ^ c[i]) * 16777619;
+	return (h);
+}
+
+/* True if the predicate holds regardless of packet contents and length */
+static int
+ng_pm_pred_always(const struct ng_pm_pred *pp)
+{
+
+	return (pp->len == 0 && pp->off_lo + pp->p_len == 0 &&
+	    pp->anchor == NG_PM_ANCHOR_FRAME);
+}
+
+/* Predicates both test the same fixed offset, outside of the VLAN tag */
+static int
+ng_pm_pred_comparable(const struct ng_pm_pred *a, const struct ng_pm_pred *b)
+{
+
+	return (!a->vlan && !b->vlan && !a->range && !b->range &&
+	    a->off_lo == a->off_hi &&
+	    b->off_lo == b->off_hi && a->off_lo == b->off_lo &&
+	    a->anchor == b->anchor);
+}
+
+/* Range predicates both compare the same field */
+static int
+ng_pm_pred_samefield(const struct ng_pm_pred *a, const struct ng_pm_pred *b)
+{
+
+	return (a->range && b->range && a->off_lo == b->off_lo &&
+	    a->p_len == b->p_len && a->anchor == b->anchor);
+}
+
+/* Whenever 'a' holds, 'b' holds as well */
+static int
+ng_pm_pred_implies(const struct ng_pm_pred *a, const struct ng_pm_pred *b)
+{
+	int i;
+
+	if (ng_pm_pred_always(b))
+		return (1);
+	if (ng_pm_pred_samefield(a, b))
+		return (a->lo > a->hi || (b->lo <= a->lo && a->hi <= b->hi));
+	if (!ng_pm_pred_comparable(a, b) || b->p_len > a->p_len)
+		return (0);
+	for (i = 0; i < b->p_len; i++)
+		if ((b->mask[i] & ~a->mask[i]) != 0 ||
+		    (a->pattern[i] & b->mask[i]) != b->pattern[i])
+			return (0);
+	return (1);
+}
+
+/* 'a' and 'b' can never hold at the same time */
+static int
+ng_pm_pred_disjoint(const struct ng_pm_pred *a, const struct ng_pm_pred *b)
+{
+	int i;
+
+	if (ng_pm_pred_samefield(a, b))
+		return (a->lo > a->hi || b->lo > b->hi ||
+		    a->hi < b->lo || b->hi < a->lo);
+	if (!ng_pm_pred_comparable(a, b))
+		return (0);
+	for (i = 0; i < a->p_len && i < b->p_len; i++)
+		if ((a->pattern[i] ^ b->pattern[i]) & a->mask[i] & b->mask[i])
+			return (1);
+	return (0);
+}
+
+/*
+ * Outcome of predicate 'q' given that predicate 'p' evaluated to 'v':
+ * 1 or 0 if implied, -1 if it has to be evaluated.  A negative 'p' stands
+ * for no knowledge at all.
+ */
+static int
+ng_pm_pred_known(const struct ng_pm_prog *prog, int q, int p, int v)
+{
+	const struct ng_pm_pred *pq = &prog->preds[q];
+	const struct ng_pm_pred *pp = &prog->preds[p < 0 ? q : p];
+
+	if (q == p)
+		return (v);
+	if (ng_pm_pred_always(pq))
+		return (1);
+	if (p < 0)
+		return (-1);
+	if (v) {
+		if (ng_pm_pred_implies(pp, pq))
+			return (1);
+		if (ng_pm_pred_disjoint(pp, pq))
+			return (0);
+	} else if (ng_pm_pred_implies(pq, pp))
+		return (0);
+	return (-1);
+}
+
+/* Does the rule act when its pattern matches, or when it does not? */
+static int
+ng_pm_action_on(int action)
+{
+
+	switch (action) {
+	case NGM_PM_ACTION_MATCH_HOOK:
+	case NGM_PM_ACTION_MATCH_DUPTO:
+	case NGM_PM_ACTION_MATCH_SKIPTO:
+	case NGM_PM_ACTION_MATCH_DROP:
+	case NGM_PM_ACTION_MATCH_HASH:
+	case NGM_PM_ACTION_MATCH_SAMPLE:
+	case NGM_PM_ACTION_MATCH_POLICE:
+	case NGM_PM_ACTION_MATCH_SET_FIELD:
+		return (1);
+	default:
+		return (0);
+	}
+}
+
+/* Compiler scratch state, per rule */
+struct ng_pm_cinfo {
+	uint32_t	pred;
+	uint32_t	act;		/* action insn, if any */
+	uint32_t	skipto;		/* where a skipto continues */
+	int		group;		/* -1 if not a group member */
+	int		target;		/* a skipto continues here */
+	int		rtab;		/* -1 if not a range rule */
+	int		rbit;
+	int		rrun;
+};
+
+/*
+ * Where to continue with rule 'k', knowing that predicate 'p' evaluated
+ * to 'v'.  Rules whose outcome follows from that are executed here and
+ * now, as far as they only decide which rule comes next.
+ */
+static uint32_t
+ng_pm_resolve(const struct ng_pm_prog *prog, const ng_pm_hookcfg_t *hc,
+    const struct ng_pm_cinfo *ci, int k, int p, int v)
+{
+	int n, w, action;
+
+	for (n = 0; n < NG_PM_RESOLVE_MAX && k < hc->rules; n++) {
+		if (hc->rule[k].action == NGM_PM_ACTION_LOOKUP)
+			return (k);
+		w = ng_pm_pred_known(prog, ci[k].pred, p, v);
+		if (w < 0)
+			return (k);
+		action = hc->rule[k].action;
+		if (w != ng_pm_action_on(action))
+			k++;
+		else
+			return (ci[k].act);
+	}
+	return (k < hc->rules ? k : prog->ninsns - 1);
+}
+
+/* Rule may be a member of a GROUP of predicates shaped like 'pp' */
+static int
+ng_pm_group_eligible(const struct ng_pm_prog *prog, const ng_pm_hookcfg_t *hc,
+    const struct ng_pm_cinfo *ci, int k, const struct ng_pm_pred *pp)
+{
+	const struct ng_pm_pred *pk;
+
+	switch (hc->rule[k].action) {
+	case NGM_PM_ACTION_MATCH_HOOK:
+	case NGM_PM_ACTION_MATCH_SKIPTO:
+	case NGM_PM_ACTION_MATCH_DROP:
+	case NGM_PM_ACTION_MATCH_HASH:
+		break;
+	default:
+		return (0);
+	}
+	pk = &prog->preds[ci[k].pred];
+	if (pk->vlan || pk->range || pk->len == 0 || pk->off_lo != pk->off_hi)
+		return (0);
+	if (pp == NULL)
+		return (1);
+	return (!ci[k].target && pk->off_lo == pp->off_lo &&
+	    pk->anchor == pp->anchor &&
+	    pk->p_len == pp->p_len && pk->skip == pp->skip &&
+	    pk->len == pp->len &&
+	    bcmp(pk->mask, pp->mask, NG_PM_MAXPATLEN) == 0);
+}
+
+/*
+ * GROUP values are ordered as arrays of native words, which is as good an
+ * order as any for binary search and cheaper to compare than bytes.
+ */
+static __inline int
+ng_pm_key_cmp(const uint64_t *a, const uint64_t *b, int nwords)
+{
+	int i;
+
+	for (i = 0; i < nwords; i++)
+		if (a[i] != b[i])
+			return (a[i] < b[i] ? -1 : 1);
+	return (0);
+}
+
+struct ng_pm_gkey {
+	uint64_t	key[NG_PM_MAXWORDS];
+	uint32_t	rule;
+};
+
+static int
+ng_pm_gkey_cmp(const void *a, const void *b)
+{
+	const struct ng_pm_gkey *ka = a, *kb = b;
+	int c;
+
+	if ((c = ng_pm_key_cmp(ka->key, kb->key, NG_PM_MAXWORDS)) != 0)
+		return (c);
+	return (ka->rule < kb->rule ? -1 : ka->rule > kb->rule);
+}
+
+static int
+ng_pm_group_build(struct ng_pm_prog *prog, struct ng_pm_cinfo *ci,
+    int first, int last)
+{
+	struct ng_pm_group *g = &prog->groups[prog->ngroups];
+	const struct ng_pm_pred *pp;
+	struct ng_pm_gkey *gk;
+	int i, n, nw;
+
+	n = last - first + 1;
+	MALLOC(gk, struct ng_pm_gkey *, n * sizeof(*gk), M_NETGRAPH_PM,
+	    M_NOWAIT | M_ZERO);
+	if (gk == NULL)
+		return (ENOMEM);
+	for (i = 0; i < n; i++) {
+		pp = &prog->preds[ci[first + i].pred];
+		bcopy(pp->wpat, gk[i].key, sizeof(gk[i].key));
+		gk[i].rule = first + i;
+	}
+	qsort(gk, n, sizeof(*gk), ng_pm_gkey_cmp);
+
+	pp = &prog->preds[ci[first].pred];
+	nw = pp->nwords;
+	g->pred = ci[first].pred;
+	g->last = last;
+	MALLOC(g->keys, uint64_t *, n * nw * sizeof(*g->keys), M_NETGRAPH_PM,
+	    M_NOWAIT);
+	MALLOC(g->rule, uint32_t *, n * sizeof(*g->rule), M_NETGRAPH_PM,
+	    M_NOWAIT);
+	if (g->keys == NULL || g->rule == NULL) {
+		FREE(gk, M_NETGRAPH_PM);
+		return (ENOMEM);
+	}
+	/* Keep only the first rule of each value, it shadows the rest. */
+	for (i = 0; i < n; i++) {
+		if (g->nkeys > 0 && ng_pm_key_cmp(gk[i].key,
+		    g->keys + (g->nkeys - 1) * nw, nw) == 0)
+			continue;
+		bcopy(gk[i].key, g->keys + g->nkeys * nw,
+		    nw * sizeof(*g->keys));
+		g->rule[g->nkeys++] = gk[i].rule;
+	}
+	FREE(gk, M_NETGRAPH_PM);
+	for (i = first; i <= last; i++)
+		ci[i].group = prog->ngroups;
+	prog->ngroups++;
+	return (0);
+}
+
+/* Predicate may be looked for by the content automaton */
+static int
+ng_pm_ac_eligible(const struct ng_pm_pred *pp)
+{
+	int i;
+
+	if (pp->len == 0 || pp->off_lo == pp->off_hi)
+		return (0);
+	for (i = pp->skip; i < pp->skip + pp->len; i++)
+		if (pp->mask[i] != 0xff)
+			return (0);
+	return (1);
+}
+
+static void
+ng_pm_ac_free(struct ng_pm_ac *ac)
+{
+
+	if (ac->delta != NULL)
+		FREE(ac->delta, M_NETGRAPH_PM);
+	if (ac->out != NULL)
+		FREE(ac->out, M_NETGRAPH_PM);
+	if (ac->next != NULL)
+		FREE(ac->next, M_NETGRAPH_PM);
+	if (ac->pred != NULL)
+		FREE(ac->pred, M_NETGRAPH_PM);
+	if (ac->none != NULL)
+		FREE(ac->none, M_NETGRAPH_PM);
+	FREE(ac, M_NETGRAPH_PM);
+}
+
+/*
+ * Build the content automaton of a program, if it has enough predicates
+ * for one.  The trie of all patterns is built first, as lists of children,
+ * then turned into the table of next states breadth first, each state
+ * starting from a copy of the row of its failure state.
+ */
+static int
+ng_pm_ac_build(struct ng_pm_prog *prog)
+{
+	struct ng_pm_ac *ac;
+	struct ng_pm_pred *pp;
+	uint16_t *child = NULL, *sib = NULL, *fail = NULL, *queue = NULL;
+	uint16_t *delta = NULL, *out, *row;
+	u_char *sclass = NULL;
+	u_char used[256];
+	int i, j, a, s, t, n, max, head, tail, error = 0;
+
+	for (i = n = 0, max = 1; i < prog->npreds && n < NG_PM_AC_MAXPATS; i++)
+		if (ng_pm_ac_eligible(&prog->preds[i])) {
+			n++;
+			max += prog->preds[i].len;
+		}
+	if (n < NG_PM_AC_MIN)
+		return (0);
+
+	MALLOC(ac, struct ng_pm_ac *, sizeof(*ac), M_NETGRAPH_PM,
+	    M_NOWAIT | M_ZERO);
+	if (ac == NULL)
+		return (ENOMEM);
+	prog->ac = ac;
+	MALLOC(ac->pred, uint32_t *, n * sizeof(*ac->pred), M_NETGRAPH_PM,
+	    M_NOWAIT);
+	MALLOC(ac->next, uint16_t *, n * sizeof(*ac->next), M_NETGRAPH_PM,
+	    M_NOWAIT | M_ZERO);
+	MALLOC(ac->out, uint16_t *, max * sizeof(*ac->out), M_NETGRAPH_PM,
+	    M_NOWAIT | M_ZERO);
+	MALLOC(child, uint16_t *, max * sizeof(*child), M_NETGRAPH_PM,
+	    M_NOWAIT | M_ZERO);
+	MALLOC(sib, uint16_t *, max * sizeof(*sib), M_NETGRAPH_PM,
+	    M_NOWAIT | M_ZERO);
+	MALLOC(fail, uint16_t *, max * sizeof(*fail), M_NETGRAPH_PM,
+	    M_NOWAIT | M_ZERO);
+	MALLOC(queue, uint16_t *, max * sizeof(*queue), M_NETGRAPH_PM,
+	    M_NOWAIT);
+	MALLOC(sclass, u_char *, max, M_NETGRAPH_PM, M_NOWAIT);
+	if (ac->pred == NULL || ac->next == NULL || ac->out == NULL ||
+	    child == NULL || sib == NULL || fail == NULL || queue == NULL ||
+	    sclass == NULL) {
+		error = ENOMEM;
+		goto done;
+	}
+
+	/* Patterns and the byte ranges they are looked for in */
+	bzero(used, sizeof(used));
+	for (i = 0; i < prog->npreds && ac->npats < n; i++) {
+		pp = &prog->preds[i];
+		if (!ng_pm_ac_eligible(pp))
+			continue;
+		ac->pred[ac->npats] = i;
+		pp->acid = ++ac->npats;
+		for (j = pp->skip; j < pp->skip + pp->len; j++)
+			used[pp->pattern[j]] = 1;
+		a = pp->anchor;
+		if (ac->hi[a] == 0 || pp->off_lo + pp->skip < ac->lo[a])
+			ac->lo[a] = pp->off_lo + pp->skip;
+		ac->hi[a] = imax(ac->hi[a], pp->off_hi + pp->skip + pp->len);
+	}
+
+	/* Bytes which are in no pattern all share the last class */
+	for (i = 0; i < 256; i++)
+		if (used[i])
+			ac->class[i] = ac->nclasses++;
+	if (ac->nclasses < 256) {
+		for (i = 0; i < 256; i++)
+			if (!used[i])
+				ac->class[i] = ac->nclasses;
+		ac->nclasses++;
+	}
+
+	/* Trie */
+	ac->nstates = 1;
+	for (i = 0; i < ac->npats; i++) {
+		pp = &prog->preds[ac->pred[i]];
+		for (s = 0, j = pp->skip; j < pp->skip + pp->len; j++, s = t) {
+			a = ac->class[pp->pattern[j]];
+			for (t = child[s]; t != 0 && sclass[t] != a; t = sib[t])
+				continue;
+			if (t != 0)
+				continue;
+			t = ac->nstates++;
+			sclass[t] = a;
+			sib[t] = child[s];
+			child[s] = t;
+		}
+		ac->next[i] = ac->out[s];
+		ac->out[s] = i + 1;
+	}
+
+	/* Failure links, next states and outputs inherited from those */
+	MALLOC(delta, uint16_t *, ac->nstates * ac->nclasses * sizeof(*delta),
+	    M_NETGRAPH_PM, M_NOWAIT | M_ZERO);
+	MALLOC(ac->delta, uint32_t *,
+	    ac->nstates * ac->nclasses * sizeof(*ac->delta), M_NETGRAPH_PM,
+	    M_NOWAIT);
+	if (delta == NULL || ac->delta == NULL) {
+		error = ENOMEM;
+		goto done;
+	}
+	head = tail = 0;
+	queue[tail++] = 0;
+	while (head < tail) {
+		s = queue[head++];
+		row = delta + s * ac->nclasses;
+		if (s != 0) {
+			bcopy(delta + fail[s] * ac->nclasses, row,
+			    ac->nclasses * sizeof(*row));
+			if ((i = ac->out[s]) == 0)
+				ac->out[s] = ac->out[fail[s]];
+			else {
+				while (ac->next[i - 1] != 0)
+					i = ac->next[i - 1];
+				ac->next[i - 1] = ac->out[fail[s]];
+			}
+		}
+		for (t = child[s]; t != 0; t = sib[t]) {
+			fail[t] = s == 0 ? 0 : row[sclass[t]];
+			row[sclass[t]] = t;
+			queue[tail++] = t;
+		}
+	}
+
+	/* Renumber, the root staying first, and go over to row offsets */
+	out = ac->out;
+	for (s = t = 0; s < ac->nstates; s++)
+		if (out[s] == 0)
+			queue[s] = t++;
+	ac->outmin = t * ac->nclasses;
+	for (s = 0; s < ac->nstates; s++)
+		if (out[s] != 0)
+			queue[s] = t++;
+	for (s = 0; s < ac->nstates; s++)
+		for (i = 0; i < ac->nclasses; i++)
+			ac->delta[queue[s] * ac->nclasses + i] =
+			    queue[delta[s * ac->nclasses + i]] * ac->nclasses;
+	for (s = 0; s < ac->nstates; s++)
+		fail[queue[s]] = out[s];
+	bcopy(fail, out, ac->nstates * sizeof(*out));
+
+done:
+	if (delta != NULL)
+		FREE(delta, M_NETGRAPH_PM);
+	if (child != NULL)
+		FREE(child, M_NETGRAPH_PM);
+	if (sib != NULL)
+		FREE(sib, M_NETGRAPH_PM);
+	if (fail != NULL)
+		FREE(fail, M_NETGRAPH_PM);
+	if (queue != NULL)
+		FREE(queue, M_NETGRAPH_PM);
+	if (sclass != NULL)
+		FREE(sclass, M_NETGRAPH_PM);
+	return (error);
+}
+
+/* Index of the interval of a range table 'v' falls into */
+static __inline int
+ng_pm_rtab_find(const struct ng_pm_rtab *rt, uint32_t v)
+{
+	int lo, hi, mid;
+
+	for (lo = 0, hi = rt->nbounds - 1; lo < hi;) {
+		mid = (lo + hi + 1) / 2;
+		if (rt->bound[mid] <= v)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return (lo);
+}
+
+static int
+ng_pm_u32_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+/* Intervals and bitmaps of a range table, given its rules */
+static int
+ng_pm_rtab_fill(const struct ng_pm_prog *prog, const struct ng_pm_cinfo *ci,
+    struct ng_pm_rtab *rt)
+{
+	const struct ng_pm_pred *pp;
+	uint32_t max = 0xffffffffU >> (32 - 8 * rt->len);
+	int b, i, n;
+
+	MALLOC(rt->bound, uint32_t *, (2 * rt->nbits + 1) * sizeof(uint32_t),
+	    M_NETGRAPH_PM, M_NOWAIT);
+	if (rt->bound == NULL)
+		return (ENOMEM);
+	/* Each range starts an interval, and ends one but at max */
+	n = 0;
+	rt->bound[n++] = 0;
+	for (b = 0; b < rt->nbits; b++) {
+		pp = &prog->preds[ci[rt->rule[b]].pred];
+		if (pp->lo > pp->hi)
+			continue;
+		rt->bound[n++] = pp->lo;
+		if (pp->hi != max)
+			rt->bound[n++] = pp->hi + 1;
+	}
+	qsort(rt->bound, n, sizeof(uint32_t), ng_pm_u32_cmp);
+	for (rt->nbounds = 1, i = 1; i < n; i++)
+		if (rt->bound[i] != rt->bound[rt->nbounds - 1])
+			rt->bound[rt->nbounds++] = rt->bound[i];
+
+	rt->nwords = howmany(rt->nbits, 64);
+	MALLOC(rt->bits, uint64_t *,
+	    rt->nbounds * rt->nwords * sizeof(uint64_t), M_NETGRAPH_PM,
+	    M_NOWAIT | M_ZERO);
+	if (rt->bits == NULL)
+		return (ENOMEM);
+	for (b = 0; b < rt->nbits; b++) {
+		pp = &prog->preds[ci[rt->rule[b]].pred];
+		if (pp->lo > pp->hi)
+			continue;
+		for (i = ng_pm_rtab_find(rt, pp->lo);
+		    i < (int)rt->nbounds && rt->bound[i] <= pp->hi; i++)
+			rt->bits[i * rt->nwords + b / 64] |= 1ULL << (b % 64);
+	}
+	return (0);
+}
+
+/* Range rules, for sorting by field and then by rule */
+struct ng_pm_rkey {
+	uint16_t	anchor;
+	uint16_t	off;
+	uint16_t	len;
+	uint32_t	rule;
+};
+
+static int
+ng_pm_rkey_field_cmp(const struct ng_pm_rkey *a, const struct ng_pm_rkey *b)
+{
+
+	if (a->anchor != b->anchor)
+		return (a->anchor < b->anchor ? -1 : 1);
+	if (a->off != b->off)
+		return (a->off < b->off ? -1 : 1);
+	return (a->len < b->len ? -1 : a->len > b->len);
+}
+
+static int
+ng_pm_rkey_cmp(const void *a, const void *b)
+{
+	const struct ng_pm_rkey *ka = a, *kb = b;
+	int c;
+
+	if ((c = ng_pm_rkey_field_cmp(ka, kb)) != 0)
+		return (c);
+	return (ka->rule < kb->rule ? -1 : ka->rule > kb->rule);
+}
+
+/*
+ * Range tables of a program and the runs of rules testing them.  Members
+ * of a run all act on a match, so that however a run is entered, the
+ * first member in range from there on decides where to go next, and the
+ * last member's jf if there is none.
+ */
+static int
+ng_pm_rtab_build(struct ng_pm_prog *prog, const ng_pm_hookcfg_t *hc,
+    struct ng_pm_cinfo *ci)
+{
+	const struct ng_pm_pred *pp;
+	struct ng_pm_rkey *rk = NULL;
+	struct ng_pm_rtab *rt;
+	struct ng_pm_rrun *rr;
+	int i, j, k, n = 0, error = 0;
+
+	for (i = 0; i < hc->rules; i++)
+		if (ci[i].pred != NG_PM_NORULE &&
+		    prog->preds[ci[i].pred].range)
+			n++;
+	if (n == 0)
+		return (0);
+	MALLOC(rk, struct ng_pm_rkey *, n * sizeof(*rk), M_NETGRAPH_PM,
+	    M_NOWAIT);
+	MALLOC(prog->rtabs, struct ng_pm_rtab *, n * sizeof(*prog->rtabs),
+	    M_NETGRAPH_PM, M_NOWAIT | M_ZERO);
+	MALLOC(prog->rruns, struct ng_pm_rrun *, n * sizeof(*prog->rruns),
+	    M_NETGRAPH_PM, M_NOWAIT | M_ZERO);
+	if (rk == NULL || prog->rtabs == NULL || prog->rruns == NULL) {
+		error = ENOMEM;
+		goto done;
+	}
+	for (i = 0, j = 0; i < hc->rules; i++) {
+		if (ci[i].pred == NG_PM_NORULE ||
+		    !(pp = &prog->preds[ci[i].pred])->range)
+			continue;
+		rk[j].anchor = pp->anchor;
+		rk[j].off = pp->off_lo;
+		rk[j].len = pp->p_len;
+		rk[j++].rule = i;
+	}
+	qsort(rk, n, sizeof(*rk), ng_pm_rkey_cmp);
+
+	/* As many rules of a field as fit go into each table */
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && j - i < NG_PM_RT_MAXBITS &&
+		    ng_pm_rkey_field_cmp(&rk[i], &rk[j]) == 0; j++)
+			continue;
+		rt = &prog->rtabs[prog->nrtabs++];
+		rt->off = rk[i].off;
+		rt->len = rk[i].len;
+		rt->anchor = rk[i].anchor;
+		rt->vlan = prog->preds[ci[rk[i].rule].pred].vlan;
+		rt->nbits = j - i;
+		MALLOC(rt->rule, uint32_t *, rt->nbits * sizeof(uint32_t),
+		    M_NETGRAPH_PM, M_NOWAIT);
+		if (rt->rule == NULL) {
+			error = ENOMEM;
+			goto done;
+		}
+		for (k = i; k < j; k++) {
+			rt->rule[k - i] = rk[k].rule;
+			ci[rk[k].rule].rtab = prog->nrtabs - 1;
+			ci[rk[k].rule].rbit = k - i;
+		}
+		if ((error = ng_pm_rtab_fill(prog, ci, rt)) != 0)
+			goto done;
+	}
+
+	for (rr = NULL, i = 0; i < hc->rules; i++) {
+		if (ci[i].rtab < 0)
+			continue;
+		if (rr != NULL && rr->rule + rr->n == i &&
+		    rr->rtab == ci[i].rtab && rr->bit + rr->n == ci[i].rbit &&
+		    ng_pm_action_on(hc->rule[i].action) &&
+		    ng_pm_action_on(hc->rule[rr->rule].action))
+			rr->n++;
+		else {
+			rr = &prog->rruns[prog->nrruns++];
+			rr->rtab = ci[i].rtab;
+			rr->rule = i;
+			rr->bit = ci[i].rbit;
+			rr->n = 1;
+		}
+		ci[i].rrun = prog->nrruns - 1;
+	}
+
+done:
+	if (rk != NULL)
+		FREE(rk, M_NETGRAPH_PM);
+	return (error);
+}
+
+static int
+ng_pm_compile(const ng_pm_hookcfg_t *hc, struct ng_pm_prog **progp)
+{
+	const ng_pm_rule_t *r;
+	struct ng_pm_prog *prog;
+	struct ng_pm_cinfo *ci = NULL;
+	struct ng_pm_insn *insn;
+	struct ng_pm_pred *pp;
+	struct ng_pm_lookup *lp;
+	struct ng_pm_meter *mp;
+	struct ng_pm_setf *sf;
+	uint32_t *phash = NULL;
+	uint32_t on, off, h, hmask;
+	int i, j, nact, p, error = 0;
+
+	*progp = NULL;
+	if (hc->rules == 0)
+		return (0);
+	if (hc->rules < 0 || hc->rules > NG_PM_MAXRULES)
+		return (EINVAL);
+
+	MALLOC(prog, struct ng_pm_prog *, sizeof(*prog), M_NETGRAPH_PM,
+	    M_NOWAIT | M_ZERO);
+	if (prog == NULL)
+		return (ENOMEM);
+	MALLOC(prog->preds, struct ng_pm_pred *,
+	    hc->rules * sizeof(*prog->preds), M_NETGRAPH_PM, M_NOWAIT);
+	MALLOC(prog->insns, struct ng_pm_insn *,
+	    (2 * hc->rules + 1) * sizeof(*prog->insns), M_NETGRAPH_PM,
+	    M_NOWAIT | M_ZERO);
+	MALLOC(prog->groups, struct ng_pm_group *,
+	    (hc->rules / NG_PM_GROUP_MIN + 1) * sizeof(*prog->groups),
+	    M_NETGRAPH_PM, M_NOWAIT | M_ZERO);
+	MALLOC(prog->lookups, struct ng_pm_lookup *,
+	    hc->rules * sizeof(*prog->lookups), M_NETGRAPH_PM,
+	    M_NOWAIT | M_ZERO);
+	MALLOC(prog->meters, struct ng_pm_meter *,
+	    hc->rules * sizeof(*prog->meters), M_NETGRAPH_PM,
+	    M_NOWAIT | M_ZERO);
+	MALLOC(prog->setfs, struct ng_pm_setf *,
+	    hc->rules * sizeof(*prog->setfs), M_NETGRAPH_PM,
+	    M_NOWAIT | M_ZERO);
+	MALLOC(ci, struct ng_pm_cinfo *, hc->rules * sizeof(*ci),
+	    M_NETGRAPH_PM, M_NOWAIT | M_ZERO);
+	for (hmask = 1; hmask < 2 * hc->rules; hmask <<= 1)
+		continue;
+	MALLOC(phash, uint32_t *, hmask * sizeof(*phash), M_NETGRAPH_PM,
+	    M_NOWAIT | M_ZERO);
+	hmask--;
+	if (prog->preds == NULL || prog->insns == NULL ||
+	    prog->groups == NULL || prog->lookups == NULL ||
+	    prog->meters == NULL || prog->setfs == NULL || ci == NULL ||
+	    phash == NULL) {
+		error = ENOMEM;
+		goto done;
+	}
+
+	/* Predicates, each distinct one only once */
+	for (i = 0; i < hc->rules; i++) {
+		r = &hc->rule[i];
+		ci[i].pred = NG_PM_NORULE;
+		ci[i].group = -1;
+		ci[i].rtab = ci[i].rrun = -1;
+		if (r->anchor >= NG_PM_ANCHORS) {
+			error = EINVAL;
+			goto done;
+		}
+		if (ng_pm_rule_extent(r) > prog->maxcontig)
+			prog->maxcontig = ng_pm_rule_extent(r);
+		if (r->action == NGM_PM_ACTION_LOOKUP)
+			continue;
+		pp = &prog->preds[prog->npreds];
+		if ((error = ng_pm_pred_init(pp, r)) != 0)
+			goto done;
+		for (h = ng_pm_pred_hash(pp) & hmask; phash[h] != 0;
+		    h = (h + 1) & hmask)
+			if (bcmp(&prog->preds[phash[h] - 1], pp,
+			    sizeof(*pp)) == 0)
+				break;
+		if (phash[h] == 0)
+			phash[h] = ++prog->npreds;
+		ci[i].pred = phash[h] - 1;
+	}
+
+	/* Action instructions follow the tests, one per rule at most */
+	nact = hc->rules;
+	for (i = 0; i < hc->rules; i++) {
+		r = &hc->rule[i];
+		switch (r->action) {
+		case NGM_PM_ACTION_MATCH_SKIPTO:
+		case NGM_PM_ACTION_NOMATCH_SKIPTO:
+			j = r->asdata.skipto_index;
+			if (j <= i || j >= hc->rules) {
+				error = EINVAL;
+				goto done;
+			}
+			/* Execution resumes past the target rule. */
+			ci[i].skipto = j + 1;
+			if (j + 1 < hc->rules)
+				ci[j + 1].target = 1;
+			ci[i].act = nact;
+			prog->insns[nact].rule = i;
+			prog->insns[nact++].op = NG_PM_OP_SKIP;
+			break;
+		case NGM_PM_ACTION_MATCH_HOOK:
+		case NGM_PM_ACTION_NOMATCH_HOOK:
+			ci[i].act = nact;
+			prog->insns[nact].rule = i;
+			prog->insns[nact].op = NG_PM_OP_FWD;
+			prog->insns[nact++].arg = r->asdata.slot;
+			break;
+		case NGM_PM_ACTION_MATCH_DUPTO:
+		case NGM_PM_ACTION_NOMATCH_DUPTO:
+			ci[i].act = nact;
+			prog->insns[nact].rule = i;
+			prog->insns[nact].op = NG_PM_OP_DUP;
+			prog->insns[nact++].arg = r->asdata.slot;
+			break;
+		case NGM_PM_ACTION_MATCH_DROP:
+		case NGM_PM_ACTION_NOMATCH_DROP:
+			ci[i].act = nact;
+			prog->insns[nact].rule = i;
+			prog->insns[nact++].op = NG_PM_OP_DROP;
+			break;
+		case NGM_PM_ACTION_MATCH_HASH:
+			if (r->asdata.hgroup < 0 ||
+			    r->asdata.hgroup >= NG_PM_MAXHGROUPS) {
+				error = EINVAL;
+				goto done;
+			}
+			ci[i].act = nact;
+			prog->insns[nact].rule = i;
+			prog->insns[nact].op = NG_PM_OP_HASH;
+			prog->insns[nact++].arg = r->asdata.hgroup;
+			break;
+		case NGM_PM_ACTION_MATCH_SAMPLE:
+		case NGM_PM_ACTION_MATCH_POLICE:
+			if (r->rate == 0 ||
+			    (r->action == NGM_PM_ACTION_MATCH_SAMPLE &&
+			    r->rate > NG_PM_MAXPERIOD) ||
+			    (r->action == NGM_PM_ACTION_MATCH_POLICE &&
+			    (r->rate > NG_PM_TB_MAXRATE || r->burst == 0))) {
+				error = EINVAL;
+				goto done;
+			}
+			mp = &prog->meters[prog->nmeters];
+			mp->slot = r->asdata.slot;
+			mp->flags = r->rflags;
+			if (r->action == NGM_PM_ACTION_MATCH_SAMPLE)
+				mp->period = r->rate;
+			else {
+				/* Bits per second to bytes per usec */
+				mp->rate = (r->rate << (NG_PM_TB_SHIFT - 3)) /
+				    1000000;
+				mp->depth =
+				    (uint64_t)r->burst << NG_PM_TB_SHIFT;
+				mp->dtmax = mp->depth / mp->rate + 1;
+			}
+			ci[i].act = nact;
+			prog->insns[nact].rule = i;
+			prog->insns[nact].op =
+			    r->action == NGM_PM_ACTION_MATCH_SAMPLE ?
+			    NG_PM_OP_SAMPLE : NG_PM_OP_POLICE;
+			prog->insns[nact++].arg = prog->nmeters++;
+			break;
+		case NGM_PM_ACTION_MATCH_SET_FIELD:
+			if (r->s_len == 0 || r->s_len > NG_PM_MAXPATLEN ||
+			    r->s_anchor >= NG_PM_ANCHORS) {
+				error = EINVAL;
+				goto done;
+			}
+			sf = &prog->setfs[prog->nsetfs];
+			sf->off = r->s_off;
+			sf->len = r->s_len;
+			sf->anchor = r->s_anchor;
+			for (j = 0; j < r->s_len; j++) {
+				sf->mask[j] = r->s_mask[j];
+				sf->value[j] = r->s_value[j] & r->s_mask[j];
+			}
+			ci[i].act = nact;
+			prog->insns[nact].rule = i;
+			prog->insns[nact].op = NG_PM_OP_SET;
+			prog->insns[nact++].arg = prog->nsetfs++;
+			break;
+		case NGM_PM_ACTION_LOOKUP:
+			if (r->p_len == 0 || r->p_len > NG_PM_MAXPATLEN ||
+			    r->p_off_lo != r->p_off_hi ||
+			    r->cmp != NG_PM_CMP_MASK ||
+			    r->asdata.table < 0 ||
+			    r->asdata.table >= NG_PM_MAXTABLES) {
+				error = EINVAL;
+				goto done;
+			}
+			lp = &prog->lookups[prog->nlookups];
+			lp->off = r->p_off_lo;
+			lp->len = r->p_len;
+			lp->nwords = howmany(r->p_len, sizeof(uint64_t));
+			lp->table = r->asdata.table;
+			lp->anchor = r->anchor;
+			bcopy(r->mask, lp->wmask, r->p_len);
+			ci[i].act = prog->nlookups++;
+			break;
+		default:
+			error = EINVAL;
+			goto done;
+		}
+	}
+	prog->insns[nact].rule = hc->rules;	/* fell off the end */
+	prog->insns[nact++].op = NG_PM_OP_DROP;
+	prog->ninsns = nact;
+
+	/* Runs of rules testing one field for different values */
+	for (i = 0; i < hc->rules; i = j) {
+		j = i + 1;
+		if (!ng_pm_group_eligible(prog, hc, ci, i, NULL))
+			continue;
+		pp = &prog->preds[ci[i].pred];
+		while (j < hc->rules &&
+		    ng_pm_group_eligible(prog, hc, ci, j, pp))
+			j++;
+		if (j - i >= NG_PM_GROUP_MIN &&
+		    (error = ng_pm_group_build(prog, ci, i, j - 1)) != 0)
+			goto done;
+	}
+
+	if ((error = ng_pm_ac_build(prog)) != 0)
+		goto done;
+	if ((error = ng_pm_rtab_build(prog, hc, ci)) != 0)
+		goto done;
+
+	/* Resolve branches */
+	for (i = 0; i < hc->rules; i++) {
+		r = &hc->rule[i];
+		insn = &prog->insns[i];
+		insn->rule = i;
+		p = ci[i].pred;
+		if (r->action == NGM_PM_ACTION_LOOKUP) {
+			/* Nothing is known past a lookup, hit or miss */
+			insn->op = NG_PM_OP_LOOKUP;
+			insn->arg = ci[i].act;
+			insn->jf = ng_pm_resolve(prog, hc, ci, i + 1, -1, 0);
+			continue;
+		}
+		if (ci[i].group >= 0) {
+			insn->op = NG_PM_OP_GROUP;
+			insn->arg = ci[i].group;
+		} else if (ci[i].rrun >= 0) {
+			insn->op = NG_PM_OP_RANGE;
+			insn->arg = ci[i].rrun;
+		} else if (prog->preds[p].acid != 0) {
+			insn->op = NG_PM_OP_CONTENT;
+			insn->arg = prog->preds[p].acid - 1;
+		} else {
+			insn->op = NG_PM_OP_TEST;
+			insn->arg = p;
+		}
+		on = ng_pm_action_on(r->action);
+		off = !on;
+		switch (r->action) {
+		case NGM_PM_ACTION_MATCH_SKIPTO:
+		case NGM_PM_ACTION_NOMATCH_SKIPTO:
+			prog->insns[ci[i].act].jt =
+			    ng_pm_resolve(prog, hc, ci, ci[i].skipto, p, on);
+			j = ci[i].act;
+			break;
+		case NGM_PM_ACTION_MATCH_SET_FIELD:
+			/* Nothing is known of the packet once rewritten */
+			prog->insns[ci[i].act].jt =
+			    ng_pm_resolve(prog, hc, ci, i + 1, -1, 0);
+			j = ci[i].act;
+			break;
+		case NGM_PM_ACTION_MATCH_HOOK:
+		case NGM_PM_ACTION_NOMATCH_HOOK:
+		case NGM_PM_ACTION_MATCH_DUPTO:
+		case NGM_PM_ACTION_NOMATCH_DUPTO:
+		case NGM_PM_ACTION_MATCH_HASH:
+		case NGM_PM_ACTION_MATCH_SAMPLE:
+		case NGM_PM_ACTION_MATCH_POLICE:
+			prog->insns[ci[i].act].jt =
+			    ng_pm_resolve(prog, hc, ci, i + 1, p, on);
+			/* FALLTHROUGH */
+		default:
+			j = ci[i].act;
+			break;
+		}
+		if (on) {
+			insn->jt = j;
+			insn->jf = ng_pm_resolve(prog, hc, ci, i + 1, p, off);
+		} else {
+			insn->jf = j;
+			insn->jt = ng_pm_resolve(prog, hc, ci, i + 1, p, off);
+		}
+	}
+
+	/* Where a run of content tests leads when no pattern was found */
+	if (prog->ac != NULL) {
+		MALLOC(prog->ac->none, uint32_t *,
+		    hc->rules * sizeof(*prog->ac->none), M_NETGRAPH_PM,
+		    M_NOWAIT);
+		if (prog->ac->none == NULL) {
+			error = ENOMEM;
+			goto done;
+		}
+		for (i = hc->rules - 1; i >= 0; i--) {
+			j = prog->insns[i].jf;
+			if (j < hc->rules &&
+			    prog->insns[j].op == NG_PM_OP_CONTENT)
+				j = prog->ac->none[j];
+			prog->ac->none[i] = j;
+		}
+	}
+
+done:
+	if (phash != NULL)
+		FREE(phash, M_NETGRAPH_PM);
+	if (ci != NULL)
+		FREE(ci, M_NETGRAPH_PM);
+	if (error)
+		ng_pm_prog_free(prog);
+	else
+		*progp = prog;
+	return (error);
+}
+
+static void
+ng_pm_prog_free(struct ng_pm_prog *prog)
+{
+	int i;
+
+	if (prog == NULL)
+		return;
+	for (i = 0; i < prog->ngroups; i++) {
+		if (prog->groups[i].keys != NULL)
+			FREE(prog->groups[i].keys, M_NETGRAPH_PM);
+		if (prog->groups[i].rule != NULL)
+			FREE(prog->groups[i].rule, M_NETGRAPH_PM);
+	}
+	if (prog->groups != NULL)
+		FREE(prog->groups, M_NETGRAPH_PM);
+	if (prog->insns != NULL)
+		FREE(prog->insns, M_NETGRAPH_PM);
+	if (prog->preds != NULL)
+		FREE(prog->preds, M_NETGRAPH_PM);
+	if (prog->lookups != NULL)
+		FREE(prog->lookups, M_NETGRAPH_PM);
+	if (prog->meters != NULL)
+		FREE(prog->meters, M_NETGRAPH_PM);
+	if (prog->setfs != NULL)
+		FREE(prog->setfs, M_NETGRAPH_PM);
+	if (prog->ac != NULL)
+		ng_pm_ac_free(prog->ac);
+	for (i = 0; i < prog->nrtabs; i++) {
+		if (prog->rtabs[i].bound != NULL)
+			FREE(prog->rtabs[i].bound, M_NETGRAPH_PM);
+		if (prog->rtabs[i].bits != NULL)
+			FREE(prog->rtabs[i].bits, M_NETGRAPH_PM);
+		if (prog->rtabs[i].rule != NULL)
+			FREE(prog->rtabs[i].rule, M_NETGRAPH_PM);
+	}
+	if (prog->rtabs != NULL)
+		FREE(prog->rtabs, M_NETGRAPH_PM);
+	if (prog->rruns != NULL)
+		FREE(prog->rruns, M_NETGRAPH_PM);
+	if (prog->cfg != NULL)
+		FREE(prog->cfg, M_NETGRAPH_PM);
+	if (prog->fc != NULL) {
+		FREE(prog->fc->ent, M_NETGRAPH_PM);
+		FREE(prog->fc, M_NETGRAPH_PM);
+	}
+	FREE(prog, M_NETGRAPH_PM);
+}
+
+/* Drop a hook's reference to a shared program */
+static void
+ng_pm_prog_release(ng_pm_priv_p priv, struct ng_pm_prog *prog)
+{
+
+	if (prog == NULL || --prog->refs > 0)
+		return;
+	ng_pm_hslot_ref(priv, prog->cfg, -1);
+	LIST_REMOVE(prog, next);
+	ng_pm_prog_free(prog);
+}
+
+/*
+ * Exact match tables.
+ */
+static __inline uint32_t
+ng_pm_table_hash(const uint64_t *key, int nwords)
+{
+	uint64_t h = 0x9e3779b97f4a7c15ULL;
+	int i;
+
+	for (i = 0; i < nwords; i++) {
+		h ^= key[i];
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+	}
+	return ((uint32_t)h);
+}
+
+static struct ng_pm_table *
+ng_pm_table_create(int keylen, int lpm)
+{
+	struct ng_pm_table *t;
+
+	MALLOC(t, struct ng_pm_table *, sizeof(*t), M_NETGRAPH_PM,
+	    M_NOWAIT | M_ZERO);
+	if (t == NULL)
+		return (NULL);
+	t->keylen = keylen;
+	t->lpm = lpm;
+	t->nwords = lpm ? NG_PM_MAXWORDS : howmany(keylen, sizeof(uint64_t));
+	return (t);
+}
+
+static void
+ng_pm_table_free(struct ng_pm_table *t)
+{
+
+	if (t == NULL)
+		return;
+	if (t->slot != NULL)
+		FREE(t->slot, M_NETGRAPH_PM);
+	if (t->ent != NULL)
+		FREE(t->ent, M_NETGRAPH_PM);
+	if (t->trie != NULL)
+		FREE(t->trie, M_NETGRAPH_PM);
+	FREE(t, M_NETGRAPH_PM);
+}
+
+/* Slot holding 'key', or the empty slot where it would go */
+static uint32_t
+ng_pm_table_slot(const struct ng_pm_table *t, const uint64_t *key,
+    uint32_t hash)
+{
+	const struct ng_pm_tslot *s;
+	uint32_t i;
+
+	for (i = hash & t->mask;; i = (i + 1) & t->mask) {
+		s = &t->slot[i];
+		if (s->idx == 0 || (s->hash == hash && ng_pm_key_cmp(key,
+		    t->ent[s->idx - 1].key, t->nwords) == 0))
+			return (i);
+	}
+}
+
+static struct ng_pm_tentry *
+ng_pm_table_find(const struct ng_pm_table *t, const uint64_t *key)
+{
+	uint32_t i;
+
+	if (t->nent == 0)
+		return (NULL);
+	i = ng_pm_table_slot(t, key, ng_pm_table_hash(key, t->nwords));
+	return (t->slot[i].idx ? &t->ent[t->slot[i].idx - 1] : NULL);
+}
+
+/* Make room for 'n' entries in total, so that inserts cannot fail */
+static int
+ng_pm_table_reserve(struct ng_pm_table *t, uint32_t n)
+{
+	struct ng_pm_tentry *ent;
+	struct ng_pm_tslot *slot;
+	uint32_t i, j, old, nslots, cap;
+
+	if (n > (1U << 30))
+		return (ENOSPC);
+	if (n > t->entcap) {
+		for (cap = t->entcap ? t->entcap : 64; cap < n; cap *= 2)
+			continue;
+		MALLOC(ent, struct ng_pm_tentry *, cap * sizeof(*ent),
+		    M_NETGRAPH_PM, M_NOWAIT);
+		if (ent == NULL)
+			return (ENOMEM);
+		if (t->ent != NULL) {
+			bcopy(t->ent, ent, t->nent * sizeof(*ent));
+			FREE(t->ent, M_NETGRAPH_PM);
+		}
+		t->ent = ent;
+		t->entcap = cap;
+	}
+	old = t->slot != NULL ? t->mask + 1 : 0;
+	if (2 * n <= old)
+		return (0);
+	for (nslots = old ? old : 128; nslots < 2 * n; nslots *= 2)
+		continue;
+	MALLOC(slot, struct ng_pm_tslot *, nslots * sizeof(*slot),
+	    M_NETGRAPH_PM, M_NOWAIT | M_ZERO);
+	if (slot == NULL)
+		return (ENOMEM);
+	for (i = 0; i < old; i++) {
+		if (t->slot[i].idx == 0)
+			continue;
+		for (j = t->slot[i].hash & (nslots - 1); slot[j].idx != 0;
+		    j = (j + 1) & (nslots - 1))
+			continue;
+		slot[j] = t->slot[i];
+	}
+	if (t->slot != NULL)
+		FREE(t->slot, M_NETGRAPH_PM);
+	t->slot = slot;
+	t->mask = nslots - 1;
+	return (0);
+}
+
+/* Add an entry or replace the action of an existing one, after reserve */
+static void
+ng_pm_table_insert(struct ng_pm_table *t, const uint64_t *key, int action,
+    const char *hname, hook_p hp)
+{
+	struct ng_pm_tentry *te;
+	uint32_t h, i;
+
+	h = ng_pm_table_hash(key, t->nwords);
+	i = ng_pm_table_slot(t, key, h);
+	if (t->slot[i].idx == 0) {
+		t->slot[i].hash = h;
+		t->slot[i].idx = ++t->nent;
+	}
+	te = &t->ent[t->slot[i].idx - 1];
+	bcopy(key, te->key, sizeof(te->key));
+	te->action = action;
+	te->hp = hp;
+	strlcpy(te->hname, hname, sizeof(te->hname));
+}
+
+static int
+ng_pm_table_delete(struct ng_pm_table *t, const uint64_t *key)
+{
+	uint32_t i, j, k, e, h;
+
+	if (t->nent == 0)
+		return (ENOENT);
+	i = ng_pm_table_slot(t, key, ng_pm_table_hash(key, t->nwords));
+	if (t->slot[i].idx == 0)
+		return (ENOENT);
+	e = t->slot[i].idx - 1;
+
+	/*
+	 * Shift back the slots following in the same run which would be
+	 * reachable from their home position through the emptied one.
+	 */
+	for (j = i;;) {
+		j = (j + 1) & t->mask;
+		if (t->slot[j].idx == 0)
+			break;
+		k = t->slot[j].hash & t->mask;
+		if (((j - k) & t->mask) >= ((j - i) & t->mask)) {
+			t->slot[i] = t->slot[j];
+			i = j;
+		}
+	}
+	t->slot[i].idx = 0;
+
+	/* Keep entries dense by moving the last one into the hole */
+	if (e != --t->nent) {
+		t->ent[e] = t->ent[t->nent];
+		h = ng_pm_table_hash(t->ent[e].key, t->nwords);
+		for (i = h & t->mask; t->slot[i].idx != t->nent + 1;
+		    i = (i + 1) & t->mask)
+			continue;
+		t->slot[i].idx = e + 1;
+	}
+	return (0);
+}
+
+/* Point 'n' trie slots from 'slot' on to entry 'e' */
+static __inline void
+ng_pm_trie_fill(uint32_t *trie, uint32_t slot, uint32_t n, uint32_t e)
+{
+
+	while (n-- > 0)
+		trie[slot++] = e + 1;
+}
+
+/*
+ * Rebuild the trie of an LPM table from scratch.  Prefixes are inserted
+ * shortest first, so that each overwrites the shorter ones it refines,
+ * and a new chunk inherits the prefix covering the slot it hangs off.
+ */
+static int
+ng_pm_trie_build(struct ng_pm_table *t)
+{
+	uint32_t cnt[NG_PM_LPM_MAXKEY * 8 + 2];
+	uint32_t *order, *trie, *ntrie;
+	uint32_t i, e, slot, base, nchunks, cap;
+	const u_char *k;
+	int plen, bit, d, r;
+
+	if (t->trie != NULL)
+		FREE(t->trie, M_NETGRAPH_PM);
+	t->trie = NULL;
+	if (t->nent == 0)
+		return (0);
+
+	/* Counting sort by prefix length */
+	MALLOC(order, uint32_t *, t->nent * sizeof(*order), M_NETGRAPH_PM,
+	    M_NOWAIT);
+	if (order == NULL)
+		return (ENOMEM);
+	bzero(cnt, sizeof(cnt));
+	for (e = 0; e < t->nent; e++)
+		cnt[t->ent[e].key[NG_PM_MAXWORDS - 1] + 1]++;
+	for (i = 1; i < nitems(cnt); i++)
+		cnt[i] += cnt[i - 1];
+	for (e = 0; e < t->nent; e++)
+		order[cnt[t->ent[e].key[NG_PM_MAXWORDS - 1]]++] = e;
+
+	cap = 16;
+	nchunks = 0;
+	MALLOC(trie, uint32_t *, (NG_PM_TRIE_ROOT + cap * 256) *
+	    sizeof(*trie), M_NETGRAPH_PM, M_NOWAIT | M_ZERO);
+	if (trie == NULL) {
+		FREE(order, M_NETGRAPH_PM);
+		return (ENOMEM);
+	}
+	for (i = 0; i < t->nent; i++) {
+		e = order[i];
+		k = (const u_char *)t->ent[e].key;
+		plen = t->ent[e].key[NG_PM_MAXWORDS - 1];
+		slot = k[0] << 8 | k[1];
+		if (plen <= 16) {
+			r = 16 - plen;
+			ng_pm_trie_fill(trie, slot & ~((1 << r) - 1), 1 << r,
+			    e);
+			continue;
+		}
+		for (bit = 16, d = 2;; bit += 8, d++) {
+			if ((trie[slot] & NG_PM_TRIE_CHILD) == 0) {
+				if (nchunks == cap) {
+					MALLOC(ntrie, uint32_t *,
+					    (NG_PM_TRIE_ROOT + 2 * cap * 256) *
+					    sizeof(*trie), M_NETGRAPH_PM,
+					    M_NOWAIT);
+					if (ntrie == NULL) {
+						FREE(order, M_NETGRAPH_PM);
+						FREE(trie, M_NETGRAPH_PM);
+						return (ENOMEM);
+					}
+					bcopy(trie, ntrie, (NG_PM_TRIE_ROOT +
+					    cap * 256) * sizeof(*trie));
+					FREE(trie, M_NETGRAPH_PM);
+					trie = ntrie;
+					cap *= 2;
+				}
+				base = NG_PM_TRIE_ROOT + nchunks * 256;
+				for (r = 0; r < 256; r++)
+					trie[base + r] = trie[slot];
+				trie[slot] = NG_PM_TRIE_CHILD | nchunks++;
+			}
+			base = NG_PM_TRIE_ROOT +
+			    (trie[slot] & ~NG_PM_TRIE_CHILD) * 256;
+			if (plen <= bit + 8)
+				break;
+			slot = base + k[d];
+		}
+		r = bit + 8 - plen;
+		ng_pm_trie_fill(trie, base + (k[d] & ~((1 << r) - 1)), 1 << r,
+		    e);
+	}
+	FREE(order, M_NETGRAPH_PM);
+	t->trie = trie;
+	return (0);
+}
+
+static __inline const struct ng_pm_tentry *
+ng_pm_trie_find(const struct ng_pm_table *t, const u_char *k)
+{
+	uint32_t v;
+	int d;
+
+	if (t->trie == NULL)
+		return (NULL);
+	v = t->trie[k[0] << 8 | k[1]];
+	for (d = 2; v & NG_PM_TRIE_CHILD; d++)
+		v = t->trie[NG_PM_TRIE_ROOT +
+		    (v & ~NG_PM_TRIE_CHILD) * 256 + k[d]];
+	return (v ? &t->ent[v - 1] : NULL);
+}
+
+/* Entries pointing to hooks by name follow hooks coming and going */
+static void
+ng_pm_table_rehook(ng_pm_priv_p priv, const char *name, hook_p old,
+    hook_p new)
+{
+	struct ng_pm_table *t;
+	uint32_t i, n;
+
+	for (n = 0; n < NG_PM_MAXTABLES; n++) {
+		if ((t = priv->table[n]) == NULL)
+			continue;
+		for (i = 0; i < t->nent; i++)
+			if (t->ent[i].hp == old && (name == NULL ||
+			    strcmp(t->ent[i].hname, name) == 0))
+				t->ent[i].hp = new;
+	}
+}
+
+/*
+ * Hook slots.
+ */
+/* Slot for a hook name, allocated and bound to the hook if new */
+static int
+ng_pm_hslot_get(node_p node, const char *name)
+{
+	ng_pm_priv_p priv = NG_NODE_PRIVATE(node);
+	struct ng_pm_hslot *hs;
+	int i, unused = -1;
+
+	for (i = 0; i < priv->nhslots; i++) {
+		hs = &priv->hslot[i];
+		if (strcmp(hs->name, name) == 0)
+			return (i);
+		if (unused < 0 && hs->refs == 0 && hs->hook == NULL)
+			unused = i;
+	}
+	if ((i = unused) < 0) {
+		MALLOC(hs, struct ng_pm_hslot *,
+		    (priv->nhslots + 1) * sizeof(*hs), M_NETGRAPH_PM,
+		    M_NOWAIT | M_ZERO);
+		if (hs == NULL)
+			return (-1);
+		if (priv->hslot != NULL) {
+			bcopy(priv->hslot, hs, priv->nhslots * sizeof(*hs));
+			FREE(priv->hslot, M_NETGRAPH_PM);
+		}
+		priv->hslot = hs;
+		i = priv->nhslots++;
+	}
+	hs = &priv->hslot[i];
+	strlcpy(hs->name, name, sizeof(hs->name));
+	hs->hook = ng_findhook(node, name);
+	hs->refs = 0;
+	return (i);
+}
+
+/* Account for the slots named by an installed rule set */
+static void
+ng_pm_hslot_ref(ng_pm_priv_p priv, const ng_pm_hookcfg_t *hc, int delta)
+{
+	int i;
+
+	for (i = 0; i < hc->rules; i++)
+		switch (hc->rule[i].action) {
+		case NGM_PM_ACTION_MATCH_HOOK:
+		case NGM_PM_ACTION_NOMATCH_HOOK:
+		case NGM_PM_ACTION_MATCH_DUPTO:
+		case NGM_PM_ACTION_NOMATCH_DUPTO:
+		case NGM_PM_ACTION_MATCH_SAMPLE:
+		case NGM_PM_ACTION_MATCH_POLICE:
+			if (hc->rule[i].asdata.slot >= 0)
+				priv->hslot[hc->rule[i].asdata.slot].refs +=
+				    delta;
+			break;
+		default:
+			break;
+		}
+}
+
+/* Free the slots of the first rules of a set left uninstalled */
+static void
+ng_pm_hslot_put(ng_pm_priv_p priv, const ng_pm_hookcfg_t *hc, int rules)
+{
+	struct ng_pm_hslot *hs;
+	int i;
+
+	for (i = 0; i < rules; i++)
+		switch (hc->rule[i].action) {
+		case NGM_PM_ACTION_MATCH_HOOK:
+		case NGM_PM_ACTION_NOMATCH_HOOK:
+		case NGM_PM_ACTION_MATCH_DUPTO:
+		case NGM_PM_ACTION_NOMATCH_DUPTO:
+		case NGM_PM_ACTION_MATCH_SAMPLE:
+		case NGM_PM_ACTION_MATCH_POLICE:
+			if (hc->rule[i].asdata.slot < 0)
+				break;
+			hs = &priv->hslot[hc->rule[i].asdata.slot];
+			if (hs->refs == 0) {
+				hs->hook = NULL;
+				hs->name[0] = '\0';
+			}
+			break;
+		default:
+			break;
+		}
+}
+
+/*
+ * Digest of an installed rule set, for getdigests: the CRC-32 of its rules
+ * as ghc lists them, with the names of the hooks in its slots.
+ */
+static uint32_t
+ng_pm_hookcfg_digest(ng_pm_priv_p priv, const ng_pm_hookcfg_t *hc)
+{
+	char rbuf[NG_PM_RULE_MAXLEN];
+	const char *hname;
+	uint32_t crc = ~0U;
+	int i, n;
+
+	for (i = 0; i < hc->rules; i++) {
+		switch (hc->rule[i].action) {
+		case NGM_PM_ACTION_MATCH_HOOK:
+		case NGM_PM_ACTION_NOMATCH_HOOK:
+		case NGM_PM_ACTION_MATCH_DUPTO:
+		case NGM_PM_ACTION_NOMATCH_DUPTO:
+		case NGM_PM_ACTION_MATCH_SAMPLE:
+		case NGM_PM_ACTION_MATCH_POLICE:
+			n = hc->rule[i].asdata.slot;
+			hname = n >= 0 ? priv->hslot[n].name : "";
+			break;
+		default:
+			hname = "";
+			break;
+		}
+		if ((n = ng_pm_rule_unparse(hc, i, hname, rbuf)) < 0)
+			continue;
+		if (i > 0)
+			crc = crc32_raw(" ", 1, crc);
+		crc = crc32_raw(rbuf, n, crc);
+	}
+	return (crc ^ ~0U);
+}
+
+/* Slots follow hooks coming and going, as table entries do */
+static void
+ng_pm_hslot_rehook(ng_pm_priv_p priv, const char *name, hook_p old,
+    hook_p new)
+{
+	int i;
+
+	for (i = 0; i < priv->nhslots; i++)
+		if (priv->hslot[i].hook == old && (name == NULL ||
+		    strcmp(priv->hslot[i].name, name) == 0))
+			priv->hslot[i].hook = new;
+}
+
+/*
+ * Hook groups.
+ */
+static __inline uint64_t
+ng_pm_mix64(uint64_t h)
+{
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return (h);
+}
+
+/* Map each bucket to its highest ranking connected member */
+static void
+ng_pm_hgroup_fill(ng_pm_priv_p priv, struct ng_pm_hgroup *g)
+{
+	uint64_t w, best;
+	int b, i, up[NG_PM_HG_MAXHOOKS];
+
+	g->nup = 0;
+	for (i = 0; i < g->nhooks; i++)
+		if (priv->hslot[g->slot[i]].hook != NULL)
+			up[g->nup++] = i;
+	if (g->nup == 0)
+		return;
+	for (b = 0; b < NG_PM_HG_BUCKETS; b++) {
+		best = 0;
+		g->bucket[b] = up[0];
+		for (i = 0; i < g->nup; i++) {
+			w = ng_pm_mix64((uint64_t)g->id[up[i]] << 32 | b);
+			if (w > best) {
+				best = w;
+				g->bucket[b] = up[i];
+			}
+		}
+	}
+}
+
+/* Members follow hooks coming and going */
+static void
+ng_pm_hgroup_rehook(ng_pm_priv_p priv)
+{
+	int n;
+
+	for (n = 0; n < NG_PM_MAXHGROUPS; n++)
+		if (priv->hgroup[n] != NULL)
+			ng_pm_hgroup_fill(priv, priv->hgroup[n]);
+}
+
+static void
+ng_pm_hgroup_free(ng_pm_priv_p priv, int n)
+{
+	struct ng_pm_hgroup *g = priv->hgroup[n];
+	int i;
+
+	if (g == NULL)
+		return;
+	for (i = 0; i < g->nhooks; i++)
+		priv->hslot[g->slot[i]].refs--;
+	FREE(g, M_NETGRAPH_PM);
+	priv->hgroup[n] = NULL;
+}
+
+/*
+ * Predicate evaluation.  Offsets in the window are tried in turn for as
+ * long as the whole pattern, including any bytes trimmed off, fits within
+ * the first 'maxlen' bytes of the packet.  Words are loaded only where
+ * they lie within the 'contig' bytes of the first mbuf.  Bytes past it
+ * are read where they are, in whichever mbuf of the chain holds them,
+ * and gathered into a buffer on the stack only where they straddle two.
+ */
+struct ng_pm_pkt {
+	const u_char	*data;		/* first mbuf */
+	int		contig;		/* its length */
+	int		maxlen;		/* bytes the rules may look at */
+	int		hdr[NG_PM_ANCHORS];	/* header offsets, or -1 */
+	int		ipver;		/* of a valid IP header, or 0 */
+	int		proto;		/* transport, -1 if unknown/fragment */
+	struct mbuf	*head;
+	struct mbuf	*m;		/* mbuf last read from */
+	int		moff;		/* packet offset of its data */
+	int		ac_done;	/* content automaton has been run */
+	int		ac_any;		/* and found any pattern */
+	uint64_t	ac_hit[NG_PM_AC_MAXPATS / 64];	/* by acid - 1 */
+	uint32_t	rt_done;	/* rows found, by range table */
+	const uint64_t	*rt_row[NG_PM_RT_CACHED];	/* NULL if no value */
+};
+
+static __inline uint64_t
+ng_pm_load64(const u_char *p)
+{
+	uint64_t w;
+
+	memcpy(&w, p, sizeof(w));
+	return (w);
+}
+
+/* Move the cursor to the mbuf holding packet byte 'off' */
+static void
+ng_pm_pkt_seek(struct ng_pm_pkt *pk, int off)
+{
+
+	if (off < pk->moff) {
+		pk->m = pk->head;
+		pk->moff = 0;
+	}
+	while (off >= pk->moff + pk->m->m_len) {
+		pk->moff += pk->m->m_len;
+		pk->m = pk->m->m_next;
+	}
+}
+
+/* Packet bytes from 'off' on, as many as one mbuf holds, in *len */
+static const u_char *
+ng_pm_pkt_run(struct ng_pm_pkt *pk, int off, int *len)
+{
+
+	if (off < pk->contig) {
+		*len = pk->contig - off;
+		return (pk->data + off);
+	}
+	ng_pm_pkt_seek(pk, off);
+	*len = pk->moff + pk->m->m_len - off;
+	return (mtod(pk->m, const u_char *) + off - pk->moff);
+}
+
+/* 'len' packet bytes at 'off' past the first mbuf, within maxlen */
+static const u_char *
+ng_pm_pkt_chain(struct ng_pm_pkt *pk, int off, int len, u_char *buf)
+{
+
+	ng_pm_pkt_seek(pk, off);
+	if (off + len <= pk->moff + pk->m->m_len)
+		return (mtod(pk->m, const u_char *) + off - pk->moff);
+	m_copydata(pk->m, off - pk->moff, len, (caddr_t)buf);
+	return (buf);
+}
+
+/* 'len' packet bytes at 'off', which must lie within maxlen */
+static __inline const u_char *
+ng_pm_pkt_bytes(struct ng_pm_pkt *pk, int off, int len, u_char *buf)
+{
+
+	if (off + len <= pk->contig)
+		return (pk->data + off);
+	return (ng_pm_pkt_chain(pk, off, len, buf));
+}
+
+/*
+ * Network and transport header offsets of a packet, in hdr[] by anchor,
+ * or -1 if missing, along with the IP version and transport protocol.
+ * Only the first maxlen bytes are looked at, and transport headers
+ * starting past NG_PM_L4_MAX are treated as missing, so that no header
+ * byte past NG_PM_HDR_MAX is ever needed.
+ */
+#define	NG_PM_HDR_UNKNOWN	(-2)	/* not parsed yet */
+#define	NG_PM_IP6_MAXEXT	8	/* extension headers walked */
+
+static void
+ng_pm_parse_hdrs(struct ng_pm_pkt *pk)
+{
+	u_char buf[NG_PM_HDR_MAX];
+	const u_char *data = pk->data;
+	int *hdr = pk->hdr;
+	int off, type, nh, n, maxlen, frag;
+
+	hdr[NG_PM_ANCHOR_L3] = hdr[NG_PM_ANCHOR_L4] = -1;
+	pk->ipver = 0;
+	pk->proto = -1;
+	maxlen = imin(pk->maxlen, NG_PM_HDR_MAX);
+	if (maxlen > pk->contig) {
+		m_copydata(pk->head, 0, maxlen, (caddr_t)buf);
+		data = buf;
+	}
+	for (off = ETHER_ADDR_LEN * 2, n = 0;; off += 4, n++) {
+		if (off + ETHER_TYPE_LEN > maxlen)
+			return;
+		type = data[off] << 8 | data[off + 1];
+		if (type != ETHERTYPE_VLAN && type != ETHERTYPE_QINQ)
+			break;
+		if (n == 2)
+			return;
+	}
+	off += ETHER_TYPE_LEN;
+	hdr[NG_PM_ANCHOR_L3] = off;
+
+	switch (type) {
+	case ETHERTYPE_IP:
+		if (off + 20 > maxlen || data[off] >> 4 != 4 ||
+		    (data[off] & 0x0f) < 5)
+			return;
+		pk->ipver = 4;
+		/* Only the first fragment carries the transport header */
+		frag = (data[off + 6] << 8 | data[off + 7]) & 0x3fff;
+		if (frag & 0x1fff)
+			return;
+		nh = frag ? -1 : data[off + 9];
+		off += (data[off] & 0x0f) * 4;
+		break;
+	case ETHERTYPE_IPV6:
+		if (off + 40 > maxlen || data[off] >> 4 != 6)
+			return;
+		pk->ipver = 6;
+		frag = 0;
+		nh = data[off + 6];
+		off += 40;
+		for (n = 0;; n++) {
+			if (nh != IPPROTO_HOPOPTS && nh != IPPROTO_ROUTING &&
+			    nh != IPPROTO_DSTOPTS && nh != IPPROTO_FRAGMENT &&
+			    nh != IPPROTO_AH)
+				break;
+			/* All of those are at least 8 bytes long */
+			if (n == NG_PM_IP6_MAXEXT || off > NG_PM_L4_MAX ||
+			    off + 8 > maxlen)
+				return;
+			if (nh == IPPROTO_FRAGMENT) {
+				if ((data[off + 2] << 8 | data[off + 3]) &
+				    0xfff8)
+					return;
+				frag = 1;
+				nh = data[off];
+				off += 8;
+			} else if (nh == IPPROTO_AH) {
+				nh = data[off];
+				off += (data[off + 1] + 2) * 4;
+			} else {
+				nh = data[off];
+				off += (data[off + 1] + 1) * 8;
+			}
+		}
+		if (frag)
+			nh = -1;
+		break;
+	default:
+		return;
+	}
+	if (off <= NG_PM_L4_MAX) {
+		hdr[NG_PM_ANCHOR_L4] = off;
+		pk->proto = nh;
+	}
+}
+
+/* Offset of the header 'anchor' in the packet, or -1 if missing */
+static __inline int
+ng_pm_anchor(struct ng_pm_pkt *pk, int anchor)
+{
+
+	if (anchor == NG_PM_ANCHOR_FRAME)
+		return (0);
+	if (pk->hdr[anchor] == NG_PM_HDR_UNKNOWN)
+		ng_pm_parse_hdrs(pk);
+	return (pk->hdr[anchor]);
+}
+
+static __inline int
+ng_pm_match_at(const struct ng_pm_pred *pp, struct ng_pm_pkt *pk, int off)
+{
+	u_char buf[NG_PM_MAXPATLEN];
+	const u_char *c;
+	uint64_t x;
+	int i;
+
+	off += pp->skip;
+	if (off + pp->nwords * (int)sizeof(uint64_t) <= pk->contig) {
+		c = pk->data + off;
+		x = 0;
+		for (i = 0; i < pp->nwords; i++)
+			x |= (ng_pm_load64(c + i * sizeof(uint64_t)) &
+			    pp->wmask[i]) ^ pp->wpat[i];
+		return (x == 0);
+	}
+	c = ng_pm_pkt_bytes(pk, off, pp->len, buf);
+	for (i = 0; i < pp->len; i++)
+		if ((c[i] & pp->mask[pp->skip + i]) !=
+		    pp->pattern[pp->skip + i])
+			return (0);
+	return (1);
+}
+
+#define	NG_PM_ONES	0x0101010101010101ULL
+#define	NG_PM_LOW7	0x7f7f7f7f7f7f7f7fULL
+
+/* Offsets are relative to 'base', the header the predicate is anchored at */
+static int
+ng_pm_pred_match(const struct ng_pm_pred *pp, struct ng_pm_pkt *pk, int base)
+{
+	const u_char *data = pk->data + pp->skip;
+	uint64_t m0, p0, x, t;
+	int off, hi, k, contig;
+
+	hi = pk->maxlen - base - pp->p_len;
+	if (hi > pp->off_hi)
+		hi = pp->off_hi;
+	off = pp->off_lo;
+	if (hi < off)
+		return (0);
+	if (pp->len == 0)
+		return (1);
+
+	/*
+	 * Sliding windows: look for the first significant byte at eight
+	 * offsets at once, and check the rest only where it was found.
+	 */
+	m0 = pp->mask[pp->skip] * NG_PM_ONES;
+	p0 = pp->pattern[pp->skip] * NG_PM_ONES;
+	contig = pk->contig - base - pp->skip - (int)sizeof(uint64_t);
+	for (; off + 7 <= hi && off <= contig; off += 8) {
+		x = (ng_pm_load64(data + base + off) & m0) ^ p0;
+		/* 0x80 in each byte of x which is zero, 0 elsewhere */
+		t = ~(((x & NG_PM_LOW7) + NG_PM_LOW7) | x | NG_PM_LOW7);
+		for (; t != 0; t &= t - 1) {
+			k = __builtin_ctzll(t) >> 3;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+			k = 7 - k;
+#endif
+			if (ng_pm_match_at(pp, pk, base + off + k))
+				return (1);
+		}
+	}
+	for (; off <= hi; off++)
+		if (ng_pm_match_at(pp, pk, base + off))
+			return (1);
+	return (0);
+}
+
+/*
+ * Same as above for VLAN tagged mbufs, where the tag has been stripped
+ * into the packet header: pattern bytes 12 to 15 are compared with the
+ * 802.1Q TPID and the VLAN ID, and those following with the packet data
+ * starting at offset 12.
+ */
+static int
+ng_pm_pred_match_vlan(const struct ng_pm_pred *pp, struct ng_pm_pkt *pk,
+    uint16_t vtag)
+{
+	u_char buf[NG_PM_MAXPATLEN];
+	const u_char *c;
+	int off, hi, i, tag, tmask;
+
+	hi = pk->maxlen - pp->p_len;
+	if (hi > pp->off_hi)
+		hi = pp->off_hi;
+	for (off = pp->off_lo; off <= hi; off++) {
+		c = ng_pm_pkt_bytes(pk, off, pp->p_len, buf);
+		for (i = 0; i < pp->p_len; i++, c++) {
+			if (off + i == 12) {
+				if ((pp->pattern[i] ^ 0x81) & pp->mask[i] ||
+				    pp->pattern[i + 1] != 0)
+					break;
+				tag = pp->pattern[i + 2] << 8 |
+				    pp->pattern[i + 3];
+				tmask = pp->mask[i + 2] << 8 | pp->mask[i + 3];
+				if ((tag ^ vtag) & tmask & 0x0fff)
+					break;
+				i += 3;
+				c--;
+				continue;
+			}
+			if ((*c & pp->mask[i]) != pp->pattern[i])
+				break;
+		}
+		if (i >= pp->p_len)
+			return (1);
+	}
+	return (0);
+}
+
+/*
+ * Run the content automaton over the packet, noting which of its
+ * predicates hold.
+ */
+static void
+ng_pm_ac_scan(const struct ng_pm_prog *prog, struct ng_pm_pkt *pk)
+{
+	const struct ng_pm_ac *ac = prog->ac;
+	const struct ng_pm_pred *pp;
+	const u_char *c;
+	int base[NG_PM_ANCHORS];
+	uint32_t s;
+	int a, b, i, k, n, off, lo, hi;
+
+	pk->ac_done = 1;
+	pk->ac_any = 0;
+	bzero(pk->ac_hit, howmany(ac->npats, 64) * sizeof(uint64_t));
+	lo = pk->maxlen;
+	hi = 0;
+	for (a = 0; a < NG_PM_ANCHORS; a++) {
+		base[a] = ac->hi[a] == 0 ? -1 : ng_pm_anchor(pk, a);
+		if (base[a] < 0)
+			continue;
+		lo = imin(lo, base[a] + ac->lo[a]);
+		hi = imax(hi, base[a] + ac->hi[a]);
+	}
+	hi = imin(hi, pk->maxlen);
+
+	for (s = 0, off = lo; off < hi; off += n) {
+		c = ng_pm_pkt_run(pk, off, &n);
+		n = imin(n, hi - off);
+		for (i = 0; i < n; i++) {
+			s = ac->delta[s + ac->class[c[i]]];
+			if (__predict_true(s < ac->outmin))
+				continue;
+			/* Patterns ending at off + i, but in their window? */
+			for (k = ac->out[s / ac->nclasses]; k != 0;
+			    k = ac->next[k - 1]) {
+				pp = &prog->preds[ac->pred[k - 1]];
+				if ((b = base[pp->anchor]) < 0)
+					continue;
+				a = off + i + 1 - pp->len - pp->skip - b;
+				if (a >= pp->off_lo && a <= pp->off_hi &&
+				    b + a + pp->p_len <= pk->maxlen) {
+					pk->ac_hit[(k - 1) / 64] |=
+					    1ULL << ((k - 1) % 64);
+					pk->ac_any = 1;
+				}
+			}
+		}
+	}
+}
+
+/* First member of a GROUP matching the packet, or NG_PM_NORULE */
+static uint32_t
+ng_pm_group_match(const struct ng_pm_prog *prog, const struct ng_pm_group *g,
+    struct ng_pm_pkt *pk, int base)
+{
+	const struct ng_pm_pred *pp = &prog->preds[g->pred];
+	uint64_t key[NG_PM_MAXWORDS];
+	u_char buf[NG_PM_MAXPATLEN];
+	const u_char *c;
+	int lo, hi, mid, i, cmp, off;
+
+	if (base + pp->off_lo + pp->p_len > pk->maxlen)
+		return (NG_PM_NORULE);
+	off = base + pp->off_lo + pp->skip;
+	if (off + pp->nwords * (int)sizeof(uint64_t) <= pk->contig)
+		c = pk->data + off;
+	else {
+		bzero(key, sizeof(key));
+		bcopy(ng_pm_pkt_bytes(pk, off, pp->len, buf), key, pp->len);
+		c = (const u_char *)key;
+	}
+	for (i = 0; i < pp->nwords; i++)
+		key[i] = ng_pm_load64(c + i * sizeof(uint64_t)) & pp->wmask[i];
+	lo = 0;
+	hi = g->nkeys - 1;
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		cmp = ng_pm_key_cmp(key, g->keys + mid * pp->nwords,
+		    pp->nwords);
+		if (cmp == 0)
+			return (g->rule[mid]);
+		if (cmp < 0)
+			hi = mid - 1;
+		else
+			lo = mid + 1;
+	}
+	return (NG_PM_NORULE);
+}
+
+/*
+ * Row of a range table for the packet's value of its field, or NULL if it
+ * has none.  Where the VLAN tag has been stripped into the packet header,
+ * field bytes 12 to 15 are the 802.1Q TPID and the tag, and those
+ * following are packet data starting at offset 12.
+ */
+static const uint64_t *
+ng_pm_rtab_row(const struct ng_pm_prog *prog, int t, struct ng_pm_pkt *pk,
+    const struct mbuf *m)
+{
+	const struct ng_pm_rtab *rt = &prog->rtabs[t];
+	const uint64_t *row = NULL;
+	u_char buf[4], tag[4], one;
+	const u_char *c;
+	uint32_t v;
+	int base, i, j;
+
+	if (t < NG_PM_RT_CACHED && pk->rt_done & 1U << t)
+		return (pk->rt_row[t]);
+	base = ng_pm_anchor(pk, rt->anchor);
+	if (base >= 0 && base + rt->off + rt->len <= pk->maxlen) {
+		if (__predict_false(rt->vlan && (m->m_flags & M_VLANTAG))) {
+			tag[0] = 0x81;
+			tag[1] = 0x00;
+			tag[2] = m->m_pkthdr.ether_vtag >> 8;
+			tag[3] = m->m_pkthdr.ether_vtag;
+			for (i = 0; i < rt->len; i++) {
+				j = rt->off + i;
+				buf[i] = j >= 12 && j < 16 ? tag[j - 12] :
+				    *ng_pm_pkt_bytes(pk, j < 12 ? j : j - 4, 1,
+				    &one);
+			}
+			c = buf;
+		} else
+			c = ng_pm_pkt_bytes(pk, base + rt->off, rt->len, buf);
+		for (v = 0, i = 0; i < rt->len; i++)
+			v = v << 8 | c[i];
+		row = rt->bits + ng_pm_rtab_find(rt, v) * rt->nwords;
+	}
+	if (t < NG_PM_RT_CACHED) {
+		pk->rt_done |= 1U << t;
+		pk->rt_row[t] = row;
+	}
+	return (row);
+}
+
+/* First member of a run from member 'k' on in range, or NG_PM_NORULE */
+static uint32_t
+ng_pm_rrun_match(const struct ng_pm_prog *prog, const struct ng_pm_rrun *rr,
+    int k, struct ng_pm_pkt *pk, const struct mbuf *m)
+{
+	const uint64_t *row;
+	uint64_t x;
+	int b, e, w;
+
+	if ((row = ng_pm_rtab_row(prog, rr->rtab, pk, m)) == NULL)
+		return (NG_PM_NORULE);
+	b = rr->bit + k;
+	e = rr->bit + rr->n - 1;
+	for (w = b / 64, x = row[w] & ~0ULL << (b % 64);; x = row[++w]) {
+		if (w == e / 64)
+			x &= ~0ULL >> (63 - e % 64);
+		if (x != 0)
+			return (rr->rule + w * 64 + __builtin_ctzll(x) -
+			    rr->bit);
+		if (w == e / 64)
+			return (NG_PM_NORULE);
+	}
+}
+
+/* Table entry for the key found under a lookup rule, or NULL */
+static const struct ng_pm_tentry *
+ng_pm_lookup(ng_pm_priv_p priv, const struct ng_pm_lookup *lp,
+    struct ng_pm_pkt *pk, int base)
+{
+	const struct ng_pm_table *t = priv->table[lp->table];
+	uint64_t key[NG_PM_MAXWORDS];
+	u_char buf[NG_PM_MAXPATLEN];
+	const u_char *c;
+	int i, off;
+
+	off = base + lp->off;
+	if (t == NULL || t->keylen != lp->len || off + lp->len > pk->maxlen)
+		return (NULL);
+	if (off + lp->nwords * (int)sizeof(uint64_t) <= pk->contig)
+		c = pk->data + off;
+	else {
+		bzero(key, sizeof(key));
+		bcopy(ng_pm_pkt_bytes(pk, off, lp->len, buf), key, lp->len);
+		c = (const u_char *)key;
+	}
+	for (i = 0; i < lp->nwords; i++)
+		key[i] = ng_pm_load64(c + i * sizeof(uint64_t)) & lp->wmask[i];
+	if (t->lpm)
+		return (ng_pm_trie_find(t, (const u_char *)key));
+	for (; i < NG_PM_MAXWORDS; i++)
+		key[i] = 0;
+	return (ng_pm_table_find(t, key));
+}
+
+/*
+ * Symmetric flow hash.  The two endpoints of a flow, each an address and
+ * a port, go into the key in a canonical order.
+ */
+static uint32_t
+ng_pm_flow_hash(struct ng_pm_pkt *pk, int fields)
+{
+	uint64_t key[howmany(2 * 16 + 5, sizeof(uint64_t))];
+	u_char abuf[2 * 16], pbuf[4];
+	u_char *k = (u_char *)key;
+	const u_char *a, *pt = NULL;
+	int alen, l3, l4, c, n;
+
+	if (fields != NG_PM_HASH_L2 &&
+	    (l3 = ng_pm_anchor(pk, NG_PM_ANCHOR_L3)) >= 0 && pk->ipver != 0) {
+		if (pk->ipver == 4) {
+			alen = 4;
+			a = ng_pm_pkt_bytes(pk, l3 + 12, 2 * alen, abuf);
+		} else {
+			alen = 16;
+			a = ng_pm_pkt_bytes(pk, l3 + 8, 2 * alen, abuf);
+		}
+		l4 = pk->hdr[NG_PM_ANCHOR_L4];
+		if (fields == NG_PM_HASH_L4 && l4 >= 0 &&
+		    l4 + 4 <= pk->maxlen && (pk->proto == IPPROTO_TCP ||
+		    pk->proto == IPPROTO_UDP || pk->proto == IPPROTO_SCTP))
+			pt = ng_pm_pkt_bytes(pk, l4, 4, pbuf);
+	} else {
+		if (pk->maxlen < ETHER_ADDR_LEN * 2)
+			return (0);
+		alen = ETHER_ADDR_LEN;
+		a = ng_pm_pkt_bytes(pk, 0, 2 * alen, abuf);
+	}
+
+	bzero(key, sizeof(key));
+	c = memcmp(a, a + alen, alen);
+	if (c == 0 && pt != NULL)
+		c = memcmp(pt, pt + 2, 2);
+	n = c > 0 ? alen : 0;
+	bcopy(a + n, k, alen);
+	bcopy(a + alen - n, k + alen, alen);
+	n = 2 * alen;
+	if (pt != NULL) {
+		bcopy(pt + (c > 0 ? 2 : 0), k + n, 2);
+		bcopy(pt + (c > 0 ? 0 : 2), k + n + 2, 2);
+		k[n + 4] = pk->proto;
+		n += 5;
+	}
+	return (ng_pm_table_hash(key, howmany(n, sizeof(uint64_t))));
+}
+
+/* Member of hook group 'n' a packet goes to, NULL if none connected */
+static __inline hook_p
+ng_pm_hgroup_pick(ng_pm_priv_p priv, int n, struct ng_pm_pkt *pk)
+{
+	const struct ng_pm_hgroup *g = priv->hgroup[n];
+	uint32_t h;
+
+	if (g == NULL || g->nup == 0)
+		return (NULL);
+	h = ng_pm_flow_hash(pk, g->fields);
+	return (priv->hslot[g->slot[g->bucket[h % NG_PM_HG_BUCKETS]]].hook);
+}
+
+/*
+ * Flow verdict cache.
+ */
+/* (Re)allocate a program's cache according to the node's settings */
+static int
+ng_pm_fc_alloc(ng_pm_priv_p priv, struct ng_pm_prog *prog)
+{
+	struct ng_pm_fcache *fc;
+	uint32_t n;
+	int span;
+
+	if ((fc = prog->fc) != NULL) {
+		FREE(fc->ent, M_NETGRAPH_PM);
+		FREE(fc, M_NETGRAPH_PM);
+		prog->fc = NULL;
+	}
+	span = prog->maxcontig;
+	if (priv->fc_span != 0 && priv->fc_span < span)
+		span = priv->fc_span;
+	if (priv->fc_entries == 0 || span > NG_PM_FC_MAXSPAN ||
+	    prog->nmeters > 0 || prog->nsetfs > 0)
+		return (0);
+	for (n = 2; n < priv->fc_entries; n <<= 1)
+		continue;
+
+	MALLOC(fc, struct ng_pm_fcache *, sizeof(*fc), M_NETGRAPH_PM,
+	    M_NOWAIT | M_ZERO);
+	if (fc == NULL)
+		return (ENOMEM);
+	fc->span = span;
+	fc->nwords = 1 + howmany(span, sizeof(uint64_t));
+	fc->mask = n / 2 - 1;
+	fc->stride = sizeof(struct ng_pm_fcent) +
+	    fc->nwords * sizeof(uint64_t);
+	fc->size = n * fc->stride;
+	MALLOC(fc->ent, u_char *, (mp_maxid + 1) * fc->size, M_NETGRAPH_PM,
+	    M_NOWAIT | M_ZERO);
+	if (fc->ent == NULL) {
+		FREE(fc, M_NETGRAPH_PM);
+		return (ENOMEM);
+	}
+	prog->fc = fc;
+	return (0);
+}
+
+/* Start a new configuration generation, making all cached verdicts stale */
+static void
+ng_pm_fc_invalidate(ng_pm_priv_p priv)
+{
+	struct ng_pm_prog *prog;
+
+	if (++priv->gen != 0)
+		return;
+	LIST_FOREACH(prog, &priv->progs, next)
+		if (prog->fc != NULL)
+			bzero(prog->fc->ent, (mp_maxid + 1) * prog->fc->size);
+	priv->gen = 1;
+}
+
+static __inline void
+ng_pm_fc_key(const struct ng_pm_fcache *fc, const struct ng_pm_pkt *pk,
+    const struct mbuf *m, struct ng_pm_fkey *fk)
+{
+	const u_char *data = pk->data;
+	int i, len;
+
+	fk->nwords = fc->nwords;
+	fk->w[0] = (uint64_t)pk->maxlen << 32;
+	if (m->m_flags & M_VLANTAG)
+		fk->w[0] |= 0x10000 | m->m_pkthdr.ether_vtag;
+	len = imin(fc->span, pk->maxlen);
+	if (len > pk->contig) {
+		bzero(&fk->w[1], (fk->nwords - 1) * sizeof(uint64_t));
+		m_copydata(m, 0, len, (caddr_t)&fk->w[1]);
+	} else {
+		for (i = 1; i < fk->nwords; i++, data += sizeof(uint64_t),
+		    len -= sizeof(uint64_t)) {
+			if (len >= (int)sizeof(uint64_t))
+				fk->w[i] = ng_pm_load64(data);
+			else {
+				fk->w[i] = 0;
+				if (len > 0)
+					bcopy(data, &fk->w[i], len);
+			}
+		}
+	}
+	fk->hash = ng_pm_table_hash(fk->w, fk->nwords);
+}
+
+/* This CPU's set for a flow key; call in a critical section */
+static __inline struct ng_pm_fcent *
+ng_pm_fc_set(const struct ng_pm_fcache *fc, const struct ng_pm_fkey *fk)
+{
+
+	return ((struct ng_pm_fcent *)(fc->ent + curcpu * fc->size +
+	    (fk->hash & fc->mask) * 2 * fc->stride));
+}
+
+static __inline int
+ng_pm_fc_hit(const struct ng_pm_fcent *fe, const struct ng_pm_fkey *fk,
+    uint32_t gen)
+{
+	uint64_t x = 0;
+	int i;
+
+	if (fe->gen != gen || fe->hash != fk->hash)
+		return (0);
+	for (i = 0; i < fk->nwords; i++)
+		x |= fe->key[i] ^ fk->w[i];
+	return (x == 0);
+}
+
+static __inline int
+ng_pm_fc_find(const struct ng_pm_fcache *fc, const struct ng_pm_fkey *fk,
+    uint32_t gen, struct ng_pm_verdict *v)
+{
+	const struct ng_pm_fcent *fe;
+	int hit;
+
+	critical_enter();
+	fe = ng_pm_fc_set(fc, fk);
+	if (!(hit = ng_pm_fc_hit(fe, fk, gen))) {
+		fe = (const struct ng_pm_fcent *)((const u_char *)fe +
+		    fc->stride);
+		hit = ng_pm_fc_hit(fe, fk, gen);
+	}
+	if (hit)
+		*v = fe->v;
+	critical_exit();
+	return (hit);
+}
+
+static __inline void
+ng_pm_fc_enter(const struct ng_pm_fcache *fc, const struct ng_pm_fkey *fk,
+    uint32_t gen, const struct ng_pm_verdict *v)
+{
+	struct ng_pm_fcent *fe;
+
+	critical_enter();
+	fe = ng_pm_fc_set(fc, fk);
+	if (fe->gen == gen)
+		bcopy(fe, (u_char *)fe + fc->stride, fc->stride);
+	fe->hash = fk->hash;
+	fe->gen = gen;
+	fe->v = *v;
+	bcopy(fk->w, fe->key, fk->nwords * sizeof(uint64_t));
+	critical_exit();
+}
+
+/*
+ * Rule counters.
+ */
+static struct ng_pm_rcount *
+ng_pm_stats_alloc(int rules, size_t *sstride)
+{
+	struct ng_pm_rcount *stats;
+
+	*sstride = roundup2((rules + 2) * sizeof(*stats), CACHE_LINE_SIZE);
+	MALLOC(stats, struct ng_pm_rcount *, (mp_maxid + 1) * *sstride,
+	    M_NETGRAPH_PM, M_NOWAIT | M_ZERO);
+	return (stats);
+}
+
+static void
+ng_pm_stats_free(ng_pm_hookinfo_p hip)
+{
+
+	if (hip->stats != NULL)
+		FREE(hip->stats, M_NETGRAPH_PM);
+	hip->stats = NULL;
+	hip->nstats = 0;
+}
+
+/* Sampling and policing state of a hook, as of now */
+static __inline uint64_t
+ng_pm_usec(void)
+{
+	struct timeval tv;
+
+	microuptime(&tv);
+	return ((uint64_t)tv.tv_sec * 1000000 + tv.tv_usec);
+}
+
+static struct ng_pm_mstate *
+ng_pm_mstate_alloc(const struct ng_pm_prog *prog)
+{
+	struct ng_pm_mstate *ms;
+	uint64_t now = ng_pm_usec();
+	int i;
+
+	if (prog == NULL || prog->nmeters == 0)
+		return (NULL);
+	MALLOC(ms, struct ng_pm_mstate *, prog->nmeters * sizeof(*ms),
+	    M_NETGRAPH_PM, M_NOWAIT | M_ZERO);
+	if (ms == NULL)
+		return (NULL);
+	for (i = 0; i < prog->nmeters; i++) {
+		mtx_init(&ms[i].mtx, "ng_patmat meter", NULL, MTX_DEF);
+		ms[i].tokens = prog->meters[i].depth;
+		ms[i].last = now;
+	}
+	return (ms);
+}
+
+static void
+ng_pm_mstate_free(ng_pm_hookinfo_p hip)
+{
+	int i;
+
+	if (hip->mstate == NULL)
+		return;
+	for (i = 0; i < hip->nmeters; i++)
+		mtx_destroy(&hip->mstate[i].mtx);
+	FREE(hip->mstate, M_NETGRAPH_PM);
+	hip->mstate = NULL;
+	hip->nmeters = 0;
+}
+
+/* Count a packet on a rule, on this CPU's counters */
+static __inline void
+ng_pm_count(ng_pm_hookinfo_p hip, int rule, int len)
+{
+	struct ng_pm_rcount *rc;
+
+	if (hip->stats == NULL)
+		return;
+	critical_enter();
+	rc = (struct ng_pm_rcount *)((u_char *)hip->stats +
+	    curcpu * hip->sstride) + rule;
+	rc->packets++;
+	rc->bytes += len;
+	rc->last = time_uptime;
+	critical_exit();
+}
+
+static int
+ng_pm_constructor(node_p node)
+{
+	ng_pm_priv_p priv;
+
+	MALLOC(priv, ng_pm_priv_p, sizeof(*priv), M_NETGRAPH_PM,
+	    M_NOWAIT | M_ZERO);
+	if (priv == NULL)
+		return (ENOMEM);
+	LIST_INIT(&priv->progs);
+	priv->gen = 1;
+	NG_NODE_SET_PRIVATE(node, priv);
+	return (0);
+}
+
+static int
+ng_pm_newhook(node_p node, hook_p hook, const char *name)
+{
+	ng_pm_hookinfo_p hip;
+
+	MALLOC(hip, ng_pm_hookinfo_p, sizeof(*hip), M_NETGRAPH_PM,
+            M_NOWAIT | M_ZERO);
+	if (hip == NULL)
+		return (ENOMEM);
+
+	NG_HOOK_SET_PRIVATE(hook, hip);
+	ng_pm_hslot_rehook(NG_NODE_PRIVATE(node), name, NULL, hook);
+	ng_pm_table_rehook(NG_NODE_PRIVATE(node), name, NULL, hook);
+	ng_pm_hgroup_rehook(NG_NODE_PRIVATE(node));
+	ng_pm_fc_invalidate(NG_NODE_PRIVATE(node));
+	return (0);
+}
+
+/* Table key of an entry, with the bits past an LPM prefix cleared */
+static void
+ng_pm_tabent_key(const struct ng_pm_tabent *te, int keylen, int lpm,
+    uint64_t *key)
+{
+	u_char *k = (u_char *)key;
+	int i;
+
+	bzero(key, NG_PM_MAXWORDS * sizeof(*key));
+	bcopy(te->key, key, keylen);
+	if (!lpm)
+		return;
+	for (i = te->plen; i < keylen * 8; i++)
+		k[i / 8] &= ~(0x80 >> (i % 8));
+	key[NG_PM_MAXWORDS - 1] = te->plen;
+}
+
+static int
+ng_pm_table_msg(node_p node, struct ng_mesg *msg, struct ng_mesg **resp)
+{
+	ng_pm_priv_p priv = NG_NODE_PRIVATE(node);
+	struct ng_pm_tabreq *tr = (struct ng_pm_tabreq *) msg->data;
+	struct ng_pm_tabent *te;
+	struct ng_pm_table *t;
+	uint64_t key[NG_PM_MAXWORDS];
+	uint32_t i;
+	int lpm, error = 0;
+
+	if (msg->header.arglen < sizeof(*tr) ||
+	    tr->table >= NG_PM_MAXTABLES ||
+	    tr->entries > (msg->header.arglen - sizeof(*tr)) / sizeof(*te))
+		return (EINVAL);
+	t = priv->table[tr->table];
+	lpm = (tr->flags & NG_PM_TABLE_LPM) != 0;
+
+	switch (msg->header.cmd) {
+	case NGM_PM_TABLE_ADD:
+		if (tr->keylen == 0 || tr->keylen > NG_PM_MAXPATLEN ||
+		    (lpm && tr->keylen > NG_PM_LPM_MAXKEY) ||
+		    (t != NULL && (t->keylen != tr->keylen || t->lpm != lpm)))
+			return (EINVAL);
+		for (i = 0; i < tr->entries; i++) {
+			te = &tr->ent[i];
+			if (lpm && te->plen > tr->keylen * 8)
+				return (EINVAL);
+			switch (te->action) {
+			case NGM_PM_ACTION_MATCH_HOOK:
+			case NGM_PM_ACTION_MATCH_DUPTO:
+				if (te->hname[0] == '\0')
+					return (EINVAL);
+				break;
+			case NGM_PM_ACTION_MATCH_DROP:
+				te->hname[0] = '\0';
+				break;
+			default:
+				return (EINVAL);
+			}
+			if (strnlen(te->hname, NG_HOOKSIZ) == NG_HOOKSIZ)
+				return (EINVAL);
+		}
+		if (t == NULL) {
+			if ((t = ng_pm_table_create(tr->keylen, lpm)) == NULL)
+				return (ENOMEM);
+			priv->table[tr->table] = t;
+		}
+		if ((error = ng_pm_table_reserve(t, t->nent + tr->entries)))
+			break;
+		for (i = 0; i < tr->entries; i++) {
+			te = &tr->ent[i];
+			ng_pm_tabent_key(te, t->keylen, lpm, key);
+			ng_pm_table_insert(t, key, te->action, te->hname,
+			    te->hname[0] ? ng_findhook(node, te->hname) : NULL);
+		}
+		if (lpm)
+			error = ng_pm_trie_build(t);
+		break;
+	case NGM_PM_TABLE_DEL:
+		if (t == NULL)
+			return (ENOENT);
+		if ((tr->keylen != t->keylen || t->lpm != lpm) &&
+		    tr->entries > 0)
+			return (EINVAL);
+		for (i = 0; i < tr->entries; i++) {
+			if (lpm && tr->ent[i].plen > t->keylen * 8)
+				return (EINVAL);
+			ng_pm_tabent_key(&tr->ent[i], t->keylen, lpm, key);
+			if (ng_pm_table_delete(t, key) != 0)
+				error = ENOENT;
+		}
+		if (lpm && (i = ng_pm_trie_build(t)) != 0)
+			error = i;
+		break;
+	case NGM_PM_TABLE_FLUSH:
+		ng_pm_table_free(t);
+		priv->table[tr->table] = NULL;
+		break;
+	case NGM_PM_TABLE_GET:
+		if (t == NULL)
+			return (ENOENT);
+		NG_MKRESPONSE(*resp, msg, sizeof(*tr) + t->nent * sizeof(*te),
+		    M_NOWAIT);
+		if (*resp == NULL)
+			return (ENOMEM);
+		tr = (struct ng_pm_tabreq *) (*resp)->data;
+		tr->table = ((struct ng_pm_tabreq *) msg->data)->table;
+		tr->keylen = t->keylen;
+		tr->flags = t->lpm ? NG_PM_TABLE_LPM : 0;
+		tr->entries = t->nent;
+		for (i = 0; i < t->nent; i++) {
+			te = &tr->ent[i];
+			bzero(te, sizeof(*te));
+			bcopy(t->ent[i].key, te->key, t->keylen);
+			if (t->lpm)
+				te->plen = t->ent[i].key[NG_PM_MAXWORDS - 1];
+			te->action = t->ent[i].action;
+			strlcpy(te->hname, t->ent[i].hname, sizeof(te->hname));
+		}
+		break;
+	default:
+		error = EINVAL;
+		break;
+	}
+	return (error);
+}
+
+/* FNV-1a, for member names */
+static uint32_t
+ng_pm_name_hash(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	while (*name != '\0')
+		h = (h ^ (u_char)*name++) * 16777619U;
+	return (h);
+}
+
+static int
+ng_pm_hgroup_msg(node_p node, struct ng_mesg *msg, struct ng_mesg **resp)
+{
+	ng_pm_priv_p priv = NG_NODE_PRIVATE(node);
+	struct ng_pm_hgreq *hr = (struct ng_pm_hgreq *) msg->data;
+	struct ng_pm_hgroup *g;
+	uint32_t i, j;
+	int slot;
+
+	if (msg->header.arglen < sizeof(*hr) ||
+	    hr->group >= NG_PM_MAXHGROUPS ||
+	    hr->hooks > (msg->header.arglen - sizeof(*hr)) / NG_HOOKSIZ)
+		return (EINVAL);
+	g = priv->hgroup[hr->group];
+
+	switch (msg->header.cmd) {
+	case NGM_PM_SET_HGROUP:
+		if (hr->fields >= NG_PM_HASH_FIELDS ||
+		    hr->hooks > NG_PM_HG_MAXHOOKS)
+			return (EINVAL);
+		for (i = 0; i < hr->hooks; i++) {
+			if (strnlen(hr->hname[i], NG_HOOKSIZ) == NG_HOOKSIZ ||
+			    hr->hname[i][0] == '\0')
+				return (EINVAL);
+			for (j = 0; j < i; j++)
+				if (strcmp(hr->hname[i], hr->hname[j]) == 0)
+					return (EINVAL);
+		}
+		if (hr->hooks == 0) {
+			ng_pm_hgroup_free(priv, hr->group);
+			break;
+		}
+		MALLOC(g, struct ng_pm_hgroup *, sizeof(*g), M_NETGRAPH_PM,
+		    M_NOWAIT | M_ZERO);
+		if (g == NULL)
+			return (ENOMEM);
+		g->fields = hr->fields;
+		/* Referenced as they go, so that no slot is taken twice */
+		for (i = 0; i < hr->hooks; i++) {
+			if ((slot = ng_pm_hslot_get(node, hr->hname[i])) < 0) {
+				while (i-- > 0)
+					priv->hslot[g->slot[i]].refs--;
+				FREE(g, M_NETGRAPH_PM);
+				return (ENOMEM);
+			}
+			priv->hslot[slot].refs++;
+			g->slot[i] = slot;
+			g->id[i] = ng_pm_name_hash(hr->hname[i]);
+		}
+		g->nhooks = hr->hooks;
+		ng_pm_hgroup_free(priv, hr->group);
+		ng_pm_hgroup_fill(priv, g);
+		priv->hgroup[hr->group] = g;
+		break;
+	case NGM_PM_GET_HGROUP:
+		if (g == NULL)
+			return (ENOENT);
+		NG_MKRESPONSE(*resp, msg, sizeof(*hr) + g->nhooks * NG_HOOKSIZ,
+		    M_NOWAIT);
+		if (*resp == NULL)
+			return (ENOMEM);
+		hr = (struct ng_pm_hgreq *) (*resp)->data;
+		hr->group = ((struct ng_pm_hgreq *) msg->data)->group;
+		hr->fields = g->fields;
+		hr->hooks = g->nhooks;
+		for (i = 0; i < hr->hooks; i++)
+			strlcpy(hr->hname[i], priv->hslot[g->slot[i]].name,
+			    NG_HOOKSIZ);
+		break;
+	default:
+		return (EINVAL);
+	}
+	return (0);
+}
+
+/* Digest of the rule set of a hook, for getdigests */
+static int
+ng_pm_digest_hook(hook_p hook, void *arg)
+{
+	struct ng_pm_digests *dg = arg;
+	struct ng_pm_digest *d = &dg->hook[dg->hooks++];
+	ng_pm_hookinfo_p hip = NG_HOOK_PRIVATE(hook);
+
+	strlcpy(d->name, NG_HOOK_NAME(hook), sizeof(d->name));
+	d->digest = hip->prog != NULL ? hip->prog->digest : 0;
+	return (1);
+}
+
+static int
+ng_pm_rcvmsg(node_p node, item_p item, hook_p lasthook)
+{
+	ng_pm_priv_p priv = NG_NODE_PRIVATE(node);
+	ng_pm_hookcfg_t *hc = NULL;
+	struct ng_mesg *msg;
+	struct ng_mesg *resp = NULL;
+	hook_p hook = NULL;
+	ng_pm_hookinfo_p hip;
+	struct ng_pm_prog *prog, *old;
+	struct ng_pm_fcreq *fr;
+	struct ng_pm_stats *st = NULL;
+	struct ng_pm_snapreq *sr = NULL;
+	struct ng_pm_chainsreq *cr = NULL;
+	struct ng_pm_rcount *stats, *rc;
+	struct ng_pm_mstate *mstate;
+	size_t sstride;
+	int i, j, lo, hi, mid, len, cpu, error = 0;
+
+	NGI_GET_MSG(item, msg);
+	if (msg->header.typecookie != NGM_PM_COOKIE)
+		error = EINVAL;
+	else {
+		switch (msg->header.cmd) {
+		case NGM_PM_SETHOOKCFG:
+		case NGM_PM_GETHOOKCFG:
+			hc = (ng_pm_hookcfg_t *) msg->data;
+			if (msg->header.arglen < NG_PM_HOOKCFG_SIZE(0)) {
+				error = EINVAL;
+				break;
+			}
+			hc->name[NG_HOOKSIZ - 1] = '\0';
+			hook = ng_findhook(node, hc->name);
+			if (hook == NULL)
+				error = ENOENT;
+			break;
+		case NGM_PM_GETSTATS:
+		case NGM_PM_CLRSTATS:
+			st = (struct ng_pm_stats *) msg->data;
+			if (msg->header.arglen <
+			    offsetof(struct ng_pm_stats, stat)) {
+				error = EINVAL;
+				break;
+			}
+			st->name[NG_HOOKSIZ - 1] = '\0';
+			hook = ng_findhook(node, st->name);
+			if (hook == NULL)
+				error = ENOENT;
+			break;
+		case NGM_PM_SET_SNAPLEN:
+		case NGM_PM_GET_SNAPLEN:
+			sr = (struct ng_pm_snapreq *) msg->data;
+			if (msg->header.arglen < sizeof(*sr)) {
+				error = EINVAL;
+				break;
+			}
+			sr->name[NG_HOOKSIZ - 1] = '\0';
+			hook = ng_findhook(node, sr->name);
+			if (hook == NULL)
+				error = ENOENT;
+			break;
+		case NGM_PM_SET_CHAINS:
+		case NGM_PM_GET_CHAINS:
+			cr = (struct ng_pm_chainsreq *) msg->data;
+			if (msg->header.arglen < sizeof(*cr)) {
+				error = EINVAL;
+				break;
+			}
+			cr->hname[NG_HOOKSIZ - 1] = '\0';
+			hook = ng_findhook(node, cr->hname);
+			if (hook == NULL)
+				error = ENOENT;
+			break;
+		case NGM_PM_TABLE_ADD:
+		case NGM_PM_TABLE_DEL:
+		case NGM_PM_TABLE_FLUSH:
+		case NGM_PM_TABLE_GET:
+			error = ng_pm_table_msg(node, msg, &resp);
+			if (msg->header.cmd != NGM_PM_TABLE_GET)
+				ng_pm_fc_invalidate(priv);
+			goto done;
+		case NGM_PM_SET_HGROUP:
+		case NGM_PM_GET_HGROUP:
+			error = ng_pm_hgroup_msg(node, msg, &resp);
+			if (msg->header.cmd == NGM_PM_SET_HGROUP)
+				ng_pm_fc_invalidate(priv);
+			goto done;
+		case NGM_PM_SET_FCACHE:
+			fr = (struct ng_pm_fcreq *) msg->data;
+			if (msg->header.arglen < sizeof(*fr) ||
+			    fr->entries > NG_PM_FC_MAXENT ||
+			    fr->span > NG_PM_FC_MAXSPAN) {
+				error = EINVAL;
+				goto done;
+			}
+			priv->fc_entries = fr->entries;
+			priv->fc_span = fr->span;
+			LIST_FOREACH(prog, &priv->progs, next)
+				if ((error = ng_pm_fc_alloc(priv, prog)) != 0)
+					break;
+			if (error) {
+				/* Back to no caching at all */
+				priv->fc_entries = 0;
+				LIST_FOREACH(prog, &priv->progs, next)
+					ng_pm_fc_alloc(priv, prog);
+			}
+			goto done;
+		case NGM_PM_GET_DIGESTS:
+			NG_MKRESPONSE(resp, msg,
+			    NG_PM_DIGESTS_SIZE(NG_NODE_NUMHOOKS(node)),
+			    M_NOWAIT);
+			if (resp == NULL) {
+				error = ENOMEM;
+				goto done;
+			}
+			NG_NODE_FOREACH_HOOK(node, ng_pm_digest_hook,
+			    resp->data, hook);
+			goto done;
+		case NGM_PM_GET_FCACHE:
+			NG_MKRESPONSE(resp, msg, sizeof(*fr), M_NOWAIT);
+			if (resp == NULL) {
+				error = ENOMEM;
+				goto done;
+			}
+			fr = (struct ng_pm_fcreq *) resp->data;
+			fr->entries = priv->fc_entries;
+			fr->span = priv->fc_span;
+			goto done;
+		default:
+			error = EINVAL;
+			break;
+		}
 	}
+	if (error)
+		goto done;
 
-	for (rule = 0; rule < hcp->rules; rule++) {
-		/* Pattern matching */
-		for (off0 = hcp->rule[rule].p_off_lo;
-		    off0 <= hcp->rule[rule].p_off_hi; off0++) {
-			end = hcp->rule[rule].p_len;
-			if (end + off0 > maxlen) {
-				match = 0;
+	/* We have a valid target hook here... */
+	hip = NG_HOOK_PRIVATE(hook);
+	switch (msg->header.cmd) {
+	case NGM_PM_SETHOOKCFG:
+		if (hc->rules < 0 || hc->rules > NG_PM_MAXRULES ||
+		    msg->header.arglen < NG_PM_HOOKCFG_SIZE(hc->rules)) {
+			error = EINVAL;
+			break;
+		}
+		/*
+		 * Check hook names and map rule numbers to indices before
+		 * claiming any slot, so that a rejected set claims none.
+		 */
+		bzero(hc->name, sizeof(hc->name));
+		for (i = 0; i < hc->rules; i++) {
+			if (i > 0 && hc->rule[i].rule_number <=
+			    hc->rule[i - 1].rule_number) {
+				error = EINVAL;
+				goto done;
+			}
+			switch (hc->rule[i].action) {
+			case NGM_PM_ACTION_MATCH_HOOK:
+			case NGM_PM_ACTION_NOMATCH_HOOK:
+			case NGM_PM_ACTION_MATCH_DUPTO:
+			case NGM_PM_ACTION_NOMATCH_DUPTO:
+			case NGM_PM_ACTION_MATCH_SAMPLE:
+			case NGM_PM_ACTION_MATCH_POLICE:
+				hc->rule[i].asdata.hname[NG_HOOKSIZ - 1] = '\0';
+				/* Policed excess may just be dropped */
+				if (hc->rule[i].action ==
+				    NGM_PM_ACTION_MATCH_POLICE &&
+				    hc->rule[i].asdata.hname[0] == '\0')
+					break;
+				if (ng_findhook(node,
+				    hc->rule[i].asdata.hname) == NULL) {
+					error = ENOENT;
+					goto done;
+				}
+				break;
+			default:
 				break;
 			}
-			match = 1;
-			c = mtod(m, char *);
-			for (i = 0, c += off0; i < end; i++, c++) {
-//printf("%s() %d: rule = %d off = %d i = %d *c = %02x pat[off] = %02x mask[i] = %02x\n", __FUNCTION__, __LINE__, rule, off0 + i, i, *c & 0xff, hcp->rule[rule].pattern[i] & 0xff, hcp->rule[rule].mask[i] & 0xff);
-				/* Special handling for VLAN tagged mbufs */
-				if (off0 + i == 12 &&
-				    (m->m_flags & M_VLANTAG)) {
-					if ((hcp->rule[rule].pattern[i] ^ 0x81)
-					    & hcp->rule[rule].mask[i] & 0xff) {
-						match = 0;
-						break;
-					}
-					i++;
-					if (hcp->rule[rule].pattern[i] & 0xff
-					    & hcp->rule[rule].mask[i]) {
-						match = 0;
-						break;
-					}
-					i++;
-					vlan_tag =
-					    hcp->rule[rule].pattern[i] << 8;
-					vlan_mask =
-					    hcp->rule[rule].mask[i] << 8;
-					i++;
-					c--;
-					vlan_tag |= hcp->rule[rule].pattern[i];
-					vlan_mask |= hcp->rule[rule].mask[i];
-//printf("VLANtagged: vlan_tag = %d vlan_mask = %08X\n", vlan_tag & 0x0fff, vlan_mask);
-					if ((vlan_tag ^ m->m_pkthdr.ether_vtag)
-					    & vlan_mask & 0x0fff) {
-						match = 0;
-						break;
-					}
-					continue;
+		}
+		for (i = 0; i < hc->rules; i++) {
+			switch (hc->rule[i].action) {
+			case NGM_PM_ACTION_MATCH_SKIPTO:
+			case NGM_PM_ACTION_NOMATCH_SKIPTO:
+				/* Rule numbers are increasing, checked above */
+				j = hc->rule[i].asdata.skipto_rule_number;
+				lo = i + 1;
+				hi = hc->rules - 1;
+				while (lo < hi) {
+					mid = (lo + hi) / 2;
+					if (hc->rule[mid].rule_number < j)
+						lo = mid + 1;
+					else
+						hi = mid;
 				}
-				if ((*c ^ hcp->rule[rule].pattern[i]) &
-				    hcp->rule[rule].mask[i]) {
-					match = 0;
-					break;
+				if (lo >= hc->rules ||
+				    hc->rule[lo].rule_number != j) {
+					error = ENOENT;
+					goto done;
 				}
+				hc->rule[i].asdata.skipto_index = lo;
+				break;
+			default:
+				break;
 			}
-			if (match)
+		}
+		/* Map hook names to slots, given back if not installed */
+		for (i = 0; i < hc->rules; i++) {
+			switch (hc->rule[i].action) {
+			case NGM_PM_ACTION_MATCH_HOOK:
+			case NGM_PM_ACTION_NOMATCH_HOOK:
+			case NGM_PM_ACTION_MATCH_DUPTO:
+			case NGM_PM_ACTION_NOMATCH_DUPTO:
+			case NGM_PM_ACTION_MATCH_SAMPLE:
+			case NGM_PM_ACTION_MATCH_POLICE:
+				j = -1;
+				if (hc->rule[i].asdata.hname[0] != '\0' &&
+				    (j = ng_pm_hslot_get(node,
+				    hc->rule[i].asdata.hname)) < 0) {
+					ng_pm_hslot_put(priv, hc, i);
+					error = ENOMEM;
+					goto done;
+				}
+				bzero(&hc->rule[i].asdata,
+				    sizeof(hc->rule[i].asdata));
+				hc->rule[i].asdata.slot = j;
+				break;
+			default:
 				break;
+			}
 		}
 
-//printf("%s() %d: rule %d match %d\n", __FUNCTION__, __LINE__, rule, match);
+		stats = ng_pm_stats_alloc(hc->rules, &sstride);
+		if (stats == NULL) {
+			ng_pm_hslot_put(priv, hc, hc->rules);
+			error = ENOMEM;
+			break;
+		}
 
-		/* Decide what to do */
-		switch (hcp->rule[rule].action) {
-		case NGM_PM_ACTION_MATCH_HOOK:
-			if (match) {
-				NG_FWD_ITEM_HOOK(error, item,
-				    hcp->rule[rule].asdata.hp);
-				return (0);
+		/* Share the program of an identically configured hook */
+		len = NG_PM_HOOKCFG_SIZE(hc->rules);
+		LIST_FOREACH(prog, &priv->progs, next)
+			if (prog->cfg->rules == hc->rules &&
+			    bcmp(prog->cfg, hc, len) == 0)
+				break;
+		if (prog != NULL)
+			prog->refs++;
+		else if (hc->rules > 0) {
+			if ((error = ng_pm_compile(hc, &prog)) != 0) {
+				ng_pm_hslot_put(priv, hc, hc->rules);
+				FREE(stats, M_NETGRAPH_PM);
+				break;
 			}
-			break;
-		case NGM_PM_ACTION_NOMATCH_HOOK:
-			if (!match) {
-				NG_FWD_ITEM_HOOK(error, item,
-				    hcp->rule[rule].asdata.hp);
-				return (0);
+			MALLOC(prog->cfg, ng_pm_hookcfg_p, len, M_NETGRAPH_PM,
+			    M_NOWAIT);
+			if (prog->cfg == NULL ||
+			    ng_pm_fc_alloc(priv, prog) != 0) {
+				ng_pm_prog_free(prog);
+				ng_pm_hslot_put(priv, hc, hc->rules);
+				FREE(stats, M_NETGRAPH_PM);
+				error = ENOMEM;
+				break;
 			}
+			bcopy(hc, prog->cfg, len);
+			prog->digest = ng_pm_hookcfg_digest(priv, prog->cfg);
+			prog->refs = 1;
+			ng_pm_hslot_ref(priv, prog->cfg, 1);
+			LIST_INSERT_HEAD(&priv->progs, prog, next);
+		}
+		mstate = ng_pm_mstate_alloc(prog);
+		if (mstate == NULL && prog != NULL && prog->nmeters > 0) {
+			ng_pm_prog_release(priv, prog);
+			ng_pm_hslot_put(priv, hc, hc->rules);
+			FREE(stats, M_NETGRAPH_PM);
+			error = ENOMEM;
 			break;
-		case NGM_PM_ACTION_MATCH_DUPTO:
-			if (match) {
-				if ((m2 = m_dup(m, M_DONTWAIT)) == NULL) {
-					printf("ouch, m_dup() failed!\n");
+		}
+		/*
+		 * Control messages run with the node's writer lock, so no
+		 * packet is being matched here and the old program can be
+		 * swapped and released right away.
+		 */
+		old = hip->prog;
+		hip->prog = prog;
+		ng_pm_prog_release(priv, old);
+		ng_pm_stats_free(hip);
+		hip->stats = stats;
+		hip->nstats = hc->rules + 1;
+		hip->sstride = sstride;
+		ng_pm_mstate_free(hip);
+		hip->mstate = mstate;
+		hip->nmeters = prog != NULL ? prog->nmeters : 0;
+		ng_pm_fc_invalidate(priv);
+		break;
+	case NGM_PM_GETHOOKCFG:
+		prog = hip->prog;
+		len = NG_PM_HOOKCFG_SIZE(prog != NULL ? prog->cfg->rules : 0);
+		NG_MKRESPONSE(resp, msg, len, M_NOWAIT);
+		if (resp == NULL)
+			error = ENOMEM;
+		else {
+			hc = (ng_pm_hookcfg_t *) resp->data;
+			if (prog != NULL)
+				bcopy(prog->cfg, hc, len);
+			sprintf(hc->name, "%s", NG_HOOK_NAME(hook));
+			/* Translate hook pointers to hook names */
+			for (i = 0; i < hc->rules; i++) {
+				switch (hc->rule[i].action) {
+				case NGM_PM_ACTION_MATCH_HOOK:
+				case NGM_PM_ACTION_NOMATCH_HOOK:
+				case NGM_PM_ACTION_MATCH_DUPTO:
+				case NGM_PM_ACTION_NOMATCH_DUPTO:
+				case NGM_PM_ACTION_MATCH_SAMPLE:
+				case NGM_PM_ACTION_MATCH_POLICE:
+					j = hc->rule[i].asdata.slot;
+					sprintf(hc->rule[i].asdata.hname,
+					    "%s", j >= 0 ? priv->hslot[j].name :
+					    "");
+				default:
 					break;
 				}
-#if 0
-				if (m->m_flags & M_VLANTAG) {
-					m2->m_flags |= M_VLANTAG;
-					m2->m_pkthdr.ether_vtag =
-					    m->m_pkthdr.ether_vtag;
-				}
-#endif
-				NG_SEND_DATA_ONLY(error,
-				    hcp->rule[rule].asdata.hp, m2);
 			}
+		}
+		break;
+	case NGM_PM_GETSTATS:
+		prog = hip->prog;
+		len = hip->nstats > 0 ? hip->nstats - 1 : 0;
+		NG_MKRESPONSE(resp, msg, NG_PM_STATS_SIZE(len), M_NOWAIT);
+		if (resp == NULL) {
+			error = ENOMEM;
 			break;
-		case NGM_PM_ACTION_NOMATCH_DUPTO:
-			if (!match) {
-				if ((m2 = m_dup(m, M_DONTWAIT)) == NULL) {
-					printf("ouch, m_dup() failed!\n");
+		}
+		st = (struct ng_pm_stats *) resp->data;
+		sprintf(st->name, "%s", NG_HOOK_NAME(hook));
+		st->rules = len;
+		for (i = 0; i < len; i++)
+			st->stat[i].rule_number =
+			    prog->cfg->rule[i].rule_number;
+		for (i = 0; hip->stats != NULL && i <= hip->nstats; i++) {
+			CPU_FOREACH(cpu) {
+				rc = (struct ng_pm_rcount *)((u_char *)
+				    hip->stats + cpu * hip->sstride) + i;
+				st->stat[i].packets += rc->packets;
+				st->stat[i].bytes += rc->bytes;
+				if (rc->last > st->stat[i].last)
+					st->stat[i].last = rc->last;
+			}
+		}
+		break;
+	case NGM_PM_CLRSTATS:
+		if (hip->stats != NULL)
+			bzero(hip->stats, (mp_maxid + 1) * hip->sstride);
+		break;
+	case NGM_PM_SET_SNAPLEN:
+		hip->snaplen = sr->snaplen;
+		break;
+	case NGM_PM_GET_SNAPLEN:
+		NG_MKRESPONSE(resp, msg, sizeof(*sr), M_NOWAIT);
+		if (resp == NULL) {
+			error = ENOMEM;
+			break;
+		}
+		sr = (struct ng_pm_snapreq *) resp->data;
+		sprintf(sr->name, "%s", NG_HOOK_NAME(hook));
+		sr->snaplen = hip->snaplen;
+		break;
+	case NGM_PM_SET_CHAINS:
+		if (cr->chains > 1) {
+			error = EINVAL;
+			break;
+		}
+		hip->chains = cr->chains;
+		break;
+	case NGM_PM_GET_CHAINS:
+		NG_MKRESPONSE(resp, msg, sizeof(*cr), M_NOWAIT);
+		if (resp == NULL) {
+			error = ENOMEM;
+			break;
+		}
+		cr = (struct ng_pm_chainsreq *) resp->data;
+		sprintf(cr->hname, "%s", NG_HOOK_NAME(hook));
+		cr->chains = hip->chains;
+		break;
+	default:
+		error = EINVAL;
+		break;
+	}
+
+done:
+	NG_RESPOND_MSG(error, node, item, resp);
+	NG_FREE_MSG(msg);
+	return (error);
+}
+
+/* Is this match one to sample? */
+static __inline int
+ng_pm_sample(const struct ng_pm_meter *mp, struct ng_pm_mstate *ms)
+{
+
+	if (mp->flags & NG_PM_RATE_RANDOM)
+		return (random() % mp->period == 0);
+	return (atomic_fetchadd_int(&ms->count, 1) % mp->period ==
+	    mp->period - 1);
+}
+
+/* Does a packet of 'len' bytes conform to the token bucket? */
+static int
+ng_pm_police(const struct ng_pm_meter *mp, struct ng_pm_mstate *ms, int len)
+{
+	uint64_t now, dt, need;
+	int conform;
+
+	need = (uint64_t)len << NG_PM_TB_SHIFT;
+	now = ng_pm_usec();
+	mtx_lock(&ms->mtx);
+	/* Another CPU may have got here with a later time first */
+	if (now > ms->last) {
+		dt = now - ms->last;
+		if (dt > mp->dtmax)
+			dt = mp->dtmax;
+		ms->last = now;
+		ms->tokens += dt * mp->rate;
+		if (ms->tokens > mp->depth)
+			ms->tokens = mp->depth;
+	}
+	conform = ms->tokens >= need;
+	if (conform)
+		ms->tokens -= need;
+	mtx_unlock(&ms->mtx);
+	return (conform);
+}
+
+/*
+ * Packets or copies which cannot be made for want of mbufs are counted on
+ * the hook the packet came in on, and reported at most once a second.
+ */
+static void
+ng_pm_nombufs(ng_pm_priv_p priv, ng_pm_hookinfo_p hip, int len,
+    const char *what)
+{
+
+	ng_pm_count(hip, hip->nstats, len);
+	if (priv->nocopy_logged != time_uptime) {
+		priv->nocopy_logged = time_uptime;
+		log(LOG_WARNING, "ng_patmat: no mbufs for %s\n", what);
+	}
+}
+
+/* May packet bytes 'off' to 'off' + 'len' - 1 be written in place? */
+static int
+ng_pm_writable(const struct mbuf *m, int off, int len)
+{
+
+	for (; m != NULL && off + len > 0; m = m->m_next) {
+		if (off < m->m_len && !M_WRITABLE(m))
+			return (0);
+		off -= m->m_len;
+	}
+	return (1);
+}
+
+static __inline uint32_t
+ng_pm_cksum_fold(uint32_t sum)
+{
+
+	sum = (sum & 0xffff) + (sum >> 16);
+	return ((sum & 0xffff) + (sum >> 16));
+}
+
+/*
+ * Set the field of a match_set_field rule, and update the IPv4 header and
+ * TCP or UDP checksums covering it, one 16-bit word changed at a time:
+ * HC' = ~(~HC + ~m + m') (RFC 1624).  Checksums left to the interface
+ * only hold the pseudo header sum, not inverted, and only change with the
+ * addresses and length in it.  The packet is copied first if any of the
+ * bytes to be written are shared.  Returns the packet, or NULL if it could
+ * not be copied and is gone.
+ */
+#define	NG_PM_CK_IP		0
+#define	NG_PM_CK_L4		1
+
+static struct mbuf *
+ng_pm_setfield(const struct ng_pm_setf *sf, struct ng_pm_pkt *pk,
+    struct mbuf *m)
+{
+	u_char old[NG_PM_MAXPATLEN + 2], new[NG_PM_MAXPATLEN + 2];
+	u_char vbuf[NG_PM_MAXPATLEN], kbuf[NG_PM_MAXPATLEN], c[2];
+	const u_char *value = sf->value, *mask = sf->mask;
+	const u_char *cp;
+	uint32_t sum[2], d, ck, o, n;
+	int cko[2], delayed = 0;
+	int off, len, lo, hi, l3, l4, l4end = 0, ihl = 0, i, j, k, w;
+
+	if ((off = ng_pm_anchor(pk, sf->anchor)) < 0)
+		return (m);
+	off += sf->off;
+	len = sf->len;
+
+	/* The stripped tag stands in for bytes 12 to 15, as when matching */
+	if (sf->anchor == NG_PM_ANCHOR_FRAME && (m->m_flags & M_VLANTAG) &&
+	    off < 16 && off + len > 12) {
+		if (off + len > m->m_pkthdr.len + 4)
+			return (m);
+		for (i = j = 0; i < len; i++) {
+			k = off + i;
+			if (k == 14 || k == 15)
+				m->m_pkthdr.ether_vtag =
+				    (m->m_pkthdr.ether_vtag &
+				    ~(mask[i] << (15 - k) * 8)) |
+				    value[i] << (15 - k) * 8;
+			else if (k < 12 || k > 15) {
+				vbuf[j] = value[i];
+				kbuf[j++] = mask[i];
+			}
+		}
+		value = vbuf;
+		mask = kbuf;
+		off = imin(off, 12);
+		len = j;
+	} else if (off + len > m->m_pkthdr.len)
+		return (m);
+	if (len == 0)
+		return (m);
+
+	/* Whole words around the field, the last padded with zero */
+	lo = off & ~1;
+	hi = (off + len + 1) & ~1;
+	bzero(old, sizeof(old));
+	m_copydata(m, lo, imin(hi, m->m_pkthdr.len) - lo, (caddr_t)old);
+	bcopy(old, new, hi - lo);
+	for (i = 0; i < len; i++)
+		new[off - lo + i] = (old[off - lo + i] & ~mask[i]) | value[i];
+	if (bcmp(old, new, hi - lo) == 0)
+		return (m);
+
+	/* Checksums to update, unless the field covers them */
+	cko[NG_PM_CK_IP] = cko[NG_PM_CK_L4] = -1;
+	l3 = ng_pm_anchor(pk, NG_PM_ANCHOR_L3);
+	l4 = pk->hdr[NG_PM_ANCHOR_L4];
+	if (pk->ipver == 4 && !(m->m_pkthdr.csum_flags & CSUM_DELAY_IP)) {
+		ihl = (*ng_pm_pkt_bytes(pk, l3, 1, c) & 0x0f) * 4;
+		cko[NG_PM_CK_IP] = l3 + 10;
+	}
+	if (l4 >= 0 &&
+	    (pk->proto == IPPROTO_TCP || pk->proto == IPPROTO_UDP)) {
+		cko[NG_PM_CK_L4] = l4 + (pk->proto == IPPROTO_TCP ? 16 : 6);
+		delayed = m->m_pkthdr.csum_flags & (pk->ipver == 4 ?
+		    CSUM_DELAY_DATA : CSUM_DELAY_DATA_IPV6);
+		/* Padding past the IP packet is not summed */
+		cp = ng_pm_pkt_bytes(pk, l3 + (pk->ipver == 4 ? 2 : 4), 2, c);
+		l4end = l3 + (pk->ipver == 4 ? 0 : 40) + (cp[0] << 8 | cp[1]);
+		if (pk->ipver == 6 && l4end == l3 + 40)
+			l4end = m->m_pkthdr.len;	/* jumbogram */
+	}
+	for (k = 0; k < 2; k++)
+		if (cko[k] + 2 > m->m_pkthdr.len ||
+		    (cko[k] < off + len && cko[k] + 2 > off))
+			cko[k] = -1;
+
+	for (k = 0, i = ng_pm_writable(m, off, len); k < 2 && i; k++)
+		if (cko[k] >= 0)
+			i = ng_pm_writable(m, cko[k], 2);
+	if (!i && (m = m_unshare(m, M_DONTWAIT)) == NULL)
+		return (NULL);
+	m_copyback(m, off, len, (caddr_t)new + off - lo);
+
+	sum[NG_PM_CK_IP] = sum[NG_PM_CK_L4] = 0;
+	for (w = lo; w < hi; w += 2) {
+		o = old[w - lo] << 8 | old[w - lo + 1];
+		n = new[w - lo] << 8 | new[w - lo + 1];
+		d = (~o & 0xffff) + n;
+		if (w >= l3 && w < l3 + ihl)
+			sum[NG_PM_CK_IP] += d;
+		/* Addresses and length in the pseudo header */
+		if ((pk->ipver == 4 && w >= l3 + 12 && w < l3 + 20) ||
+		    (pk->ipver == 6 && w >= l3 + 8 && w < l3 + 40) ||
+		    (pk->proto == IPPROTO_TCP &&
+		    w == l3 + (pk->ipver == 4 ? 2 : 4)) ||
+		    (pk->proto == IPPROTO_UDP && w == l4 + 4))
+			sum[NG_PM_CK_L4] += d;
+		if (l4 >= 0 && w >= l4 && w < l4end && !delayed)
+			sum[NG_PM_CK_L4] += w + 1 < l4end ? d :
+			    (~o & 0xff00) + (n & 0xff00) + 0xff;
+	}
+	for (k = 0; k < 2; k++) {
+		if (cko[k] < 0 || sum[k] == 0)
+			continue;
+		m_copydata(m, cko[k], 2, (caddr_t)c);
+		ck = c[0] << 8 | c[1];
+		if (k == NG_PM_CK_L4 && delayed)
+			ck = ng_pm_cksum_fold(ck + sum[k]);
+		else if (k == NG_PM_CK_L4 && ck == 0 &&
+		    pk->proto == IPPROTO_UDP && pk->ipver == 4)
+			continue;	/* no UDP checksum */
+		else {
+			ck = ~ng_pm_cksum_fold((~ck & 0xffff) + sum[k]) &
+			    0xffff;
+			if (ck == 0 && k == NG_PM_CK_L4 &&
+			    pk->proto == IPPROTO_UDP)
+				ck = 0xffff;
+		}
+		c[0] = ck >> 8;
+		c[1] = ck;
+		m_copyback(m, cko[k], 2, (caddr_t)c);
+	}
+	return (m);
+}
+
+/*
+ * Send a copy of a packet to a mirror hook.  The copy shares the storage
+ * of the packet rather than duplicating it, so both are read-only from
+ * here on, until a field is set.
+ */
+static void
+ng_pm_mirror(ng_pm_priv_p priv, ng_pm_hookinfo_p hip, struct mbuf *m,
+    hook_p hp)
+{
+	ng_pm_hookinfo_p mip = NG_HOOK_PRIVATE(hp);
+	struct mbuf *m2;
+	int error;
+
+	if (mip->snaplen == 0 || mip->snaplen >= m->m_pkthdr.len)
+		m2 = m_copypacket(m, M_DONTWAIT);
+	else
+		m2 = m_copym(m, 0, mip->snaplen, M_DONTWAIT);
+	/* Nothing to share in an empty packet */
+	if (m2 == NULL && m->m_pkthdr.len == 0)
+		m2 = m_dup(m, M_DONTWAIT);
+	if (m2 == NULL) {
+		ng_pm_nombufs(priv, hip, m->m_pkthdr.len, "mirrored copies");
+		return;
+	}
+	NG_SEND_DATA_ONLY(error, hp, m2);
+}
+
+/*
+ * Count a packet on a rule which acted on it without deciding its fate,
+ * note the rule in the verdict, and send a copy to a hook, if any.
+ */
+static void
+ng_pm_step(ng_pm_priv_p priv, ng_pm_hookinfo_p hip, struct mbuf *m, int rule,
+    hook_p hp, struct ng_pm_verdict *v)
+{
+
+	ng_pm_count(hip, rule, m->m_pkthdr.len);
+	if (v->nsteps >= NG_PM_FC_MAXSTEPS - 1)
+		v->nsteps = -1;
+	else if (v->nsteps >= 0) {
+		v->rule[v->nsteps] = rule;
+		v->hook[v->nsteps++] = hp;
+	}
+	if (hp != NULL)
+		ng_pm_mirror(priv, hip, m, hp);
+}
+
+/*
+ * Rules read the packet where it is, across the mbuf chain, so there is
+ * nothing to pull up.  Headers are parsed for the first rule relative to
+ * one, if any.
+ */
+static void
+ng_pm_pkt_init(struct ng_pm_pkt *pk, const struct ng_pm_prog *prog,
+    struct mbuf *m)
+{
+
+	pk->data = mtod(m, const u_char *);
+	pk->contig = m->m_len;
+	pk->maxlen = imin(prog->maxcontig, m->m_pkthdr.len);
+	pk->hdr[NG_PM_ANCHOR_FRAME] = 0;
+	pk->hdr[NG_PM_ANCHOR_L3] = pk->hdr[NG_PM_ANCHOR_L4] =
+	    NG_PM_HDR_UNKNOWN;
+	pk->head = pk->m = m;
+	pk->moff = 0;
+	pk->ac_done = 0;
+	pk->rt_done = 0;
+}
+
+/*
+ * Run a packet through the rule set of the hook it came in on, counting
+ * and mirroring it on the way, and return the hook to forward it to, or
+ * NULL to drop it.  Setting a field may replace the packet with a copy, or
+ * lose it for want of mbufs, which '*m0' is updated for.
+ */
+static hook_p
+ng_pm_classify(ng_pm_priv_p priv, ng_pm_hookinfo_p hip,
+    struct ng_pm_prog *prog, struct mbuf **m0)
+{
+	const struct ng_pm_insn *insn;
+	const struct ng_pm_pred *pp;
+	const struct ng_pm_tentry *te;
+	const struct ng_pm_meter *mp;
+	const struct ng_pm_rrun *rr;
+	struct ng_pm_fcache *fc;
+	struct ng_pm_fkey fk;
+	struct ng_pm_verdict v;
+	struct ng_pm_pkt pk;
+	struct mbuf *m = *m0;
+	hook_p hp = NULL;
+	uint32_t pc, rule;
+	int i, base;
+
+	if (prog == NULL) {
+		ng_pm_count(hip, 0, m->m_pkthdr.len);	/* no rules */
+		return (NULL);
+	}
+
+	if (!(m->m_flags & M_PKTHDR)) {
+		printf("ouch, M_PKTHDR not set!?\n");
+		return (NULL);
+	}
+
+	ng_pm_pkt_init(&pk, prog, m);
+
+	v.nsteps = 0;
+	if ((fc = prog->fc) != NULL) {
+		ng_pm_fc_key(fc, &pk, m, &fk);
+		if (ng_pm_fc_find(fc, &fk, priv->gen, &v))
+			goto cached;
+	}
+
+	for (pc = 0;;) {
+		insn = &prog->insns[pc];
+		switch (insn->op) {
+		case NG_PM_OP_TEST:
+			pp = &prog->preds[insn->arg];
+			base = ng_pm_anchor(&pk, pp->anchor);
+			if (base < 0)
+				pc = insn->jf;
+			else if (__predict_false(pp->vlan &&
+			    (m->m_flags & M_VLANTAG)))
+				pc = ng_pm_pred_match_vlan(pp, &pk,
+				    m->m_pkthdr.ether_vtag) ?
+				    insn->jt : insn->jf;
+			else
+				pc = ng_pm_pred_match(pp, &pk, base) ?
+				    insn->jt : insn->jf;
+			break;
+		case NG_PM_OP_CONTENT:
+			i = insn->arg;
+			if (__predict_false(m->m_flags & M_VLANTAG)) {
+				pp = &prog->preds[prog->ac->pred[i]];
+				if (pp->vlan) {
+					pc = ng_pm_pred_match_vlan(pp, &pk,
+					    m->m_pkthdr.ether_vtag) ?
+					    insn->jt : insn->jf;
 					break;
 				}
-				NG_SEND_DATA_ONLY(error,
-				    hcp->rule[rule].asdata.hp, m2);
 			}
+			if (!pk.ac_done)
+				ng_pm_ac_scan(prog, &pk);
+			if (pk.ac_hit[i / 64] & 1ULL << (i % 64))
+				pc = insn->jt;
+			else if (pk.ac_any || (m->m_flags & M_VLANTAG))
+				pc = insn->jf;
+			else
+				pc = prog->ac->none[pc];
 			break;
-		case NGM_PM_ACTION_MATCH_SKIPTO:
-			if (match)
-				rule = hcp->rule[rule].asdata.skipto_index;
+		case NG_PM_OP_GROUP:
+			pp = &prog->preds[prog->groups[insn->arg].pred];
+			base = ng_pm_anchor(&pk, pp->anchor);
+			rule = base < 0 ? NG_PM_NORULE : ng_pm_group_match(prog,
+			    &prog->groups[insn->arg], &pk, base);
+			if (rule != NG_PM_NORULE)
+				pc = prog->insns[rule].jt;
+			else
+				pc = prog->insns[
+				    prog->groups[insn->arg].last].jf;
 			break;
-		case NGM_PM_ACTION_NOMATCH_SKIPTO:
-			if (!match)
-				rule = hcp->rule[rule].asdata.skipto_index;
+		case NG_PM_OP_RANGE:
+			rr = &prog->rruns[insn->arg];
+			rule = ng_pm_rrun_match(prog, rr, pc - rr->rule, &pk,
+			    m);
+			if (rule != NG_PM_NORULE)
+				pc = prog->insns[rule].jt;
+			else
+				pc = prog->insns[rr->rule + rr->n - 1].jf;
 			break;
-		case NGM_PM_ACTION_MATCH_DROP:
-			if (match)
-				goto drop;
+		case NG_PM_OP_LOOKUP:
+			base = ng_pm_anchor(&pk,
+			    prog->lookups[insn->arg].anchor);
+			te = base < 0 ? NULL : ng_pm_lookup(priv,
+			    &prog->lookups[insn->arg], &pk, base);
+			pc = insn->jf;
+			if (te == NULL)
+				break;
+			if (te->action == NGM_PM_ACTION_MATCH_DROP) {
+				hp = NULL;
+				goto done;
+			}
+			if (te->hp == NULL)
+				break;
+			if (te->action == NGM_PM_ACTION_MATCH_HOOK) {
+				hp = te->hp;
+				goto done;
+			}
+			ng_pm_step(priv, hip, m, insn->rule, te->hp, &v);
 			break;
-		case NGM_PM_ACTION_NOMATCH_DROP:
-			if (!match)
-				goto drop;
+		case NG_PM_OP_SKIP:
+			pc = insn->jt;
+			ng_pm_step(priv, hip, m, insn->rule, NULL, &v);
 			break;
-		default:
+		case NG_PM_OP_FWD:
+			if ((hp = priv->hslot[insn->arg].hook) != NULL)
+				goto done;
+			pc = insn->jt;
+			break;
+		case NG_PM_OP_DUP:
+			pc = insn->jt;
+			if ((hp = priv->hslot[insn->arg].hook) != NULL)
+				ng_pm_step(priv, hip, m, insn->rule, hp, &v);
+			break;
+		case NG_PM_OP_HASH:
+			if ((hp = ng_pm_hgroup_pick(priv, insn->arg, &pk)) !=
+			    NULL)
+				goto done;
+			pc = insn->jt;
+			break;
+		case NG_PM_OP_SAMPLE:
+			pc = insn->jt;
+			mp = &prog->meters[insn->arg];
+			if (ng_pm_sample(mp, &hip->mstate[insn->arg]) &&
+			    (hp = priv->hslot[mp->slot].hook) != NULL)
+				ng_pm_step(priv, hip, m, insn->rule, hp, &v);
+			break;
+		case NG_PM_OP_POLICE:
+			pc = insn->jt;
+			mp = &prog->meters[insn->arg];
+			if (ng_pm_police(mp, &hip->mstate[insn->arg],
+			    m->m_pkthdr.len))
+				break;
+			hp = mp->slot >= 0 ? priv->hslot[mp->slot].hook : NULL;
+			goto done;
+		case NG_PM_OP_SET:
+			pc = insn->jt;
+			i = m->m_pkthdr.len;
+			m = ng_pm_setfield(&prog->setfs[insn->arg], &pk, m);
+			if ((*m0 = m) == NULL) {
+				ng_pm_nombufs(priv, hip, i,
+				    "rewritten packets");
+				return (NULL);
+			}
+			ng_pm_step(priv, hip, m, insn->rule, NULL, &v);
+			/* Later rules see the new bytes, wherever they are */
+			ng_pm_pkt_init(&pk, prog, m);
 			break;
+		default:
+			hp = NULL;
+			goto done;
+		}
+	}
+
+done:
+	ng_pm_count(hip, insn->rule, m->m_pkthdr.len);
+	if (fc != NULL && v.nsteps >= 0) {
+		v.rule[v.nsteps] = insn->rule;
+		v.hook[v.nsteps++] = hp;
+		ng_pm_fc_enter(fc, &fk, priv->gen, &v);
+	}
+	return (hp);
+
+cached:
+	for (i = 0; i < v.nsteps; i++) {
+		ng_pm_count(hip, v.rule[i], m->m_pkthdr.len);
+		if ((hp = v.hook[i]) != NULL && i < v.nsteps - 1)
+			ng_pm_mirror(priv, hip, m, hp);
+	}
+	return (hp);
+}
+
+/*
+ * A chain of packets linked by m_nextpkt is classified in one go, the
+ * mbuf and first bytes of the next packet prefetched while one is run
+ * through the rules, and grouped by hook, in the order they came in.  A
+ * group goes out as one chain to a hook set to take chains, and packet by
+ * packet to any other, stock nodes not expecting m_nextpkt to be set.
+ * Copies to dupto and sample hooks are sent one by one as they are made.
+ */
+#define	NG_PM_BATCH_HOOKS	8	/* chains built at a time */
+
+struct ng_pm_batch {
+	hook_p		hook;
+	struct mbuf	*head;
+	struct mbuf	**tail;
+};
+
+static void
+ng_pm_batch_flush(struct ng_pm_batch *b, int n, item_p *itemp)
+{
+	ng_pm_hookinfo_p hip;
+	struct mbuf *m, *next;
+	int error, i;
+
+	/* The item the chain came in will do for the first one going out */
+	for (i = 0; i < n; i++) {
+		hip = NG_HOOK_PRIVATE(b[i].hook);
+		for (m = b[i].head; m != NULL; m = next) {
+			if (hip->chains)
+				next = NULL;
+			else {
+				next = m->m_nextpkt;
+				m->m_nextpkt = NULL;
+			}
+			if (*itemp != NULL)
+				NG_FWD_NEW_DATA(error, *itemp, b[i].hook, m);
+			else
+				NG_SEND_DATA_ONLY(error, b[i].hook, m);
+		}
+	}
+}
+
+static int
+ng_pm_rcvbatch(ng_pm_priv_p priv, ng_pm_hookinfo_p hip,
+    struct ng_pm_prog *prog, item_p item)
+{
+	struct ng_pm_batch b[NG_PM_BATCH_HOOKS];
+	struct mbuf *m, *next;
+	hook_p hp;
+	int i, n = 0;
+
+	NGI_GET_M(item, m);
+	for (; m != NULL; m = next) {
+		next = m->m_nextpkt;
+		m->m_nextpkt = NULL;
+		if (next != NULL) {
+			/* Fetched with this one, the mbuf after next */
+			__builtin_prefetch(next->m_nextpkt);
+			__builtin_prefetch(mtod(next, const u_char *));
+		}
+		if ((hp = ng_pm_classify(priv, hip, prog, &m)) == NULL) {
+			if (m != NULL)
+				m_freem(m);
+			continue;
 		}
+		for (i = 0; i < n && b[i].hook != hp; i++)
+			continue;
+		if (i == n) {
+			if (n == NG_PM_BATCH_HOOKS) {
+				ng_pm_batch_flush(b, n, &item);
+				i = n = 0;
+			}
+			b[i].hook = hp;
+			b[i].head = NULL;
+			b[i].tail = &b[i].head;
+			n++;
+		}
+		*b[i].tail = m;
+		b[i].tail = &m->m_nextpkt;
 	}
+	ng_pm_batch_flush(b, n, &item);
+	if (item != NULL)
+		NG_FREE_ITEM(item);
+	return (0);
+}
 
-drop:
-//printf("%s() %d: drop\n", __FUNCTION__, __LINE__);
-	NG_FREE_ITEM(item);
+static int
+ng_pm_rcvdata(hook_p hook, item_p item)
+{
+	ng_pm_priv_p priv = NG_NODE_PRIVATE(NG_HOOK_NODE(hook));
+	ng_pm_hookinfo_p hip = NG_HOOK_PRIVATE(hook);
+	struct ng_pm_prog *prog = hip->prog;
+	struct mbuf *m = NGI_M(item);
+	hook_p hp;
+	int error = 0;
+
+	if (m->m_nextpkt != NULL)
+		return (ng_pm_rcvbatch(priv, hip, prog, item));
+	hp = ng_pm_classify(priv, hip, prog, &m);
+	if ((NGI_M(item) = m) == NULL || hp == NULL) {
+		NG_FREE_ITEM(item);
+		return (0);
+	}
+	NG_FWD_ITEM_HOOK(error, item, hp);
 	return (0);
 }
 
 static int
 ng_pm_shutdown(node_p node)
 {
+	ng_pm_priv_p priv = NG_NODE_PRIVATE(node);
+	int i;
 
+	for (i = 0; i < NG_PM_MAXTABLES; i++)
+		ng_pm_table_free(priv->table[i]);
+	for (i = 0; i < NG_PM_MAXHGROUPS; i++)
+		ng_pm_hgroup_free(priv, i);
+	if (priv->hslot != NULL)
+		FREE(priv->hslot, M_NETGRAPH_PM);
+	FREE(priv, M_NETGRAPH_PM);
+	NG_NODE_SET_PRIVATE(node, NULL);
 	NG_NODE_UNREF(node);
 	return (0);
 }
@@ -736,10 +5680,21 @@ ng_pm_shutdown(node_p node)
 static int
 ng_pm_disconnect(hook_p hook)
 {
-	ng_pm_hookcfg_p hcp = NG_HOOK_PRIVATE(hook);
+	ng_pm_priv_p priv = NG_NODE_PRIVATE(NG_HOOK_NODE(hook));
+	ng_pm_hookinfo_p hip = NG_HOOK_PRIVATE(hook);
 
-	ng_pm_clear_config(NG_HOOK_NODE(hook));
-	FREE(hcp, M_NETGRAPH_PM);
+	/*
+	 * The hook's own rule set goes with it.  Rules of other hooks
+	 * sending to it are kept, and skipped until it comes back.
+	 */
+	ng_pm_prog_release(priv, hip->prog);
+	ng_pm_hslot_rehook(priv, NULL, hook, NULL);
+	ng_pm_table_rehook(priv, NULL, hook, NULL);
+	ng_pm_hgroup_rehook(priv);
+	ng_pm_fc_invalidate(priv);
+	ng_pm_stats_free(hip);
+	ng_pm_mstate_free(hip);
+	FREE(hip, M_NETGRAPH_PM);
 	NG_HOOK_SET_PRIVATE(hook, NULL);
 	return (0);
 }
@@ -0,0 +1,464 @@
+/*-
+ * Copyright (c) 2026 University of Zagreb
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * rfee_bench -- drives an unmodified ng_rfee.c, linked against the ngshim
+ * userspace netgraph stand-in, on a deterministic virtual clock.
+ *
+ * Without arguments, runs the benchmark suite and reports the wall-clock
+ * cost of pushing frames through a number of typical link configurations.
+ * With -a, runs the accuracy suite instead, comparing the throughput,
+ * delay and loss achieved in virtual time with the configured values, and
+ * exits non-zero if any of them is off by more than its tolerance.
+ */
+
+#include <math.h>
+#include <unistd.h>
+
+#include "ngshim.h"
+#include "../ng_rfee.h"
+
+#define	MAX_SINKS	1024
+#define	FRAME_MAX	4096
+
+/* Per-sink receive accounting */
+struct sink {
+	uint64_t	frames;
+	uint64_t	octets;
+	uint64_t	first;		/* virtual time of first frame, usec */
+	uint64_t	last;		/* virtual time of last frame, usec */
+	uint64_t	dly_sum;	/* sum of per-frame delays, usec */
+	uint64_t	dly_min;
+	uint64_t	dly_max;
+};
+
+static struct sink sinks[MAX_SINKS];
+
+static void
+sink_rcv(hook_p hook, struct mbuf *m, void *arg)
+{
+	struct sink *s = arg;
+	uint64_t sent, dly;
+
+	if (s->frames == 0)
+		s->first = ngshim_now;
+	s->last = ngshim_now;
+	s->frames++;
+	s->octets += m->m_pkthdr.len;
+
+	/* Injection timestamp travels in the first bytes of each frame. */
+	if (m->m_len >= (int)sizeof(sent)) {
+		bcopy(mtod(m, caddr_t), &sent, sizeof(sent));
+		dly = ngshim_now - sent;
+		s->dly_sum += dly;
+		if (s->frames == 1 || dly < s->dly_min)
+			s->dly_min = dly;
+		if (dly > s->dly_max)
+			s->dly_max = dly;
+	}
+	m_freem(m);
+}
+
+/*
+ * A node with link0 as the sender and link1..linkN as receivers.  EPIDs
+ * equal the link number plus one, so the sender is EPID 1.
+ */
+static node_p
+topo_create(int receivers, hook_p *tx)
+{
+	char name[NG_HOOKSIZ];
+	node_p node;
+	hook_p hook;
+	int i;
+
+	if (receivers + 1 > MAX_SINKS) {
+		fprintf(stderr, "too many receivers\n");
+		exit(2);
+	}
+	bzero(sinks, sizeof(sinks));
+	node = ngshim_node_create(ngshim_type, "rfee");
+	if (node == NULL) {
+		fprintf(stderr, "can't create node\n");
+		exit(2);
+	}
+	for (i = 0; i <= receivers; i++) {
+		snprintf(name, sizeof(name), "link%d", i);
+		hook = ngshim_hook_create(node, name, sink_rcv, &sinks[i]);
+		if (hook == NULL) {
+			fprintf(stderr, "can't create hook %s\n", name);
+			exit(2);
+		}
+		if (i == 0)
+			*tx = hook;
+	}
+	return (node);
+}
+
+/*
+ * Configure link0 as "<txattrs>" towards all receivers with per-EPID
+ * attributes "<rxattrs>", and receivers as sinks with no distribution.
+ */
+static void
+topo_config(node_p node, int receivers, const char *txattrs,
+    const char *rxattrs)
+{
+	char *cmd;
+	size_t len;
+	int i, n, error;
+
+	len = 64 + receivers * (16 + strlen(rxattrs));
+	cmd = malloc(len);
+	n = snprintf(cmd, len, "setlinkcfg link0 1%s", txattrs);
+	for (i = 1; i <= receivers; i++)
+		n += snprintf(cmd + n, len - n, " %d%s", i + 1, rxattrs);
+	if ((error = ngshim_ascii_msg(node, cmd, NULL, 0)) != 0) {
+		fprintf(stderr, "%s: %s\n", cmd, strerror(error));
+		exit(2);
+	}
+	for (i = 1; i <= receivers; i++) {
+		snprintf(cmd, len, "setlinkcfg link%d %d", i, i + 1);
+		if ((error = ngshim_ascii_msg(node, cmd, NULL, 0)) != 0) {
+			fprintf(stderr, "%s: %s\n", cmd, strerror(error));
+			exit(2);
+		}
+	}
+	free(cmd);
+}
+
+static void
+inject(hook_p tx, int len)
+{
+	static u_char frame[FRAME_MAX];
+	struct mbuf *m;
+
+	bcopy(&ngshim_now, frame, sizeof(ngshim_now));
+	m = ngshim_m_frombuf(frame, len, 0);
+	ngshim_rcvdata(tx, m);
+}
+
+/*
+ * Offer 'pps' frames per second of 'len' bytes each to the sender for
+ * 'usec' of virtual time, evenly spaced.
+ */
+static uint64_t
+offer(hook_p tx, int len, uint64_t pps, uint64_t usec)
+{
+	uint64_t start, i, n;
+
+	start = ngshim_now;
+	n = pps * usec / 1000000;
+	for (i = 0; i < n; i++) {
+		ngshim_clock_set(start + i * 1000000 / pps);
+		inject(tx, len);
+	}
+	ngshim_clock_set(start + usec);
+	return (n);
+}
+
+static uint64_t
+rx_frames(int receivers)
+{
+	uint64_t n = 0;
+	int i;
+
+	for (i = 1; i <= receivers; i++)
+		n += sinks[i].frames;
+	return (n);
+}
+
+/*
+ * Benchmarks.
+ */
+struct bench {
+	const char	*name;
+	int		receivers;
+	const char	*txattrs;
+	const char	*rxattrs;
+	int		len;
+	uint64_t	pps;		/* offered load, virtual */
+};
+
+static const struct bench benches[] = {
+	{ "fanout-1",	1,	"",			"",		64,	1000000 },
+	{ "fanout-8",	8,	"",			"",		64,	1000000 },
+	{ "fanout-64",	64,	"",			"",		64,	250000 },
+	{ "fanout-512",	512,	"",			"",		64,	25000 },
+	{ "ber-8",	8,	"",			":ber1E-5",	1000,	500000 },
+	{ "ber-64",	64,	"",			":ber1E-5",	1000,	100000 },
+	{ "delay-8",	8,	"",			":dly2.5",	1000,	500000 },
+	{ "jitter-1",	1,	":jit1.5:qlen100",	"",		1000,	800 },
+	{ "bw-1",	1,	":bw1000000000:qlen1024", "",		1000,	125000 },
+	{ "bw-8",	8,	":bw1000000000:qlen1024", ":dly1",	1000,	125000 },
+	{ "wlan-8",	8,	":jit1.5:dup5:bw54000000:qlen20",
+						":ber1E-6",	1500,	800 },
+	{ NULL }
+};
+
+static void
+run_bench(const struct bench *b, uint64_t frames)
+{
+	node_p node;
+	hook_p tx;
+	uint64_t t0, t1, sent, rcvd;
+	double ns;
+
+	ngshim_srandom(1);
+	node = topo_create(b->receivers, &tx);
+	topo_config(node, b->receivers, b->txattrs, b->rxattrs);
+
+	t0 = ngshim_wallclock_ns();
+	sent = offer(tx, b->len, b->pps, frames * 1000000 / b->pps);
+	t1 = ngshim_wallclock_ns();
+	rcvd = rx_frames(b->receivers);
+	ngshim_node_shutdown(node);
+
+	ns = (double)(t1 - t0) / sent;
+	printf("%-12s %4d rcv %5dB  %10.0f pkt/s %8.1f ns/pkt %8.1f ns/copy"
+	    "  (%ju in, %ju out)\n", b->name, b->receivers, b->len,
+	    1e9 / ns, ns, rcvd ? (double)(t1 - t0) / rcvd : 0.0,
+	    (uintmax_t)sent, (uintmax_t)rcvd);
+}
+
+/*
+ * Accuracy tests.
+ */
+static int failures;
+
+static void
+check(const char *what, double got, double want, double tol, const char *unit)
+{
+	int ok = fabs(got - want) <= tol;
+
+	printf("%-40s %12.3f %-6s (configured %.3f, tolerance %.3f)  %s\n",
+	    what, got, unit, want, tol, ok ? "ok" : "FAIL");
+	if (!ok)
+		failures++;
+}
+
+/* Like check(), with got bounded by [lo, hi] instead of want +- tol. */
+static void
+check_range(const char *what, double got, double lo, double hi,
+    const char *unit)
+{
+	int ok = got >= lo && got <= hi;
+
+	printf("%-40s %12.3f %-6s (configured %.3f, range %.3f..%.3f)  %s\n",
+	    what, got, unit, lo, lo, hi, ok ? "ok" : "FAIL");
+	if (!ok)
+		failures++;
+}
+
+static void
+info(const char *what, double got, double want, const char *unit)
+{
+
+	printf("%-40s %12.3f %-6s (configured %.3f)  info\n",
+	    what, got, unit, want);
+}
+
+/* Saturated sender: achieved rate must match the configured bandwidth. */
+static void
+acc_throughput(uint32_t bw, int len)
+{
+	char attrs[64], what[64];
+	node_p node;
+	hook_p tx;
+	double secs, rate;
+
+	ngshim_srandom(2);
+	node = topo_create(1, &tx);
+	snprintf(attrs, sizeof(attrs), ":bw%u:qlen1000", bw);
+	topo_config(node, 1, attrs, "");
+	offer(tx, len, (uint64_t)bw * 3 / 2 / (len * 8), 10000000);
+	secs = (sinks[1].last - sinks[1].first) / 1e6;
+	rate = (sinks[1].octets - len) * 8 / secs;
+	ngshim_node_shutdown(node);
+	snprintf(what, sizeof(what), "throughput bw%u %dB", bw, len);
+	check(what, rate / 1e6, bw / 1e6, bw / 1e6 * 0.01, "Mbit/s");
+}
+
+/*
+ * Propagation delay: frames may not arrive before the configured delay,
+ * and no later than one tick after it, the resolution of the node's queue
+ * timer.  Injections are spread over all phases of a tick, so on average
+ * they wait half a tick past the delay.
+ */
+static void
+acc_delay(const char *dly, double want_ms)
+{
+	char attrs[64], what[64];
+	node_p node;
+	hook_p tx;
+	int i;
+
+	ngshim_srandom(3);
+	node = topo_create(1, &tx);
+	snprintf(attrs, sizeof(attrs), ":dly%s", dly);
+	topo_config(node, 1, "", attrs);
+	/* Odd spacing so injections land at all phases within a tick. */
+	for (i = 0; i < 10000; i++) {
+		ngshim_clock_advance(7 * tick + 37 * (i % 27));
+		inject(tx, 100);
+	}
+	ngshim_clock_advance(1000000);
+	ngshim_node_shutdown(node);
+	snprintf(what, sizeof(what), "delay dly%s min", dly);
+	check_range(what, sinks[1].dly_min / 1e3, want_ms,
+	    want_ms + tick / 1e3, "ms");
+	snprintf(what, sizeof(what), "delay dly%s max", dly);
+	check_range(what, sinks[1].dly_max / 1e3, want_ms,
+	    want_ms + tick / 1e3, "ms");
+	snprintf(what, sizeof(what), "delay dly%s mean", dly);
+	check(what, (double)sinks[1].dly_sum / sinks[1].frames / 1e3,
+	    want_ms + tick / 2e3, tick / 20e3, "ms");
+}
+
+/* BER: frame loss must match 1 - (1 - BER) ^ (8 * len). */
+static void
+acc_loss(const char *ber, double ber_val, int len)
+{
+	char attrs[64], what[64];
+	node_p node;
+	hook_p tx;
+	double want, got, n = 200000;
+	int i;
+
+	ngshim_srandom(4);
+	node = topo_create(1, &tx);
+	snprintf(attrs, sizeof(attrs), ":ber%s", ber);
+	topo_config(node, 1, "", attrs);
+	for (i = 0; i < n; i++) {
+		inject(tx, len);
+		if (i % 100 == 0)
+			ngshim_clock_advance(tick);
+	}
+	ngshim_node_shutdown(node);
+	want = 1 - pow(1 - ber_val, 8 * len);
+	got = 1 - sinks[1].frames / n;
+	snprintf(what, sizeof(what), "loss ber%s %dB", ber, len);
+	/* Five standard deviations of the binomial estimate. */
+	check(what, got * 100, want * 100,
+	    500 * sqrt(want * (1 - want) / n) + 0.01, "%");
+}
+
+/* Jitter and duplication are reported, but not checked. */
+static void
+acc_jitter_dup(void)
+{
+	node_p node;
+	hook_p tx;
+	int i, n = 20000;
+
+	ngshim_srandom(5);
+	node = topo_create(1, &tx);
+	topo_config(node, 1, ":jit1.5:qlen100000", "");
+	for (i = 0; i < n; i++) {
+		ngshim_clock_advance(20 * tick);
+		inject(tx, 100);
+	}
+	ngshim_clock_advance(1000000);
+	info("jitter jit1.5 mean added delay",
+	    (double)sinks[1].dly_sum / sinks[1].frames / 1e3 - tick / 2e3,
+	    1.5, "ms");
+	ngshim_node_shutdown(node);
+
+	ngshim_srandom(6);
+	node = topo_create(1, &tx);
+	topo_config(node, 1, ":dup5:qlen100000", "");
+	for (i = 0; i < n; i++) {
+		ngshim_clock_advance(tick);
+		inject(tx, 100);
+	}
+	ngshim_clock_advance(1000000);
+	info("duplication dup5", (sinks[1].frames - n) * 100.0 / n, 5, "%");
+	ngshim_node_shutdown(node);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: rfee_bench [-a] [-n frames] [bench ...]\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	const struct bench *b;
+	uint64_t frames = 200000;
+	int accuracy = 0;
+	int ch, i;
+
+	while ((ch = getopt(argc, argv, "an:")) != -1) {
+		switch (ch) {
+		case 'a':
+			accuracy = 1;
+			break;
+		case 'n':
+			frames = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (ngshim_load(ngshim_type) != 0) {
+		fprintf(stderr, "can't load ng_rfee\n");
+		return (2);
+	}
+
+	if (accuracy) {
+		acc_throughput(10000000, 1000);
+		acc_throughput(54000000, 1500);
+		acc_throughput(1000000, 64);
+		acc_delay("0.5", 0.5);
+		acc_delay("2.5", 2.5);
+		acc_delay("20", 20);
+		acc_loss("1E-5", 1e-5, 1000);
+		acc_loss("1E-6", 1e-6, 1500);
+		acc_loss("3E-4", 3e-4, 64);
+		acc_jitter_dup();
+		ngshim_unload(ngshim_type);
+		printf("%d failure(s)\n", failures);
+		return (failures != 0);
+	}
+
+	for (b = benches; b->name != NULL; b++) {
+		if (argc > 0) {
+			for (i = 0; i < argc; i++)
+				if (strcmp(argv[i], b->name) == 0)
+					break;
+			if (i == argc)
+				continue;
+		}
+		run_bench(b, frames);
+	}
+	ngshim_unload(ngshim_type);
+	return (0);
+}
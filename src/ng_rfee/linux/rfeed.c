@@ -0,0 +1,693 @@
+/*-
+ * Copyright (c) 2026 University of Zagreb
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * rfeed -- Linux userspace WLAN emulation engine.
+ *
+ * Hosts an unmodified ng_rfee.c on top of the ngshim netgraph stand-in,
+ * with the shim's clock slaved to CLOCK_MONOTONIC.  Each link hook of the
+ * node is bound to a network interface (normally the host side of a veth
+ * pair) through an AF_PACKET socket with TPACKET_V3 receive and transmit
+ * rings.  Frames are picked up from the rx ring a block at a time, passed
+ * through the node, and written straight into the tx ring of the
+ * destination interface; the kernel is kicked once per interface per
+ * loop iteration.  Delayed frames are released by the shim's callout
+ * wheel, which is run from the main loop with ppoll(2) timing out at the
+ * next tick whenever the node has anything queued.
+ *
+ * The engine is controlled over a UNIX domain socket, one command per
+ * connection:
+ *
+ *	attach <hook> <ifname>		bind link hook to an interface
+ *	detach <hook>			unbind and remove link hook
+ *	setlinkcfg <hook> <cfg>		as with ngctl msg rfee: setlinkcfg
+ *	getlinkcfg <hook>		as with ngctl msg rfee: getlinkcfg
+ *	stats				per-hook frame counters
+ *	shutdown			terminate the daemon
+ *
+ * The reply is "ok" or "error: <reason>", optionally followed by output.
+ */
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ngshim.h"
+#include "../ng_rfee.h"
+
+#define	RFEED_SOCK	"/var/run/rfeed.sock"
+#define	MAX_PORTS	2048
+#define	CMD_MAX		16384
+#define	ETH_FRAME_MAX	65536
+#define	TX_FRAME_SIZE	2048
+#define	TX_DATA_OFF	TPACKET_ALIGN(sizeof(struct tpacket3_hdr))
+#define	TX_DATA_MAX	(TX_FRAME_SIZE - TX_DATA_OFF)
+
+/* A link hook bound to a network interface */
+struct port {
+	hook_p		hook;
+	char		ifname[IFNAMSIZ];
+	int		fd;
+	uint8_t		*ring;		/* rx blocks, followed by tx frames */
+	size_t		ring_len;
+	uint8_t		*tx_ring;
+	u_int		rx_blk;		/* next rx block to look at */
+	u_int		tx_slot;	/* next tx frame to fill */
+	int		tx_kick;	/* tx frames queued since last kick */
+	uint64_t	rx_frames;
+	uint64_t	tx_frames;
+	uint64_t	tx_drops;
+};
+
+static struct port *ports[MAX_PORTS];
+static struct pollfd pfds[MAX_PORTS + 2];
+static int nports;
+static node_p node;
+static volatile sig_atomic_t quit;
+
+/* Ring geometry, per interface */
+static u_int rx_blk_size = 1 << 18;
+static u_int rx_blk_nr = 8;
+static u_int tx_frame_nr = 512;
+
+static uint64_t
+clock_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static void
+port_kick(struct port *p)
+{
+
+	if (p->tx_kick == 0)
+		return;
+	p->tx_kick = 0;
+	if (sendto(p->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 &&
+	    errno != EAGAIN && errno != ENOBUFS)
+		fprintf(stderr, "rfeed: %s: sendto: %s\n", p->ifname,
+		    strerror(errno));
+}
+
+/*
+ * Transmit path: the node's sink for a link hook.  The frame is copied
+ * into the next free tx ring slot; the kernel is kicked from the main loop
+ * once per batch, or earlier when the ring is filling up.
+ */
+static void
+port_tx(hook_p hook, struct mbuf *m, void *arg)
+{
+	struct port *p = arg;
+	struct tpacket3_hdr *th;
+	int len;
+
+	len = m->m_pkthdr.len;
+	th = (struct tpacket3_hdr *)(p->tx_ring + p->tx_slot * TX_FRAME_SIZE);
+	if (th->tp_status != TP_STATUS_AVAILABLE) {
+		/* Ring full: push out what is queued and look again. */
+		port_kick(p);
+		__sync_synchronize();
+	}
+	if (len > TX_DATA_MAX || th->tp_status != TP_STATUS_AVAILABLE) {
+		p->tx_drops++;
+		m_freem(m);
+		return;
+	}
+	m_copydata(m, 0, len, (caddr_t)th + TX_DATA_OFF);
+	m_freem(m);
+	th->tp_len = len;
+	th->tp_snaplen = len;
+	th->tp_next_offset = 0;
+	__sync_synchronize();
+	th->tp_status = TP_STATUS_SEND_REQUEST;
+	if (++p->tx_slot == tx_frame_nr)
+		p->tx_slot = 0;
+	p->tx_frames++;
+	if (++p->tx_kick >= tx_frame_nr / 4)
+		port_kick(p);
+}
+
+/*
+ * Complete the TCP or UDP checksum of a frame which was handed to us with
+ * only the pseudo-header sum filled in (TP_STATUS_CSUMNOTREADY), as is
+ * the case for anything sent out of a veth with checksum offload enabled.
+ */
+static uint16_t
+in_cksum(const uint8_t *p, u_int len, uint32_t sum)
+{
+
+	for (; len > 1; p += 2, len -= 2)
+		sum += (p[0] << 8) | p[1];
+	if (len > 0)
+		sum += p[0] << 8;
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return (~sum & 0xffff);
+}
+
+static void
+csum_fixup(uint8_t *frame, u_int len)
+{
+	uint8_t *l3, *l4;
+	uint32_t sum;
+	u_int off, l4len, proto, csoff;
+	uint16_t type, cs;
+
+	off = 2 * ETH_ALEN;
+	type = (frame[off] << 8) | frame[off + 1];
+	while ((type == ETH_P_8021Q || type == ETH_P_8021AD) &&
+	    off + 6 <= len) {
+		off += 4;
+		type = (frame[off] << 8) | frame[off + 1];
+	}
+	off += 2;
+	l3 = frame + off;
+	if (type == ETH_P_IP && off + 20 <= len) {
+		if ((l3[6] & 0x3f) != 0 || l3[7] != 0)
+			return;		/* fragment */
+		proto = l3[9];
+		l4 = l3 + (l3[0] & 0x0f) * 4;
+		l4len = ((l3[2] << 8) | l3[3]) - (l4 - l3);
+		sum = in_cksum(l3 + 12, 8, 0) ^ 0xffff;
+	} else if (type == ETH_P_IPV6 && off + 40 <= len) {
+		proto = l3[6];
+		l4 = l3 + 40;
+		l4len = (l3[4] << 8) | l3[5];
+		sum = in_cksum(l3 + 8, 32, 0) ^ 0xffff;
+	} else
+		return;
+	if (proto == IPPROTO_TCP)
+		csoff = 16;
+	else if (proto == IPPROTO_UDP)
+		csoff = 6;
+	else
+		return;
+	if (l4 + l4len > frame + len || l4len < csoff + 2)
+		return;
+	sum += proto + l4len;
+	l4[csoff] = l4[csoff + 1] = 0;
+	cs = in_cksum(l4, l4len, sum);
+	if (cs == 0 && proto == IPPROTO_UDP)
+		cs = 0xffff;
+	l4[csoff] = cs >> 8;
+	l4[csoff + 1] = cs & 0xff;
+}
+
+/*
+ * Receive path: hand every frame of every completed rx block to the node.
+ * VLAN tags stripped by the kernel are put back in place, so that the
+ * frame leaves the far end the way it entered.
+ */
+static void
+port_rx(struct port *p)
+{
+	struct tpacket_block_desc *bd;
+	struct tpacket3_hdr *th;
+	struct sockaddr_ll *sll;
+	static uint8_t vbuf[ETH_FRAME_MAX];
+	struct mbuf *m;
+	uint8_t *data;
+	uint16_t tag[2];
+	u_int i, n, len;
+
+	for (;;) {
+		bd = (struct tpacket_block_desc *)
+		    (p->ring + p->rx_blk * rx_blk_size);
+		if ((bd->hdr.bh1.block_status & TP_STATUS_USER) == 0)
+			break;
+		__sync_synchronize();
+		n = bd->hdr.bh1.num_pkts;
+		th = (struct tpacket3_hdr *)
+		    ((uint8_t *)bd + bd->hdr.bh1.offset_to_first_pkt);
+		for (i = 0; i < n; i++, th = (struct tpacket3_hdr *)
+		    ((uint8_t *)th + th->tp_next_offset)) {
+			sll = (struct sockaddr_ll *)
+			    ((uint8_t *)th + TPACKET_ALIGN(sizeof(*th)));
+			if (sll->sll_pkttype == PACKET_OUTGOING)
+				continue;
+			data = (uint8_t *)th + th->tp_mac;
+			len = th->tp_snaplen;
+			if ((th->tp_status & TP_STATUS_CSUMNOTREADY) &&
+			    len > 2 * ETH_ALEN + 2)
+				csum_fixup(data, len);
+			if ((th->tp_status & TP_STATUS_VLAN_VALID) &&
+			    len >= 2 * ETH_ALEN && len <= ETH_FRAME_MAX - 4) {
+				bcopy(data, vbuf, 2 * ETH_ALEN);
+				tag[0] = htons(th->tp_status &
+				    TP_STATUS_VLAN_TPID_VALID ?
+				    th->hv1.tp_vlan_tpid : ETH_P_8021Q);
+				tag[1] = htons(th->hv1.tp_vlan_tci);
+				bcopy(tag, vbuf + 2 * ETH_ALEN, sizeof(tag));
+				bcopy(data + 2 * ETH_ALEN,
+				    vbuf + 2 * ETH_ALEN + sizeof(tag),
+				    len - 2 * ETH_ALEN);
+				data = vbuf;
+				len += sizeof(tag);
+			}
+			m = ngshim_m_frombuf(data, len, 0);
+			if (m == NULL)
+				continue;
+			p->rx_frames++;
+			ngshim_rcvdata(p->hook, m);
+		}
+		__sync_synchronize();
+		bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+		if (++p->rx_blk == rx_blk_nr)
+			p->rx_blk = 0;
+	}
+}
+
+static int
+port_open(struct port *p)
+{
+	struct tpacket_req3 req;
+	struct sockaddr_ll sll;
+	size_t rx_len, tx_len;
+	int ver = TPACKET_V3, one = 1;
+	u_int ifindex;
+
+	if ((ifindex = if_nametoindex(p->ifname)) == 0)
+		return (ENXIO);
+	p->fd = socket(AF_PACKET, SOCK_RAW, 0);
+	if (p->fd < 0)
+		return (errno);
+	if (setsockopt(p->fd, SOL_PACKET, PACKET_VERSION, &ver,
+	    sizeof(ver)) < 0)
+		goto fail;
+
+	bzero(&req, sizeof(req));
+	req.tp_block_size = rx_blk_size;
+	req.tp_block_nr = rx_blk_nr;
+	req.tp_frame_size = TX_FRAME_SIZE;
+	req.tp_frame_nr = rx_blk_size / TX_FRAME_SIZE * rx_blk_nr;
+	req.tp_retire_blk_tov = 1;	/* msec, bounds rx batching latency */
+	if (setsockopt(p->fd, SOL_PACKET, PACKET_RX_RING, &req,
+	    sizeof(req)) < 0)
+		goto fail;
+	rx_len = (size_t)req.tp_block_size * req.tp_block_nr;
+
+	bzero(&req, sizeof(req));
+	req.tp_block_size = TX_FRAME_SIZE * 32;
+	req.tp_block_nr = tx_frame_nr / 32;
+	req.tp_frame_size = TX_FRAME_SIZE;
+	req.tp_frame_nr = tx_frame_nr;
+	if (setsockopt(p->fd, SOL_PACKET, PACKET_TX_RING, &req,
+	    sizeof(req)) < 0)
+		goto fail;
+	tx_len = (size_t)req.tp_block_size * req.tp_block_nr;
+
+	/* Our own transmissions must not loop back into the node. */
+	(void)setsockopt(p->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one,
+	    sizeof(one));
+	(void)setsockopt(p->fd, SOL_PACKET, PACKET_QDISC_BYPASS, &one,
+	    sizeof(one));
+
+	p->ring_len = rx_len + tx_len;
+	p->ring = mmap(NULL, p->ring_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, p->fd, 0);
+	if (p->ring == MAP_FAILED) {
+		p->ring = NULL;
+		goto fail;
+	}
+	p->tx_ring = p->ring + rx_len;
+
+	bzero(&sll, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	sll.sll_ifindex = ifindex;
+	if (bind(p->fd, (struct sockaddr *)&sll, sizeof(sll)) < 0)
+		goto fail;
+	return (0);
+
+fail:
+	ver = errno;
+	if (p->ring != NULL)
+		munmap(p->ring, p->ring_len);
+	close(p->fd);
+	return (ver);
+}
+
+static void
+port_close(struct port *p)
+{
+
+	port_kick(p);
+	munmap(p->ring, p->ring_len);
+	close(p->fd);
+}
+
+static void
+pfds_rebuild(int ctl)
+{
+	int i;
+
+	pfds[0].fd = ctl;
+	pfds[0].events = POLLIN;
+	for (i = 0; i < nports; i++) {
+		pfds[i + 1].fd = ports[i]->fd;
+		pfds[i + 1].events = POLLIN;
+	}
+}
+
+static struct port *
+port_find(const char *hookname)
+{
+	int i;
+
+	for (i = 0; i < nports; i++)
+		if (strcmp(NG_HOOK_NAME(ports[i]->hook), hookname) == 0)
+			return (ports[i]);
+	return (NULL);
+}
+
+static int
+cmd_attach(const char *hookname, const char *ifname)
+{
+	struct port *p;
+	int error;
+
+	if (nports == MAX_PORTS)
+		return (ENOSPC);
+	if (port_find(hookname) != NULL)
+		return (EEXIST);
+	if ((p = calloc(1, sizeof(*p))) == NULL)
+		return (ENOMEM);
+	snprintf(p->ifname, sizeof(p->ifname), "%s", ifname);
+	if ((error = port_open(p)) != 0) {
+		free(p);
+		return (error);
+	}
+	p->hook = ngshim_hook_create(node, hookname, port_tx, p);
+	if (p->hook == NULL) {
+		port_close(p);
+		free(p);
+		return (EINVAL);
+	}
+	ports[nports++] = p;
+	return (0);
+}
+
+static int
+cmd_detach(const char *hookname)
+{
+	struct port *p;
+	int i;
+
+	for (i = 0; i < nports; i++)
+		if (strcmp(NG_HOOK_NAME(ports[i]->hook), hookname) == 0)
+			break;
+	if (i == nports)
+		return (ENOENT);
+	p = ports[i];
+	ports[i] = ports[--nports];
+	ngshim_hook_disconnect(p->hook);
+	port_close(p);
+	free(p);
+	return (0);
+}
+
+/*
+ * Execute one control command, leaving the reply in 'out'.
+ */
+static void
+control_exec(char *cmd, char *out, int outlen)
+{
+	char *verb, *arg1, *arg2, *body;
+	int error, i, n, cmdlen;
+
+	cmd[strcspn(cmd, "\r\n")] = '\0';
+	cmdlen = strlen(cmd);
+	body = out + 3;
+	*body = '\0';
+	verb = strtok(cmd, " \t");
+	if (verb == NULL) {
+		error = EINVAL;
+	} else if (strcmp(verb, "attach") == 0) {
+		arg1 = strtok(NULL, " \t");
+		arg2 = strtok(NULL, " \t");
+		error = arg2 == NULL ? EINVAL : cmd_attach(arg1, arg2);
+	} else if (strcmp(verb, "detach") == 0) {
+		arg1 = strtok(NULL, " \t");
+		error = arg1 == NULL ? EINVAL : cmd_detach(arg1);
+	} else if (strcmp(verb, "setlinkcfg") == 0 ||
+	    strcmp(verb, "getlinkcfg") == 0) {
+		/* Undo strtok's damage and pass the line on verbatim. */
+		if (verb + strlen(verb) < cmd + cmdlen)
+			verb[strlen(verb)] = ' ';
+		error = ngshim_ascii_msg(node, verb, body, outlen - 4);
+	} else if (strcmp(verb, "stats") == 0) {
+		for (i = 0, n = 0; i < nports && n < outlen - 4; i++)
+			n += snprintf(body + n, outlen - 4 - n,
+			    "%s %s rx %ju tx %ju drop %ju\n",
+			    NG_HOOK_NAME(ports[i]->hook), ports[i]->ifname,
+			    (uintmax_t)ports[i]->rx_frames,
+			    (uintmax_t)ports[i]->tx_frames,
+			    (uintmax_t)ports[i]->tx_drops);
+		error = 0;
+	} else if (strcmp(verb, "shutdown") == 0) {
+		quit = 1;
+		error = 0;
+	} else
+		error = EOPNOTSUPP;
+
+	if (error != 0)
+		snprintf(out, outlen, "error: %s\n", strerror(error));
+	else {
+		n = strlen(body);
+		if (n > 0 && body[n - 1] != '\n' && n < outlen - 4)
+			strcpy(body + n, "\n");
+		memcpy(out, "ok\n", 3);
+	}
+}
+
+static void
+control_accept(int ctl)
+{
+	static char cmd[CMD_MAX], out[CMD_MAX];
+	ssize_t len, n;
+	int fd;
+
+	if ((fd = accept(ctl, NULL, NULL)) < 0)
+		return;
+	len = 0;
+	while (len < CMD_MAX - 1 &&
+	    (n = read(fd, cmd + len, CMD_MAX - 1 - len)) > 0) {
+		len += n;
+		if (memchr(cmd + len - n, '\n', n) != NULL)
+			break;
+	}
+	cmd[len] = '\0';
+	control_exec(cmd, out, sizeof(out));
+	(void)write(fd, out, strlen(out));
+	close(fd);
+}
+
+static int
+control_open(const char *path)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	bzero(&sun, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return (-1);
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+	    listen(fd, 16) < 0) {
+		close(fd);
+		return (-1);
+	}
+	return (fd);
+}
+
+/*
+ * Client mode: send one command to a running daemon and print the reply.
+ */
+static int
+client(const char *path, int argc, char **argv)
+{
+	struct sockaddr_un sun;
+	char buf[CMD_MAX];
+	ssize_t n;
+	int fd, i, len, ok;
+
+	bzero(&sun, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+	    connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		fprintf(stderr, "rfeed: %s: %s\n", path, strerror(errno));
+		return (2);
+	}
+	for (i = 0, len = 0; i < argc && len < CMD_MAX - 1; i++)
+		len += snprintf(buf + len, CMD_MAX - len, "%s%s",
+		    argv[i], i + 1 < argc ? " " : "\n");
+	if (write(fd, buf, strlen(buf)) < 0) {
+		fprintf(stderr, "rfeed: write: %s\n", strerror(errno));
+		return (2);
+	}
+	ok = -1;
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		if (ok < 0)
+			ok = n >= 2 && strncmp(buf, "ok", 2) == 0;
+		fwrite(buf, 1, n, stdout);
+	}
+	close(fd);
+	return (ok == 1 ? 0 : 1);
+}
+
+static void
+onsignal(int sig)
+{
+
+	quit = 1;
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr,
+	    "usage: rfeed [-d] [-H hz] [-b blksize] [-n blocks] [-t txframes]"
+	    " [-s sockpath]\n"
+	    "       rfeed [-s sockpath] -c command [args ...]\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *sockpath = RFEED_SOCK;
+	struct timespec ts, *tsp;
+	uint64_t now, next;
+	int ch, ctl, i, daemonize = 0, clientmode = 0;
+
+	while ((ch = getopt(argc, argv, "b:cdH:n:s:t:")) != -1) {
+		switch (ch) {
+		case 'b':
+			rx_blk_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			clientmode = 1;
+			break;
+		case 'd':
+			daemonize = 1;
+			break;
+		case 'H':
+			ngshim_clock_hz(atoi(optarg));
+			break;
+		case 'n':
+			rx_blk_nr = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			sockpath = optarg;
+			break;
+		case 't':
+			tx_frame_nr = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (clientmode) {
+		if (argc == 0)
+			usage();
+		return (client(sockpath, argc, argv));
+	}
+	if (argc != 0 || hz <= 0 || hz > 1000000 || rx_blk_nr == 0 ||
+	    rx_blk_size < TX_FRAME_SIZE || rx_blk_size % getpagesize() != 0 ||
+	    tx_frame_nr < 32 || tx_frame_nr % 32 != 0)
+		usage();
+
+	ngshim_clock_set(clock_usec());
+	if (ngshim_load(ngshim_type) != 0 ||
+	    (node = ngshim_node_create(ngshim_type, "rfee")) == NULL) {
+		fprintf(stderr, "rfeed: can't create ng_rfee node\n");
+		return (1);
+	}
+	if ((ctl = control_open(sockpath)) < 0) {
+		fprintf(stderr, "rfeed: %s: %s\n", sockpath, strerror(errno));
+		return (1);
+	}
+	if (daemonize && daemon(0, 0) < 0) {
+		fprintf(stderr, "rfeed: daemon: %s\n", strerror(errno));
+		return (1);
+	}
+	signal(SIGINT, onsignal);
+	signal(SIGTERM, onsignal);
+	signal(SIGPIPE, SIG_IGN);
+
+	while (!quit) {
+		pfds_rebuild(ctl);
+		tsp = NULL;
+		if (ngshim_callouts_pending()) {
+			/* Sleep until the next tick boundary at most. */
+			now = clock_usec();
+			next = (now / tick + 1) * tick;
+			ts.tv_sec = (next - now) / 1000000;
+			ts.tv_nsec = (next - now) % 1000000 * 1000;
+			tsp = &ts;
+		}
+		if (ppoll(pfds, nports + 1, tsp, NULL) < 0 && errno != EINTR)
+			break;
+
+		ngshim_clock_set(clock_usec());
+		for (i = 0; i < nports; i++)
+			if (pfds[i + 1].revents & POLLIN)
+				port_rx(ports[i]);
+		for (i = 0; i < nports; i++)
+			port_kick(ports[i]);
+		if (pfds[0].revents & POLLIN)
+			control_accept(ctl);
+	}
+
+	while (nports > 0)
+		cmd_detach(NG_HOOK_NAME(ports[0]->hook));
+	ngshim_node_shutdown(node);
+	ngshim_unload(ngshim_type);
+	close(ctl);
+	unlink(sockpath);
+	return (0);
+}
@@ -567,7 +567,7 @@ ng_rfee_dlq_enqueue(hook_priv_p hp, struct mbuf *m, struct timeval *now,
 		NG_SEND_DATA_ONLY(error, hp->hook, m);
 		return (error);
 	}
-	delay = delay * 100 - 50; /* internal to usec conversion */
+	delay = delay * 100; /* internal to usec conversion */
 
 	ngd_h = uma_zalloc(ngd_zone, M_NOWAIT);
 	KASSERT((ngd_h != NULL), ("ngd_h zalloc failed"));
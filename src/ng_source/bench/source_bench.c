@@ -0,0 +1,900 @@
+/*-
+ * Copyright (c) 2026 University of Zagreb
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * source_bench -- drives an unmodified ng_source.c, linked against the
+ * ngshim userspace netgraph stand-in.
+ *
+ * Without arguments, runs the benchmark suite: the node replays queued
+ * UDP frames of 64 and 1500 bytes, as they are or with a counter or a
+ * timestamp embedded or with MACs, addresses and ports generated, with or
+ * without fixing up the checksums, as fast as the virtual clock lets it,
+ * and the wall-clock rate is reported.
+ *
+ * With -c, runs the correctness suite instead: for random frames and
+ * embedding, generator and checksum settings, every frame sent is
+ * compared with the queued one as modified by a reference model, and the
+ * queued frames must come out as they went in once embedding is turned
+ * off again.  When the checksums are those of the frames and nothing is
+ * embedded across them, the IPv4 and UDP checksums of every frame sent
+ * must also verify.
+ *
+ * All modes exit non-zero on failure.
+ */
+
+#include <unistd.h>
+
+#include "ngshim.h"
+#include "../ng_source.h"
+
+#define	FRAME_MAX	2048
+#define	QUEUE_MAX	8
+
+/*
+ * Frames
+ */
+struct frame {
+	int	len;
+	u_char	data[FRAME_MAX];
+};
+
+static struct frame queue[QUEUE_MAX];
+static int nqueue;
+
+static uint64_t rng = 0x9e3779b97f4a7c15ULL;
+
+static void
+rng_seed(uint64_t seed)
+{
+
+	rng = seed * 0x9e3779b97f4a7c15ULL + 1;
+}
+
+/* xorshift64*, so that the node's own random() is left alone */
+static uint32_t
+rnd(void)
+{
+
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return ((rng * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+static int
+rnd_range(int lo, int hi)
+{
+
+	return (lo + rnd() % (hi - lo + 1));
+}
+
+/* One's complement sum of 'len' bytes taken as 16-bit words, onto 'sum' */
+static uint32_t
+cksum_add(const u_char *p, int len, uint32_t sum)
+{
+	int i;
+
+	for (i = 0; i + 1 < len; i += 2)
+		sum += p[i] << 8 | p[i + 1];
+	if (i < len)
+		sum += p[i] << 8;
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return (sum);
+}
+
+/* Ethernet / IPv4 / UDP of 'len' bytes, with checksums, flow 'flow' */
+static void
+frame_build(struct frame *fr, int len, int flow)
+{
+	u_char *f = fr->data;
+	uint32_t c;
+	int i;
+
+	bzero(f, len);
+	fr->len = len;
+	f[0] = 0x02; f[5] = 0x01;
+	f[6] = 0x02; f[11] = 0x02;
+	f[12] = 0x08; f[13] = 0x00;
+	f[14] = 0x45;
+	f[16] = (len - 14) >> 8; f[17] = len - 14;
+	f[18] = flow >> 8; f[19] = flow;
+	f[22] = 64;
+	f[23] = 17;
+	f[26] = 10; f[27] = 0; f[28] = 0; f[29] = 1;
+	f[30] = 10; f[31] = 1; f[32] = flow >> 8; f[33] = flow;
+	f[34] = 0x04; f[35] = 0x00;
+	f[36] = 0x00; f[37] = 0x09;
+	f[38] = (len - 34) >> 8; f[39] = len - 34;
+	for (i = 42; i < len; i++)
+		f[i] = i * 7 + flow;
+	c = ~cksum_add(f + 14, 20, 0);
+	f[24] = c >> 8; f[25] = c;
+	c = cksum_add(f + 26, 8, 17 + len - 34);
+	c = ~cksum_add(f + 34, len - 34, c) & 0xffff;
+	if (c == 0)
+		c = 0xffff;
+	f[40] = c >> 8; f[41] = c;
+}
+
+/*
+ * The node
+ */
+typedef void sink_fn(struct mbuf *);
+
+static sink_fn *sink_check;
+static uint64_t sunk;
+
+static void
+sink_rcv(hook_p hook, struct mbuf *m, void *arg)
+{
+
+	sunk++;
+	if (sink_check != NULL)
+		(*sink_check)(m);
+	m_freem(m);
+}
+
+static void
+node_msg(node_p node, uint32_t cmd, const void *data, int len)
+{
+	int error;
+
+	if ((error = ngshim_msg(node, NGM_SOURCE_COOKIE, cmd, data, len,
+	    NULL)) != 0) {
+		fprintf(stderr, "message %u: %s\n", cmd, strerror(error));
+		exit(2);
+	}
+}
+
+/* A node with the frames in 'queue' queued for sending */
+static node_p
+node_create(int seglen)
+{
+	node_p node;
+	hook_p in;
+	int i;
+
+	node = ngshim_node_create(ngshim_type, "source");
+	if (node == NULL) {
+		fprintf(stderr, "can't create node\n");
+		exit(2);
+	}
+	in = ngshim_hook_create(node, NG_SOURCE_HOOK_INPUT, NULL, NULL);
+	if (in == NULL || ngshim_hook_create(node, NG_SOURCE_HOOK_OUTPUT,
+	    sink_rcv, NULL) == NULL) {
+		fprintf(stderr, "can't create hooks\n");
+		exit(2);
+	}
+	for (i = 0; i < nqueue; i++)
+		ngshim_rcvdata(in, ngshim_m_frombuf(queue[i].data,
+		    queue[i].len, seglen));
+	return (node);
+}
+
+/* Send 'packets' frames, running the clock until the node stops */
+static void
+node_run(node_p node, uint64_t packets)
+{
+
+	node_msg(node, NGM_SOURCE_START, &packets, sizeof(packets));
+	while (ngshim_callouts_pending())
+		ngshim_clock_advance(tick);
+}
+
+/*
+ * Benchmarks
+ */
+struct bench {
+	const char	*name;
+	int		len;
+	int		counter;	/* width of a counter */
+	int		timestamp;	/* embed one behind the UDP header */
+	int		csum;		/* fix up the IPv4 and UDP checksums */
+	int		flows;		/* vary MACs, addresses and ports */
+	int		cntoff;		/* of the counter, if not the IP ID */
+};
+
+static const struct bench benches[] = {
+	{ "64",			64,	0,	0,	0,	0 },
+	{ "64-cnt",		64,	2,	0,	0,	0 },
+	{ "64-cnt-csum",	64,	2,	0,	1,	0 },
+	{ "64-ts",		64,	0,	1,	0,	0 },
+	{ "64-ts-csum",		64,	0,	1,	1,	0 },
+	{ "64-flows",		64,	0,	0,	1,	1 },
+	{ "1500",		1500,	0,	0,	0,	0 },
+	{ "1500-cnt",		1500,	2,	0,	0,	0 },
+	{ "1500-cnt400",	1500,	4,	0,	0,	0,	400 },
+	{ "1500-seq",		1500,	4,	0,	0,	0,	1400 },
+	{ "1500-cnt-csum",	1500,	2,	0,	1,	0 },
+	{ "1500-ts",		1500,	0,	1,	0,	0 },
+	{ "1500-ts-csum",	1500,	0,	1,	1,	0 },
+	{ "1500-flows",		1500,	0,	0,	1,	1 },
+	{ NULL }
+};
+
+static void
+run_bench(const struct bench *b, uint64_t frames)
+{
+	struct ng_source_embed_cnt_info cnt;
+	struct ng_source_embed_info ts;
+	struct ng_source_embed_csum_info cs;
+	struct {
+		struct ng_source_gen	gen;
+		u_char			values[4 * 6];
+	} g;
+	node_p node;
+	uint64_t t0, t1;
+	int i;
+	double ns;
+
+	frame_build(&queue[0], b->len, 1);
+	nqueue = 1;
+	node = node_create(0);
+	if (b->counter) {
+		bzero(&cnt, sizeof(cnt));
+		cnt.offset = b->cntoff ? b->cntoff : 18;
+		cnt.flags = NGM_SOURCE_EMBED_ENABLE;
+		cnt.width = b->counter;
+		cnt.max_val = b->cntoff ? 0xffffffff : 0xffff;
+		cnt.increment = 1;
+		node_msg(node, NGM_SOURCE_SET_COUNTER, &cnt, sizeof(cnt));
+	}
+	if (b->timestamp) {
+		bzero(&ts, sizeof(ts));
+		ts.offset = 42;
+		ts.flags = NGM_SOURCE_EMBED_ENABLE;
+		node_msg(node, NGM_SOURCE_SET_TIMESTAMP, &ts, sizeof(ts));
+	}
+	if (b->csum) {
+		bzero(&cs, sizeof(cs));
+		cs.offset = 24;
+		cs.start = 14;
+		cs.end = 34;
+		cs.flags = NGM_SOURCE_EMBED_ENABLE;
+		cs.type = NG_SOURCE_CSUM_INET;
+		node_msg(node, NGM_SOURCE_SET_CSUM, &cs, sizeof(cs));
+		cs.offset = 40;
+		cs.start = 26;
+		cs.end = 0xffff;
+		cs.type = NG_SOURCE_CSUM_UDP;
+		cs.index = 1;
+		node_msg(node, NGM_SOURCE_SET_CSUM, &cs, sizeof(cs));
+	}
+	if (b->flows) {
+		/* One of four destination MACs */
+		bzero(&g, sizeof(g));
+		g.gen.width = 6;
+		g.gen.type = NG_SOURCE_GEN_LIST;
+		g.gen.step = 1;
+		g.gen.count = 4;
+		for (i = 0; i < 4; i++)
+			g.values[i * 6 + 5] = i + 1;
+		node_msg(node, NGM_SOURCE_ADD_GEN, &g, sizeof(g));
+		/* 2^20 sources from 10.0.0.0 at random, 2^16 destinations */
+		bzero(&g, sizeof(g));
+		g.gen.offset = 26;
+		g.gen.width = 4;
+		g.gen.type = NG_SOURCE_GEN_RANDOM;
+		g.gen.count = 1 << 20;
+		g.gen.base[0] = 10;
+		node_msg(node, NGM_SOURCE_ADD_GEN, &g.gen, sizeof(g.gen));
+		g.gen.offset = 30;
+		g.gen.type = NG_SOURCE_GEN_COUNTER;
+		g.gen.step = 1;
+		g.gen.count = 1 << 16;
+		g.gen.base[1] = 1;
+		node_msg(node, NGM_SOURCE_ADD_GEN, &g.gen, sizeof(g.gen));
+		/* Any source port */
+		bzero(&g, sizeof(g));
+		g.gen.offset = 34;
+		g.gen.width = 2;
+		g.gen.type = NG_SOURCE_GEN_RANDOM;
+		node_msg(node, NGM_SOURCE_ADD_GEN, &g.gen, sizeof(g.gen));
+	}
+	sunk = 0;
+	t0 = ngshim_wallclock_ns();
+	node_run(node, frames);
+	t1 = ngshim_wallclock_ns();
+	ngshim_node_shutdown(node);
+
+	ns = (double)(t1 - t0) / sunk;
+	printf("%-14s %5dB %s%s%s%s  %8.2f Mpps %8.1f ns/pkt\n", b->name,
+	    b->len, b->counter ? "counter  " : "         ",
+	    b->timestamp ? "timestamp " : "          ",
+	    b->flows ? "flows " : "      ",
+	    b->csum ? "csum" : "    ", 1e3 / ns, ns);
+}
+
+/*
+ * Correctness
+ */
+static struct ng_source_embed_cnt_info cnts[NG_SOURCE_COUNTERS];
+static struct ng_source_embed_info tstamp;
+static struct ng_source_embed_csum_info csums[NG_SOURCE_CSUMS];
+static int nextq, verify, failures, failed;
+
+/* Field generators, in the order the node applies them */
+#define	GENS_MAX	8
+
+struct refgen {
+	struct ng_source_gen	*gen;
+	uint32_t		index;
+	u_char			cur[NG_SOURCE_GEN_MAXWIDTH];
+};
+
+static struct refgen refgens[GENS_MAX];
+static int nrefgens;
+static uint64_t refrng;
+
+/* splitmix64, as seeded into the node */
+static uint64_t
+ref_random(void)
+{
+	uint64_t z;
+
+	z = (refrng += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return (z ^ (z >> 31));
+}
+
+static int
+gen_islist(const struct ng_source_gen *gen)
+{
+
+	return (gen->type == NG_SOURCE_GEN_LIST ||
+	    gen->type == NG_SOURCE_GEN_RANDLIST);
+}
+
+/* The list entry at the index, or the base plus the index */
+static void
+ref_gen_value(struct refgen *rg)
+{
+	const struct ng_source_gen *gen = rg->gen;
+	uint32_t rest;
+	int c, i;
+
+	if (gen_islist(gen)) {
+		bcopy(gen->values + rg->index * gen->width, rg->cur,
+		    gen->width);
+		return;
+	}
+	rest = rg->index;
+	for (c = 0, i = gen->width - 1; i >= 0; i--, rest >>= 8) {
+		c += gen->base[i] + (rest & 0xff);
+		rg->cur[i] = c;
+		c >>= 8;
+	}
+}
+
+static void
+ref_gen_next(struct refgen *rg)
+{
+	const struct ng_source_gen *gen = rg->gen;
+	int64_t period, idx;
+	uint64_t r;
+	int i;
+
+	switch (gen->type) {
+	case NG_SOURCE_GEN_COUNTER:
+	case NG_SOURCE_GEN_LIST:
+		period = gen->count ? gen->count : 1LL << 32;
+		idx = ((int64_t)rg->index + gen->step) % period;
+		rg->index = idx < 0 ? idx + period : idx;
+		break;
+	case NG_SOURCE_GEN_RANDOM:
+		if (gen->count == 0) {
+			for (i = 0; i < gen->width; i += sizeof(r)) {
+				r = ref_random();
+				bcopy(&r, rg->cur + i,
+				    imin(sizeof(r), gen->width - i));
+			}
+			return;
+		}
+		/* FALLTHROUGH */
+	case NG_SOURCE_GEN_RANDLIST:
+		rg->index = (ref_random() >> 32) * gen->count >> 32;
+		break;
+	}
+	ref_gen_value(rg);
+}
+
+/* One's complement sum over the span of each checksum */
+static void
+ref_spans(const u_char *f, int len, uint32_t *sums)
+{
+	struct ng_source_embed_csum_info *cs;
+	int i, end;
+
+	for (i = 0; i < NG_SOURCE_CSUMS; i++) {
+		cs = &csums[i];
+		end = imin(cs->end, len);
+		sums[i] = cs->start < end ?
+		    cksum_add(f + cs->start, end - cs->start, 0) : 0;
+	}
+}
+
+/*
+ * Bytes 'cp' at 'offset', where they fit.  Each checksum covering them
+ * moves by as much as the sum over its span did, not counting the other
+ * checksums' own updates.
+ */
+static void
+ref_mod(u_char *f, int len, int offset, int n, const void *cp)
+{
+	struct ng_source_embed_csum_info *cs;
+	uint32_t before[NG_SOURCE_CSUMS], after[NG_SOURCE_CSUMS], c;
+	int i;
+
+	if (offset + n > len)
+		return;
+	ref_spans(f, len, before);
+	bcopy(cp, f + offset, n);
+	ref_spans(f, len, after);
+	for (i = 0; i < NG_SOURCE_CSUMS; i++) {
+		cs = &csums[i];
+		if (!(cs->flags & NGM_SOURCE_EMBED_ENABLE) ||
+		    offset < cs->start || offset + n > cs->end ||
+		    cs->offset + 2 > len)
+			continue;
+		c = f[cs->offset] << 8 | f[cs->offset + 1];
+		if (c == 0 && cs->type == NG_SOURCE_CSUM_UDP)
+			continue;
+		c = (~c & 0xffff) + (~before[i] & 0xffff) + after[i];
+		c = ~cksum_add(NULL, 0, c) & 0xffff;
+		if (c == 0 && cs->type == NG_SOURCE_CSUM_UDP)
+			c = 0xffff;
+		f[cs->offset] = c >> 8;
+		f[cs->offset + 1] = c;
+	}
+}
+
+/* The IPv4 and UDP checksums of frame 'f' verify */
+static int
+ref_verify(const u_char *f, int len)
+{
+	uint32_t c;
+	int ulen;
+
+	if (cksum_add(f + 14, 20, 0) != 0xffff)
+		return (0);
+	ulen = f[38] << 8 | f[39];
+	if (ulen > len - 34 || (f[40] == 0 && f[41] == 0))
+		return (0);
+	c = cksum_add(f + 26, 8, f[23] + ulen);
+	return (cksum_add(f + 34, ulen, c) == 0xffff);
+}
+
+/* The frame the node is to send next, as modified */
+static void
+ref_next(u_char *f, int *len)
+{
+	struct ng_source_embed_cnt_info *cnt;
+	struct refgen *rg;
+	struct timeval now;
+	uint32_t val;
+	int i, q;
+
+	q = nextq;
+	nextq = (nextq + 1) % nqueue;
+	*len = queue[q].len;
+	bcopy(queue[q].data, f, *len);
+	for (i = 0; i < NG_SOURCE_COUNTERS; i++) {
+		cnt = &cnts[i];
+		if (!(cnt->flags & NGM_SOURCE_EMBED_ENABLE))
+			continue;
+		val = htonl(cnt->next_val);
+		ref_mod(f, *len, cnt->offset, cnt->width,
+		    (u_char *)&val + sizeof(val) - cnt->width);
+		if ((cnt->flags & NGM_SOURCE_INC_CNT_PER_LIST) &&
+		    q != nqueue - 1)
+			continue;
+		/* Wrapping around as the node does */
+		cnt->next_val += cnt->increment;
+		if (cnt->increment > 0 && cnt->next_val > cnt->max_val) {
+			cnt->next_val = cnt->min_val - 1 +
+			    (cnt->next_val - cnt->max_val);
+			if (cnt->next_val > cnt->max_val)
+				cnt->next_val = cnt->max_val;
+		} else if (cnt->increment < 0 &&
+		    cnt->next_val < cnt->min_val) {
+			cnt->next_val = cnt->max_val + 1 +
+			    (cnt->next_val - cnt->min_val);
+			if (cnt->next_val < cnt->min_val)
+				cnt->next_val = cnt->max_val;
+		}
+	}
+	for (i = 0; i < nrefgens; i++) {
+		rg = &refgens[i];
+		ref_mod(f, *len, rg->gen->offset, rg->gen->width, rg->cur);
+		if (!(rg->gen->flags & NGM_SOURCE_INC_CNT_PER_LIST) ||
+		    q == nqueue - 1)
+			ref_gen_next(rg);
+	}
+	if (tstamp.flags & NGM_SOURCE_EMBED_ENABLE) {
+		getmicrotime(&now);
+		now.tv_sec = htonl(now.tv_sec);
+		now.tv_usec = htonl(now.tv_usec);
+		ref_mod(f, *len, tstamp.offset, sizeof(now), &now);
+	}
+}
+
+static void
+check_rcv(struct mbuf *m)
+{
+	u_char want[FRAME_MAX], got[FRAME_MAX];
+	int len, i, j;
+
+	ref_next(want, &len);
+	if (failed)
+		return;
+	if (m->m_pkthdr.len == len) {
+		m_copydata(m, 0, len, (caddr_t)got);
+		/* 0 and 0xffff are both one's complement zero */
+		for (i = 0; i < NG_SOURCE_CSUMS; i++) {
+			j = csums[i].offset;
+			if ((csums[i].flags & NGM_SOURCE_EMBED_ENABLE) &&
+			    j + 2 <= len && want[j] == (u_char)~got[j] &&
+			    want[j + 1] == (u_char)~got[j + 1] &&
+			    (got[j] == 0 || got[j] == 0xff) &&
+			    got[j] == got[j + 1])
+				want[j] = got[j], want[j + 1] = got[j + 1];
+		}
+		if (bcmp(want, got, len) == 0) {
+			if (!verify || ref_verify(got, len))
+				return;
+			failed = 1;
+			printf("FAIL frame %ju checksums\n", (uintmax_t)sunk);
+			return;
+		}
+	}
+	failed = 1;
+	printf("FAIL frame %ju of %d bytes, got %d:", (uintmax_t)sunk, len,
+	    m->m_pkthdr.len);
+	for (i = 0; i < len; i++)
+		if (i >= m->m_pkthdr.len || want[i] != got[i])
+			printf(" %d:%02x/%02x", i, want[i],
+			    i < m->m_pkthdr.len ? got[i] : 0);
+	printf("\n");
+}
+
+/* Frames sent as they are must share the storage of the queued ones */
+static void
+check_shared(struct mbuf *m)
+{
+
+	check_rcv(m);
+	for (; m != NULL && !failed; m = m->m_next)
+		if (M_WRITABLE(m)) {
+			failed = 1;
+			printf("FAIL frame %ju copied\n", (uintmax_t)sunk);
+		}
+}
+
+/*
+ * Where 'width' bytes may go so that the checksums of the frame are kept
+ * valid: not across the checksums themselves nor the fields the UDP
+ * pseudo header takes from elsewhere.
+ */
+static int
+verify_offset(int width)
+{
+	static const struct {
+		int	start, end;
+	} spans[] = {
+		{ 14, 16 }, { 18, 23 }, { 26, 34 }, { 34, 38 }, { 42, 60 }
+	};
+	int i;
+
+	do
+		i = rnd() % nitems(spans);
+	while (spans[i].end - spans[i].start < width);
+	return (rnd_range(spans[i].start, spans[i].end - width));
+}
+
+/* A random generator, for the node and the reference */
+static void
+gen_add(node_p node, int len)
+{
+	static const int widths[] = { 1, 2, 4, 6, 16 };
+	struct ng_source_gen *gen;
+	struct refgen rg;
+	int vlen, i;
+
+	gen = calloc(1, sizeof(*gen) + 20 * NG_SOURCE_GEN_MAXWIDTH);
+	gen->type = rnd_range(NG_SOURCE_GEN_COUNTER, NG_SOURCE_GEN_RANDLIST);
+	gen->width = rnd() % 2 ? widths[rnd() % nitems(widths)] :
+	    rnd_range(1, NG_SOURCE_GEN_MAXWIDTH);
+	gen->offset = verify ? verify_offset(gen->width) :
+	    rnd() % 8 ? rnd_range(0, 60) : rnd_range(0, len + 4);
+	gen->flags = rnd() % 4 ? 0 : NGM_SOURCE_INC_CNT_PER_LIST;
+	gen->step = rnd() % 4 ? 1 : rnd() % 2 ? rnd_range(-300, 300) :
+	    (int32_t)rnd();
+	if (gen_islist(gen))
+		gen->count = rnd_range(1, 20);
+	else
+		gen->count = rnd() % 4 == 0 ? 0 : rnd() % 2 ?
+		    rnd_range(1, 300) : rnd();
+	/* All ones, to carry through the whole field */
+	for (i = 0; i < gen->width; i++)
+		gen->base[i] = rnd() % 4 ? rnd() : 0xff;
+	vlen = NG_SOURCE_GEN_LISTLEN(gen);
+	for (i = 0; i < vlen; i++)
+		gen->values[i] = rnd();
+	node_msg(node, NGM_SOURCE_ADD_GEN, gen, sizeof(*gen) + vlen);
+
+	rg.gen = gen;
+	rg.index = 0;
+	if (gen->type == NG_SOURCE_GEN_RANDOM ||
+	    gen->type == NG_SOURCE_GEN_RANDLIST)
+		ref_gen_next(&rg);
+	else
+		ref_gen_value(&rg);
+	/* After those at the same offset */
+	for (i = nrefgens; i > 0 && refgens[i - 1].gen->offset > gen->offset;
+	    i--)
+		refgens[i] = refgens[i - 1];
+	refgens[i] = rg;
+	nrefgens++;
+}
+
+/* Generators as configured, and invalid ones refused */
+static void
+gen_check(node_p node)
+{
+	struct ng_source_gen bad;
+	struct ng_mesg *resp;
+	const struct ng_source_gen *gen;
+	uint32_t i;
+	int len, error;
+
+	for (i = 0; i < nrefgens && !failed; i++) {
+		gen = refgens[i].gen;
+		len = sizeof(*gen) + NG_SOURCE_GEN_LISTLEN(gen);
+		resp = NULL;
+		error = ngshim_msg(node, NGM_SOURCE_COOKIE,
+		    NGM_SOURCE_GET_GEN, &i, sizeof(i), &resp);
+		if (error != 0 || resp->header.arglen != len ||
+		    bcmp(resp->data, gen, len) != 0) {
+			failed = 1;
+			printf("FAIL getgen %u\n", i);
+		}
+		ngshim_free(resp, M_NETGRAPH);
+	}
+	for (i = 0; i < 5 && !failed; i++) {
+		bzero(&bad, sizeof(bad));
+		bad.width = 4;
+		bad.type = NG_SOURCE_GEN_COUNTER;
+		switch (i) {
+		case 0:
+			bad.width = 0;
+			break;
+		case 1:
+			bad.width = NG_SOURCE_GEN_MAXWIDTH + 1;
+			break;
+		case 2:
+			bad.type = NG_SOURCE_GEN_RANDLIST + 1;
+			break;
+		case 3:
+			bad.type = NG_SOURCE_GEN_LIST;
+			break;
+		case 4:
+			bad.type = NG_SOURCE_GEN_LIST;
+			bad.count = 0x40000001;	/* times 4 wraps to 4 */
+			break;
+		}
+		len = sizeof(bad);
+		if (ngshim_msg(node, NGM_SOURCE_COOKIE, NGM_SOURCE_ADD_GEN,
+		    &bad, len, NULL) != EINVAL) {
+			failed = 1;
+			printf("FAIL bad generator %u accepted\n", i);
+		}
+	}
+}
+
+static void
+check_case(int n)
+{
+	struct ng_source_embed_cnt_info *cnt;
+	struct ng_source_embed_csum_info *cs;
+	node_p node;
+	uint64_t seed;
+	int len, seglen, i;
+
+	nqueue = rnd_range(1, QUEUE_MAX);
+	len = rnd() % 2 ? rnd_range(60, 128) : rnd_range(60, 1514);
+	for (i = 0; i < nqueue; i++)
+		frame_build(&queue[i], rnd() % 4 ? len : rnd_range(60, 1514),
+		    rnd());
+	seglen = rnd() % 3 ? 0 : rnd_range(1, 100);
+	node = node_create(seglen);
+
+	/* Those of the frames, or anywhere */
+	bzero(csums, sizeof(csums));
+	verify = 0;
+	if (rnd() % 3 == 0) {
+		verify = 1;
+		csums[0].offset = 24;
+		csums[0].start = 14;
+		csums[0].end = 34;
+		csums[0].type = NG_SOURCE_CSUM_INET;
+		csums[1].offset = 40;
+		csums[1].start = 26;
+		csums[1].end = 0xffff;
+		csums[1].type = NG_SOURCE_CSUM_UDP;
+		for (i = 0; i < 2; i++)
+			csums[i].flags = NGM_SOURCE_EMBED_ENABLE;
+	} else if (rnd() % 2) {
+		for (i = 0; i < NG_SOURCE_CSUMS; i++) {
+			if (rnd() % 2)
+				continue;
+			cs = &csums[i];
+			cs->flags = NGM_SOURCE_EMBED_ENABLE;
+			cs->type = rnd_range(NG_SOURCE_CSUM_INET,
+			    NG_SOURCE_CSUM_UDP);
+			cs->offset = rnd() % 8 ? rnd_range(0, 60) :
+			    rnd_range(0, len + 4);
+			cs->start = rnd_range(0, 60);
+			cs->end = rnd() % 4 ? cs->start + rnd_range(0, len) :
+			    0xffff;
+		}
+	}
+	for (i = 0; i < NG_SOURCE_CSUMS; i++) {
+		csums[i].index = i;
+		if (csums[i].flags & NGM_SOURCE_EMBED_ENABLE)
+			node_msg(node, NGM_SOURCE_SET_CSUM, &csums[i],
+			    sizeof(csums[i]));
+	}
+
+	/* Up to the end of the frames, and a bit beyond */
+	bzero(cnts, sizeof(cnts));
+	bzero(&tstamp, sizeof(tstamp));
+	for (i = 0; i < NG_SOURCE_COUNTERS; i++) {
+		if (rnd() % 2)
+			continue;
+		cnt = &cnts[i];
+		cnt->index = i;
+		cnt->flags = NGM_SOURCE_EMBED_ENABLE |
+		    (rnd() % 4 ? 0 : NGM_SOURCE_INC_CNT_PER_LIST);
+		cnt->width = 1 << rnd_range(0, 2);
+		cnt->offset = verify ? verify_offset(cnt->width) :
+		    rnd() % 8 ? rnd_range(0, 60) : rnd_range(0, len + 4);
+		cnt->min_val = rnd() % 2 ? 0 : rnd() % 1000;
+		cnt->max_val = cnt->min_val + (rnd() % 2 ? rnd() % 100 :
+		    rnd());
+		cnt->next_val = rnd_range(cnt->min_val, cnt->min_val + 10);
+		cnt->increment = rnd() % 4 ? 1 : rnd_range(-300, 300);
+		node_msg(node, NGM_SOURCE_SET_COUNTER, cnt, sizeof(*cnt));
+	}
+	if (rnd() % 3 == 0) {
+		tstamp.flags = NGM_SOURCE_EMBED_ENABLE;
+		tstamp.offset = verify ? verify_offset(sizeof(struct timeval)) :
+		    rnd() % 8 ? rnd_range(0, 60) : rnd_range(0, len + 4);
+		node_msg(node, NGM_SOURCE_SET_TIMESTAMP, &tstamp,
+		    sizeof(tstamp));
+	}
+
+	/* Generators, wide ones too, and the same random numbers */
+	seed = (uint64_t)rnd() << 32 | rnd();
+	refrng = seed;
+	node_msg(node, NGM_SOURCE_SET_SEED, &seed, sizeof(seed));
+	nrefgens = 0;
+	if (rnd() % 2)
+		for (i = rnd_range(1, GENS_MAX); i > 0; i--)
+			gen_add(node, len);
+
+	nextq = 0;
+	sunk = 0;
+	failed = 0;
+	gen_check(node);
+	sink_check = check_rcv;
+	node_run(node, rnd_range(1, 5000));
+
+	/* Nothing embedded any more, the frames as they were queued */
+	for (i = 0; i < NG_SOURCE_COUNTERS; i++) {
+		cnts[i].index = i;
+		cnts[i].flags = 0;
+		cnts[i].width = 1;
+		node_msg(node, NGM_SOURCE_SET_COUNTER, &cnts[i],
+		    sizeof(cnts[i]));
+	}
+	tstamp.flags = 0;
+	node_msg(node, NGM_SOURCE_SET_TIMESTAMP, &tstamp, sizeof(tstamp));
+	node_msg(node, NGM_SOURCE_CLR_GENS, NULL, 0);
+	for (i = 0; i < nrefgens; i++)
+		free(refgens[i].gen);
+	nrefgens = 0;
+	sink_check = check_shared;
+	node_run(node, 2 * nqueue);
+	sink_check = NULL;
+	ngshim_node_shutdown(node);
+	if (failed) {
+		printf("  case %d: %d frame(s), seg %d%s\n", n, nqueue, seglen,
+		    verify ? ", verified" : "");
+		failures++;
+	}
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: source_bench [-n frames] [bench ...]\n"
+	    "       source_bench -c [-n cases] [-s seed]\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	const struct bench *b;
+	uint64_t n = 0;
+	int check = 0;
+	int ch, i;
+
+	while ((ch = getopt(argc, argv, "cn:s:")) != -1) {
+		switch (ch) {
+		case 'c':
+			check = 1;
+			break;
+		case 'n':
+			n = strtoull(optarg, NULL, 10);
+			break;
+		case 's':
+			rng_seed(strtoull(optarg, NULL, 10));
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (ngshim_load(ngshim_type) != 0) {
+		fprintf(stderr, "can't load ng_source\n");
+		return (2);
+	}
+
+	if (check) {
+		for (i = 0; i < (int)(n ? n : 500); i++)
+			check_case(i);
+		printf("%d cases, %d failure(s)\n", i, failures);
+	} else {
+		for (b = benches; b->name != NULL; b++) {
+			if (argc > 0) {
+				for (i = 0; i < argc; i++)
+					if (strcmp(argv[i], b->name) == 0)
+						break;
+				if (i == argc)
+					continue;
+			}
+			run_bench(b, n ? n : 5000000);
+		}
+	}
+	ngshim_unload(ngshim_type);
+	return (failures != 0);
+}
@@ -48,14 +48,15 @@ __FBSDID("$FreeBSD: releng/9.3/sys/netgraph/ng_source.c 220768 2011-04-18 09:12:
  * this way this node can be preloaded with a packet stream which it
  * can then send continuously as fast as possible.
  *
- * Currently it just copies the mbufs as required.  It could do various
- * tricks to try and avoid this.  Probably the best performance would
- * be achieved by modifying the appropriate drivers to be told to
- * self-re-enqueue packets (e.g. the if_bge driver could reuse the same
- * transmit descriptors) under control of this node; perhaps via some
- * flag in the mbuf or some such.  The node could peek at an appropriate
- * ifnet flag to see if such support is available for the connected
- * interface.
+ * Packets are sent as read-only copies sharing the storage of the queued
+ * ones.  When a counter or timestamp is embedded, only the bytes up to
+ * the last one written go into a fresh mbuf, and the rest stays shared.
+ * Probably the best performance would be achieved by modifying the
+ * appropriate drivers to be told to self-re-enqueue packets (e.g. the
+ * if_bge driver could reuse the same transmit descriptors) under control
+ * of this node; perhaps via some flag in the mbuf or some such.  The node
+ * could peek at an appropriate ifnet flag to see if such support is
+ * available for the connected interface.
  */
 
 #include <sys/param.h>
@@ -85,6 +86,19 @@ __FBSDID("$FreeBSD: releng/9.3/sys/netgraph/ng_source.c 220768 2011-04-18 09:12:
 
 #define	mtod_off(m,off,t)	((t)(mtod((m),caddr_t)+(off)))
 
+/* Per field generator info */
+struct ng_source_genstate {
+	uint16_t		offset;
+	uint8_t			width;
+	uint8_t			type;
+	uint8_t			flags;
+	uint32_t		count;
+	uint32_t		step;		/* modulo 'count' */
+	uint32_t		index;
+	u_char			cur[NG_SOURCE_GEN_MAXWIDTH];	/* to embed */
+	struct ng_source_gen	*gen;		/* as configured */
+};
+
 /* Per node info */
 struct privdata {
 	node_p				node;
@@ -100,6 +114,11 @@ struct privdata {
 	uint32_t			queueOctets;
 	struct ng_source_embed_info	embed_timestamp;
 	struct ng_source_embed_cnt_info	embed_counter[NG_SOURCE_COUNTERS];
+	struct ng_source_embed_csum_info embed_csum[NG_SOURCE_CSUMS];
+	struct ng_source_genstate	*gens;		/* by offset */
+	int				ngens;
+	int				gens_hdrlen;	/* bytes written to */
+	uint64_t			rng;		/* splitmix64 state */
 	int				persistent;
 };
 typedef struct privdata *sc_p;
@@ -128,6 +147,14 @@ static void		ng_source_packet_mod(sc_p, struct mbuf *,
 static void		ng_source_mod_counter(sc_p sc,
 			    struct ng_source_embed_cnt_info *cnt,
 			    struct mbuf *m, int increment);
+static void		ng_source_csum_fix(sc_p, struct mbuf *, int, int,
+			    const u_char *, const u_char *);
+static int		ng_source_add_gen(sc_p, const struct ng_source_gen *,
+			    int);
+static void		ng_source_clr_gens(sc_p);
+static void		ng_source_gen_next(sc_p, struct ng_source_genstate *);
+static void		ng_source_gen_value(struct ng_source_genstate *);
+static struct mbuf	*ng_source_dup_hdr(struct mbuf *, int);
 static int		ng_source_dup_mod(sc_p, struct mbuf *,
 			    struct mbuf **);
 
@@ -166,6 +193,49 @@ static const struct ng_parse_type ng_source_embed_cnt_type = {
 	&ng_source_embed_cnt_type_fields
 };
 
+/* Parse type for struct ng_source_embed_csum_info */
+static const struct ng_parse_struct_field ng_source_embed_csum_type_fields[] =
+	NG_SOURCE_EMBED_CSUM_TYPE_INFO;
+static const struct ng_parse_type ng_source_embed_csum_type = {
+	&ng_parse_struct_type,
+	&ng_source_embed_csum_type_fields
+};
+
+/* Parse type for struct ng_source_gen */
+static const struct ng_parse_fixedarray_info ng_source_gen_base_info = {
+	&ng_parse_hint8_type,
+	NG_SOURCE_GEN_MAXWIDTH
+};
+static const struct ng_parse_type ng_source_gen_base_type = {
+	&ng_parse_fixedarray_type,
+	&ng_source_gen_base_info
+};
+static int
+ng_source_gen_getLength(const struct ng_parse_type *type,
+    const u_char *start, const u_char *buf)
+{
+	const struct ng_source_gen *gen;
+
+	gen = (const struct ng_source_gen *)
+	    (buf - offsetof(struct ng_source_gen, values));
+	return (NG_SOURCE_GEN_LISTLEN(gen));
+}
+static const struct ng_parse_array_info ng_source_gen_values_info = {
+	&ng_parse_hint8_type,
+	&ng_source_gen_getLength
+};
+static const struct ng_parse_type ng_source_gen_values_type = {
+	&ng_parse_array_type,
+	&ng_source_gen_values_info
+};
+static const struct ng_parse_struct_field ng_source_gen_type_fields[] =
+	NG_SOURCE_GEN_TYPE_INFO(&ng_source_gen_base_type,
+	    &ng_source_gen_values_type);
+static const struct ng_parse_type ng_source_gen_type = {
+	&ng_parse_struct_type,
+	&ng_source_gen_type_fields
+};
+
 /* List of commands and how to convert arguments to/from ASCII */
 static const struct ng_cmdlist ng_source_cmds[] = {
 	{
@@ -259,6 +329,48 @@ static const struct ng_cmdlist ng_source_cmds[] = {
 	  NULL,
 	  NULL
 	},
+	{
+	  NGM_SOURCE_COOKIE,
+	  NGM_SOURCE_SET_CSUM,
+	  "setcsum",
+	  &ng_source_embed_csum_type,
+	  NULL
+	},
+	{
+	  NGM_SOURCE_COOKIE,
+	  NGM_SOURCE_GET_CSUM,
+	  "getcsum",
+	  &ng_parse_uint8_type,
+	  &ng_source_embed_csum_type
+	},
+	{
+	  NGM_SOURCE_COOKIE,
+	  NGM_SOURCE_ADD_GEN,
+	  "addgen",
+	  &ng_source_gen_type,
+	  NULL
+	},
+	{
+	  NGM_SOURCE_COOKIE,
+	  NGM_SOURCE_GET_GEN,
+	  "getgen",
+	  &ng_parse_uint32_type,
+	  &ng_source_gen_type
+	},
+	{
+	  NGM_SOURCE_COOKIE,
+	  NGM_SOURCE_CLR_GENS,
+	  "clrgens",
+	  NULL,
+	  NULL
+	},
+	{
+	  NGM_SOURCE_COOKIE,
+	  NGM_SOURCE_SET_SEED,
+	  "setseed",
+	  &ng_parse_uint64_type,
+	  NULL
+	},
 	{ 0 }
 };
 
@@ -292,6 +404,7 @@ ng_source_constructor(node_p node)
 	NG_NODE_SET_PRIVATE(node, sc);
 	sc->node = node;
 	sc->snd_queue.ifq_maxlen = 2048;	/* XXX not checked */
+	arc4rand(&sc->rng, sizeof(sc->rng), 0);
 	ng_callout_init(&sc->intr_ch);
 
 	return (0);
@@ -512,6 +625,85 @@ ng_source_rcvmsg(node_p node, item_p item, hook_p lasthook)
 		case NGM_SOURCE_SET_PERSISTENT:
 			sc->persistent = 1;
 			break;
+		case NGM_SOURCE_SET_CSUM:
+		    {
+			struct ng_source_embed_csum_info *embed;
+
+			if (msg->header.arglen != sizeof(*embed)) {
+				error = EINVAL;
+				goto done;
+			}
+			embed = (struct ng_source_embed_csum_info *)msg->data;
+			if (embed->index >= NG_SOURCE_CSUMS ||
+			    !(embed->type == NG_SOURCE_CSUM_INET ||
+			    embed->type == NG_SOURCE_CSUM_UDP)) {
+				error = EINVAL;
+				goto done;
+			}
+			bcopy(embed, &sc->embed_csum[embed->index],
+			    sizeof(*embed));
+
+			break;
+		    }
+		case NGM_SOURCE_GET_CSUM:
+		    {
+			uint8_t index = *(uint8_t *)msg->data;
+			struct ng_source_embed_csum_info *embed;
+
+			if (index >= NG_SOURCE_CSUMS) {
+				error = EINVAL;
+				goto done;
+			}
+			NG_MKRESPONSE(resp, msg, sizeof(*embed), M_DONTWAIT);
+			if (resp == NULL) {
+				error = ENOMEM;
+				goto done;
+			}
+			embed = (struct ng_source_embed_csum_info *)resp->data;
+			bcopy(&sc->embed_csum[index], embed, sizeof(*embed));
+
+			break;
+		    }
+		case NGM_SOURCE_ADD_GEN:
+			error = ng_source_add_gen(sc,
+			    (struct ng_source_gen *)msg->data,
+			    msg->header.arglen);
+			break;
+		case NGM_SOURCE_GET_GEN:
+		    {
+			struct ng_source_gen *gen;
+			uint32_t index;
+			int len;
+
+			if (msg->header.arglen != sizeof(uint32_t)) {
+				error = EINVAL;
+				break;
+			}
+			index = *(uint32_t *)msg->data;
+			if (index >= sc->ngens) {
+				error = EINVAL;
+				break;
+			}
+			gen = sc->gens[index].gen;
+			len = sizeof(*gen) + NG_SOURCE_GEN_LISTLEN(gen);
+			NG_MKRESPONSE(resp, msg, len, M_DONTWAIT);
+			if (resp == NULL) {
+				error = ENOMEM;
+				break;
+			}
+			bcopy(gen, resp->data, len);
+			break;
+		    }
+		case NGM_SOURCE_CLR_GENS:
+			ng_source_clr_gens(sc);
+			break;
+		case NGM_SOURCE_SET_SEED:
+			if (msg->header.arglen != sizeof(uint64_t)) {
+				error = EINVAL;
+				break;
+			}
+			sc->rng = *(uint64_t *)msg->data;
+			break;
 		default:
 			error = EINVAL;
 			break;
@@ -596,6 +788,7 @@ ng_source_rmnode(node_p node)
 
 	ng_source_stop(sc);
 	ng_source_clr_data(sc);
+	ng_source_clr_gens(sc);
 	NG_NODE_SET_PRIVATE(node, NULL);
 	NG_NODE_UNREF(node);
 	free(sc, M_NETGRAPH);
@@ -828,7 +1021,7 @@ ng_source_send(sc_p sc, int tosend, int *sent_p)
 
 /*
  * Modify packet in 'm' by changing 'len' bytes starting at 'offset'
- * to data in 'cp'.
+ * to data in 'cp', and fix up the checksums covering them.
  *
  * The packet data in 'm' must be in a contiguous buffer in a single mbuf.
  */
@@ -836,6 +1029,8 @@ static void
 ng_source_packet_mod(sc_p sc, struct mbuf *m, int offset, int len, caddr_t cp,
     int flags)
 {
+	u_char old[NG_SOURCE_GEN_MAXWIDTH];
+
 	if (len == 0)
 		return;
 
@@ -844,7 +1039,52 @@ ng_source_packet_mod(sc_p sc, struct mbuf *m, int offset, int len, caddr_t cp,
 	if (offset + len > m->m_len)
 		return;
 
+	KASSERT(len <= sizeof(old), ("%s: len %d", __func__, len));
+	bcopy(mtod_off(m, offset, caddr_t), old, len);
 	bcopy(cp, mtod_off(m, offset, caddr_t), len);
+	ng_source_csum_fix(sc, m, offset, len, old, (u_char *)cp);
+}
+
+/*
+ * Update the checksums whose span covers the 'len' bytes at 'offset' for
+ * their change from 'old' to 'new', by adding the one's complement of
+ * each old 16-bit word and the new one (RFC 1624, eqn. 3).  Bytes at an
+ * odd distance from the start of the span are the low half of a word.
+ */
+static void
+ng_source_csum_fix(sc_p sc, struct mbuf *m, int offset, int len,
+    const u_char *old, const u_char *new)
+{
+	struct ng_source_embed_csum_info *csum;
+	u_char *cp;
+	uint32_t sum;
+	int i, j, shift;
+
+	for (i = 0; i < NG_SOURCE_CSUMS; ++i) {
+		csum = &sc->embed_csum[i];
+		if (!(csum->flags & NGM_SOURCE_EMBED_ENABLE) ||
+		    offset < csum->start || offset + len > csum->end ||
+		    csum->offset + 2 > m->m_len)
+			continue;
+		cp = mtod_off(m, csum->offset, u_char *);
+		sum = cp[0] << 8 | cp[1];
+		if (sum == 0 && csum->type == NG_SOURCE_CSUM_UDP)
+			continue;
+		sum = ~sum & 0xffff;
+		shift = (offset - csum->start) & 1 ? 0 : 8;
+		for (j = 0; j < len; ++j) {
+			sum += (~(old[j] << shift) & 0xffff) +
+			    (new[j] << shift);
+			shift ^= 8;
+		}
+		sum = (sum & 0xffff) + (sum >> 16);
+		sum = (sum & 0xffff) + (sum >> 16);
+		sum = ~sum & 0xffff;
+		if (sum == 0 && csum->type == NG_SOURCE_CSUM_UDP)
+			sum = 0xffff;
+		cp[0] = sum >> 8;
+		cp[1] = sum;
+	}
 }
 
 static void
@@ -875,30 +1115,254 @@ ng_source_mod_counter(sc_p sc, struct ng_source_embed_cnt_info *cnt,
 	}
 }
 
+/*
+ * Add a field generator, keeping them in order of offset so that the
+ * header is written front to back.
+ */
+static int
+ng_source_add_gen(sc_p sc, const struct ng_source_gen *gen, int len)
+{
+	struct ng_source_genstate *gens, *gs;
+	struct ng_source_gen *cfg;
+	int i;
+
+	if (len < sizeof(*gen) || gen->width == 0 ||
+	    gen->width > NG_SOURCE_GEN_MAXWIDTH)
+		return (EINVAL);
+	switch (gen->type) {
+	case NG_SOURCE_GEN_COUNTER:
+	case NG_SOURCE_GEN_RANDOM:
+		break;
+	case NG_SOURCE_GEN_LIST:
+	case NG_SOURCE_GEN_RANDLIST:
+		if (gen->count == 0 ||
+		    gen->count > (len - sizeof(*gen)) / gen->width)
+			return (EINVAL);
+		break;
+	default:
+		return (EINVAL);
+	}
+	if (len != sizeof(*gen) + NG_SOURCE_GEN_LISTLEN(gen))
+		return (EINVAL);
+	if (sc->ngens == NG_SOURCE_MAXGENS)
+		return (ENOSPC);
+
+	cfg = malloc(len, M_NETGRAPH, M_NOWAIT);
+	if (cfg == NULL)
+		return (ENOMEM);
+	gens = malloc((sc->ngens + 1) * sizeof(*gens), M_NETGRAPH,
+	    M_NOWAIT | M_ZERO);
+	if (gens == NULL) {
+		free(cfg, M_NETGRAPH);
+		return (ENOMEM);
+	}
+	bcopy(gen, cfg, len);
+	for (i = 0; i < sc->ngens && sc->gens[i].offset <= gen->offset; ++i)
+		;
+	if (sc->gens != NULL) {
+		bcopy(sc->gens, gens, i * sizeof(*gens));
+		bcopy(sc->gens + i, gens + i + 1,
+		    (sc->ngens - i) * sizeof(*gens));
+		free(sc->gens, M_NETGRAPH);
+	}
+	sc->gens = gens;
+	sc->ngens++;
+
+	gs = &gens[i];
+	gs->offset = gen->offset;
+	gs->width = gen->width;
+	gs->type = gen->type;
+	gs->flags = gen->flags;
+	gs->count = gen->count;
+	if (gen->count == 0)
+		gs->step = gen->step;
+	else if (gen->step < 0)
+		gs->step = gen->count - 1 -
+		    (-(int64_t)gen->step - 1) % gen->count;
+	else
+		gs->step = gen->step % gen->count;
+	gs->gen = cfg;
+	if (gs->type == NG_SOURCE_GEN_RANDOM ||
+	    gs->type == NG_SOURCE_GEN_RANDLIST)
+		ng_source_gen_next(sc, gs);
+	else
+		ng_source_gen_value(gs);
+	if (gen->offset + gen->width > sc->gens_hdrlen)
+		sc->gens_hdrlen = gen->offset + gen->width;
+
+	return (0);
+}
+
+/*
+ * Remove all field generators
+ */
+static void
+ng_source_clr_gens(sc_p sc)
+{
+	int i;
+
+	for (i = 0; i < sc->ngens; ++i)
+		free(sc->gens[i].gen, M_NETGRAPH);
+	free(sc->gens, M_NETGRAPH);
+	sc->gens = NULL;
+	sc->ngens = 0;
+	sc->gens_hdrlen = 0;
+}
+
+/* splitmix64 */
+static __inline uint64_t
+ng_source_random(sc_p sc)
+{
+	uint64_t z;
+
+	z = (sc->rng += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return (z ^ (z >> 31));
+}
+
+/*
+ * Move a field generator on to its next value.  Indices are drawn by
+ * scaling 32 random bits by 'count', which is as uniform as need be.
+ */
+static void
+ng_source_gen_next(sc_p sc, struct ng_source_genstate *gs)
+{
+	uint64_t r;
+	int i;
+
+	switch (gs->type) {
+	case NG_SOURCE_GEN_COUNTER:
+	case NG_SOURCE_GEN_LIST:
+		gs->index += gs->step;
+		if (gs->count != 0 &&
+		    (gs->index >= gs->count || gs->index < gs->step))
+			gs->index -= gs->count;
+		break;
+	case NG_SOURCE_GEN_RANDOM:
+		if (gs->count == 0) {
+			for (i = 0; i < gs->width; i += sizeof(r)) {
+				r = ng_source_random(sc);
+				bcopy(&r, gs->cur + i,
+				    imin(sizeof(r), gs->width - i));
+			}
+			return;
+		}
+		/* FALLTHROUGH */
+	case NG_SOURCE_GEN_RANDLIST:
+		r = ng_source_random(sc) >> 32;
+		gs->index = (r * gs->count) >> 32;
+		break;
+	}
+	ng_source_gen_value(gs);
+}
+
+/*
+ * Set the value to embed from the index.  Values beyond the range of the
+ * field wrap around.
+ */
+static void
+ng_source_gen_value(struct ng_source_genstate *gs)
+{
+	const struct ng_source_gen *gen = gs->gen;
+	uint64_t carry;
+	int i;
+
+	if (gs->type == NG_SOURCE_GEN_LIST ||
+	    gs->type == NG_SOURCE_GEN_RANDLIST) {
+		bcopy(gen->values + gs->index * gs->width, gs->cur,
+		    gs->width);
+		return;
+	}
+	carry = gs->index;
+	for (i = gs->width - 1; i >= 0; --i) {
+		carry += gen->base[i];
+		gs->cur[i] = carry;
+		carry >>= 8;
+	}
+}
+
+/*
+ * Copy the first 'hdrlen' bytes of 'm0' into a new mbuf, or a cluster if
+ * they don't fit, to be written to, followed by the rest of the packet,
+ * shared.  A tail which would fit in an mbuf is copied along, which is
+ * cheaper than sharing it.
+ */
+static struct mbuf *
+ng_source_dup_hdr(struct mbuf *m0, int hdrlen)
+{
+	struct mbuf *m;
+
+	if (m0->m_pkthdr.len - hdrlen <= MHLEN &&
+	    (hdrlen <= MHLEN ? m0->m_pkthdr.len <= MHLEN :
+	    m0->m_pkthdr.len <= MCLBYTES))
+		hdrlen = m0->m_pkthdr.len;
+	if (hdrlen > MCLBYTES)
+		return (m_dup(m0, M_DONTWAIT));
+	if (hdrlen > MHLEN)
+		m = m_getcl(M_DONTWAIT, MT_DATA, M_PKTHDR);
+	else
+		m = m_gethdr(M_DONTWAIT, MT_DATA);
+	if (m == NULL)
+		return (NULL);
+	if (!m_dup_pkthdr(m, m0, M_DONTWAIT)) {
+		m_free(m);
+		return (NULL);
+	}
+	m_copydata(m0, 0, hdrlen, mtod(m, caddr_t));
+	m->m_len = hdrlen;
+	if (hdrlen < m0->m_pkthdr.len) {
+		m->m_next = m_copym(m0, hdrlen, M_COPYALL, M_DONTWAIT);
+		if (m->m_next == NULL) {
+			m_freem(m);
+			return (NULL);
+		}
+	}
+	return (m);
+}
+
 static int
 ng_source_dup_mod(sc_p sc, struct mbuf *m0, struct mbuf **m_ptr)
 {
 	struct mbuf *m;
 	struct ng_source_embed_cnt_info *cnt;
 	struct ng_source_embed_info *ts;
-	int modify;
+	struct ng_source_embed_csum_info *csum;
+	struct ng_source_genstate *gs;
+	int hdrlen = 0;
 	int i, increment;
 
-	/* Are we going to modify packets? */
-	modify = sc->embed_timestamp.flags & NGM_SOURCE_EMBED_ENABLE;
-	for (i = 0; !modify && i < NG_SOURCE_COUNTERS; ++i)
-		modify = sc->embed_counter[i].flags & NGM_SOURCE_EMBED_ENABLE;
+	/* Are we going to modify packets, and up to where? */
+	ts = &sc->embed_timestamp;
+	if (ts->flags & NGM_SOURCE_EMBED_ENABLE)
+		hdrlen = ts->offset + sizeof(struct timeval);
+	for (i = 0; i < NG_SOURCE_COUNTERS; ++i) {
+		cnt = &sc->embed_counter[i];
+		if ((cnt->flags & NGM_SOURCE_EMBED_ENABLE) &&
+		    cnt->offset + cnt->width > hdrlen)
+			hdrlen = cnt->offset + cnt->width;
+	}
+	if (sc->gens_hdrlen > hdrlen)
+		hdrlen = sc->gens_hdrlen;
+	for (i = 0; hdrlen != 0 && i < NG_SOURCE_CSUMS; ++i) {
+		csum = &sc->embed_csum[i];
+		if ((csum->flags & NGM_SOURCE_EMBED_ENABLE) &&
+		    csum->offset + 2 > hdrlen)
+			hdrlen = csum->offset + 2;
+	}
+
+	/* Unmodified packets go out sharing all of their storage. */
+	if (hdrlen == 0) {
+		if ((*m_ptr = m_copypacket(m0, M_DONTWAIT)) == NULL)
+			return (ENOBUFS);
+		return (0);
+	}
 
-	/* Duplicate the packet. */
-	m = m_dup(m0, M_DONTWAIT);
+	/* Copy the bytes to be modified for sending. */
+	m = ng_source_dup_hdr(m0, hdrlen);
 	if (m == NULL)
 		return (ENOBUFS);
 	*m_ptr = m;
-
-	if (!modify)
-		return (0);
-
-	/* Modify the copied packet for sending. */
 	KASSERT(M_WRITABLE(m), ("%s: packet not writable", __func__));
 
 	for (i = 0; i < NG_SOURCE_COUNTERS; ++i) {
@@ -913,7 +1377,15 @@ ng_source_dup_mod(sc_p sc, struct mbuf *m0, struct mbuf **m_ptr)
 		}
 	}
 
-	ts = &sc->embed_timestamp;
+	for (i = 0; i < sc->ngens; ++i) {
+		gs = &sc->gens[i];
+		ng_source_packet_mod(sc, m, gs->offset, gs->width,
+		    (caddr_t)gs->cur, gs->flags);
+		if ((gs->flags & NGM_SOURCE_INC_CNT_PER_LIST) == 0 ||
+		    sc->last_packet == m0)
+			ng_source_gen_next(sc, gs);
+	}
+
 	if (ts->flags & NGM_SOURCE_EMBED_ENABLE) {
 		struct timeval now;
 		getmicrotime(&now);
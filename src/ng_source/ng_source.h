@@ -120,6 +120,84 @@ struct ng_source_embed_cnt_info {
 	{ NULL }						\
 }
 
+/*
+ * Checksum fix-up info for NGM_SOURCE_GET/SET_CSUM.  When a counter or
+ * timestamp is embedded entirely within [start, end), the checksum at
+ * 'offset' is updated for the change (RFC 1624).  For TCP and UDP the
+ * span starts at the IP source address, which is followed by the
+ * destination address and then the transport header.
+ */
+#define	NG_SOURCE_CSUMS		4
+struct ng_source_embed_csum_info {
+	uint16_t	offset;		/* of the checksum */
+	uint16_t	start;		/* span covered, from ethernet header */
+	uint16_t	end;
+	uint8_t		flags;		/* NGM_SOURCE_EMBED_ENABLE */
+	uint8_t		type;
+	uint8_t		index;		/* which checksum (0..3) */
+};
+#define	NG_SOURCE_CSUM_INET	1	/* IPv4 header, TCP, ICMP */
+#define	NG_SOURCE_CSUM_UDP	2	/* UDP, where zero means none */
+
+/* Keep this in sync with the above structure definition. */
+#define NG_SOURCE_EMBED_CSUM_TYPE_INFO {			\
+	{ "offset",		&ng_parse_hint16_type	},	\
+	{ "start",		&ng_parse_hint16_type	},	\
+	{ "end",		&ng_parse_hint16_type	},	\
+	{ "flags",		&ng_parse_hint8_type	},	\
+	{ "type",		&ng_parse_uint8_type	},	\
+	{ "index",		&ng_parse_uint8_type	},	\
+	{ NULL }						\
+}
+
+/*
+ * Field generator for NGM_SOURCE_ADD_GEN and NGM_SOURCE_GET_GEN.  The
+ * first 'width' bytes of 'base' are a value in network byte order; the
+ * field holds 'base' plus an index into 'count' values (0 for 2^32), or
+ * the indexed entry of the 'values' list.  A counter steps the index by
+ * 'step', wrapping around, a random generator draws it from the node's
+ * generator, and a list is walked in order or at random.  A random
+ * generator with 'count' 0 makes every byte of the field random.  With
+ * NGM_SOURCE_INC_CNT_PER_LIST the field only changes once per queue.
+ * Generators are applied after the counters, in order of offset.
+ */
+#define	NG_SOURCE_GEN_MAXWIDTH	16
+#define	NG_SOURCE_MAXGENS	256
+struct ng_source_gen {
+	uint16_t	offset;		/* offset from ethernet header */
+	uint8_t		width;		/* in bytes (1 .. 16) */
+	uint8_t		type;
+	uint8_t		flags;		/* NGM_SOURCE_INC_CNT_PER_LIST */
+	uint8_t		spare[3];
+	int32_t		step;
+	uint32_t	count;
+	u_char		base[NG_SOURCE_GEN_MAXWIDTH];
+	u_char		values[];	/* lists: 'count' values of 'width' */
+};
+#define	NG_SOURCE_GEN_COUNTER	1
+#define	NG_SOURCE_GEN_RANDOM	2
+#define	NG_SOURCE_GEN_LIST	3
+#define	NG_SOURCE_GEN_RANDLIST	4
+
+/* Bytes of the list following a struct ng_source_gen */
+#define	NG_SOURCE_GEN_LISTLEN(gen)					\
+	((gen)->type == NG_SOURCE_GEN_LIST ||				\
+	    (gen)->type == NG_SOURCE_GEN_RANDLIST ?			\
+	    (gen)->count * (gen)->width : 0)
+
+/* Keep this in sync with the above structure definition. */
+#define NG_SOURCE_GEN_TYPE_INFO(basetype, valtype) {		\
+	{ "offset",		&ng_parse_hint16_type	},	\
+	{ "width",		&ng_parse_uint8_type	},	\
+	{ "type",		&ng_parse_uint8_type	},	\
+	{ "flags",		&ng_parse_hint8_type	},	\
+	{ "step",		&ng_parse_int32_type	},	\
+	{ "count",		&ng_parse_uint32_type	},	\
+	{ "base",		(basetype)		},	\
+	{ "values",		(valtype)		},	\
+	{ NULL }						\
+}
+
 /* Netgraph commands */
 enum {
 	NGM_SOURCE_GET_STATS = 1,	/* get stats */
@@ -135,6 +213,12 @@ enum {
 	NGM_SOURCE_SET_COUNTER,		/* embed counter */
 	NGM_SOURCE_GET_COUNTER,
 	NGM_SOURCE_SET_PERSISTENT,
+	NGM_SOURCE_SET_CSUM,		/* fix up checksum */
+	NGM_SOURCE_GET_CSUM,
+	NGM_SOURCE_ADD_GEN,		/* add field generator */
+	NGM_SOURCE_GET_GEN,
+	NGM_SOURCE_CLR_GENS,		/* remove all field generators */
+	NGM_SOURCE_SET_SEED,		/* seed the random generator */
 };
 
 #endif /* _NETGRAPH_NG_SOURCE_H_ */
@@ -0,0 +1,10 @@
+/*
+ * Userspace stand-in, see ngshim.h.  Only nodes, built with _KERNEL, get
+ * the stand-in; drivers such as rfeed need the C library's interface
+ * name functions.
+ */
+#ifdef _KERNEL
+#include <ngshim.h>
+#else
+#include_next <net/if.h>
+#endif
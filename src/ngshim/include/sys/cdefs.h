@@ -0,0 +1,6 @@
+/* Userspace stand-in, see ngshim.h */
+#include_next <sys/cdefs.h>
+
+#ifndef __FBSDID
+#define	__FBSDID(s)	struct __hack
+#endif
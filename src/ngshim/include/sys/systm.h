@@ -0,0 +1,2 @@
+/* Userspace stand-in, see ngshim.h */
+#include <ngshim.h>
@@ -0,0 +1,1217 @@
+/*-
+ * Copyright (c) 2026 University of Zagreb
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * ngshim.c -- userspace implementation of the kernel API subset declared
+ * in ngshim.h.  See there for the overall model.
+ */
+
+#include <stdarg.h>
+#include <time.h>
+
+#include "ngshim.h"
+
+MALLOC_DEFINE(M_NETGRAPH, "netgraph", "netgraph");
+MALLOC_DEFINE(M_DEVBUF, "devbuf", "devbuf");
+MALLOC_DEFINE(M_TEMP, "temp", "temp");
+
+uint64_t	ngshim_now;
+int		ticks;
+int		hz = 1000;
+int		tick = 1000;
+
+static TAILQ_HEAD(callout_tailq, callout) callwheel[CALLWHEEL_SIZE];
+static uint64_t	softticks;		/* next tick to be processed */
+static int	callouts_pending;
+static ng_ID_t	next_node_id = 1;
+
+void
+ngshim_panic(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	fprintf(stderr, "panic: ");
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+	abort();
+}
+
+/*
+ * malloc(9)
+ */
+void *
+ngshim_malloc(size_t size, struct malloc_type *type, int flags)
+{
+	void *p;
+
+	if (flags & M_ZERO)
+		p = calloc(1, size);
+	else
+		p = malloc(size);
+	if (p == NULL && (flags & M_WAITOK))
+		panic("%s: out of memory", type->ks_shortdesc);
+	if (p != NULL)
+		type->ks_inuse++;
+	return (p);
+}
+
+void
+ngshim_free(void *addr, struct malloc_type *type)
+{
+
+	if (addr == NULL)
+		return;
+	type->ks_inuse--;
+	free(addr);
+}
+
+/*
+ * uma(9).  Each zone keeps a free list of its items, which is close
+ * enough to the per-CPU bucket caches to make zone-heavy code paths
+ * benchmark realistically.
+ */
+struct uma_item {
+	struct uma_item	*next;
+};
+
+struct uma_zone {
+	const char	*name;
+	size_t		size;
+	struct uma_item	*free;
+	u_long		inuse;
+};
+
+uma_zone_t
+uma_zcreate(const char *name, size_t size, uma_ctor ctor, uma_dtor dtor,
+    uma_init init, uma_fini fini, int align, uint32_t flags)
+{
+	uma_zone_t zone;
+
+	zone = calloc(1, sizeof(*zone));
+	if (zone == NULL)
+		return (NULL);
+	zone->name = name;
+	zone->size = roundup2(imax(size, sizeof(struct uma_item)),
+	    sizeof(void *));
+	return (zone);
+}
+
+void
+uma_zdestroy(uma_zone_t zone)
+{
+	struct uma_item *it;
+
+	if (zone->inuse != 0)
+		fprintf(stderr, "uma_zdestroy: zone %s has %lu items in use\n",
+		    zone->name, zone->inuse);
+	while ((it = zone->free) != NULL) {
+		zone->free = it->next;
+		free(it);
+	}
+	free(zone);
+}
+
+void *
+uma_zalloc(uma_zone_t zone, int flags)
+{
+	struct uma_item *it;
+
+	if ((it = zone->free) != NULL)
+		zone->free = it->next;
+	else if ((it = malloc(zone->size)) == NULL)
+		return (NULL);
+	if (flags & M_ZERO)
+		bzero(it, zone->size);
+	zone->inuse++;
+	return (it);
+}
+
+void
+uma_zfree(uma_zone_t zone, void *item)
+{
+	struct uma_item *it = item;
+
+	if (it == NULL)
+		return;
+	it->next = zone->free;
+	zone->free = it;
+	zone->inuse--;
+}
+
+/*
+ * Virtual time.
+ */
+void
+microuptime(struct timeval *tv)
+{
+
+	tv->tv_sec = ngshim_now / 1000000;
+	tv->tv_usec = ngshim_now % 1000000;
+}
+
+void
+getmicrouptime(struct timeval *tv)
+{
+
+	microuptime(tv);
+}
+
+void
+microtime(struct timeval *tv)
+{
+
+	microuptime(tv);
+}
+
+void
+getmicrotime(struct timeval *tv)
+{
+
+	microuptime(tv);
+}
+
+void
+timevaladd(struct timeval *t1, const struct timeval *t2)
+{
+
+	t1->tv_sec += t2->tv_sec;
+	t1->tv_usec += t2->tv_usec;
+	if (t1->tv_usec >= 1000000) {
+		t1->tv_sec++;
+		t1->tv_usec -= 1000000;
+	}
+}
+
+void
+timevalsub(struct timeval *t1, const struct timeval *t2)
+{
+
+	t1->tv_sec -= t2->tv_sec;
+	t1->tv_usec -= t2->tv_usec;
+	if (t1->tv_usec < 0) {
+		t1->tv_sec--;
+		t1->tv_usec += 1000000;
+	}
+}
+
+void
+ngshim_clock_hz(int newhz)
+{
+
+	hz = newhz;
+	tick = 1000000 / hz;
+}
+
+/*
+ * Move the virtual clock to 'usec', running every callout which becomes
+ * due up to and including that instant.  Buckets are processed tick by
+ * tick, with the clock stepped to each tick boundary before its callouts
+ * run, so handlers observe the same timestamps they would on an idle
+ * kernel.  A callout (re)scheduled from a handler for the current tick
+ * runs on the next one.
+ */
+void
+ngshim_clock_set(uint64_t usec)
+{
+	struct callout_tailq *bucket;
+	struct callout *c;
+	uint64_t target = usec / tick;
+	uint64_t curtick;
+
+	while (softticks <= target) {
+		if (callouts_pending == 0) {
+			softticks = target + 1;
+			break;
+		}
+		curtick = softticks++;
+		bucket = &callwheel[curtick & (CALLWHEEL_SIZE - 1)];
+		for (;;) {
+			TAILQ_FOREACH(c, bucket, c_le)
+				if (c->c_tick == curtick)
+					break;
+			if (c == NULL)
+				break;
+			TAILQ_REMOVE(bucket, c, c_le);
+			c->c_pending = 0;
+			callouts_pending--;
+			if (curtick * tick > ngshim_now)
+				ngshim_now = curtick * tick;
+			ticks = curtick;
+			(*c->c_fn)(c->c_node, c->c_hook, c->c_arg1, c->c_arg2);
+		}
+	}
+	if (usec > ngshim_now)
+		ngshim_now = usec;
+	ticks = ngshim_now / tick;
+}
+
+int
+ngshim_callouts_pending(void)
+{
+
+	return (callouts_pending);
+}
+
+void
+ngshim_clock_advance(uint64_t usec)
+{
+
+	ngshim_clock_set(ngshim_now + usec);
+}
+
+uint64_t
+ngshim_wallclock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/*
+ * Callouts.  Like the kernel's callwheel, a callout scheduled for 'n'
+ * ticks fires at the n-th tick boundary from now.
+ */
+void
+ng_callout_init(struct callout *c)
+{
+	static int inited;
+	int i;
+
+	if (!inited) {
+		for (i = 0; i < CALLWHEEL_SIZE; i++)
+			TAILQ_INIT(&callwheel[i]);
+		softticks = ngshim_now / tick;
+		inited = 1;
+	}
+	bzero(c, sizeof(*c));
+}
+
+int
+ng_callout(struct callout *c, node_p node, hook_p hook, int nticks,
+    ng_item_fn *fn, void *arg1, int arg2)
+{
+	int cancelled;
+
+	cancelled = ng_uncallout(c, node);
+	if (nticks < 0)
+		nticks = 0;
+	c->c_tick = ngshim_now / tick + nticks;
+	if (c->c_tick < softticks)
+		c->c_tick = softticks;
+	c->c_fn = fn;
+	c->c_node = node;
+	c->c_hook = hook;
+	c->c_arg1 = arg1;
+	c->c_arg2 = arg2;
+	c->c_pending = 1;
+	TAILQ_INSERT_TAIL(&callwheel[c->c_tick & (CALLWHEEL_SIZE - 1)], c,
+	    c_le);
+	callouts_pending++;
+	return (cancelled);
+}
+
+int
+ng_uncallout(struct callout *c, node_p node)
+{
+
+	if (!c->c_pending)
+		return (0);
+	TAILQ_REMOVE(&callwheel[c->c_tick & (CALLWHEEL_SIZE - 1)], c, c_le);
+	c->c_pending = 0;
+	callouts_pending--;
+	return (1);
+}
+
+/*
+ * random(9).  A xorshift64* generator, truncated to the 31 bits the
+ * kernel's random() returns.
+ */
+static uint64_t ngshim_rnd_state = 0x9e3779b97f4a7c15ULL;
+
+void
+ngshim_srandom(uint64_t seed)
+{
+
+	ngshim_rnd_state = seed ? seed : 0x9e3779b97f4a7c15ULL;
+}
+
+u_long
+ngshim_random(void)
+{
+	uint64_t x = ngshim_rnd_state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	ngshim_rnd_state = x;
+	return ((x * 0x2545f4914f6cdd1dULL) >> 33);
+}
+
+void
+arc4rand(void *ptr, u_int len, int reseed)
+{
+	u_char *p = ptr;
+
+	while (len--)
+		*p++ = ngshim_random();
+}
+
+/*
+ * crc32(9), the CRC-32 of ISO 3309 and zlib, a bit at a time.
+ */
+uint32_t
+crc32_raw(const void *buf, size_t size, uint32_t crc)
+{
+	const u_char *p = buf;
+	int k;
+
+	while (size--) {
+		crc ^= *p++;
+		for (k = 0; k < 8; k++)
+			crc = (crc >> 1) ^ (0xedb88320U & -(crc & 1));
+	}
+	return (crc);
+}
+
+/*
+ * mbuf(9).
+ *
+ * Freed clusters are kept for reuse, the way UMA caches them, so that
+ * getting one costs about what it does in the kernel rather than what
+ * malloc() charges for a buffer of that size.
+ */
+#define	CLCACHE_MAX	256
+
+static void	*clcache[CLCACHE_MAX];
+static int	clcached;
+
+static void
+m_ext_free(struct mbuf *m)
+{
+
+	if (--*m->m_ext.ext_cnt != 0)
+		return;
+	if (m->m_ext.ext_size == MCLBYTES && clcached < CLCACHE_MAX)
+		clcache[clcached++] = (void *)m->m_ext.ext_cnt;
+	else
+		free((void *)m->m_ext.ext_cnt);
+}
+
+static struct mbuf *
+m_alloc(int size, int flags)
+{
+	struct mbuf *m;
+	u_int *cnt;
+
+	m = calloc(1, sizeof(*m));
+	if (size == MCLBYTES && clcached > 0)
+		cnt = clcache[--clcached];
+	else
+		cnt = malloc(sizeof(*cnt) + size);
+	if (m == NULL || cnt == NULL) {
+		free(m);
+		free(cnt);
+		return (NULL);
+	}
+	*cnt = 1;
+	m->m_ext.ext_cnt = cnt;
+	m->m_ext.ext_buf = (caddr_t)(cnt + 1);
+	m->m_ext.ext_size = size;
+	m->m_data = m->m_ext.ext_buf;
+	m->m_type = MT_DATA;
+	m->m_flags = M_EXT | flags;
+	return (m);
+}
+
+struct mbuf *
+m_get(int how, short type)
+{
+
+	return (m_alloc(MLEN, 0));
+}
+
+struct mbuf *
+m_gethdr(int how, short type)
+{
+
+	return (m_alloc(MHLEN, M_PKTHDR));
+}
+
+struct mbuf *
+m_getcl(int how, short type, int flags)
+{
+
+	return (m_alloc(MCLBYTES, flags));
+}
+
+struct mbuf *
+m_getjcl(int how, short type, int flags, int size)
+{
+
+	return (m_alloc(size, flags));
+}
+
+struct mbuf *
+m_free(struct mbuf *m)
+{
+	struct mbuf *n = m->m_next;
+
+	m_ext_free(m);
+	free(m);
+	return (n);
+}
+
+void
+m_freem(struct mbuf *m)
+{
+
+	while (m != NULL)
+		m = m_free(m);
+}
+
+int
+m_dup_pkthdr(struct mbuf *to, const struct mbuf *from, int how)
+{
+
+	to->m_flags = (from->m_flags & ~M_EXT & ~M_RDONLY) |
+	    (to->m_flags & M_EXT);
+	to->m_pkthdr = from->m_pkthdr;
+	return (1);
+}
+
+u_int
+m_length(struct mbuf *m0, struct mbuf **last)
+{
+	struct mbuf *m;
+	u_int len = 0;
+
+	for (m = m0; m != NULL; m = m->m_next) {
+		len += m->m_len;
+		if (m->m_next == NULL)
+			break;
+	}
+	if (last != NULL)
+		*last = m;
+	return (len);
+}
+
+void
+m_copydata(const struct mbuf *m, int off, int len, caddr_t cp)
+{
+	u_int count;
+
+	KASSERT(off >= 0 && len >= 0, ("m_copydata: bad off/len"));
+	while (off > 0) {
+		KASSERT(m != NULL, ("m_copydata: off > len"));
+		if (off < m->m_len)
+			break;
+		off -= m->m_len;
+		m = m->m_next;
+	}
+	while (len > 0) {
+		KASSERT(m != NULL, ("m_copydata: len > pkt"));
+		count = min(m->m_len - off, len);
+		bcopy(mtod(m, caddr_t) + off, cp, count);
+		len -= count;
+		cp += count;
+		off = 0;
+		m = m->m_next;
+	}
+}
+
+void
+m_copyback(struct mbuf *m, int off, int len, c_caddr_t cp)
+{
+	u_int count;
+
+	while (m != NULL && off >= m->m_len) {
+		off -= m->m_len;
+		m = m->m_next;
+	}
+	while (m != NULL && len > 0) {
+		count = min(m->m_len - off, len);
+		bcopy(cp, mtod(m, caddr_t) + off, count);
+		len -= count;
+		cp += count;
+		off = 0;
+		m = m->m_next;
+	}
+}
+
+/*
+ * Deep copy into a single buffer (or as few clusters as needed).
+ */
+struct mbuf *
+m_dup(const struct mbuf *m, int how)
+{
+	struct mbuf *n;
+	int len;
+
+	len = (m->m_flags & M_PKTHDR) ? m->m_pkthdr.len :
+	    m_length((struct mbuf *)m, NULL);
+	n = m_alloc(imax(len, MHLEN), M_PKTHDR);
+	if (n == NULL)
+		return (NULL);
+	if (m->m_flags & M_PKTHDR)
+		m_dup_pkthdr(n, m, how);
+	n->m_pkthdr.len = n->m_len = len;
+	m_copydata(m, 0, len, mtod(n, caddr_t));
+	return (n);
+}
+
+/*
+ * Shallow copy of 'len' bytes at 'off': new mbuf headers referencing the
+ * same storage.
+ */
+struct mbuf *
+m_copym(struct mbuf *m, int off, int len, int how)
+{
+	struct mbuf *top = NULL, **np = &top, *n;
+	int copyhdr = (off == 0 && (m->m_flags & M_PKTHDR));
+
+	if (len == M_COPYALL)
+		len = m_length(m, NULL) - off;
+	while (off > 0 && m != NULL && off >= m->m_len) {
+		off -= m->m_len;
+		m = m->m_next;
+	}
+	while (len > 0 && m != NULL) {
+		n = calloc(1, sizeof(*n));
+		if (n == NULL) {
+			m_freem(top);
+			return (NULL);
+		}
+		n->m_ext = m->m_ext;
+		(*n->m_ext.ext_cnt)++;
+		n->m_type = m->m_type;
+		n->m_flags = M_EXT;
+		if (copyhdr) {
+			m_dup_pkthdr(n, m, how);
+			n->m_pkthdr.len = len;
+			copyhdr = 0;
+		}
+		n->m_data = m->m_data + off;
+		n->m_len = min(len, m->m_len - off);
+		len -= n->m_len;
+		off = 0;
+		*np = n;
+		np = &n->m_next;
+		m = m->m_next;
+	}
+	return (top);
+}
+
+struct mbuf *
+m_copypacket(struct mbuf *m, int how)
+{
+
+	return (m_copym(m, 0, M_COPYALL, how));
+}
+
+/*
+ * Make the first 'len' bytes of the chain contiguous in its first mbuf.
+ */
+struct mbuf *
+m_pullup(struct mbuf *m, int len)
+{
+	struct mbuf *n;
+	int count;
+
+	if (m->m_len >= len)
+		return (m);
+	if ((m->m_flags & M_PKTHDR) && len > m->m_pkthdr.len)
+		goto bad;
+	n = m_alloc(imax(len, MHLEN), m->m_flags & M_PKTHDR);
+	if (n == NULL)
+		goto bad;
+	if (m->m_flags & M_PKTHDR)
+		m_dup_pkthdr(n, m, M_NOWAIT);
+	while (n->m_len < len && m != NULL) {
+		count = min(len - n->m_len, m->m_len);
+		bcopy(mtod(m, caddr_t), mtod(n, caddr_t) + n->m_len, count);
+		n->m_len += count;
+		m->m_data += count;
+		m->m_len -= count;
+		if (m->m_len == 0)
+			m = m_free(m);
+	}
+	if (n->m_len < len) {
+		m_free(n);
+		goto bad;
+	}
+	n->m_next = m;
+	return (n);
+bad:
+	m_freem(m);
+	return (NULL);
+}
+
+/*
+ * Replace every shared buffer in the chain with a private copy.
+ */
+struct mbuf *
+m_unshare(struct mbuf *m0, int how)
+{
+	struct mbuf *m, *n;
+
+	for (m = m0; m != NULL; m = m->m_next) {
+		if (M_WRITABLE(m))
+			continue;
+		n = m_alloc(imax(m->m_len, 1), 0);
+		if (n == NULL) {
+			m_freem(m0);
+			return (NULL);
+		}
+		bcopy(mtod(m, caddr_t), mtod(n, caddr_t), m->m_len);
+		m_ext_free(m);
+		m->m_ext = n->m_ext;
+		m->m_data = n->m_data;
+		m->m_flags &= ~M_RDONLY;
+		free(n);
+	}
+	return (m0);
+}
+
+void
+m_adj(struct mbuf *mp, int req_len)
+{
+	struct mbuf *m;
+	int len = req_len;
+
+	if (mp == NULL)
+		return;
+	if (len >= 0) {
+		for (m = mp; m != NULL && len > 0; m = m->m_next) {
+			if (m->m_len <= len) {
+				len -= m->m_len;
+				m->m_len = 0;
+			} else {
+				m->m_data += len;
+				m->m_len -= len;
+				len = 0;
+			}
+		}
+		if (mp->m_flags & M_PKTHDR)
+			mp->m_pkthdr.len -= (req_len - len);
+	} else {
+		len = -len;
+		int total = m_length(mp, NULL) - len;
+
+		if (total < 0)
+			total = 0;
+		if (mp->m_flags & M_PKTHDR)
+			mp->m_pkthdr.len = total;
+		for (m = mp; m != NULL; m = m->m_next) {
+			if (m->m_len >= total) {
+				m->m_len = total;
+				m_freem(m->m_next);
+				m->m_next = NULL;
+				break;
+			}
+			total -= m->m_len;
+		}
+	}
+}
+
+void
+m_cat(struct mbuf *m, struct mbuf *n)
+{
+
+	while (m->m_next != NULL)
+		m = m->m_next;
+	m->m_next = n;
+}
+
+struct mbuf *
+ngshim_m_prepend(struct mbuf *m, int len, int how)
+{
+	struct mbuf *n;
+
+	if (M_LEADINGSPACE(m) >= len) {
+		m->m_data -= len;
+		m->m_len += len;
+		if (m->m_flags & M_PKTHDR)
+			m->m_pkthdr.len += len;
+		return (m);
+	}
+	n = m_alloc(imax(len, MHLEN), m->m_flags & M_PKTHDR);
+	if (n == NULL) {
+		m_freem(m);
+		return (NULL);
+	}
+	if (m->m_flags & M_PKTHDR) {
+		m_dup_pkthdr(n, m, how);
+		m->m_flags &= ~M_PKTHDR;
+	}
+	n->m_data = n->m_ext.ext_buf + n->m_ext.ext_size - len;
+	n->m_len = len;
+	n->m_next = m;
+	n->m_pkthdr.len += len;
+	return (n);
+}
+
+/*
+ * Build a packet from a flat buffer, in segments of at most 'seglen'
+ * bytes each (0 selects MCLBYTES), the way a driver with that receive
+ * buffer size would hand it to the stack.
+ */
+struct mbuf *
+ngshim_m_frombuf(const void *buf, int len, int seglen)
+{
+	struct mbuf *top = NULL, **np = &top, *m;
+	const char *cp = buf;
+	int off, count;
+
+	if (seglen <= 0)
+		seglen = MCLBYTES;
+	off = 0;
+	do {
+		count = imin(len - off, seglen);
+		m = m_alloc(imax(count, 1), top == NULL ? M_PKTHDR : 0);
+		if (m == NULL) {
+			m_freem(top);
+			return (NULL);
+		}
+		bcopy(cp + off, mtod(m, caddr_t), count);
+		m->m_len = count;
+		*np = m;
+		np = &m->m_next;
+		off += count;
+	} while (off < len);
+	top->m_pkthdr.len = len;
+	return (top);
+}
+
+/*
+ * Netgraph.
+ */
+const struct ng_parse_type ng_parse_struct_type;
+const struct ng_parse_type ng_parse_fixedarray_type;
+const struct ng_parse_type ng_parse_array_type;
+const struct ng_parse_type ng_parse_int8_type;
+const struct ng_parse_type ng_parse_int16_type;
+const struct ng_parse_type ng_parse_int32_type;
+const struct ng_parse_type ng_parse_int64_type;
+const struct ng_parse_type ng_parse_uint8_type;
+const struct ng_parse_type ng_parse_uint16_type;
+const struct ng_parse_type ng_parse_uint32_type;
+const struct ng_parse_type ng_parse_uint64_type;
+const struct ng_parse_type ng_parse_hint8_type;
+const struct ng_parse_type ng_parse_hint16_type;
+const struct ng_parse_type ng_parse_hint32_type;
+const struct ng_parse_type ng_parse_hint64_type;
+const struct ng_parse_type ng_parse_string_type;
+const struct ng_parse_type ng_parse_fixedstring_type;
+const struct ng_parse_type ng_parse_bytearray_type;
+
+static item_p
+ngshim_item(struct mbuf *m, struct ng_mesg *msg)
+{
+	item_p item;
+
+	item = calloc(1, sizeof(*item));
+	if (item == NULL)
+		panic("ngshim_item: out of memory");
+	item->m = m;
+	item->msg = msg;
+	return (item);
+}
+
+void
+ngshim_free_item(item_p item)
+{
+
+	if (item == NULL)
+		return;
+	if (item->m != NULL)
+		m_freem(item->m);
+	if (item->msg != NULL)
+		ngshim_free(item->msg, M_NETGRAPH);
+	free(item);
+}
+
+/*
+ * Deliver data leaving a node on 'hook': to the peer node if the hook
+ * is connected to one, otherwise to the driver's sink.
+ */
+int
+ngshim_send_data(hook_p hook, struct mbuf *m)
+{
+	hook_p peer;
+
+	if (hook == NULL) {
+		m_freem(m);
+		return (ENOTCONN);
+	}
+	hook->hk_sent++;
+	if ((peer = hook->hk_peer) != NULL)
+		return ((*peer->hk_node->nd_type->rcvdata)(peer,
+		    ngshim_item(m, NULL)));
+	if (hook->hk_sink != NULL)
+		(*hook->hk_sink)(hook, m, hook->hk_sinkarg);
+	else
+		m_freem(m);
+	return (0);
+}
+
+int
+ngshim_fwd_item(item_p item, hook_p hook)
+{
+	struct mbuf *m = item->m;
+
+	item->m = NULL;
+	ngshim_free_item(item);
+	return (ngshim_send_data(hook, m));
+}
+
+struct ng_mesg *
+ngshim_mkmessage(uint32_t cookie, uint32_t cmd, int len)
+{
+	struct ng_mesg *msg;
+
+	msg = ngshim_malloc(sizeof(*msg) + len, M_NETGRAPH, M_NOWAIT | M_ZERO);
+	if (msg == NULL)
+		return (NULL);
+	msg->header.version = NG_VERSION;
+	msg->header.typecookie = cookie;
+	msg->header.cmd = cmd;
+	msg->header.arglen = len;
+	return (msg);
+}
+
+struct ng_mesg *
+ngshim_mkresponse(struct ng_mesg *msg, int len)
+{
+	struct ng_mesg *rsp;
+
+	rsp = ngshim_mkmessage(msg->header.typecookie, msg->header.cmd, len);
+	if (rsp == NULL)
+		return (NULL);
+	rsp->header.flags = NGF_RESP;
+	rsp->header.token = msg->header.token;
+	return (rsp);
+}
+
+void
+ngshim_respond(int error, item_p item, struct ng_mesg *resp)
+{
+
+	if (item != NULL && item->resp != NULL && *item->resp == NULL)
+		*item->resp = resp;
+	else
+		ngshim_free(resp, M_NETGRAPH);
+	ngshim_free_item(item);
+}
+
+int
+ngshim_send_msg_hook(hook_p hook, struct ng_mesg *msg)
+{
+	hook_p peer;
+
+	if (hook == NULL || (peer = hook->hk_peer) == NULL) {
+		ngshim_free(msg, M_NETGRAPH);
+		return (0);
+	}
+	return ((*peer->hk_node->nd_type->rcvmsg)(peer->hk_node,
+	    ngshim_item(NULL, msg), peer));
+}
+
+hook_p
+ng_findhook(node_p node, const char *name)
+{
+	hook_p hook;
+
+	if (node->nd_type->findhook != NULL)
+		return ((*node->nd_type->findhook)(node, name));
+	LIST_FOREACH(hook, &node->nd_hooks, hk_hooks)
+		if (strcmp(hook->hk_name, name) == 0)
+			return (hook);
+	return (NULL);
+}
+
+int
+ngshim_load(struct ng_type *type)
+{
+
+	if (type->mod_event != NULL)
+		return ((*type->mod_event)(NULL, MOD_LOAD, NULL));
+	return (0);
+}
+
+void
+ngshim_unload(struct ng_type *type)
+{
+
+	if (type->mod_event != NULL)
+		(*type->mod_event)(NULL, MOD_UNLOAD, NULL);
+}
+
+node_p
+ngshim_node_create(struct ng_type *type, const char *name)
+{
+	node_p node;
+
+	node = calloc(1, sizeof(*node));
+	if (node == NULL)
+		return (NULL);
+	node->nd_type = type;
+	node->nd_ID = next_node_id++;
+	node->nd_refs = 1;
+	LIST_INIT(&node->nd_hooks);
+	if (name != NULL)
+		snprintf(node->nd_name, sizeof(node->nd_name), "%s", name);
+	if ((*type->constructor)(node) != 0) {
+		free(node);
+		return (NULL);
+	}
+	return (node);
+}
+
+void
+ngshim_node_unref(node_p node)
+{
+
+	if (--node->nd_refs == 0)
+		free(node);
+}
+
+void
+ngshim_node_shutdown(node_p node)
+{
+	hook_p hook;
+
+	node->nd_flags |= NGF_INVALID;
+	while ((hook = LIST_FIRST(&node->nd_hooks)) != NULL)
+		ngshim_hook_disconnect(hook);
+	(*node->nd_type->shutdown)(node);
+}
+
+int
+ng_rmnode_self(node_p node)
+{
+
+	if (node->nd_flags & NGF_INVALID)
+		return (0);
+	ngshim_node_shutdown(node);
+	return (0);
+}
+
+static hook_p
+ngshim_hook_add(node_p node, const char *name)
+{
+	hook_p hook;
+
+	if (ng_findhook(node, name) != NULL)
+		return (NULL);
+	hook = calloc(1, sizeof(*hook));
+	if (hook == NULL)
+		return (NULL);
+	snprintf(hook->hk_name, sizeof(hook->hk_name), "%s", name);
+	hook->hk_node = node;
+	if (node->nd_type->newhook != NULL &&
+	    (*node->nd_type->newhook)(node, hook, name) != 0) {
+		free(hook);
+		return (NULL);
+	}
+	LIST_INSERT_HEAD(&node->nd_hooks, hook, hk_hooks);
+	node->nd_numhooks++;
+	return (hook);
+}
+
+static int
+ngshim_hook_connected(hook_p hook)
+{
+
+	if (hook->hk_node->nd_type->connect != NULL &&
+	    (*hook->hk_node->nd_type->connect)(hook) != 0) {
+		ngshim_hook_disconnect(hook);
+		return (EINVAL);
+	}
+	return (0);
+}
+
+/*
+ * Create a hook whose peer is the driver: frames the node sends out of it
+ * are handed to 'sink' (or dropped, if NULL).
+ */
+hook_p
+ngshim_hook_create(node_p node, const char *name, ngshim_sink_t *sink,
+    void *arg)
+{
+	hook_p hook;
+
+	if ((hook = ngshim_hook_add(node, name)) == NULL)
+		return (NULL);
+	hook->hk_sink = sink;
+	hook->hk_sinkarg = arg;
+	if (ngshim_hook_connected(hook) != 0)
+		return (NULL);
+	return (hook);
+}
+
+/*
+ * Connect two nodes, as "ngctl connect" would.
+ */
+int
+ngshim_hook_connect(node_p node1, const char *name1, node_p node2,
+    const char *name2)
+{
+	hook_p hook1, hook2;
+
+	if ((hook1 = ngshim_hook_add(node1, name1)) == NULL)
+		return (EINVAL);
+	if ((hook2 = ngshim_hook_add(node2, name2)) == NULL) {
+		ngshim_hook_disconnect(hook1);
+		return (EINVAL);
+	}
+	hook1->hk_peer = hook2;
+	hook2->hk_peer = hook1;
+	if (ngshim_hook_connected(hook1) != 0)
+		return (EINVAL);
+	if (ngshim_hook_connected(hook2) != 0)
+		return (EINVAL);
+	return (0);
+}
+
+void
+ngshim_hook_disconnect(hook_p hook)
+{
+	node_p node = hook->hk_node;
+	hook_p peer = hook->hk_peer;
+
+	LIST_REMOVE(hook, hk_hooks);
+	node->nd_numhooks--;
+	hook->hk_peer = NULL;
+	if (peer != NULL)
+		peer->hk_peer = NULL;
+	if (node->nd_type->disconnect != NULL)
+		(*node->nd_type->disconnect)(hook);
+	free(hook);
+	if (peer != NULL)
+		ngshim_hook_disconnect(peer);
+}
+
+/*
+ * Inject a frame into 'hook', as if its peer had sent it.
+ */
+int
+ngshim_rcvdata(hook_p hook, struct mbuf *m)
+{
+
+	return ((*hook->hk_node->nd_type->rcvdata)(hook, ngshim_item(m, NULL)));
+}
+
+/*
+ * Send a binary control message to 'node'.  A response, if any, is
+ * returned in '*resp' and must be freed by the caller.
+ */
+int
+ngshim_msg(node_p node, uint32_t cookie, uint32_t cmd, const void *data,
+    int len, struct ng_mesg **resp)
+{
+	struct ng_mesg *msg, *rsp = NULL;
+	item_p item;
+	int error;
+
+	if ((msg = ngshim_mkmessage(cookie, cmd, len)) == NULL)
+		return (ENOMEM);
+	if (len > 0)
+		bcopy(data, msg->data, len);
+	item = ngshim_item(NULL, msg);
+	item->resp = &rsp;
+	error = (*node->nd_type->rcvmsg)(node, item, NULL);
+	if (resp != NULL)
+		*resp = rsp;
+	else
+		ngshim_free(rsp, M_NETGRAPH);
+	return (error);
+}
+
+/*
+ * Send an ASCII control message such as "setlinkcfg link0 1 2 3", the way
+ * "ngctl msg" would, converting arguments and response with the command's
+ * parse types.  The unparsed response, if any, is left in 'rbuf'.
+ */
+int
+ngshim_ascii_msg(node_p node, const char *ascii, char *rbuf, int rbuflen)
+{
+	const struct ng_cmdlist *c;
+	struct ng_mesg *resp = NULL;
+	char cmd[NG_CMDSTRSIZ];
+	const char *args;
+	u_char *buf;
+	int size, buflen;
+	int off, error = 0;
+
+	args = ascii + strcspn(ascii, " \t");
+	snprintf(cmd, sizeof(cmd), "%.*s", (int)(args - ascii), ascii);
+	args += strspn(args, " \t");
+
+	for (c = node->nd_type->cmdlist; c != NULL && c->name != NULL; c++)
+		if (strcmp(c->name, cmd) == 0)
+			break;
+	if (c == NULL || c->name == NULL)
+		return (ENOSYS);
+
+	/* Grow the binary message until the parser finds it big enough */
+	for (size = 64 * 1024;; size *= 2) {
+		buf = calloc(1, size);
+		if (buf == NULL)
+			return (ENOMEM);
+		off = 0;
+		buflen = size;
+		if (c->mesgType == NULL)
+			buflen = 0;
+		else if (c->mesgType->parse == NULL)
+			error = EOPNOTSUPP;
+		else
+			error = (*c->mesgType->parse)(c->mesgType, args, &off,
+			    buf, buf, &buflen);
+		if ((error != ENOMEM && error != ERANGE) ||
+		    size >= 64 * 1024 * 1024)
+			break;
+		free(buf);
+	}
+	if (error != 0) {
+		free(buf);
+		return (error);
+	}
+	error = ngshim_msg(node, c->cookie, c->cmd, buf, buflen, &resp);
+	free(buf);
+	if (rbuf != NULL && rbuflen > 0)
+		rbuf[0] = 0;
+	if (resp != NULL && rbuf != NULL && c->respType != NULL &&
+	    c->respType->unparse != NULL) {
+		off = 0;
+		(*c->respType->unparse)(c->respType, (u_char *)resp->data,
+		    &off, rbuf, rbuflen);
+	}
+	ngshim_free(resp, M_NETGRAPH);
+	return (error);
+}
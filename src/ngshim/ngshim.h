@@ -0,0 +1,824 @@
+/*-
+ * Copyright (c) 2026 University of Zagreb
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * ngshim.h -- a minimal userspace stand-in for the parts of the FreeBSD
+ * kernel API (mbufs, netgraph, callouts, uma, malloc) that our ng_*
+ * modules depend on.  Node sources are compiled unchanged with -D_KERNEL
+ * and -Iinclude, so that <sys/mbuf.h>, <netgraph/netgraph.h> etc. resolve
+ * to thin wrappers around this file.
+ *
+ * Time is virtual: microuptime() and friends return ngshim_now, which
+ * only moves forward when the driver calls ngshim_clock_advance() or
+ * ngshim_clock_set(), firing any callouts which became due on the way.
+ * A given driver and PRNG seed therefore always produces the same run.
+ *
+ * Only single-threaded operation is supported.
+ */
+
+#ifndef _NGSHIM_H_
+#define _NGSHIM_H_
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/queue.h>
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/*
+ * <sys/queue.h> bits which glibc lacks.
+ */
+#ifndef LIST_FOREACH_SAFE
+#define	LIST_FOREACH_SAFE(var, head, field, tvar)			\
+	for ((var) = LIST_FIRST((head));				\
+	    (var) && ((tvar) = LIST_NEXT((var), field), 1);		\
+	    (var) = (tvar))
+#endif
+#ifndef TAILQ_FOREACH_SAFE
+#define	TAILQ_FOREACH_SAFE(var, head, field, tvar)			\
+	for ((var) = TAILQ_FIRST((head));				\
+	    (var) && ((tvar) = TAILQ_NEXT((var), field), 1);		\
+	    (var) = (tvar))
+#endif
+#ifndef STAILQ_FOREACH_SAFE
+#define	STAILQ_FOREACH_SAFE(var, head, field, tvar)			\
+	for ((var) = STAILQ_FIRST((head));				\
+	    (var) && ((tvar) = STAILQ_NEXT((var), field), 1);		\
+	    (var) = (tvar))
+#endif
+
+/*
+ * <sys/cdefs.h>, <sys/param.h>, <sys/systm.h>
+ */
+#ifndef __FBSDID
+#define	__FBSDID(s)		struct __hack
+#endif
+#define	__predict_true(exp)	__builtin_expect((exp), 1)
+#define	__predict_false(exp)	__builtin_expect((exp), 0)
+#ifndef __unused
+#define	__unused		__attribute__((__unused__))
+#endif
+#define	__aligned(x)		__attribute__((__aligned__(x)))
+#define	__packed		__attribute__((__packed__))
+
+typedef char		*caddr_t;
+typedef const char	*c_caddr_t;
+
+#ifndef nitems
+#define	nitems(x)	(sizeof((x)) / sizeof((x)[0]))
+#endif
+#ifndef roundup2
+#define	roundup2(x, y)	(((x) + ((y) - 1)) & (~((y) - 1)))
+#endif
+#ifndef howmany
+#define	howmany(x, y)	(((x) + ((y) - 1)) / (y))
+#endif
+#define	CACHE_LINE_SIZE	64
+
+static __inline int imax(int a, int b) { return (a > b ? a : b); }
+static __inline int imin(int a, int b) { return (a < b ? a : b); }
+static __inline u_int max(u_int a, u_int b) { return (a > b ? a : b); }
+static __inline u_int min(u_int a, u_int b) { return (a < b ? a : b); }
+
+/* Older glibc lacks strlcpy(), and newer ones may declare it differently */
+static __inline size_t
+ngshim_strlcpy(char *dst, const char *src, size_t size)
+{
+	size_t len = strlen(src);
+
+	if (size > 0) {
+		size = len < size ? len : size - 1;
+		memcpy(dst, src, size);
+		dst[size] = '\0';
+	}
+	return (len);
+}
+#define	strlcpy			ngshim_strlcpy
+
+void	ngshim_panic(const char *, ...) __attribute__((__noreturn__));
+#define	panic			ngshim_panic
+#define	KASSERT(exp, msg) do {						\
+	if (__predict_false(!(exp)))					\
+		panic msg;						\
+} while (0)
+#define	MPASS(exp)		KASSERT((exp), ("Assertion %s failed", #exp))
+#define	CTASSERT(x)		_Static_assert((x), "compile-time assertion")
+
+#define	splimp()		0
+#define	splnet()		0
+#define	splx(s)			((void)(s))
+
+#define	kdb_enter(why, msg)	panic("%s", (msg))
+
+/*
+ * <sys/pcpu.h>, <sys/smp.h>: a single CPU, which is never preempted.
+ */
+#define	mp_maxid		0
+#define	curcpu			0
+#define	CPU_FOREACH(i)		for ((i) = 0; (i) <= mp_maxid; (i)++)
+#define	critical_enter()	do { } while (0)
+#define	critical_exit()		do { } while (0)
+
+/*
+ * <machine/atomic.h>, as far as used.
+ */
+#define	atomic_fetchadd_int(p, v)					\
+	__atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+
+/*
+ * <sys/lock.h>, <sys/mutex.h>: nothing to contend with on a single CPU,
+ * but lock order and pairing mistakes still trip an assertion.
+ */
+struct mtx {
+	const char	*mtx_name;
+	int		mtx_owned;
+};
+#define	MTX_DEF		0x0000
+#define	MTX_SPIN	0x0001
+#define	mtx_init(m, name, type, opts) do {				\
+	(m)->mtx_name = (name);						\
+	(m)->mtx_owned = 0;						\
+} while (0)
+#define	mtx_destroy(m)		KASSERT(!(m)->mtx_owned,		\
+	("%s: destroying owned mutex", (m)->mtx_name))
+#define	mtx_lock(m) do {						\
+	KASSERT(!(m)->mtx_owned, ("%s: recursed", (m)->mtx_name));	\
+	(m)->mtx_owned = 1;						\
+} while (0)
+#define	mtx_unlock(m) do {						\
+	KASSERT((m)->mtx_owned, ("%s: not owned", (m)->mtx_name));	\
+	(m)->mtx_owned = 0;						\
+} while (0)
+#define	mtx_lock_spin(m)	mtx_lock(m)
+#define	mtx_unlock_spin(m)	mtx_unlock(m)
+
+/*
+ * <sys/kernel.h>, <sys/module.h>
+ */
+typedef struct module	*module_t;
+enum modeventtype {
+	MOD_LOAD,
+	MOD_UNLOAD,
+	MOD_SHUTDOWN,
+	MOD_QUIESCE
+};
+
+/*
+ * <sys/malloc.h>
+ */
+struct malloc_type {
+	const char	*ks_shortdesc;
+	u_long		ks_inuse;	/* # of outstanding allocations */
+};
+#define	MALLOC_DEFINE(type, shortdesc, longdesc)			\
+	struct malloc_type type[1] = { { (shortdesc), 0 } }
+#define	MALLOC_DECLARE(type)	extern struct malloc_type type[1]
+MALLOC_DECLARE(M_NETGRAPH);
+MALLOC_DECLARE(M_DEVBUF);
+MALLOC_DECLARE(M_TEMP);
+
+#define	M_NOWAIT	0x0001
+#define	M_WAITOK	0x0002
+#define	M_ZERO		0x0100
+#define	M_NOVM		0x0200
+#define	M_USE_RESERVE	0x0400
+
+void	*ngshim_malloc(size_t, struct malloc_type *, int);
+void	ngshim_free(void *, struct malloc_type *);
+
+/*
+ * <vm/uma.h>
+ */
+typedef struct uma_zone	*uma_zone_t;
+typedef int	(*uma_ctor)(void *, int, void *, int);
+typedef void	(*uma_dtor)(void *, int, void *);
+typedef int	(*uma_init)(void *, int, int);
+typedef void	(*uma_fini)(void *, int);
+#define	UMA_ALIGN_PTR	(sizeof(void *) - 1)
+#define	UMA_ALIGN_CACHE	(64 - 1)
+
+uma_zone_t	uma_zcreate(const char *, size_t, uma_ctor, uma_dtor,
+		    uma_init, uma_fini, int, uint32_t);
+void		uma_zdestroy(uma_zone_t);
+void		*uma_zalloc(uma_zone_t, int);
+void		uma_zfree(uma_zone_t, void *);
+
+/*
+ * <sys/time.h>
+ */
+extern uint64_t	ngshim_now;		/* virtual uptime, in usec */
+extern int	ticks;
+extern int	hz;
+extern int	tick;			/* usec per tick */
+#define	time_uptime	((time_t)(ngshim_now / 1000000))
+
+void	microuptime(struct timeval *);
+void	getmicrouptime(struct timeval *);
+void	microtime(struct timeval *);
+void	getmicrotime(struct timeval *);
+
+#ifndef timevalclear
+#define	timevalclear(tvp)	((tvp)->tv_sec = (tvp)->tv_usec = 0)
+#endif
+#ifndef timevalisset
+#define	timevalisset(tvp)	((tvp)->tv_sec || (tvp)->tv_usec)
+#endif
+#ifndef timevalcmp
+#define	timevalcmp(tvp, uvp, cmp)					\
+	(((tvp)->tv_sec == (uvp)->tv_sec) ?				\
+	    ((tvp)->tv_usec cmp (uvp)->tv_usec) :			\
+	    ((tvp)->tv_sec cmp (uvp)->tv_sec))
+#endif
+void	timevaladd(struct timeval *, const struct timeval *);
+void	timevalsub(struct timeval *, const struct timeval *);
+
+/*
+ * <sys/libkern.h>
+ */
+u_long	ngshim_random(void);
+void	ngshim_srandom(uint64_t);
+void	arc4rand(void *, u_int, int);
+uint32_t crc32_raw(const void *, size_t, uint32_t);
+
+static __inline uint32_t
+crc32(const void *buf, size_t size)
+{
+
+	return (crc32_raw(buf, size, ~0U) ^ ~0U);
+}
+
+/*
+ * <sys/mbuf.h>
+ *
+ * Every mbuf in the shim keeps its data in a refcounted external buffer,
+ * so that m_copypacket() and friends have the same sharing semantics as
+ * in the kernel, and M_WRITABLE() can be trusted.
+ */
+#define	MSIZE		256
+#define	MLEN		224
+#define	MHLEN		160
+#define	MINCLSIZE	(MHLEN + 1)
+#define	MCLBYTES	2048
+#define	MJUMPAGESIZE	4096
+#define	MJUM9BYTES	(9 * 1024)
+
+#define	M_EXT		0x00000001	/* has associated external storage */
+#define	M_PKTHDR	0x00000002	/* start of record */
+#define	M_EOR		0x00000004	/* end of record */
+#define	M_RDONLY	0x00000008	/* associated data is marked read-only */
+#define	M_BCAST		0x00000010
+#define	M_MCAST		0x00000020
+#define	M_VLANTAG	0x00000080	/* ether_vtag is valid */
+
+#define	CSUM_IP		0x0001		/* IP header checksum offloaded */
+#define	CSUM_TCP	0x0002
+#define	CSUM_UDP	0x0004
+#define	CSUM_UDP_IPV6	0x2000
+#define	CSUM_TCP_IPV6	0x4000
+#define	CSUM_DELAY_IP	CSUM_IP
+#define	CSUM_DELAY_DATA	(CSUM_TCP | CSUM_UDP)
+#define	CSUM_DELAY_DATA_IPV6	(CSUM_TCP_IPV6 | CSUM_UDP_IPV6)
+
+#define	MT_DATA		1
+#define	MT_HEADER	MT_DATA
+
+#define	M_COPYALL	1000000000
+
+struct ifnet;
+
+struct pkthdr {
+	struct ifnet	*rcvif;
+	int		len;
+	uint32_t	flowid;
+	uint32_t	csum_flags;
+	uint16_t	ether_vtag;
+};
+
+struct m_ext {
+	caddr_t		ext_buf;
+	u_int		ext_size;
+	volatile u_int	*ext_cnt;
+};
+
+struct mbuf {
+	struct mbuf	*m_next;
+	struct mbuf	*m_nextpkt;
+	caddr_t		m_data;
+	int		m_len;
+	int		m_type;
+	int		m_flags;
+	struct pkthdr	m_pkthdr;
+	struct m_ext	m_ext;
+};
+
+#define	mtod(m, t)	((t)((m)->m_data))
+#define	M_WRITABLE(m)	(!((m)->m_flags & M_RDONLY) &&			\
+			    (!((m)->m_flags & M_EXT) ||			\
+			    *((m)->m_ext.ext_cnt) == 1))
+#define	M_LEADINGSPACE(m)						\
+	(M_WRITABLE(m) ? ((m)->m_data - (m)->m_ext.ext_buf) : 0)
+#define	M_TRAILINGSPACE(m)						\
+	(M_WRITABLE(m) ? ((m)->m_ext.ext_buf + (m)->m_ext.ext_size -	\
+	    ((m)->m_data + (m)->m_len)) : 0)
+#define	M_SIZE(m)	((m)->m_ext.ext_size)
+#define	M_ALIGN(m, len)	do {						\
+	(m)->m_data += (M_SIZE(m) - (len)) & ~(sizeof(long) - 1);	\
+} while (0)
+#define	M_PREPEND(m, plen, how) do {					\
+	(m) = ngshim_m_prepend((m), (plen), (how));			\
+} while (0)
+
+struct mbuf	*m_get(int, short);
+struct mbuf	*m_gethdr(int, short);
+struct mbuf	*m_getcl(int, short, int);
+struct mbuf	*m_getjcl(int, short, int, int);
+struct mbuf	*m_free(struct mbuf *);
+void		m_freem(struct mbuf *);
+struct mbuf	*m_dup(const struct mbuf *, int);
+struct mbuf	*m_copypacket(struct mbuf *, int);
+struct mbuf	*m_copym(struct mbuf *, int, int, int);
+struct mbuf	*m_pullup(struct mbuf *, int);
+struct mbuf	*m_unshare(struct mbuf *, int);
+void		m_copydata(const struct mbuf *, int, int, caddr_t);
+void		m_copyback(struct mbuf *, int, int, c_caddr_t);
+void		m_adj(struct mbuf *, int);
+void		m_cat(struct mbuf *, struct mbuf *);
+u_int		m_length(struct mbuf *, struct mbuf **);
+int		m_dup_pkthdr(struct mbuf *, const struct mbuf *, int);
+struct mbuf	*ngshim_m_prepend(struct mbuf *, int, int);
+
+/*
+ * <net/if_var.h>
+ *
+ * No interface is ever found by name; struct ifnet is only here for nodes
+ * which look at the send queue of one to compile.
+ */
+#ifndef IFNAMSIZ
+#define	IFNAMSIZ	16
+#endif
+
+struct ifqueue {
+	struct mbuf	*ifq_head;
+	struct mbuf	*ifq_tail;
+	int		ifq_len;
+	int		ifq_maxlen;
+};
+
+struct ifnet {
+	char		if_xname[IFNAMSIZ];
+	struct ifqueue	if_snd;
+};
+
+#define	_IF_ENQUEUE(ifq, m) do {					\
+	(m)->m_nextpkt = NULL;						\
+	if ((ifq)->ifq_tail == NULL)					\
+		(ifq)->ifq_head = (m);					\
+	else								\
+		(ifq)->ifq_tail->m_nextpkt = (m);			\
+	(ifq)->ifq_tail = (m);						\
+	(ifq)->ifq_len++;						\
+} while (0)
+#define	_IF_PREPEND(ifq, m) do {					\
+	(m)->m_nextpkt = (ifq)->ifq_head;				\
+	if ((ifq)->ifq_tail == NULL)					\
+		(ifq)->ifq_tail = (m);					\
+	(ifq)->ifq_head = (m);						\
+	(ifq)->ifq_len++;						\
+} while (0)
+#define	_IF_DEQUEUE(ifq, m) do {					\
+	(m) = (ifq)->ifq_head;						\
+	if ((m) != NULL) {						\
+		if (((ifq)->ifq_head = (m)->m_nextpkt) == NULL)		\
+			(ifq)->ifq_tail = NULL;				\
+		(m)->m_nextpkt = NULL;					\
+		(ifq)->ifq_len--;					\
+	}								\
+} while (0)
+#define	ifunit(name)		((struct ifnet *)NULL)
+
+/*
+ * <netgraph/ng_message.h>
+ */
+#define	NG_HOOKSIZ	32
+#define	NG_NODESIZ	32
+#define	NG_TYPESIZ	32
+#define	NG_CMDSTRSIZ	32
+#define	NG_PATHSIZ	512
+#define	NG_VERSION	8
+#define	NG_ABI_VERSION	12
+
+typedef uint32_t	ng_ID_t;
+
+struct ng_mesg {
+	struct ng_msghdr {
+		u_char		version;
+		u_char		spare;
+		uint16_t	spare2;
+		uint32_t	arglen;
+		uint32_t	cmd;
+		uint32_t	flags;
+		uint32_t	token;
+		uint32_t	typecookie;
+		u_char		cmdstr[NG_CMDSTRSIZ];
+	} header;
+	char	data[];
+};
+
+#define	NGF_ORIG	0x00000000
+#define	NGF_RESP	0x00000001
+
+#define	NGM_GENERIC_COOKIE	1137070366
+
+/*
+ * <netgraph/ng_ether.h>, the messages nodes send to ng_ether.
+ */
+#define	NGM_ETHER_COOKIE	917786906
+
+enum {
+	NGM_ETHER_GET_IFNAME = 1,
+	NGM_ETHER_GET_IFINDEX,
+	NGM_ETHER_GET_ENADDR,
+	NGM_ETHER_SET_ENADDR,
+	NGM_ETHER_GET_PROMISC,
+	NGM_ETHER_SET_PROMISC,
+	NGM_ETHER_GET_AUTOSRC,
+	NGM_ETHER_SET_AUTOSRC,
+};
+
+/*
+ * <netgraph/ng_parse.h>
+ */
+struct ng_parse_type;
+
+typedef int	ng_parse_t(const struct ng_parse_type *, const char *, int *,
+		    const u_char *, u_char *, int *);
+typedef int	ng_unparse_t(const struct ng_parse_type *, const u_char *,
+		    int *, char *, int);
+typedef int	ng_getDefault_t(const struct ng_parse_type *, const u_char *,
+		    u_char *, int *);
+typedef int	ng_getAlign_t(const struct ng_parse_type *);
+
+struct ng_parse_type {
+	const struct ng_parse_type	*supertype;
+	const void			*info;
+	void				*private;
+	ng_parse_t			*parse;
+	ng_unparse_t			*unparse;
+	ng_getDefault_t			*getDefault;
+	ng_getAlign_t			*getAlign;
+};
+
+struct ng_parse_struct_field {
+	const char			*name;
+	const struct ng_parse_type	*type;
+	int				alignment;
+};
+
+typedef int	ng_parse_array_getLength_t(const struct ng_parse_type *,
+		    const u_char *, const u_char *);
+typedef int	ng_parse_array_getDefault_t(const struct ng_parse_type *,
+		    int, const u_char *, u_char *, int *);
+
+struct ng_parse_fixedarray_info {
+	const struct ng_parse_type	*elementType;
+	int				length;
+	ng_parse_array_getDefault_t	*getDefault;
+};
+
+struct ng_parse_array_info {
+	const struct ng_parse_type	*elementType;
+	ng_parse_array_getLength_t	*getLength;
+	ng_parse_array_getDefault_t	*getDefault;
+};
+
+/*
+ * Generic parse types are only provided as placeholders so that node
+ * cmdlists link; ASCII conversion is only supported for node types
+ * which supply their own parse/unparse routines.
+ */
+extern const struct ng_parse_type ng_parse_struct_type;
+extern const struct ng_parse_type ng_parse_fixedarray_type;
+extern const struct ng_parse_type ng_parse_array_type;
+extern const struct ng_parse_type ng_parse_int8_type;
+extern const struct ng_parse_type ng_parse_int16_type;
+extern const struct ng_parse_type ng_parse_int32_type;
+extern const struct ng_parse_type ng_parse_int64_type;
+extern const struct ng_parse_type ng_parse_uint8_type;
+extern const struct ng_parse_type ng_parse_uint16_type;
+extern const struct ng_parse_type ng_parse_uint32_type;
+extern const struct ng_parse_type ng_parse_uint64_type;
+extern const struct ng_parse_type ng_parse_hint8_type;
+extern const struct ng_parse_type ng_parse_hint16_type;
+extern const struct ng_parse_type ng_parse_hint32_type;
+extern const struct ng_parse_type ng_parse_hint64_type;
+extern const struct ng_parse_type ng_parse_string_type;
+extern const struct ng_parse_type ng_parse_fixedstring_type;
+extern const struct ng_parse_type ng_parse_bytearray_type;
+
+/*
+ * <netgraph/netgraph.h>
+ */
+typedef struct ng_node	*node_p;
+typedef struct ng_hook	*hook_p;
+typedef struct ng_item	*item_p;
+
+typedef void	ngshim_sink_t(hook_p, struct mbuf *, void *);
+
+struct ng_hook {
+	char		hk_name[NG_HOOKSIZ];
+	void		*hk_private;
+	int		hk_flags;
+	struct ng_hook	*hk_peer;	/* other end, if node-to-node */
+	struct ng_node	*hk_node;
+	LIST_ENTRY(ng_hook) hk_hooks;
+	ngshim_sink_t	*hk_sink;	/* driver's receiver, if no peer */
+	void		*hk_sinkarg;
+	uint64_t	hk_sent;	/* frames passed to peer / sink */
+};
+
+struct ng_node {
+	char		nd_name[NG_NODESIZ];
+	struct ng_type	*nd_type;
+	int		nd_flags;
+	int		nd_numhooks;
+	void		*nd_private;
+	ng_ID_t		nd_ID;
+	LIST_HEAD(, ng_hook) nd_hooks;
+	int		nd_refs;
+};
+
+#define	NGF_INVALID	0x00000001
+#define	NGF_FORCE_WRITER 0x00000004
+#define	NGF_TYPE1	0x00001000
+#define	NGF_TYPE2	0x00002000
+#define	NGF_TYPE3	0x00004000
+#define	NGF_TYPE4	0x00008000
+
+struct ng_item {
+	struct mbuf	*m;
+	struct ng_mesg	*msg;
+	struct ng_mesg	**resp;		/* where to leave a response */
+	int		*resp_error;
+};
+
+typedef int	ng_constructor_t(node_p);
+typedef int	ng_close_t(node_p);
+typedef int	ng_shutdown_t(node_p);
+typedef int	ng_newhook_t(node_p, hook_p, const char *);
+typedef hook_p	ng_findhook_t(node_p, const char *);
+typedef int	ng_connect_t(hook_p);
+typedef int	ng_rcvmsg_t(node_p, item_p, hook_p);
+typedef int	ng_rcvdata_t(hook_p, item_p);
+typedef int	ng_disconnect_t(hook_p);
+typedef int	ng_rcvitem(node_p, hook_p, item_p);
+typedef void	ng_item_fn(node_p, hook_p, void *, int);
+
+struct ng_cmdlist {
+	uint32_t			cookie;
+	int				cmd;
+	const char			*name;
+	const struct ng_parse_type	*mesgType;
+	const struct ng_parse_type	*respType;
+};
+
+struct ng_type {
+	u_int32_t	version;
+	const char	*name;
+	int		(*mod_event)(module_t, int, void *);
+	ng_constructor_t *constructor;
+	ng_rcvmsg_t	*rcvmsg;
+	ng_close_t	*close;
+	ng_shutdown_t	*shutdown;
+	ng_newhook_t	*newhook;
+	ng_findhook_t	*findhook;
+	ng_connect_t	*connect;
+	ng_rcvdata_t	*rcvdata;
+	ng_disconnect_t	*disconnect;
+	const struct ng_cmdlist *cmdlist;
+};
+
+/*
+ * Each node module defines exactly one ngshim_type, which is what the
+ * driver instantiates nodes of.
+ */
+#define	NETGRAPH_INIT(typename, typestructp)				\
+	struct ng_type *ngshim_type = (typestructp)
+extern struct ng_type *ngshim_type;
+
+#define	NG_HOOK_NAME(hook)		((hook)->hk_name)
+#define	NG_HOOK_NODE(hook)		((hook)->hk_node)
+#define	NG_HOOK_PRIVATE(hook)		((hook)->hk_private)
+#define	NG_HOOK_SET_PRIVATE(hook, val)	do { (hook)->hk_private = (val); } while (0)
+#define	NG_HOOK_PEER(hook)		((hook)->hk_peer)
+#define	NG_HOOK_IS_VALID(hook)		(1)
+#define	NG_HOOK_NOT_VALID(hook)		(0)
+#define	NG_HOOK_FORCE_QUEUE(hook)	do { } while (0)
+#define	NG_HOOK_REF(hook)		do { } while (0)
+#define	NG_HOOK_UNREF(hook)		do { } while (0)
+#define	NG_PEER_NODE(hook)						\
+	((hook)->hk_peer != NULL ? (hook)->hk_peer->hk_node : NULL)
+
+#define	NG_NODE_NAME(node)		((node)->nd_name)
+#define	NG_NODE_ID(node)		((node)->nd_ID)
+#define	NG_NODE_PRIVATE(node)		((node)->nd_private)
+#define	NG_NODE_SET_PRIVATE(node, val)	do { (node)->nd_private = (val); } while (0)
+#define	NG_NODE_NUMHOOKS(node)		((node)->nd_numhooks)
+#define	NG_NODE_FORCE_WRITER(node)					\
+	do { (node)->nd_flags |= NGF_FORCE_WRITER; } while (0)
+#define	NG_NODE_REF(node)		do { (node)->nd_refs++; } while (0)
+#define	NG_NODE_UNREF(node)		ngshim_node_unref(node)
+#define	NG_NODE_IS_VALID(node)		(!((node)->nd_flags & NGF_INVALID))
+
+typedef int	ng_fn_eachhook(hook_p, void *);
+#define	NG_NODE_FOREACH_HOOK(node, fn, arg, rethook) do {		\
+	hook_p _hook;							\
+									\
+	(rethook) = NULL;						\
+	LIST_FOREACH(_hook, &(node)->nd_hooks, hk_hooks)		\
+		if ((fn)(_hook, arg) == 0) {				\
+			(rethook) = _hook;				\
+			break;						\
+		}							\
+} while (0)
+
+#define	NGI_M(item)		((item)->m)
+#define	NGI_MSG(item)		((item)->msg)
+#define	NGI_GET_M(item, m) do {						\
+	(m) = (item)->m;						\
+	(item)->m = NULL;						\
+} while (0)
+#define	NGI_GET_MSG(item, msg) do {					\
+	(msg) = (item)->msg;						\
+	(item)->msg = NULL;						\
+} while (0)
+
+#define	NG_FREE_ITEM(item) do {						\
+	ngshim_free_item(item);						\
+	(item) = NULL;							\
+} while (0)
+#define	NG_FREE_M(m) do {						\
+	if ((m) != NULL) {						\
+		m_freem((m));						\
+		(m) = NULL;						\
+	}								\
+} while (0)
+#define	NG_FREE_MSG(msg) do {						\
+	if ((msg) != NULL) {						\
+		ngshim_free((msg), M_NETGRAPH);				\
+		(msg) = NULL;						\
+	}								\
+} while (0)
+
+/*
+ * Nodes are free to ignore the error of a send, as they do in the kernel;
+ * the (void) uses keep -Wall from calling such variables set but unused.
+ */
+#define	NG_SEND_DATA_ONLY(error, hook, m) do {				\
+	(error) = ngshim_send_data((hook), (m));			\
+	(void)(error);							\
+	(m) = NULL;							\
+} while (0)
+#define	NG_SEND_DATA(error, hook, m, meta) NG_SEND_DATA_ONLY(error, hook, m)
+#define	NG_FWD_ITEM_HOOK(error, item, hook) do {			\
+	(error) = ngshim_fwd_item((item), (hook));			\
+	(void)(error);							\
+	(item) = NULL;							\
+} while (0)
+#define	NG_FWD_NEW_DATA(error, item, hook, m) do {			\
+	NGI_M(item) = (m);						\
+	NG_FWD_ITEM_HOOK(error, item, hook);				\
+	(m) = NULL;							\
+} while (0)
+
+#define	NG_MKMESSAGE(msg, cookie, cmdid, len, how) do {			\
+	(msg) = ngshim_mkmessage((cookie), (cmdid), (len));		\
+} while (0)
+#define	NG_MKRESPONSE(rsp, msg, len, how) do {				\
+	(rsp) = ngshim_mkresponse((msg), (len));			\
+} while (0)
+#define	NG_RESPOND_MSG(error, here, item, resp) do {			\
+	ngshim_respond((error), (item), (resp));			\
+	(item) = NULL;							\
+	(resp) = NULL;							\
+} while (0)
+#define	NG_SEND_MSG_HOOK(error, here, msg, hook, retaddr) do {		\
+	(error) = ngshim_send_msg_hook((hook), (msg));			\
+	(void)(error);							\
+	(msg) = NULL;							\
+} while (0)
+#define	NG_SEND_MSG_ID(error, here, msg, ID, retaddr) do {		\
+	(error) = 0;							\
+	(void)(error);							\
+	NG_FREE_MSG(msg);						\
+} while (0)
+
+hook_p	ng_findhook(node_p, const char *);
+int	ng_rmnode_self(node_p);
+int	ng_rmhook_self(hook_p);
+
+/*
+ * Callouts.  Handlers run synchronously from within the clock driver.
+ * Pending callouts hang off a hashed timing wheel of CALLWHEEL_SIZE
+ * one-tick buckets, as in kern_timeout.c, so scheduling and expiry cost
+ * O(1) regardless of how many are outstanding.
+ */
+#define	CALLWHEEL_SIZE	256		/* must be a power of 2 */
+
+struct callout {
+	TAILQ_ENTRY(callout) c_le;
+	uint64_t	c_tick;		/* due tick */
+	ng_item_fn	*c_fn;
+	node_p		c_node;
+	hook_p		c_hook;
+	void		*c_arg1;
+	int		c_arg2;
+	int		c_pending;
+};
+
+void	ng_callout_init(struct callout *);
+int	ng_callout(struct callout *, node_p, hook_p, int, ng_item_fn *,
+	    void *, int);
+int	ng_uncallout(struct callout *, node_p);
+#define	callout_pending(c)	((c)->c_pending)
+#define	callout_active(c)	((c)->c_pending)
+
+/*
+ * Shim internals referenced from the macros above.
+ */
+int		ngshim_send_data(hook_p, struct mbuf *);
+int		ngshim_fwd_item(item_p, hook_p);
+void		ngshim_free_item(item_p);
+struct ng_mesg	*ngshim_mkmessage(uint32_t, uint32_t, int);
+struct ng_mesg	*ngshim_mkresponse(struct ng_mesg *, int);
+void		ngshim_respond(int, item_p, struct ng_mesg *);
+int		ngshim_send_msg_hook(hook_p, struct ng_mesg *);
+void		ngshim_node_unref(node_p);
+
+/*
+ * Kernel-only names which would otherwise clash with libc.  Only the node
+ * sources are compiled with _KERNEL; the shim itself and the drivers see
+ * plain libc.
+ */
+#ifdef _KERNEL
+#define	malloc(size, type, flags)	ngshim_malloc((size), (type), (flags))
+#define	free(addr, type)		ngshim_free((addr), (type))
+#define	random()			ngshim_random()
+#define	log(level, ...)			printf(__VA_ARGS__)
+#endif
+
+/*
+ * Driver API.
+ */
+int		ngshim_load(struct ng_type *);
+void		ngshim_unload(struct ng_type *);
+node_p		ngshim_node_create(struct ng_type *, const char *);
+void		ngshim_node_shutdown(node_p);
+hook_p		ngshim_hook_create(node_p, const char *, ngshim_sink_t *,
+		    void *);
+int		ngshim_hook_connect(node_p, const char *, node_p,
+		    const char *);
+void		ngshim_hook_disconnect(hook_p);
+int		ngshim_rcvdata(hook_p, struct mbuf *);
+int		ngshim_msg(node_p, uint32_t, uint32_t, const void *, int,
+		    struct ng_mesg **);
+int		ngshim_ascii_msg(node_p, const char *, char *, int);
+
+void		ngshim_clock_set(uint64_t);
+void		ngshim_clock_advance(uint64_t);
+void		ngshim_clock_hz(int);
+int		ngshim_callouts_pending(void);
+
+struct mbuf	*ngshim_m_frombuf(const void *, int, int);
+uint64_t	ngshim_wallclock_ns(void);
+
+#endif /* _NGSHIM_H_ */